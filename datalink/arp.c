@@ -207,10 +207,13 @@ VOID ARPReceive(
     }
     Packet->MappedHeader = FALSE;
 
-    BytesCopied = CopyPacketToBuffer((PCHAR)Packet->Header,
-                                     Packet->NdisPacket,
-                                     Packet->Position,
-                                     sizeof(ARP_HEADER));
+    if (Packet->Cursor.Packet != Packet->NdisPacket ||
+        Packet->Cursor.Offset != Packet->Position)
+        CursorInitialize(&Packet->Cursor, Packet->NdisPacket, Packet->Position);
+
+    BytesCopied = CursorPull(&Packet->Cursor,
+                             Packet->Header,
+                             sizeof(ARP_HEADER));
     if (BytesCopied != sizeof(ARP_HEADER))
     {
         TI_DbgPrint(DEBUG_ARP, ("Unable to copy in header buffer\n"));
@@ -244,10 +247,9 @@ VOID ARPReceive(
         return;
     }
 
-    BytesCopied = CopyPacketToBuffer(DataBuffer,
-                                     Packet->NdisPacket,
-                                     Packet->Position + sizeof(ARP_HEADER),
-                                     DataSize);
+    BytesCopied = CursorPull(&Packet->Cursor,
+                             DataBuffer,
+                             DataSize);
     if (BytesCopied != DataSize)
     {
         TI_DbgPrint(DEBUG_ARP, ("Unable to copy in data buffer\n"));
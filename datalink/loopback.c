@@ -12,15 +12,94 @@
 
 PIP_INTERFACE Loopback = NULL;
 
+/* Deliveries in flight at once, more are dropped */
+#define LOOP_DELIVERIES 256
+
+/* A packet on its way from LoopTransmit to IPReceive */
+typedef struct _LOOP_DELIVERY {
+    LIST_ENTRY ListEntry;   /* Entry on LoopFreeList or LoopQueue */
+    IP_PACKET IPPacket;     /* Wrapper handed to IPReceive */
+} LOOP_DELIVERY, *PLOOP_DELIVERY;
+
+static LOOP_DELIVERY LoopDeliveries[LOOP_DELIVERIES];
+static LIST_ENTRY LoopFreeList;
+static LIST_ENTRY LoopQueue;
+static KSPIN_LOCK LoopLock;
+static BOOLEAN LoopWorkerQueued;
+
 VOID LoopPassiveWorker(
   PVOID Context)
+/*
+ * FUNCTION: Delivers the queued loopback packets
+ * ARGUMENTS:
+ *   Context = Unused
+ * NOTES:
+ *   Only one worker is queued at a time, it runs until the queue is empty
+ */
 {
-  PIP_PACKET IPPacket = Context;
+  PLOOP_DELIVERY Delivery;
+  PLIST_ENTRY Entry;
+  KIRQL OldIrql;
+
+  for (;;)
+  {
+    TcpipAcquireSpinLock(&LoopLock, &OldIrql);
+    if (IsListEmpty(&LoopQueue))
+    {
+      LoopWorkerQueued = FALSE;
+      TcpipReleaseSpinLock(&LoopLock, OldIrql);
+      break;
+    }
+    Entry = RemoveHeadList(&LoopQueue);
+    TcpipReleaseSpinLock(&LoopLock, OldIrql);
+
+    Delivery = CONTAINING_RECORD(Entry, LOOP_DELIVERY, ListEntry);
 
-  /* IPReceive() takes care of the NDIS packet */
-  IPReceive(Loopback, IPPacket);
+    IF_STAT_ADD(Loopback, InBytes, Delivery->IPPacket.TotalSize);
 
-  ExFreePool(IPPacket);
+    /* IPReceive() takes care of the NDIS packet */
+    IPReceive(Loopback, &Delivery->IPPacket);
+
+    TcpipAcquireSpinLock(&LoopLock, &OldIrql);
+    InsertTailList(&LoopFreeList, &Delivery->ListEntry);
+    TcpipReleaseSpinLock(&LoopLock, OldIrql);
+  }
+}
+
+static BOOLEAN LoopCanLend(
+  PNDIS_PACKET NdisPacket)
+/*
+ * FUNCTION: Decides whether a packet can be handed to the receive path as is
+ * ARGUMENTS:
+ *   NdisPacket = Pointer to NDIS packet to send
+ * RETURNS:
+ *   TRUE if the packet is a whole datagram whose sender does not wait for it
+ * NOTES:
+ *   SendFragments reuses one packet for every fragment and waits for each
+ *   completion, while reassembly holds fragments until the whole datagram
+ *   arrived. Lending those would stall the sender until the reassembly
+ *   timeout and overwrite the fragments still held. The sender may also
+ *   be the loopback worker itself, answering a ping, which would then
+ *   wait for itself. Packets queued on a neighbor carry NBCompleteSend,
+ *   the sender's routine is in the NEIGHBOR_PACKET
+ */
+{
+  PACKET_COMPLETION_ROUTINE Complete = PC(NdisPacket)->DLComplete;
+  PIPv4_HEADER Header;
+  UINT Length;
+
+  if (Complete == NBCompleteSend)
+    Complete = (PACKET_COMPLETION_ROUTINE)((PNEIGHBOR_PACKET)PC(NdisPacket)->Context)->Complete;
+
+  if (Complete == IPSendComplete)
+    return FALSE;
+
+  GetDataPtr(NdisPacket, 0, (PCHAR *)&Header, &Length);
+
+  if (Length < sizeof(IPv4_HEADER) || (Header->VerIHL & 0xF0) != 0x40)
+    return FALSE;
+
+  return (WN2H(Header->FlagsFragOfs) & (IPv4_MF_MASK | IPv4_FRAGOFS_MASK)) == 0;
 }
 
 VOID LoopTransmit(
@@ -37,13 +116,19 @@ VOID LoopTransmit(
  *   Offset      = Offset in packet where packet data starts
  *   LinkAddress = Pointer to link address
  *   Type        = LAN protocol type (unused)
+ * NOTES:
+ *   A whole datagram is lent to the receive path, which completes it to
+ *   the sender when it frees it. Anything else is copied and completed at
+ *   once, see LoopCanLend
  */
 {
     PCHAR PacketBuffer;
     UINT PacketLength;
     PNDIS_PACKET XmitPacket;
-    NDIS_STATUS NdisStatus;
-    PIP_PACKET IPPacket;
+    NDIS_STATUS NdisStatus = NDIS_STATUS_SUCCESS;
+    PLOOP_DELIVERY Delivery = NULL;
+    BOOLEAN Lend;
+    KIRQL OldIrql;
 
     ASSERT_KM_POINTER(NdisPacket);
     ASSERT_KM_POINTER(PC(NdisPacket));
@@ -51,37 +136,73 @@ VOID LoopTransmit(
 
     TI_DbgPrint(MAX_TRACE, ("Called (NdisPacket = %x)\n", NdisPacket));
 
-    GetDataPtr( NdisPacket, 0, &PacketBuffer, &PacketLength );
+    NdisQueryPacketLength(NdisPacket, &PacketLength);
 
-    NdisStatus = AllocatePacketWithBuffer
-        ( &XmitPacket, PacketBuffer, PacketLength );
+    Lend = LoopCanLend(NdisPacket);
+    if (Lend)
+    {
+        XmitPacket = NdisPacket;
+        PC(XmitPacket)->References = 1;
+    }
+    else
+    {
+        GetDataPtr( NdisPacket, 0, &PacketBuffer, &PacketLength );
 
-    if( NT_SUCCESS(NdisStatus) ) {
-        IPPacket = ExAllocatePool(NonPagedPool, sizeof(IP_PACKET));
-        if (IPPacket)
-        {
-            IPInitializePacket(IPPacket, 0);
+        NdisStatus = AllocatePacketWithBuffer
+            ( &XmitPacket, PacketBuffer, PacketLength );
+    }
 
-            IPPacket->NdisPacket = XmitPacket;
+    if (NdisStatus == NDIS_STATUS_SUCCESS)
+    {
+        TcpipAcquireSpinLock(&LoopLock, &OldIrql);
 
-            GetDataPtr(IPPacket->NdisPacket,
-                       0,
-                       (PCHAR*)&IPPacket->Header,
-                       &IPPacket->TotalSize);
+        if (!IsListEmpty(&LoopFreeList))
+        {
+            Delivery = CONTAINING_RECORD(RemoveHeadList(&LoopFreeList),
+                                         LOOP_DELIVERY, ListEntry);
 
-            IPPacket->MappedHeader = TRUE;
+            IPInitializePacket(&Delivery->IPPacket, 0);
+            Delivery->IPPacket.NdisPacket = XmitPacket;
+            Delivery->IPPacket.TotalSize = PacketLength;
 
-            if (!ChewCreate(LoopPassiveWorker, IPPacket))
+            InsertTailList(&LoopQueue, &Delivery->ListEntry);
+
+            if (!LoopWorkerQueued)
             {
-                IPPacket->Free(IPPacket);
-                ExFreePool(IPPacket);
-                NdisStatus = NDIS_STATUS_RESOURCES;
+                if (ChewCreateEx(LoopPassiveWorker, NULL, CHEW_PRIORITY_HIGH))
+                    LoopWorkerQueued = TRUE;
+                else
+                {
+                    RemoveEntryList(&Delivery->ListEntry);
+                    InsertTailList(&LoopFreeList, &Delivery->ListEntry);
+                    Delivery = NULL;
+                }
             }
         }
-        else
+
+        TcpipReleaseSpinLock(&LoopLock, OldIrql);
+
+        if (!Delivery)
+        {
+            if (Lend)
+                PC(XmitPacket)->References = 0;
+            else
+                FreeNdisPacket(XmitPacket);
+
             NdisStatus = NDIS_STATUS_RESOURCES;
+        }
     }
 
+    if (NdisStatus == NDIS_STATUS_SUCCESS) {
+        IF_STAT_ADD(Loopback, OutBytes, PacketLength);
+        IF_STAT_INC(Loopback, OutUnicast);
+    } else
+        IF_STAT_INC(Loopback, OutDiscarded);
+
+    /* A lent packet is completed when the receive path frees it */
+    if (Lend && NdisStatus == NDIS_STATUS_SUCCESS)
+        return;
+
     (PC(NdisPacket)->DLComplete)
         ( PC(NdisPacket)->Context, NdisPacket, NdisStatus );
 }
@@ -100,8 +221,17 @@ NDIS_STATUS LoopRegisterAdapter(
 {
   LLIP_BIND_INFO BindInfo;
 
+  ULONG i;
+
   TI_DbgPrint(MID_TRACE, ("Called.\n"));
 
+  KeInitializeSpinLock(&LoopLock);
+  InitializeListHead(&LoopQueue);
+  InitializeListHead(&LoopFreeList);
+  for (i = 0; i < LOOP_DELIVERIES; i++)
+    InsertTailList(&LoopFreeList, &LoopDeliveries[i].ListEntry);
+  LoopWorkerQueued = FALSE;
+
   /* Bind the adapter to network (IP) layer */
   BindInfo.Context = NULL;
   BindInfo.HeaderSize = 0;
@@ -109,6 +239,7 @@ NDIS_STATUS LoopRegisterAdapter(
   BindInfo.Address = NULL;
   BindInfo.AddressLength = 0;
   BindInfo.Transmit = LoopTransmit;
+  BindInfo.TransmitPackets = NULL;
 
   Loopback = IPCreateInterface(&BindInfo);
   if (!Loopback) return NDIS_STATUS_RESOURCES;
@@ -57,6 +57,25 @@ BOOLEAN AddrIsEqualIPv4(
 PIP_INTERFACE AddrLocateInterface(
     PIP_ADDRESS MatchAddress);
 
+VOID AddrSetStartup(
+    VOID);
+
+VOID AddrSetShutdown(
+    VOID);
+
+VOID AddrSetRebuild(
+    VOID);
+
+PIP_INTERFACE AddrSetLocateInterface(
+    PIP_ADDRESS Address);
+
+BOOLEAN AddrSetIsBroadcastMatch(
+    PIP_ADDRESS UnicastAddress,
+    PIP_ADDRESS BroadcastAddress);
+
+PIP_INTERFACE AddrSetFindOnLinkInterface(
+    PIP_ADDRESS Address);
+
 PADDRESS_FILE AddrSearchFirst(
     PIP_ADDRESS Address,
     USHORT Port,
@@ -11,13 +11,20 @@
 #define _REACTOS_CHEW_H
 
 /**
- * Initialize CHEW, given a device object (since IoAllocateWorkItem relies on
- * it).
+ * Work item priorities.  Receive processing runs ahead of everything else
+ * so it is not starved by request completions.
  */
-VOID ChewInit(PDEVICE_OBJECT DeviceObject);
+#define CHEW_PRIORITY_HIGH   0
+#define CHEW_PRIORITY_NORMAL 1
+#define CHEW_PRIORITY_COUNT  2
 
 /**
- * Shutdown CHEW, waits for remaining work items.
+ * Initialize CHEW and start one worker thread per processor.
+ */
+NTSTATUS ChewInit(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * Shutdown CHEW, waits for remaining work items and stops the workers.
  */
 VOID ChewShutdown(VOID);
 
@@ -26,4 +33,9 @@ VOID ChewShutdown(VOID);
  */
 BOOLEAN ChewCreate(VOID (*Worker)(PVOID), PVOID WorkerContext);
 
+/**
+ * Creates and queues a work item with the given CHEW_PRIORITY_*.
+ */
+BOOLEAN ChewCreateEx(VOID (*Worker)(PVOID), PVOID WorkerContext, ULONG Priority);
+
 #endif/*_REACTOS_CHEW_H*/
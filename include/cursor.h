@@ -0,0 +1,40 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/cursor.h
+ * PURPOSE:     Reading position in an NDIS buffer chain
+ * NOTES:       A cursor remembers the buffer and offset it stopped at, so
+ *              reading a packet piece by piece walks its chain once
+ *              instead of from the first buffer for every piece.
+ */
+
+#pragma once
+
+typedef struct _PACKET_CURSOR {
+    PNDIS_PACKET Packet;    /* Packet being read, NULL if not set up */
+    PNDIS_BUFFER Buffer;    /* Buffer holding the next byte, NULL past the end */
+    PCHAR Data;             /* Next byte */
+    UINT Left;              /* Bytes from Data to the end of Buffer */
+    UINT Offset;            /* Offset of Data into the packet */
+} PACKET_CURSOR, *PPACKET_CURSOR;
+
+BOOLEAN CursorInitialize(
+    PPACKET_CURSOR Cursor,
+    PNDIS_PACKET Packet,
+    UINT Offset);
+
+PVOID CursorPeek(
+    PPACKET_CURSOR Cursor,
+    UINT Length);
+
+UINT CursorPull(
+    PPACKET_CURSOR Cursor,
+    PVOID Destination,
+    UINT Length);
+
+PVOID CursorLinearize(
+    PPACKET_CURSOR Cursor,
+    PVOID Scratch,
+    UINT Length);
+
+/* EOF */
@@ -21,10 +21,21 @@ NTSTATUS DGReceiveDatagram(
     PVOID Context,
     PIRP Irp);
 
+BOOLEAN DGReceiveQueued(
+    PADDRESS_FILE AddrFile,
+    PCHAR Buffer,
+    ULONG ReceiveLength,
+    PTDI_CONNECTION_INFORMATION ReturnInfo,
+    PULONG BytesReceived,
+    PNTSTATUS Status);
+
 BOOLEAN DGRemoveIRP(
     PADDRESS_FILE AddrFile,
     PIRP Irp);
 
+VOID DGFlushReceivedQueue(
+    PADDRESS_FILE AddrFile);
+
 VOID DGDeliverData(
   PADDRESS_FILE AddrFile,
   PIP_ADDRESS SrcAddress,
@@ -69,6 +69,14 @@ NTSTATUS DispTdiDeleteIPAddress(
     PIRP Irp,
     PIO_STACK_LOCATION IrpSp);
 
+NTSTATUS DispTcpSendDatagrams(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+NTSTATUS DispTcpReceiveDatagrams(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
 VOID DispDoDisconnect(
     PVOID Data);
 
@@ -9,9 +9,13 @@
 
 extern LIST_ENTRY AddressFileListHead;
 extern KSPIN_LOCK AddressFileListLock;
+extern AF_HASH_BUCKET AddressFileHash[ADDRESS_FILE_HASH_SIZE];
 extern LIST_ENTRY ConnectionEndpointListHead;
 extern KSPIN_LOCK ConnectionEndpointListLock;
 
+VOID AddrFileHashStartup(
+  VOID);
+
 NTSTATUS FileOpenAddress(
   PTDI_REQUEST Request,
   PTA_IP_ADDRESS AddrList,
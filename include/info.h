@@ -156,6 +156,31 @@ TDI_STATUS InfoTdiQueryGetIPSnmpInfo( TDIEntityID ID,
 				      PNDIS_BUFFER Buffer,
 				      PUINT BufferSize );
 
+TDI_STATUS InfoTdiQueryGetStatsEx(TDIEntityID ID,
+				  PVOID Context,
+				  PNDIS_BUFFER Buffer,
+				  PUINT BufferSize);
+
+TDI_STATUS InfoTdiQueryGetLatency(PNDIS_BUFFER Buffer,
+				  PUINT BufferSize,
+				  PVOID Context);
+
+TDI_STATUS InfoTdiSetLatency(PVOID Buffer,
+			     UINT BufferSize);
+
+TDI_STATUS InfoTdiQueryGetLockProfile(PNDIS_BUFFER Buffer,
+				      PUINT BufferSize,
+				      PVOID Context);
+
+TDI_STATUS InfoTdiSetLockProfile(PVOID Buffer,
+				 UINT BufferSize);
+
+TDI_STATUS InfoTdiQueryGetSlab(PNDIS_BUFFER Buffer,
+			       PUINT BufferSize);
+
+TDI_STATUS InfoTdiQueryGetPacketCache(PNDIS_BUFFER Buffer,
+				      PUINT BufferSize);
+
 TDI_STATUS InfoTdiQueryGetRouteTable( PIP_INTERFACE IF,
                                       PNDIS_BUFFER Buffer,
                                       PUINT BufferSize );
@@ -7,6 +7,12 @@
 
 #pragma once
 
+#include <stats.h>
+#include <trace.h>
+#include <latency.h>
+#include <lockprof.h>
+#include <cursor.h>
+
 typedef VOID (*OBJECT_FREE_ROUTINE)(PVOID Object);
 
 #define FOURCC(a,b,c,d) (((a)<<24)|((b)<<16)|((c)<<8)|(d))
@@ -73,6 +79,12 @@ typedef VOID (*PACKET_COMPLETION_ROUTINE)(
     PNDIS_PACKET NdisPacket,
     NDIS_STATUS NdisStatus);
 
+/* Shared reference to the pool buffer holding a received packet */
+typedef struct _IP_PACKET_BUFFER {
+    LONG RefCount;                      /* Reference count */
+    PVOID Buffer;                       /* Pool buffer (PACKET_BUFFER_TAG) */
+} IP_PACKET_BUFFER, *PIP_PACKET_BUFFER;
+
 /* Structure for an IP packet */
 typedef struct _IP_PACKET {
     OBJECT_FREE_ROUTINE Free;           /* Routine used to free resources for the object */
@@ -88,6 +100,9 @@ typedef struct _IP_PACKET {
     PNDIS_PACKET NdisPacket;            /* Pointer to NDIS packet */
     IP_ADDRESS SrcAddr;                 /* Source address */
     IP_ADDRESS DstAddr;                 /* Destination address */
+    PIP_PACKET_BUFFER HeaderBuffer;     /* Shared reference to Header once a receiver keeps it */
+    ULONGLONG Timestamp;                /* LATENCY_STAMP() of the first stage, zero if not timed */
+    PACKET_CURSOR Cursor;               /* Next byte of NdisPacket to read when receiving */
 } IP_PACKET, *PIP_PACKET;
 
 #define IP_PACKET_FLAG_RAW      0x01    /* Raw IP packet */
@@ -100,6 +115,10 @@ typedef struct _PACKET_CONTEXT {
 					   * in a queue */
     PVOID Context;                        /* Context information for handler */
     UINT  PacketType;                     /* Type of packet */
+    ULONGLONG Timestamp;                  /* LATENCY_STAMP() of the send, zero if not timed */
+    LONG  References;                     /* Receivers holding the packet, see LoopTransmit */
+    UINT  CacheClass;                     /* Packet cache size class */
+    PNDIS_BUFFER CacheBuffer;             /* Buffer kept with the packet, NULL if not cached */
 } PACKET_CONTEXT, *PPACKET_CONTEXT;
 
 /* The ProtocolReserved field is structured as a PACKET_CONTEXT */
@@ -122,6 +141,17 @@ typedef VOID (*LL_TRANSMIT_ROUTINE)(
     PVOID LinkAddress,
     USHORT Type);
 
+/* Maximum number of packets handed to a batched transmit routine at once */
+#define LL_TRANSMIT_BATCH 16
+
+/* Link layer transmit prototype for several packets to the same destination */
+typedef VOID (*LL_TRANSMIT_PACKETS_ROUTINE)(
+    PVOID Context,
+    PNDIS_PACKET *NdisPackets,
+    UINT Count,
+    PVOID LinkAddress,
+    USHORT Type);
+
 /* Link layer to IP binding information */
 typedef struct _LLIP_BIND_INFO {
     PVOID Context;                /* Pointer to link layer context information */
@@ -130,22 +160,9 @@ typedef struct _LLIP_BIND_INFO {
     PUCHAR Address;               /* Pointer to interface address */
     UINT  AddressLength;          /* Length of address in bytes */
     LL_TRANSMIT_ROUTINE Transmit; /* Transmit function for this interface */
+    LL_TRANSMIT_PACKETS_ROUTINE TransmitPackets; /* Batched transmit function, optional */
 } LLIP_BIND_INFO, *PLLIP_BIND_INFO;
 
-typedef struct _SEND_RECV_STATS {
-    UINT InBytes;
-    UINT InUnicast;
-    UINT InNUnicast;
-    UINT InDiscarded;
-    UINT InErrors;
-    UINT InDiscardedUnknownProto;
-    UINT OutBytes;
-    UINT OutUnicast;
-    UINT OutNUnicast;
-    UINT OutDiscarded;
-    UINT OutErrors;
-} SEND_RECV_STATS, *PSEND_RECV_STATS;
-
 /* Information about an IP interface */
 typedef struct _IP_INTERFACE {
     LIST_ENTRY ListEntry;         /* Entry on list */
@@ -166,8 +183,9 @@ typedef struct _IP_INTERFACE {
     UINT  AddressLength;          /* Length of address in bytes */
     UINT  Index;                  /* Index of adapter (used to add ip addr) */
     LL_TRANSMIT_ROUTINE Transmit; /* Pointer to transmit function */
+    LL_TRANSMIT_PACKETS_ROUTINE TransmitPackets; /* Pointer to batched transmit function, if any */
     PVOID TCPContext;             /* TCP Content for this interface */
-    SEND_RECV_STATS Stats;        /* Send/Receive statistics */
+    PSEND_RECV_STATS Stats;       /* Per-processor send/receive statistics */
 } IP_INTERFACE, *PIP_INTERFACE;
 
 typedef struct _IP_SET_ADDRESS {
@@ -205,6 +223,10 @@ extern KSPIN_LOCK InterfaceListLock;
 extern LIST_ENTRY NetTableListHead;
 extern KSPIN_LOCK NetTableListLock;
 
+/* Identification of the next IPv4 datagram we send. Senders take one with
+ * InterlockedIncrement, or a block of them with InterlockedExchangeAdd */
+extern LONG IPv4Identification;
+
 PIP_PACKET IPCreatePacket(
   ULONG Type);
 
@@ -212,6 +234,12 @@ PIP_PACKET IPInitializePacket(
     PIP_PACKET IPPacket,
     ULONG Type);
 
+PIP_PACKET_BUFFER IPReferencePacketBuffer(
+    PIP_PACKET IPPacket);
+
+VOID IPDereferencePacketBuffer(
+    PIP_PACKET_BUFFER PacketBuffer);
+
 PIP_INTERFACE IPCreateInterface(
     PLLIP_BIND_INFO BindInfo);
 
@@ -243,6 +271,10 @@ VOID IPRegisterProtocol(
     UINT ProtocolNumber,
     IP_PROTOCOL_HANDLER Handler);
 
+VOID DefaultProtocolHandler(
+    PIP_INTERFACE Interface,
+    PIP_PACKET IPPacket);
+
 NTSTATUS IPStartup(PUNICODE_STRING RegistryPath);
 
 NTSTATUS IPShutdown(VOID);
@@ -0,0 +1,41 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/latency.h
+ * PURPOSE:     Per-stage latency histograms
+ * NOTES:       Packets and requests carry the time stamp counter value of
+ *              their first stage, zero when they are not being timed. Each
+ *              later stage adds the elapsed ticks to a per-processor
+ *              histogram.
+ */
+
+#pragma once
+
+#include <tcpioctl.h>
+#include <intrin.h>
+
+extern volatile BOOLEAN LatencyEnabled;
+
+#define LATENCY_STAMP() (LatencyEnabled ? __rdtsc() : 0)
+
+#define LATENCY_RECORD(Stage, Start)                \
+    do {                                            \
+        if (LatencyEnabled && (Start))              \
+            LatencyRecord((Stage), (Start));        \
+    } while (0)
+
+/* Send and receive IRPs keep their stamp in the driver context while we own them */
+#define IRP_LATENCY_STAMP(Irp) (*(PULONGLONG)&(Irp)->Tail.Overlay.DriverContext[2])
+
+VOID LatencyRecord(
+    ULONG Stage,
+    ULONGLONG Start);
+
+VOID LatencyRecordIrp(
+    PIRP Irp);
+
+NTSTATUS LatencyStartup(VOID);
+
+VOID LatencyShutdown(VOID);
+
+/* EOF */
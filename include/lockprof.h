@@ -0,0 +1,48 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/lockprof.h
+ * PURPOSE:     Spin lock contention profile
+ * NOTES:       While profiling is off the lock wrappers cost a load and a
+ *              branch. Locks are given a TCP_LOCK_SITE_* name when they are
+ *              initialized; anything unnamed is counted as
+ *              TCP_LOCK_SITE_OTHER.
+ */
+
+#pragma once
+
+#include <tcpioctl.h>
+
+/* Site argument asking for the site the lock was named with */
+#define LOCK_SITE_LOOKUP ((ULONG)-1)
+
+extern volatile BOOLEAN LockProfileEnabled;
+
+VOID LockProfileName(
+    PKSPIN_LOCK SpinLock,
+    ULONG Site);
+
+VOID LockProfileForget(
+    PKSPIN_LOCK SpinLock);
+
+VOID LockProfileAcquire(
+    PKSPIN_LOCK SpinLock,
+    PKIRQL Irql,
+    ULONG Site);
+
+VOID LockProfileAcquireAtDpcLevel(
+    PKSPIN_LOCK SpinLock,
+    ULONG Site);
+
+VOID LockProfileRelease(
+    PKSPIN_LOCK SpinLock,
+    KIRQL Irql);
+
+VOID LockProfileReleaseFromDpcLevel(
+    PKSPIN_LOCK SpinLock);
+
+NTSTATUS LockProfileStartup(VOID);
+
+VOID LockProfileShutdown(VOID);
+
+/* EOF */
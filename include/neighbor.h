@@ -57,6 +57,11 @@ typedef struct NEIGHBOR_CACHE_ENTRY {
 extern NEIGHBOR_CACHE_TABLE NeighborCache[NB_HASHMASK + 1];
 
 
+VOID NBCompleteSend(
+    PVOID Context,
+    PNDIS_PACKET NdisPacket,
+    NDIS_STATUS Status);
+
 VOID NBTimeout(
     VOID);
 
@@ -96,6 +101,13 @@ BOOLEAN NBQueuePacket(
     PNEIGHBOR_PACKET_COMPLETE PacketComplete,
     PVOID PacketContext);
 
+BOOLEAN NBQueuePackets(
+    PNEIGHBOR_CACHE_ENTRY NCE,
+    PNDIS_PACKET *NdisPackets,
+    UINT Count,
+    PNEIGHBOR_PACKET_COMPLETE PacketComplete,
+    PVOID *PacketContexts);
+
 VOID NBRemoveNeighbor(
     PNEIGHBOR_CACHE_ENTRY NCE);
 
@@ -10,19 +10,42 @@
 
 #pragma once
 
+/* Number of ephemeral ports each processor reserves at once */
+#define PORT_CACHE_BATCH 16
+
+/* Ephemeral ports reserved in the bitmap for one processor, so that
+ * AllocateAnyPort rarely takes the port set lock */
+typedef struct _PORT_CACHE {
+    KSPIN_LOCK Lock;
+    ULONG Count;
+    USHORT Ports[PORT_CACHE_BATCH]; /* Host byte order */
+} PORT_CACHE, *PPORT_CACHE;
+
 typedef struct _PORT_SET {
     RTL_BITMAP ProtoBitmap;
     PVOID ProtoBitBuffer;
     UINT StartingPort;
     UINT PortsToOversee;
+    UINT EphemeralFirst;   /* Range handed out when no port is asked for */
+    UINT EphemeralCount;
+    ULONG NextEphemeral;   /* RFC 6056 algorithm 3 counter */
+    ULONG Secret[2];       /* Key of the RFC 6056 port offset hash */
+    ULONG RandomSeed;      /* Only used at startup, RtlRandomEx is pageable */
+    ULONG NextRandom;      /* Hashed to pick cache refill points */
+    PPORT_CACHE Caches;    /* One per processor */
+    ULONG CacheCount;
     KSPIN_LOCK Lock;
 } PORT_SET, *PPORT_SET;
 
 NTSTATUS PortsStartup( PPORT_SET PortSet,
 		       UINT StartingPort,
-		       UINT PortsToManage );
+		       UINT PortsToManage,
+		       UINT EphemeralFirst,
+		       UINT EphemeralCount );
 VOID PortsShutdown( PPORT_SET PortSet );
 VOID DeallocatePort( PPORT_SET PortSet, ULONG Port );
 BOOLEAN AllocatePort( PPORT_SET PortSet, ULONG Port );
 ULONG AllocateAnyPort( PPORT_SET PortSet );
+ULONG AllocatePortForPeer( PPORT_SET PortSet, ULONG LocalAddress,
+			   ULONG RemoteAddress, ULONG RemotePort );
 ULONG AllocatePortFromRange( PPORT_SET PortSet, ULONG Lowest, ULONG Highest );
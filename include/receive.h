@@ -18,6 +18,7 @@ typedef struct IP_FRAGMENT {
     PNDIS_PACKET Packet;  /* NDIS packet containing fragment data */
     BOOLEAN ReturnPacket; /* States whether to call NdisReturnPackets */
     UINT PacketOffset;    /* Offset into NDIS packet where data is */
+    PACKET_CURSOR Cursor; /* Positioned at PacketOffset */
     UINT Offset;          /* Offset into datagram where this fragment is */
     UINT Size;            /* Size of this fragment */
 } IP_FRAGMENT, *PIP_FRAGMENT;
@@ -0,0 +1,52 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/regbuf.h
+ * PURPOSE:     Registered buffer region definitions
+ */
+
+#pragma once
+
+/* A client buffer that is locked and mapped for the lifetime of the region */
+typedef struct _TCP_REGION {
+    LONG RefCount;              /* One for the registration, one per user */
+    ULONG Id;                   /* Identifier handed to the client, 0 if unregistered */
+    PEPROCESS Process;          /* Process whose memory this is */
+    PFILE_OBJECT Owner;         /* File object the region was registered on */
+    PMDL Mdl;                   /* Locked pages */
+    PUCHAR SystemVa;            /* Mapping of the pages */
+    ULONG Length;
+} TCP_REGION, *PTCP_REGION;
+
+VOID RegionStartup(VOID);
+
+NTSTATUS RegionCreate(
+    PVOID Base,
+    ULONG Length,
+    KPROCESSOR_MODE Mode,
+    PTCP_REGION *Region);
+
+PTCP_REGION RegionReference(
+    ULONG Id);
+
+VOID RegionDereference(
+    PTCP_REGION Region);
+
+VOID RegionBuildMdl(
+    PTCP_REGION Region,
+    ULONG Offset,
+    ULONG Length,
+    PMDL Mdl);
+
+VOID RegionCloseFileObject(
+    PFILE_OBJECT FileObject);
+
+NTSTATUS DispTcpRegisterBuffer(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+NTSTATUS DispTcpDeregisterBuffer(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+/* EOF */
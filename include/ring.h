@@ -0,0 +1,21 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/ring.h
+ * PURPOSE:     Batched I/O ring definitions
+ */
+
+#pragma once
+
+NTSTATUS DispTcpRingSetup(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+NTSTATUS DispTcpRingEnter(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+VOID RingDetach(
+    PTRANSPORT_CONTEXT Context);
+
+/* EOF */
@@ -16,4 +16,23 @@
 
 PNEIGHBOR_CACHE_ENTRY RouteGetRouteToDestination(PIP_ADDRESS Destination);
 
+UINT PMTUGetPathMTU(
+    PIP_ADDRESS Destination,
+    UINT InterfaceMTU,
+    PBOOLEAN Locked);
+
+UINT PMTUUpdate(
+    PIP_ADDRESS Destination,
+    UINT NextHopMTU,
+    UINT DatagramSize);
+
+VOID PMTUTimeout(
+    VOID);
+
+VOID PMTUStartup(
+    VOID);
+
+VOID PMTUShutdown(
+    VOID);
+
 /* EOF */
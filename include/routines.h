@@ -53,6 +53,10 @@ NDIS_STATUS AllocatePacketWithBuffer( PNDIS_PACKET *NdisPacket,
 
 VOID FreeNdisPacket( PNDIS_PACKET Packet );
 
+NTSTATUS PacketCacheStartup(VOID);
+
+VOID PacketCacheShutdown(VOID);
+
 void GetDataPtr( PNDIS_PACKET Packet,
 		 UINT Offset,
 		 PCHAR *DataOut,
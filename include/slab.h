@@ -0,0 +1,37 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/slab.h
+ * PURPOSE:     Fixed size object caches
+ * NOTES:       Objects are carved from large nonpaged chunks. Every
+ *              processor keeps two magazines of free objects, so
+ *              allocating and freeing only raise the IRQL. The cache lock
+ *              is taken only to trade magazines with the shared depot or
+ *              to carve new objects.
+ */
+
+#pragma once
+
+typedef struct _SLAB_CACHE *PSLAB_CACHE;
+
+PSLAB_CACHE SlabCreateCache(
+    PCSTR Name,
+    ULONG Size,
+    ULONG Tag);
+
+VOID SlabDestroyCache(
+    PSLAB_CACHE Cache);
+
+PVOID SlabAllocate(
+    PSLAB_CACHE Cache);
+
+VOID SlabFree(
+    PSLAB_CACHE Cache,
+    PVOID Object);
+
+ULONG SlabObjectSize(
+    PSLAB_CACHE Cache);
+
+VOID SlabStartup(VOID);
+
+/* EOF */
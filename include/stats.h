@@ -0,0 +1,90 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/stats.h
+ * PURPOSE:     Per-processor statistics counters
+ * NOTES:       Each processor bumps its own copy of a counter block, so the
+ *              hot paths never share a cache line or take a lock. Queries
+ *              add the copies up.
+ */
+
+#pragma once
+
+#include <tcpioctl.h>
+
+#define STATS_CACHE_LINE 64
+
+/* Distance between the copies of a counter block of the given type */
+#define STATS_STRIDE(Type) \
+    ((sizeof(Type) + STATS_CACHE_LINE - 1) & ~(STATS_CACHE_LINE - 1))
+
+#define STATS_CPU(Stats, Type) \
+    ((Type *)((PUCHAR)(Stats) + \
+        STATS_STRIDE(Type) * (KeGetCurrentProcessorNumber() % KeNumberProcessors)))
+
+/* Bumps a 64-bit counter that StatsSum may read from another processor.
+   A plain add is one store on 64-bit processors, but two on x86, where a
+   reader could see the halves of different values */
+#ifdef _WIN64
+#define STATS_COUNT(Counter, Value) ((Counter) += (Value))
+#else
+#define STATS_COUNT(Counter, Value) \
+    InterlockedExchangeAdd64((PLONGLONG)&(Counter), (LONGLONG)(Value))
+#endif
+
+/* Counters are only written by their own processor, raising to
+   DISPATCH_LEVEL keeps the update from being preempted half way */
+#define STAT_ADD(Stats, Type, Field, Value)             \
+    do {                                                \
+        KIRQL _StatsIrql;                               \
+        KeRaiseIrql(DISPATCH_LEVEL, &_StatsIrql);       \
+        STATS_COUNT(STATS_CPU(Stats, Type)->Field, Value); \
+        KeLowerIrql(_StatsIrql);                        \
+    } while (0)
+
+#define STAT_INC(Stats, Type, Field) STAT_ADD(Stats, Type, Field, 1)
+
+/* Not the lwIP *_STATS_INC macros, which count into lwip_stats */
+#define IF_STAT_ADD(IF, Field, Value) STAT_ADD((IF)->Stats, SEND_RECV_STATS, Field, Value)
+#define IF_STAT_INC(IF, Field)        STAT_INC((IF)->Stats, SEND_RECV_STATS, Field)
+#define IP_STAT_ADD(Field, Value)     STAT_ADD(IPStats, TCPIP_IP_STATS, Field, Value)
+#define IP_STAT_INC(Field)            STAT_INC(IPStats, TCPIP_IP_STATS, Field)
+#define UDP_STAT_ADD(Field, Value)    STAT_ADD(UDPStats, TCPIP_UDP_STATS, Field, Value)
+#define UDP_STAT_INC(Field)           STAT_INC(UDPStats, TCPIP_UDP_STATS, Field)
+#define TCP_STAT_INC(Field)           STAT_INC(TCPStats, TCPIP_TCP_STATS, Field)
+
+/* Counter blocks have the layout returned by MIB_STATS_EX_ID */
+typedef TCPIP_IF_STATS SEND_RECV_STATS, *PSEND_RECV_STATS;
+
+extern PTCPIP_IP_STATS IPStats;
+extern PTCPIP_UDP_STATS UDPStats;
+extern PTCPIP_TCP_STATS TCPStats;
+
+PVOID StatsAllocate(
+    ULONG Stride);
+
+VOID StatsFree(
+    PVOID Stats);
+
+VOID StatsSum(
+    PVOID Stats,
+    ULONG Stride,
+    ULONG Size,
+    PULONGLONG Total);
+
+VOID StatsReset(
+    PVOID Stats,
+    ULONG Stride,
+    ULONG Size);
+
+#define STATS_ALLOCATE(Type) StatsAllocate(STATS_STRIDE(Type))
+#define STATS_SUM(Stats, Type, Total) \
+    StatsSum((Stats), STATS_STRIDE(Type), sizeof(Type), (PULONGLONG)(Total))
+#define STATS_RESET(Stats, Type) \
+    StatsReset((Stats), STATS_STRIDE(Type), sizeof(Type))
+
+NTSTATUS StatsStartup(VOID);
+
+VOID StatsShutdown(VOID);
+
+/* EOF */
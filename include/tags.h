@@ -14,9 +14,12 @@
 #define TDI_ENTITY_TAG 'EidT'
 #define DATAGRAM_SEND_TAG 'StaD'
 #define DATAGRAM_RECV_TAG 'RtaD'
+#define DATAGRAM_QUEUE_TAG 'QtaD'
+#define DATAGRAM_BATCH_TAG 'BtaD'
 #define QUERY_CONTEXT_TAG 'noCQ'
 #define IP_ADDRESS_TAG 'dAPI'
 #define IP_INTERFACE_TAG 'FIPI'
+#define ADDR_SET_TAG 'tSdA'
 #define DATAGRAM_REASSEMBLY_TAG 'RDPI'
 #define DATAGRAM_FRAGMENT_TAG 'GFPI'
 #define DATAGRAM_HOLE_TAG 'LHPI'
@@ -25,6 +28,7 @@
 #define NCE_TAG ' ECN'
 #define PORT_SET_TAG 'teSP'
 #define PACKET_BUFFER_TAG 'fuBP'
+#define PACKET_BUFFER_REF_TAG 'fRBP'
 #define FRAGMENT_DATA_TAG 'taDF'
 #define FIB_TAG ' BIF'
 #define IFC_TAG ' CFI'
@@ -36,3 +40,11 @@
 #define LAN_ADAPTER_TAG ' NAL'
 #define LAN_GENERAL_TAG 'gNAL'
 #define WQ_CONTEXT_TAG 'noCW'
+#define COMPLETION_QUEUE_TAG 'QpmC'
+#define TCP_RING_TAG 'gniR'
+#define TCP_REGION_TAG 'geRT'
+#define STATS_TAG 'tatS'
+#define TRACE_RING_TAG 'carT'
+#define LATENCY_TAG 'ctaL'
+#define SLAB_TAG 'balS'
+#define PMTU_TAG 'utmP'
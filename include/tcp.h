@@ -10,6 +10,14 @@
 typedef VOID
 (*PTCP_COMPLETION_ROUTINE)( PVOID Context, NTSTATUS Status, ULONG Count );
 
+/* Ephemeral port range; lwIP's TCP_LOCAL_PORT_RANGE_START/END must match */
+#define TCP_STARTING_PORT 0xC000
+#define TCP_DYNAMIC_PORTS 0x4000
+
+/* Ephemeral ports tried for a connection before giving up because their
+ * 4-tuple is still in TIME-WAIT */
+#define TCP_PORT_REUSE_TRIES 8
+
 /* TCPv4 header structure */
 #include <pshpack1.h>
 typedef struct TCPv4_HEADER {
@@ -154,11 +162,12 @@ NTSTATUS TCPReceiveData(
   PULONG BytesReceived,
   ULONG ReceiveFlags,
   PTCP_COMPLETION_ROUTINE Complete,
-  PVOID Context);
+  PVOID Context,
+  PIRP Irp);
 
 NTSTATUS TCPSendData(
   PCONNECTION_ENDPOINT Connection,
-  PCHAR Buffer,
+  PNDIS_BUFFER Buffer,
   ULONG DataSize,
   PULONG DataUsed,
   ULONG Flags,
@@ -189,6 +198,9 @@ BOOLEAN TCPRemoveIRP( PCONNECTION_ENDPOINT Connection, PIRP Irp );
 VOID
 TCPUpdateInterfaceLinkStatus(PIP_INTERFACE IF);
 
+VOID
+TCPFragmentationNeeded(PIP_ADDRESS Source, PIP_ADDRESS Destination, PVOID Segment, UINT NextHopMTU, UINT DatagramSize);
+
 VOID
 TCPUpdateInterfaceIPInformation(PIP_INTERFACE IF);
 
@@ -204,6 +216,9 @@ FlushReceiveQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const
 VOID
 FlushSendQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOOLEAN interlocked);
 
+VOID
+FlushInFlightQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status);
+
 VOID
 FlushShutdownQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOOLEAN interlocked);
 
@@ -211,3 +226,7 @@ VOID
 FlushAllQueues(PCONNECTION_ENDPOINT Connection, NTSTATUS Status);
 
 VOID CompleteBucket(PCONNECTION_ENDPOINT Connection, PTDI_BUCKET Bucket, const BOOLEAN Synchronous);
+
+NTSTATUS TCPCompletionStartup(VOID);
+
+VOID TCPCompletionShutdown(VOID);
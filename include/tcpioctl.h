@@ -43,6 +43,34 @@
 #define IOCTL_DELETE_IP_ADDRESS \
     _TCP_CTL_CODE(16, METHOD_BUFFERED, FILE_WRITE_ACCESS)
 
+/* Submission/completion rings, see TCP_RING_SETUP */
+#define IOCTL_TCP_RING_SETUP \
+    _TCP_CTL_CODE(32, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_TCP_RING_ENTER \
+    _TCP_CTL_CODE(33, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* Registered buffers, see TCP_REGISTER_BUFFER */
+#define IOCTL_TCP_REGISTER_BUFFER \
+    _TCP_CTL_CODE(34, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_TCP_DEREGISTER_BUFFER \
+    _TCP_CTL_CODE(35, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_TCP_SEND_DATAGRAMS \
+    _TCP_CTL_CODE(36, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+
+#define IOCTL_TCP_RECEIVE_DATAGRAMS \
+    _TCP_CTL_CODE(37, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+/* Binary event trace, see TCP_TRACE_DUMP. Records carry addresses, ports
+ * and kernel pointers, so reading them needs the same access as control */
+#define IOCTL_TCP_TRACE_CONTROL \
+    _TCP_CTL_CODE(38, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define IOCTL_TCP_QUERY_TRACE \
+    _TCP_CTL_CODE(39, METHOD_OUT_DIRECT, FILE_WRITE_ACCESS)
+
 #define IF_MIB_STATS_ID                 1
 #define IP_MIB_STATS_ID                 1
 #define IP_MIB_ARPTABLE_ENTRY_ID        0x101
@@ -50,6 +78,67 @@
 #define IP_INTFC_INFO_ID                0x103
 #define MAX_PHYSADDR_SIZE               8
 
+/*
+ * Private MIB ids
+ *
+ * Querying an IF, NL, CL_TL (UDP) or CO_TL (TCP) entity with
+ * MIB_STATS_EX_ID returns its counters as 64-bit values in the matching
+ * TCPIP_*_STATS structure below.  The standard MIB structures carry the
+ * same counters truncated to 32 bits.
+ */
+#define MIB_STATS_EX_ID                 0x1000
+
+typedef struct _TCPIP_IF_STATS
+{
+    ULONGLONG InBytes;
+    ULONGLONG InUnicast;
+    ULONGLONG InNUnicast;
+    ULONGLONG InDiscarded;
+    ULONGLONG InErrors;
+    ULONGLONG InDiscardedUnknownProto;
+    ULONGLONG OutBytes;
+    ULONGLONG OutUnicast;
+    ULONGLONG OutNUnicast;
+    ULONGLONG OutDiscarded;
+    ULONGLONG OutErrors;
+} TCPIP_IF_STATS, *PTCPIP_IF_STATS;
+
+typedef struct _TCPIP_IP_STATS
+{
+    ULONGLONG InReceives;
+    ULONGLONG InHdrErrors;          /* Bad version, length or checksum */
+    ULONGLONG InAddrErrors;
+    ULONGLONG InUnknownProtos;
+    ULONGLONG InDiscards;           /* Dropped for lack of resources */
+    ULONGLONG InDelivers;
+    ULONGLONG OutRequests;
+    ULONGLONG OutDiscards;          /* Dropped for lack of resources */
+    ULONGLONG OutNoRoutes;
+    ULONGLONG ReasmReqds;
+    ULONGLONG ReasmOks;
+    ULONGLONG ReasmFails;
+    ULONGLONG FragOks;
+    ULONGLONG FragFails;
+    ULONGLONG FragCreates;
+} TCPIP_IP_STATS, *PTCPIP_IP_STATS;
+
+typedef struct _TCPIP_UDP_STATS
+{
+    ULONGLONG InDatagrams;
+    ULONGLONG NoPorts;              /* No address file bound to the port */
+    ULONGLONG InErrors;             /* Bad checksum or length */
+    ULONGLONG RcvBufErrors;         /* Dropped on a full receive buffer */
+    ULONGLONG OutDatagrams;
+} TCPIP_UDP_STATS, *PTCPIP_UDP_STATS;
+
+typedef struct _TCPIP_TCP_STATS
+{
+    ULONGLONG InSegs;
+    ULONGLONG OutSegs;
+    ULONGLONG OutErrors;            /* Segments that could not be routed or sent */
+    ULONGLONG LoopbackSegs;         /* Segments handed straight to a local endpoint */
+} TCPIP_TCP_STATS, *PTCPIP_TCP_STATS;
+
 /* Address Object Options */
 #define AO_OPTION_TTL                1
 #define AO_OPTION_MCASTTTL           2
@@ -90,6 +179,11 @@
 #define AO_OPTION_UNBIND            37
 #define AO_OPTION_PROTECT           38
 
+/* Private address object options */
+#define AO_OPTION_RCVBUF_DROPS      0x1000 /* Datagrams dropped on a full receive buffer */
+#define AO_OPTION_UDP_SEGMENT_SIZE  0x1001 /* Larger UDP sends are split into datagrams
+                                              of this payload size, 0 to disable */
+
 typedef struct IFEntry
 {
     ULONG if_index;
@@ -164,4 +258,381 @@ typedef struct IPInterfaceInfo
     UCHAR iii_addr[1];
 } IPInterfaceInfo;
 
+/*
+ * Batched I/O rings
+ *
+ * A client attaches one ring to a connection or address file object with
+ * IOCTL_TCP_RING_SETUP.  The ring memory holds a TCP_RING_HEADER followed by
+ * the submission and completion queues; it is locked once at setup, as is
+ * the optional data area.  Descriptors point into that data area (region 0)
+ * or into a buffer registered with IOCTL_TCP_REGISTER_BUFFER.  The client fills submission
+ * entries, advances SqTail and issues IOCTL_TCP_RING_ENTER to have the stack
+ * consume them.  Results are posted to the completion queue, advancing
+ * CqTail, and the optional event is signalled.  The client advances CqHead
+ * as it reaps completions.
+ */
+#define TCP_RING_MAX_ENTRIES        4096
+#define TCP_RING_MAX_IO             0x10000
+
+#define TCP_RING_OP_SEND            1   /* Connection: send Length bytes at Offset */
+#define TCP_RING_OP_RECEIVE         2   /* Connection: receive into Length bytes at Offset */
+#define TCP_RING_OP_SEND_DATAGRAM   3   /* Address file: send to RemoteAddress:RemotePort */
+#define TCP_RING_OP_RECEIVE_DATAGRAM 4  /* Address file: receive, sender is reported */
+
+typedef struct _TCP_RING_HEADER
+{
+    volatile ULONG SqHead;          /* Written by the stack */
+    volatile ULONG SqTail;          /* Written by the client */
+    volatile ULONG CqHead;          /* Written by the client */
+    volatile ULONG CqTail;          /* Written by the stack */
+    ULONG SqEntries;
+    ULONG CqEntries;
+    ULONG SqOffset;                 /* Offset of the TCP_RING_SQE array */
+    ULONG CqOffset;                 /* Offset of the TCP_RING_CQE array */
+} TCP_RING_HEADER, *PTCP_RING_HEADER;
+
+typedef struct _TCP_RING_SQE
+{
+    ULONG Opcode;                   /* TCP_RING_OP_* */
+    ULONG Flags;                    /* TDI send/receive flags */
+    ULONG RegionId;                 /* 0 for the ring data area, else a registered buffer */
+    ULONG Offset;                   /* Offset into the region */
+    ULONG Length;                   /* At most TCP_RING_MAX_IO */
+    ULONG Reserved0;
+    ULONGLONG UserData;             /* Returned in the completion */
+    ULONG RemoteAddress;            /* Datagram destination, network order */
+    USHORT RemotePort;              /* Network order */
+    USHORT Reserved;
+} TCP_RING_SQE, *PTCP_RING_SQE;
+
+typedef struct _TCP_RING_CQE
+{
+    ULONGLONG UserData;
+    LONG Status;
+    ULONG Information;              /* Bytes transferred */
+    ULONG RemoteAddress;            /* Datagram sender, network order */
+    USHORT RemotePort;
+    USHORT Reserved;
+} TCP_RING_CQE, *PTCP_RING_CQE;
+
+typedef struct _TCP_RING_SETUP
+{
+    PVOID RingBase;
+    ULONG RingLength;
+    PVOID DataBase;                 /* Optional data area */
+    ULONG DataLength;
+    ULONG Entries;                  /* Submission entries, a power of two; twice
+                                       as many completion entries are used */
+    HANDLE Event;                   /* Optional, signalled on completions */
+} TCP_RING_SETUP, *PTCP_RING_SETUP;
+
+/*
+ * Registered buffers
+ *
+ * IOCTL_TCP_REGISTER_BUFFER locks and maps a buffer once and returns an id
+ * that ring descriptors of the same process name it by.  The registration
+ * lasts until IOCTL_TCP_DEREGISTER_BUFFER or until the file object it was
+ * made on is closed; requests in flight keep the pages locked until they
+ * complete.
+ */
+typedef struct _TCP_REGISTER_BUFFER
+{
+    PVOID Base;                     /* In: register */
+    ULONG Length;                   /* In: register */
+    ULONG RegionId;                 /* Out: register, in: deregister */
+} TCP_REGISTER_BUFFER, *PTCP_REGISTER_BUFFER;
+
+typedef struct _TCP_RING_ENTER
+{
+    ULONG ToSubmit;                 /* In: entries to consume */
+    ULONG Submitted;                /* Out: entries consumed */
+} TCP_RING_ENTER, *PTCP_RING_ENTER;
+
+/*
+ * Batched datagrams
+ *
+ * IOCTL_TCP_SEND_DATAGRAMS sends several datagrams from an address file in
+ * one call.  The input buffer is a TCP_SEND_DATAGRAMS naming each datagram
+ * by offset and length into the output buffer, which holds the payloads.
+ * Information returns the number of datagrams sent.
+ *
+ * IOCTL_TCP_RECEIVE_DATAGRAMS fills up to Count slots of SlotSize bytes in
+ * the output buffer, each a TCP_DATAGRAM_SLOT followed by the payload.  It
+ * waits for the first datagram unless TCP_RECEIVE_DATAGRAMS_NOWAIT is set,
+ * and returns the number of slots filled in Information.
+ */
+#define TCP_DATAGRAM_BATCH_MAX      64
+
+#define TCP_RECEIVE_DATAGRAMS_NOWAIT 0x00000001
+
+typedef struct _TCP_DATAGRAM_DESC
+{
+    ULONG RemoteAddress;            /* Network order */
+    USHORT RemotePort;              /* Network order */
+    USHORT Reserved;
+    ULONG Offset;                   /* Offset of the payload in the data buffer */
+    ULONG Length;
+} TCP_DATAGRAM_DESC, *PTCP_DATAGRAM_DESC;
+
+typedef struct _TCP_SEND_DATAGRAMS
+{
+    ULONG Count;                    /* At most TCP_DATAGRAM_BATCH_MAX */
+    TCP_DATAGRAM_DESC Datagrams[1];
+} TCP_SEND_DATAGRAMS, *PTCP_SEND_DATAGRAMS;
+
+typedef struct _TCP_RECEIVE_DATAGRAMS
+{
+    ULONG Count;                    /* At most TCP_DATAGRAM_BATCH_MAX */
+    ULONG SlotSize;                 /* Includes the TCP_DATAGRAM_SLOT */
+    ULONG Flags;                    /* TCP_RECEIVE_DATAGRAMS_* */
+} TCP_RECEIVE_DATAGRAMS, *PTCP_RECEIVE_DATAGRAMS;
+
+typedef struct _TCP_DATAGRAM_SLOT
+{
+    ULONG RemoteAddress;            /* Sender, network order */
+    USHORT RemotePort;
+    USHORT Reserved;
+    ULONG Length;                   /* Payload bytes stored after the slot header */
+    LONG Status;                    /* STATUS_BUFFER_OVERFLOW if truncated */
+} TCP_DATAGRAM_SLOT, *PTCP_DATAGRAM_SLOT;
+
+/*
+ * Binary event trace
+ *
+ * IOCTL_TCP_TRACE_CONTROL turns tracing on or off.  While it is on, hot
+ * paths append fixed size records to a ring of their processor; a full
+ * ring overwrites its oldest records.  IOCTL_TCP_QUERY_TRACE drains the
+ * rings into the output buffer: a TCP_TRACE_DUMP followed by Count
+ * records, ordered by processor and then by time.
+ */
+#define TCP_TRACE_PACKET_RECEIVE    1   /* Arg0 interface index, Arg1 size, Arg2 ether type */
+#define TCP_TRACE_IP_DISPATCH       2   /* Arg0 protocol, Arg1 size, Arg2 source address */
+#define TCP_TRACE_TCP_INPUT         3   /* Arg0 size */
+#define TCP_TRACE_TCP_OUTPUT        4   /* Arg0 size, Arg1 destination address */
+#define TCP_TRACE_IRP_QUEUE         5   /* Arg0 IRP, Arg1 minor function */
+#define TCP_TRACE_IRP_COMPLETE      6   /* Arg0 IRP, Arg1 status, Arg2 information */
+#define TCP_TRACE_IRP_CANCEL        7   /* Arg0 IRP, Arg1 minor function */
+#define TCP_TRACE_NEIGHBOR_SOLICIT  8   /* Arg0 address */
+#define TCP_TRACE_NEIGHBOR_UPDATE   9   /* Arg0 address, Arg1 state */
+#define TCP_TRACE_DROP              10  /* Reason TCP_DROP_*, Arg0-2 depend on it */
+
+#define TCP_DROP_IP_HEADER          1   /* Bad IP version, length or checksum */
+#define TCP_DROP_IP_RESOURCES       2   /* Out of memory on receive */
+#define TCP_DROP_IP_UNKNOWN_PROTO   3   /* Arg0 protocol */
+#define TCP_DROP_IP_REASSEMBLY      4   /* Timed out, Arg0 source address, Arg1 id */
+#define TCP_DROP_NO_ROUTE           5   /* Arg0 destination address */
+#define TCP_DROP_UDP_HEADER         6   /* Bad checksum or length, Arg0 port */
+#define TCP_DROP_UDP_NO_PORT        7   /* Arg0 port, network order, Arg1 address */
+#define TCP_DROP_RCVBUF             8   /* Arg0 port, network order, Arg1 size */
+#define TCP_DROP_LINK_PROTO         9   /* Arg0 ether type */
+#define TCP_DROP_LINK_RESOURCES     10  /* Out of memory on transmit */
+#define TCP_DROP_NEIGHBOR           11  /* Arg0 address, Arg1 status */
+
+typedef struct _TCP_TRACE_CONTROL
+{
+    ULONG Enable;
+} TCP_TRACE_CONTROL, *PTCP_TRACE_CONTROL;
+
+typedef struct _TCP_TRACE_RECORD
+{
+    ULONGLONG Timestamp;            /* Time stamp counter */
+    USHORT Event;                   /* TCP_TRACE_* */
+    UCHAR Processor;
+    UCHAR Reason;                   /* TCP_DROP_* for TCP_TRACE_DROP */
+    ULONGLONG Arg0;                 /* Wide enough for an IRP pointer */
+    ULONG Arg1;
+    ULONG Arg2;
+} TCP_TRACE_RECORD, *PTCP_TRACE_RECORD;
+
+typedef struct _TCP_TRACE_DUMP
+{
+    ULONG Count;                    /* Records following the header */
+    ULONG Lost;                     /* Records overwritten before they were drained */
+    ULONGLONG StartTimestamp;       /* Time stamp counter when tracing was enabled */
+    LARGE_INTEGER StartTime;        /* System time when tracing was enabled */
+    ULONGLONG TimestampFrequency;   /* Time stamp counter ticks per second, estimated */
+} TCP_TRACE_DUMP, *PTCP_TRACE_DUMP;
+
+/*
+ * Latency histograms
+ *
+ * Querying any entity with MIB_LATENCY_ID returns a TCPIP_LATENCY_INFO.
+ * Receive stages are timed from the NDIS indication of a packet, send
+ * stages from the send request entering the driver.  A query whose first
+ * context ULONG is TCP_LATENCY_QUERY_RESET clears the histograms once
+ * they are read.  Setting MIB_LATENCY_ID with a TCP_LATENCY_CONTROL turns
+ * timing on or off.
+ *
+ * Buckets are log-linear in time stamp counter ticks: values below 4
+ * have a bucket each, above that every power of two is split into 4
+ * buckets.  The last bucket also counts everything larger.
+ */
+#define MIB_LATENCY_ID                  0x1001
+
+#define TCP_LATENCY_RX_WORKER       0   /* LanReceiveWorker picked the packet up */
+#define TCP_LATENCY_RX_IP           1   /* IPReceive */
+#define TCP_LATENCY_RX_TRANSPORT    2   /* TCPReceive or UDPReceive */
+#define TCP_LATENCY_RX_LWIP         3   /* lwIP handed the segment data back */
+#define TCP_LATENCY_RX_EVENT        4   /* TCPRecvEventHandler */
+#define TCP_LATENCY_RX_COMPLETE     5   /* IRPFinish of the receive it satisfied */
+#define TCP_LATENCY_TX_SEND         6   /* NdisSend */
+#define TCP_LATENCY_TX_COMPLETE     7   /* IRPFinish of the send */
+#define TCP_LATENCY_STAGES          8
+
+#define TCP_LATENCY_BUCKETS         128
+
+/* Smallest tick count counted in a bucket */
+#define TCP_LATENCY_BUCKET_LOW(Bucket) \
+    ((Bucket) < 4 ? (ULONGLONG)(Bucket) : \
+     (ULONGLONG)(4 + (Bucket) % 4) << ((Bucket) / 4 - 1))
+
+#define TCP_LATENCY_QUERY_RESET     1
+
+typedef struct _TCP_LATENCY_CONTROL
+{
+    ULONG Enable;
+} TCP_LATENCY_CONTROL, *PTCP_LATENCY_CONTROL;
+
+typedef struct _TCPIP_LATENCY_STATS
+{
+    ULONGLONG Count[TCP_LATENCY_STAGES][TCP_LATENCY_BUCKETS];
+} TCPIP_LATENCY_STATS, *PTCPIP_LATENCY_STATS;
+
+typedef struct _TCPIP_LATENCY_INFO
+{
+    ULONG Enabled;
+    ULONG Reserved;
+    ULONGLONG TimestampFrequency;   /* Time stamp counter ticks per second, estimated */
+    TCPIP_LATENCY_STATS Stats;
+} TCPIP_LATENCY_INFO, *PTCPIP_LATENCY_INFO;
+
+/*
+ * Spin lock profile
+ *
+ * Querying any entity with MIB_LOCK_PROFILE_ID returns a
+ * TCPIP_LOCK_PROFILE_INFO with one entry per lock site.  Every lock of
+ * a site adds to the same entry, so the per-bucket and per-object locks
+ * are reported as a whole.  Names[] holds the stable name of each site.
+ * A query whose first context ULONG is TCP_LOCK_PROFILE_QUERY_RESET
+ * clears the counters once they are read.  Setting MIB_LOCK_PROFILE_ID
+ * with a TCP_LOCK_PROFILE_CONTROL turns profiling on or off.
+ *
+ * Times are in time stamp counter ticks.  Spin time is counted from the
+ * first failed attempt until the lock was taken, hold time from taking
+ * the lock until its release.
+ */
+#define MIB_LOCK_PROFILE_ID             0x1002
+
+#define TCP_LOCK_SITE_OTHER             0   /* Locks without a name */
+#define TCP_LOCK_SITE_FIB               1   /* FIBLock */
+#define TCP_LOCK_SITE_ADDRESS_FILE_LIST 2   /* AddressFileListLock */
+#define TCP_LOCK_SITE_ADDRESS_FILE_HASH 3   /* AddressFileHash bucket locks */
+#define TCP_LOCK_SITE_CONNECTION_LIST   4   /* ConnectionEndpointListLock */
+#define TCP_LOCK_SITE_REASSEMBLY_LIST   5   /* ReassemblyListLock */
+#define TCP_LOCK_SITE_NEIGHBOR          6   /* NeighborCache bucket locks */
+#define TCP_LOCK_SITE_INTERFACE_LIST    7   /* InterfaceListLock */
+#define TCP_LOCK_SITE_NET_TABLE_LIST    8   /* NetTableListLock */
+#define TCP_LOCK_SITE_INTERFACE         9   /* IP_INTERFACE locks */
+#define TCP_LOCK_SITE_ADAPTER_LIST      10  /* AdapterListLock */
+#define TCP_LOCK_SITE_ADAPTER           11  /* LAN_ADAPTER locks */
+#define TCP_LOCK_SITE_ENTITY_LIST       12  /* EntityListLock */
+#define TCP_LOCK_SITE_ADDRESS_SET       13  /* AddressSetLock */
+#define TCP_LOCK_SITE_OBJECT            14  /* Address file and connection locks */
+#define TCP_LOCK_SITE_PATH_MTU          15  /* PMTULock */
+#define TCP_LOCK_SITES                  16
+
+#define TCP_LOCK_NAME_LENGTH            32
+
+#define TCP_LOCK_PROFILE_QUERY_RESET    1
+
+typedef struct _TCP_LOCK_PROFILE_CONTROL
+{
+    ULONG Enable;
+} TCP_LOCK_PROFILE_CONTROL, *PTCP_LOCK_PROFILE_CONTROL;
+
+typedef struct _TCPIP_LOCK_SITE_STATS
+{
+    ULONGLONG Acquisitions;         /* Times a lock of the site was taken */
+    ULONGLONG Contentions;          /* Acquisitions that found the lock held */
+    ULONGLONG SpinTicks;            /* Ticks spent waiting in those */
+    ULONGLONG Holds;                /* Acquisitions whose hold time was measured */
+    ULONGLONG HoldTicks;            /* Ticks the lock was held over those */
+} TCPIP_LOCK_SITE_STATS, *PTCPIP_LOCK_SITE_STATS;
+
+typedef struct _TCPIP_LOCK_STATS
+{
+    TCPIP_LOCK_SITE_STATS Site[TCP_LOCK_SITES];
+} TCPIP_LOCK_STATS, *PTCPIP_LOCK_STATS;
+
+typedef struct _TCPIP_LOCK_PROFILE_INFO
+{
+    ULONG Enabled;
+    ULONG Sites;                    /* TCP_LOCK_SITES */
+    ULONGLONG TimestampFrequency;   /* Time stamp counter ticks per second, estimated */
+    CHAR Names[TCP_LOCK_SITES][TCP_LOCK_NAME_LENGTH];
+    TCPIP_LOCK_STATS Stats;
+} TCPIP_LOCK_PROFILE_INFO, *PTCPIP_LOCK_PROFILE_INFO;
+
+/*
+ * Object caches
+ *
+ * Querying any entity with MIB_SLAB_ID returns a TCPIP_SLAB_INFO
+ * followed by one TCPIP_SLAB_STATS per cache.  Chunks are kept until
+ * the driver unloads, so HighWater is the largest number of objects the
+ * cache ever needed at once, in use or waiting in a magazine.
+ */
+#define MIB_SLAB_ID                     0x1003
+
+#define TCP_SLAB_NAME_LENGTH            16
+
+typedef struct _TCPIP_SLAB_STATS
+{
+    CHAR Name[TCP_SLAB_NAME_LENGTH];
+    ULONG ObjectSize;
+    ULONG Chunks;                   /* Chunks taken from nonpaged pool */
+    ULONGLONG Allocations;
+    ULONGLONG Frees;
+    ULONGLONG InUse;                /* Allocations not freed yet */
+    ULONGLONG HighWater;            /* Objects carved from the chunks */
+    ULONGLONG DepotExchanges;       /* Magazines traded with the depot */
+    ULONGLONG Failures;             /* Allocations that found no memory */
+} TCPIP_SLAB_STATS, *PTCPIP_SLAB_STATS;
+
+typedef struct _TCPIP_SLAB_INFO
+{
+    ULONG Caches;                   /* Entries in Cache[] */
+    ULONG Reserved;
+    TCPIP_SLAB_STATS Cache[1];
+} TCPIP_SLAB_INFO, *PTCPIP_SLAB_INFO;
+
+/*
+ * Packet cache
+ *
+ * Querying any entity with MIB_PACKET_CACHE_ID returns a
+ * TCPIP_PACKET_CACHE_INFO.  Packets are kept with their buffer in
+ * TCP_PACKET_CACHE_CLASSES size classes; Hits out of Allocations is the
+ * hit rate of a class and Outstanding the packets not freed yet.
+ */
+#define MIB_PACKET_CACHE_ID             0x1004
+
+#define TCP_PACKET_CACHE_CLASSES        4
+
+typedef struct _TCPIP_PACKET_CACHE_STATS
+{
+    ULONG BufferSize;               /* Largest packet the class holds */
+    ULONG Cached;                   /* Packets waiting for reuse */
+    ULONGLONG Allocations;
+    ULONGLONG Hits;                 /* Allocations served from the cache */
+    ULONGLONG Frees;
+    ULONGLONG Recycled;             /* Frees kept in the cache */
+    ULONGLONG Outstanding;          /* Allocations not freed yet */
+} TCPIP_PACKET_CACHE_STATS, *PTCPIP_PACKET_CACHE_STATS;
+
+typedef struct _TCPIP_PACKET_CACHE_INFO
+{
+    ULONG Classes;                  /* TCP_PACKET_CACHE_CLASSES */
+    ULONG Reserved;
+    TCPIP_PACKET_CACHE_STATS Class[TCP_PACKET_CACHE_CLASSES];
+} TCPIP_PACKET_CACHE_INFO, *PTCPIP_PACKET_CACHE_INFO;
+
 #endif/*_TCPIOCTL_H*/
@@ -51,6 +51,12 @@
 #define IOCTL_DELETE_IP_ADDRESS \
     _TCP_CTL_CODE(16, METHOD_BUFFERED, FILE_WRITE_ACCESS)
 
+/* Number of (protocol, port) buckets in the address file hash, power of two */
+#define ADDRESS_FILE_HASH_SIZE 256
+
+/* Default limit for datagrams buffered on an address file (SO_RCVBUF) */
+#define DEFAULT_RECEIVE_BUFFER_SIZE 0x10000
+
 /* Unique error values for log entries */
 #define TI_ERROR_DRIVERENTRY 0
 
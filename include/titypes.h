@@ -32,7 +32,11 @@
 #define LockObject(Object, Irql)                         \
 {                                                        \
     ReferenceObject(Object);                             \
-    KeAcquireSpinLock(&((Object)->Lock), Irql);          \
+    if (LockProfileEnabled)                              \
+        LockProfileAcquire(&((Object)->Lock), Irql,      \
+                           TCP_LOCK_SITE_OBJECT);        \
+    else                                                 \
+        KeAcquireSpinLock(&((Object)->Lock), Irql);      \
     memcpy(&(Object)->OldIrql, Irql, sizeof(KIRQL));     \
 }
 
@@ -42,7 +46,11 @@
 #define LockObjectAtDpcLevel(Object)                     \
 {                                                        \
     ReferenceObject(Object);                             \
-    KeAcquireSpinLockAtDpcLevel(&((Object)->Lock));      \
+    if (LockProfileEnabled)                              \
+        LockProfileAcquireAtDpcLevel(&((Object)->Lock),  \
+            TCP_LOCK_SITE_OBJECT);                       \
+    else                                                 \
+        KeAcquireSpinLockAtDpcLevel(&((Object)->Lock));  \
     (Object)->OldIrql = DISPATCH_LEVEL;                  \
 }
 
@@ -51,7 +59,10 @@
  */
 #define UnlockObject(Object, OldIrql)                       \
 {                                                           \
-    KeReleaseSpinLock(&((Object)->Lock), OldIrql);          \
+    if (LockProfileEnabled)                                 \
+        LockProfileRelease(&((Object)->Lock), OldIrql);     \
+    else                                                    \
+        KeReleaseSpinLock(&((Object)->Lock), OldIrql);      \
     DereferenceObject(Object);                              \
 }
 
@@ -60,7 +71,10 @@
  */
 #define UnlockObjectFromDpcLevel(Object)                    \
 {                                                           \
-    KeReleaseSpinLockFromDpcLevel(&((Object)->Lock));       \
+    if (LockProfileEnabled)                                 \
+        LockProfileReleaseFromDpcLevel(&((Object)->Lock));  \
+    else                                                    \
+        KeReleaseSpinLockFromDpcLevel(&((Object)->Lock));   \
     DereferenceObject(Object);                              \
 }
 
@@ -104,6 +118,16 @@ typedef struct _DATAGRAM_RECEIVE_REQUEST {
     PIRP Irp;                              /* IRP on behalf of */
 } DATAGRAM_RECEIVE_REQUEST, *PDATAGRAM_RECEIVE_REQUEST;
 
+/* Datagram kept on an address file until a receive request is posted */
+typedef struct _DATAGRAM_RECEIVED {
+    LIST_ENTRY ListEntry;                  /* Entry on list */
+    PIP_PACKET_BUFFER PacketBuffer;        /* Reference to the received packet */
+    PVOID Data;                            /* Datagram data inside PacketBuffer */
+    UINT DataSize;                         /* Size of Data */
+    IP_ADDRESS SrcAddress;                 /* Remote address the datagram came from */
+    USHORT SrcPort;                        /* Remote port the datagram came from */
+} DATAGRAM_RECEIVED, *PDATAGRAM_RECEIVED;
+
 /* Datagram build routine prototype */
 typedef NTSTATUS (*DATAGRAM_BUILD_ROUTINE)(
     PVOID Context,
@@ -127,6 +151,7 @@ typedef struct _DATAGRAM_SEND_REQUEST {
    field holds a pointer to this structure */
 typedef struct _ADDRESS_FILE {
     LIST_ENTRY ListEntry;                 /* Entry on list */
+    LIST_ENTRY HashEntry;                 /* Entry on (protocol, port) hash bucket */
     LONG RefCount;                        /* Reference count */
     OBJECT_FREE_ROUTINE Free;             /* Routine to use to free resources for the object */
     KSPIN_LOCK Lock;                      /* Spin lock to manipulate this structure */
@@ -140,12 +165,17 @@ typedef struct _ADDRESS_FILE {
     UINT DF;                              /* Don't fragment */
     UINT BCast;                           /* Receive broadcast packets */
     UINT HeaderIncl;                      /* Include header in RawIP packets */
+    ULONG SegmentSize;                    /* UDP segmentation payload size, 0 if off */
     WORK_QUEUE_ITEM WorkItem;             /* Work queue item handle */
     DATAGRAM_COMPLETION_ROUTINE Complete; /* Completion routine for delete request */
     PVOID Context;                        /* Delete request context */
     DATAGRAM_SEND_ROUTINE Send;           /* Routine to send a datagram */
     LIST_ENTRY ReceiveQueue;              /* List of outstanding receive requests */
     LIST_ENTRY TransmitQueue;             /* List of outstanding transmit requests */
+    LIST_ENTRY ReceivedQueue;             /* Datagrams waiting for a receive request */
+    ULONG ReceivedBytes;                  /* Bytes charged for ReceivedQueue */
+    ULONG ReceiveBufferSize;              /* Limit for ReceivedBytes (SO_RCVBUF) */
+    ULONG ReceiveDrops;                   /* Datagrams dropped because ReceivedQueue was full */
     struct _CONNECTION_ENDPOINT *Connection;
     /* Associated connection or NULL if no associated connection exist */
     struct _CONNECTION_ENDPOINT *Listener;
@@ -194,8 +224,16 @@ typedef struct _ADDRESS_FILE {
     BOOLEAN RegisteredChainedReceiveExpeditedHandler;
 } ADDRESS_FILE, *PADDRESS_FILE;
 
+/* Bucket of the address file hash. Wildcard binds are kept at the head
+   and specific local address binds at the tail */
+typedef struct _AF_HASH_BUCKET {
+    LIST_ENTRY ListHead;    /* Address files hashing to this bucket */
+    KSPIN_LOCK Lock;        /* Protects ListHead */
+} AF_HASH_BUCKET, *PAF_HASH_BUCKET;
+
 /* Structure used to search through Address Files */
 typedef struct _AF_SEARCH {
+    PAF_HASH_BUCKET Bucket; /* Bucket being searched */
     PLIST_ENTRY Next;       /* Next address file to check */
     PIP_ADDRESS Address;    /* Pointer to address to be found */
     USHORT Port;            /* Network port */
@@ -247,6 +285,12 @@ typedef struct _TDI_BUCKET {
     TDI_REQUEST Request;
     NTSTATUS Status;
     ULONG Information;
+    PMDL SendMdl;               /* MDL holding the next byte to hand to lwIP */
+    ULONG SendOffset;           /* Offset of that byte within SendMdl */
+    ULONG SendRemaining;        /* Bytes not yet handed to lwIP */
+    ULONG AckRemaining;         /* Bytes handed to lwIP but not yet acknowledged */
+    PMDL ReceiveMdl;            /* Buffer a pending receive fills */
+    PIRP Irp;                   /* IRP behind the request, NULL for ring requests */
 } TDI_BUCKET, *PTDI_BUCKET;
 
 /* Transport connection context structure A.K.A. Transmission Control Block
@@ -267,6 +311,7 @@ typedef struct _CONNECTION_ENDPOINT {
     LIST_ENTRY ListenRequest;  /* Queued listen requests */
     LIST_ENTRY ReceiveRequest; /* Queued receive requests */
     LIST_ENTRY SendRequest;    /* Queued send requests */
+    LIST_ENTRY SendInFlight;   /* Send requests referenced by lwIP until acknowledged */
     LIST_ENTRY ShutdownRequest;/* Queued shutdown requests */
 
     LIST_ENTRY PacketQueue;    /* Queued received packets waiting to be processed */
@@ -280,6 +325,8 @@ typedef struct _CONNECTION_ENDPOINT {
     BOOLEAN ReceiveShutdown;
     NTSTATUS ReceiveShutdownStatus;
 
+    ULONGLONG ReceiveTimestamp; /* LATENCY_STAMP() of the segment being delivered, tcpip thread only */
+
     struct _CONNECTION_ENDPOINT *Next; /* Next connection in address file list */
 } CONNECTION_ENDPOINT, *PCONNECTION_ENDPOINT;
 
@@ -308,6 +355,7 @@ typedef struct _TRANSPORT_CONTEXT {
     } Handle;
     BOOLEAN CancelIrps;
     KEVENT CleanupEvent;
+    struct _TCP_RING *Ring;     /* Batched I/O ring, if one was set up */
 } TRANSPORT_CONTEXT, *PTRANSPORT_CONTEXT;
 
 typedef struct _TI_QUERY_CONTEXT {
@@ -0,0 +1,58 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        include/trace.h
+ * PURPOSE:     Binary event trace
+ * NOTES:       Trace points cost a load and a branch while tracing is
+ *              off; define TI_NO_TRACE to compile them out entirely.
+ */
+
+#pragma once
+
+#include <tcpioctl.h>
+
+#define TRACE_RING_SIZE 4096    /* Records per processor, a power of two */
+
+extern volatile BOOLEAN TraceEnabled;
+
+#ifdef TI_NO_TRACE
+#define TRACE_EVENT(Event, Reason, Arg0, Arg1, Arg2) do { } while (0)
+#else
+#define TRACE_EVENT(Event, Reason, Arg0, Arg1, Arg2)                       \
+    do {                                                                    \
+        if (TraceEnabled)                                                   \
+            TraceWrite((Event), (Reason),                                   \
+                       (ULONG_PTR)(Arg0), (ULONG)(Arg1), (ULONG)(Arg2));    \
+    } while (0)
+#endif
+
+#define TRACE_DROP(Reason, Arg0, Arg1) \
+    TRACE_EVENT(TCP_TRACE_DROP, Reason, Arg0, Arg1, 0)
+
+#define TRACE_IRP(Event, Irp, Arg1, Arg2) \
+    TRACE_EVENT(Event, 0, (ULONG_PTR)(Irp), Arg1, Arg2)
+
+VOID TraceWrite(
+    USHORT Event,
+    UCHAR Reason,
+    ULONG_PTR Arg0,
+    ULONG Arg1,
+    ULONG Arg2);
+
+ULONGLONG TraceEstimateTimestampFrequency(
+    ULONGLONG StartTimestamp,
+    LARGE_INTEGER StartCounter);
+
+VOID TraceStartup(VOID);
+
+VOID TraceShutdown(VOID);
+
+NTSTATUS DispTcpTraceControl(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+NTSTATUS DispTcpQueryTrace(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp);
+
+/* EOF */
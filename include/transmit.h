@@ -30,5 +30,10 @@ typedef struct IPFRAGMENT_CONTEXT {
 } IPFRAGMENT_CONTEXT, *PIPFRAGMENT_CONTEXT;
 
 
+VOID IPSendComplete(PVOID Context, PNDIS_PACKET NdisPacket, NDIS_STATUS NdisStatus);
 NTSTATUS IPSendDatagram(PIP_PACKET IPPacket, PNEIGHBOR_CACHE_ENTRY NCE);
+NTSTATUS IPSendDatagramBatch(PIP_PACKET IPPackets, UINT Count, PNEIGHBOR_CACHE_ENTRY NCE,
+                             PUINT Sent);
+NTSTATUS IPSendSegments(PIP_PACKET Template, PCHAR Data, UINT DataSize,
+                        UINT SegmentSize, PNEIGHBOR_CACHE_ENTRY NCE, PUINT DataSent);
 /* EOF */
@@ -7,8 +7,8 @@
 
 #pragma once
 
-#define UDP_STARTING_PORT 0x8000
-#define UDP_DYNAMIC_PORTS 0x8000
+#define UDP_STARTING_PORT 0xC000
+#define UDP_DYNAMIC_PORTS 0x4000
 
 /* UDPv4 header structure */
 #include <pshpack1.h>
@@ -29,15 +29,21 @@ typedef struct UDP_PSEUDO_HEADER {
 } UDP_PSEUDO_HEADER, *PUDP_PSEUDO_HEADER;
 #include <poppack.h>
 
-typedef struct UDP_STATISTICS {
-  ULONG InputDatagrams;
-  ULONG NumPorts;
-  ULONG InputErrors;
-  ULONG OutputDatagrams;
-  ULONG NumAddresses;
-} UDP_STATISTICS, *PUDP_STATISTICS;
 
-extern UDP_STATISTICS UDPStats;
+/* Limits for segmented sends (AO_OPTION_UDP_SEGMENT_SIZE) */
+#define UDP_MAX_SEGMENTS     64
+#define UDP_MAX_SEGMENT_SIZE (0xFFFF - sizeof(IPv4_HEADER) - sizeof(UDP_HEADER))
+
+/* Maximum number of datagrams built before they are handed to IP */
+#define UDP_SEND_BATCH 8
+
+/* One datagram of a batched send */
+typedef struct UDP_SEND_ENTRY {
+  IP_ADDRESS RemoteAddress; /* Destination address */
+  USHORT RemotePort;        /* Destination port, big-endian */
+  PCHAR Data;               /* Datagram payload */
+  ULONG DataSize;           /* Size of the payload */
+} UDP_SEND_ENTRY, *PUDP_SEND_ENTRY;
 
 VOID UDPSend(
   PVOID Context,
@@ -50,6 +56,12 @@ NTSTATUS UDPSendDatagram(
     ULONG DataSize,
     PULONG DataUsed );
 
+NTSTATUS UDPSendDatagrams(
+    PADDRESS_FILE AddrFile,
+    PUDP_SEND_ENTRY Entries,
+    ULONG Count,
+    PULONG Sent );
+
 VOID UDPReceive(
     PIP_INTERFACE Interface,
     PIP_PACKET IPPacket);
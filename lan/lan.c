@@ -22,6 +22,7 @@ typedef struct _LAN_WQ_ITEM {
     PLAN_ADAPTER Adapter;
     UINT BytesTransferred;
     BOOLEAN LegacyReceive;
+    ULONGLONG Timestamp;
 } LAN_WQ_ITEM, *PLAN_WQ_ITEM;
 
 typedef struct _RECONFIGURE_CONTEXT {
@@ -127,39 +128,28 @@ GetPacketTypeFromHeaderBuffer(PLAN_ADAPTER Adapter,
 /* Used by ProtocolReceivePacket for packet type */
 NDIS_STATUS
 GetPacketTypeFromNdisPacket(PLAN_ADAPTER Adapter,
-                            PNDIS_PACKET NdisPacket,
+                            PPACKET_CURSOR Cursor,
                             PULONG PacketType)
 {
+    UCHAR Scratch[MAX_MEDIA_ETH];
     PVOID HeaderBuffer;
-    ULONG BytesCopied;
-    NDIS_STATUS Status;
     
-    HeaderBuffer = ExAllocatePool(NonPagedPool,
-                                  Adapter->HeaderSize);
+    if (Adapter->HeaderSize > sizeof(Scratch))
+        return NDIS_STATUS_NOT_ACCEPTED;
+
+    /* Get the media header, copied only if it spans buffers */
+    HeaderBuffer = CursorLinearize(Cursor, Scratch, Adapter->HeaderSize);
     if (!HeaderBuffer)
-        return NDIS_STATUS_RESOURCES;
-    
-    /* Copy the media header */
-    BytesCopied = CopyPacketToBuffer(HeaderBuffer,
-                                     NdisPacket,
-                                     0,
-                                     Adapter->HeaderSize);
-    if (BytesCopied != Adapter->HeaderSize)
     {
         /* Runt frame */
-        ExFreePool(HeaderBuffer);
-        TI_DbgPrint(DEBUG_DATALINK, ("Runt frame (size %d).\n", BytesCopied));
+        TI_DbgPrint(DEBUG_DATALINK, ("Runt frame (size %d).\n", Cursor->Offset));
         return NDIS_STATUS_NOT_ACCEPTED;
     }
 
-    Status = GetPacketTypeFromHeaderBuffer(Adapter,
-                                           HeaderBuffer,
-                                           BytesCopied,
-                                           PacketType);
-    
-    ExFreePool(HeaderBuffer);
-    
-    return Status;
+    return GetPacketTypeFromHeaderBuffer(Adapter,
+                                         HeaderBuffer,
+                                         Adapter->HeaderSize,
+                                         PacketType);
 }
 
 
@@ -171,6 +161,7 @@ VOID FreeAdapter(
  *     Adapter = Pointer to LAN_ADAPTER structure to free
  */
 {
+    LockProfileForget(&Adapter->Lock);
     ExFreePoolWithTag(Adapter, LAN_ADAPTER_TAG);
 }
 
@@ -296,6 +287,11 @@ VOID NTAPI ProtocolSendComplete(
  *     Status         = Status of the operation
  */
 {
+    PLAN_ADAPTER Adapter = (PLAN_ADAPTER)BindingContext;
+
+    if (Status != NDIS_STATUS_SUCCESS && Adapter->Context)
+        IF_STAT_INC((PIP_INTERFACE)Adapter->Context, OutErrors);
+
     FreeNdisPacket(Packet);
 }
 
@@ -316,15 +312,21 @@ VOID LanReceiveWorker( PVOID Context ) {
     BytesTransferred = WorkItem->BytesTransferred;
     LegacyReceive = WorkItem->LegacyReceive;
 
+    IPInitializePacket(&IPPacket, 0);
+
+    IPPacket.Timestamp = WorkItem->Timestamp;
+    LATENCY_RECORD(TCP_LATENCY_RX_WORKER, IPPacket.Timestamp);
+
     ExFreePoolWithTag(WorkItem, WQ_CONTEXT_TAG);
 
     Interface = Adapter->Context;
 
-    IPInitializePacket(&IPPacket, 0);
-
     IPPacket.NdisPacket = Packet;
     IPPacket.ReturnPacket = !LegacyReceive;
 
+    /* Everything above the link layer reads on from here */
+    CursorInitialize(&IPPacket.Cursor, Packet, 0);
+
     if (LegacyReceive)
     {
         /* Packet type is precomputed */
@@ -340,10 +342,11 @@ VOID LanReceiveWorker( PVOID Context ) {
     {
         /* Determine packet type from media header */
         if (GetPacketTypeFromNdisPacket(Adapter,
-                                        IPPacket.NdisPacket,
+                                        &IPPacket.Cursor,
                                         &PacketType) != NDIS_STATUS_SUCCESS)
         {
             /* Bad packet */
+            IF_STAT_INC(Interface, InErrors);
             IPPacket.Free(&IPPacket);
             return;
         }
@@ -361,7 +364,9 @@ VOID LanReceiveWorker( PVOID Context ) {
 	  PacketType, IPPacket.TotalSize));
 
     /* Update interface stats */
-    Interface->Stats.InBytes += IPPacket.TotalSize + Adapter->HeaderSize;
+    IF_STAT_ADD(Interface, InBytes, IPPacket.TotalSize + Adapter->HeaderSize);
+
+    TRACE_EVENT(TCP_TRACE_PACKET_RECEIVE, 0, Interface->Index, IPPacket.TotalSize, PacketType);
 
     /* NDIS packet is freed in all of these cases */
     switch (PacketType) {
@@ -375,6 +380,8 @@ VOID LanReceiveWorker( PVOID Context ) {
             ARPReceive(Adapter->Context, &IPPacket);
             break;
         default:
+            IF_STAT_INC(Interface, InDiscardedUnknownProto);
+            TRACE_DROP(TCP_DROP_LINK_PROTO, PacketType, 0);
             IPPacket.Free(&IPPacket);
             break;
     }
@@ -397,8 +404,9 @@ VOID LanSubmitReceiveWork(
     WQItem->Adapter = Adapter;
     WQItem->BytesTransferred = BytesTransferred;
     WQItem->LegacyReceive = LegacyReceive;
+    WQItem->Timestamp = LATENCY_STAMP();
 
-    if (!ChewCreate( LanReceiveWorker, WQItem ))
+    if (!ChewCreateEx( LanReceiveWorker, WQItem, CHEW_PRIORITY_HIGH ))
         ExFreePoolWithTag(WQItem, WQ_CONTEXT_TAG);
 }
 
@@ -734,6 +742,9 @@ BOOLEAN ReconfigureAdapter(PRECONFIGURE_CONTEXT Context)
     
     Context->Adapter->CompletingReset = FALSE;
 
+    /* Rebuild the local address set with the new addresses */
+    AddrSetRebuild();
+
     /* Update the IP and link status information cached in TCP */
     TCPUpdateInterfaceIPInformation(Interface);
     TCPUpdateInterfaceLinkStatus(Interface);
@@ -935,60 +946,45 @@ VOID NTAPI ProtocolBindAdapter(
 }
 
 
-VOID LANTransmit(
-    PVOID Context,
+static NDIS_STATUS LANBuildXmitPacket(
+    PLAN_ADAPTER Adapter,
     PNDIS_PACKET NdisPacket,
-    UINT Offset,
     PVOID LinkAddress,
-    USHORT Type)
+    USHORT Type,
+    PNDIS_PACKET *XmitPacket,
+    PUINT XmitSize)
 /*
- * FUNCTION: Transmits a packet
+ * FUNCTION: Copies a packet behind a link level header
  * ARGUMENTS:
- *     Context     = Pointer to context information (LAN_ADAPTER)
- *     NdisPacket  = Pointer to NDIS packet to send
- *     Offset      = Offset in packet where data starts
+ *     Adapter     = Adapter to transmit on
+ *     NdisPacket  = Pointer to NDIS packet to send, completed on return
  *     LinkAddress = Pointer to link address of destination (NULL = broadcast)
  *     Type        = LAN protocol type (LAN_PROTO_*)
+ *     XmitPacket  = Address of pointer to the packet to hand to NDIS
+ *     XmitSize    = Address of buffer to place its size in
+ * RETURNS:
+ *     Status of operation
  */
 {
     NDIS_STATUS NdisStatus;
     PETH_HEADER EHeader;
     PCHAR Data, OldData;
-    UINT Size, OldSize;
-    PLAN_ADAPTER Adapter = (PLAN_ADAPTER)Context;
-    KIRQL OldIrql;
-    PNDIS_PACKET XmitPacket;
-    PIP_INTERFACE Interface = Adapter->Context;
-
-    TI_DbgPrint(DEBUG_DATALINK,
-		("Called( NdisPacket %x, Offset %d, Adapter %x )\n",
-		 NdisPacket, Offset, Adapter));
-
-    if (Adapter->State != LAN_STATE_STARTED) {
-        (*PC(NdisPacket)->DLComplete)(PC(NdisPacket)->Context, NdisPacket, NDIS_STATUS_NOT_ACCEPTED);
-        return;
-    }
-
-    TI_DbgPrint(DEBUG_DATALINK,
-		("Adapter Address [%02x %02x %02x %02x %02x %02x]\n",
-		 Adapter->HWAddress[0] & 0xff,
-		 Adapter->HWAddress[1] & 0xff,
-		 Adapter->HWAddress[2] & 0xff,
-		 Adapter->HWAddress[3] & 0xff,
-		 Adapter->HWAddress[4] & 0xff,
-		 Adapter->HWAddress[5] & 0xff));
+    UINT OldSize;
 
     GetDataPtr( NdisPacket, 0, &OldData, &OldSize );
 
-    NdisStatus = AllocatePacketWithBuffer(&XmitPacket, NULL, OldSize + Adapter->HeaderSize);
+    NdisStatus = AllocatePacketWithBuffer(XmitPacket, NULL, OldSize + Adapter->HeaderSize);
     if (NdisStatus != NDIS_STATUS_SUCCESS) {
+        IF_STAT_INC((PIP_INTERFACE)Adapter->Context, OutDiscarded);
+        TRACE_DROP(TCP_DROP_LINK_RESOURCES, 0, 0);
         (*PC(NdisPacket)->DLComplete)(PC(NdisPacket)->Context, NdisPacket, NDIS_STATUS_RESOURCES);
-        return;
+        return NdisStatus;
     }
 
-    GetDataPtr(XmitPacket, 0, &Data, &Size);
+    GetDataPtr(*XmitPacket, 0, &Data, XmitSize);
 
     RtlCopyMemory(Data + Adapter->HeaderSize, OldData, OldSize);
+    PC(*XmitPacket)->Timestamp = PC(NdisPacket)->Timestamp;
 
     (*PC(NdisPacket)->DLComplete)(PC(NdisPacket)->Context, NdisPacket, NDIS_STATUS_SUCCESS);
 
@@ -1018,7 +1014,8 @@ VOID LANTransmit(
                     break;
                 default:
                     ASSERT(FALSE);
-                    return;
+                    FreeNdisPacket(*XmitPacket);
+                    return NDIS_STATUS_NOT_SUPPORTED;
             }
             break;
 
@@ -1040,14 +1037,67 @@ VOID LANTransmit(
 		   ((PCHAR)LinkAddress)[5] & 0xff));
 	}
 
+    /* Update interface stats */
+    IF_STAT_ADD((PIP_INTERFACE)Adapter->Context, OutBytes, *XmitSize);
+    if (LinkAddress)
+        IF_STAT_INC((PIP_INTERFACE)Adapter->Context, OutUnicast);
+    else
+        IF_STAT_INC((PIP_INTERFACE)Adapter->Context, OutNUnicast);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID LANTransmit(
+    PVOID Context,
+    PNDIS_PACKET NdisPacket,
+    UINT Offset,
+    PVOID LinkAddress,
+    USHORT Type)
+/*
+ * FUNCTION: Transmits a packet
+ * ARGUMENTS:
+ *     Context     = Pointer to context information (LAN_ADAPTER)
+ *     NdisPacket  = Pointer to NDIS packet to send
+ *     Offset      = Offset in packet where data starts
+ *     LinkAddress = Pointer to link address of destination (NULL = broadcast)
+ *     Type        = LAN protocol type (LAN_PROTO_*)
+ */
+{
+    NDIS_STATUS NdisStatus;
+    UINT Size;
+    PLAN_ADAPTER Adapter = (PLAN_ADAPTER)Context;
+    KIRQL OldIrql;
+    PNDIS_PACKET XmitPacket;
+
+    TI_DbgPrint(DEBUG_DATALINK,
+		("Called( NdisPacket %x, Offset %d, Adapter %x )\n",
+		 NdisPacket, Offset, Adapter));
+
+    if (Adapter->State != LAN_STATE_STARTED) {
+        (*PC(NdisPacket)->DLComplete)(PC(NdisPacket)->Context, NdisPacket, NDIS_STATUS_NOT_ACCEPTED);
+        return;
+    }
+
+    TI_DbgPrint(DEBUG_DATALINK,
+		("Adapter Address [%02x %02x %02x %02x %02x %02x]\n",
+		 Adapter->HWAddress[0] & 0xff,
+		 Adapter->HWAddress[1] & 0xff,
+		 Adapter->HWAddress[2] & 0xff,
+		 Adapter->HWAddress[3] & 0xff,
+		 Adapter->HWAddress[4] & 0xff,
+		 Adapter->HWAddress[5] & 0xff));
+
+    NdisStatus = LANBuildXmitPacket(Adapter, NdisPacket, LinkAddress, Type, &XmitPacket, &Size);
+    if (NdisStatus != NDIS_STATUS_SUCCESS)
+        return;
+
     if (Adapter->MTU < Size) {
         /* This is NOT a pointer. MSDN explicitly says so. */
-        NDIS_PER_PACKET_INFO_FROM_PACKET(NdisPacket,
+        NDIS_PER_PACKET_INFO_FROM_PACKET(XmitPacket,
                                          TcpLargeSendPacketInfo) = (PVOID)((ULONG_PTR)Adapter->MTU);
     }
 
-    /* Update interface stats */
-    Interface->Stats.OutBytes += Size;
+	LATENCY_RECORD(TCP_LATENCY_TX_SEND, PC(XmitPacket)->Timestamp);
 
 	TcpipAcquireSpinLock( &Adapter->Lock, &OldIrql );
 	TI_DbgPrint(MID_TRACE, ("NdisSend\n"));
@@ -1065,6 +1115,57 @@ VOID LANTransmit(
             ProtocolSendComplete((NDIS_HANDLE)Context, XmitPacket, NdisStatus);
 }
 
+VOID LANTransmitPackets(
+    PVOID Context,
+    PNDIS_PACKET *NdisPackets,
+    UINT Count,
+    PVOID LinkAddress,
+    USHORT Type)
+/*
+ * FUNCTION: Transmits several packets to one destination with one NDIS call
+ * ARGUMENTS:
+ *     Context     = Pointer to context information (LAN_ADAPTER)
+ *     NdisPackets = Array of NDIS packets to send
+ *     Count       = Number of packets in the array, at most LL_TRANSMIT_BATCH
+ *     LinkAddress = Pointer to link address of destination (NULL = broadcast)
+ *     Type        = LAN protocol type (LAN_PROTO_*)
+ * NOTES:
+ *     Packets larger than the MTU are not expected here
+ */
+{
+    PNDIS_PACKET XmitPackets[LL_TRANSMIT_BATCH];
+    PLAN_ADAPTER Adapter = (PLAN_ADAPTER)Context;
+    UINT i, XmitCount = 0, Size;
+    KIRQL OldIrql;
+
+    TI_DbgPrint(DEBUG_DATALINK, ("Called( %d packets, Adapter %x )\n", Count, Adapter));
+
+    ASSERT(Count <= LL_TRANSMIT_BATCH);
+
+    for (i = 0; i < Count; i++)
+    {
+        if (Adapter->State != LAN_STATE_STARTED) {
+            (*PC(NdisPackets[i])->DLComplete)(PC(NdisPackets[i])->Context, NdisPackets[i], NDIS_STATUS_NOT_ACCEPTED);
+            continue;
+        }
+
+        if (LANBuildXmitPacket(Adapter, NdisPackets[i], LinkAddress, Type,
+                               &XmitPackets[XmitCount], &Size) == NDIS_STATUS_SUCCESS)
+            XmitCount++;
+    }
+
+    if (!XmitCount)
+        return;
+
+    for (i = 0; i < XmitCount; i++)
+        LATENCY_RECORD(TCP_LATENCY_TX_SEND, PC(XmitPackets[i])->Timestamp);
+
+    /* NDIS completes every packet through ProtocolSendComplete */
+    TcpipAcquireSpinLock( &Adapter->Lock, &OldIrql );
+    NdisSendPackets(Adapter->NdisHandle, XmitPackets, XmitCount);
+    TcpipReleaseSpinLock( &Adapter->Lock, OldIrql );
+}
+
 static NTSTATUS
 OpenRegistryKey( PNDIS_STRING RegistryPath, PHANDLE RegHandle ) {
     OBJECT_ATTRIBUTES Attributes;
@@ -1333,6 +1434,7 @@ BOOLEAN BindAdapter(
     BindInfo.Address       = (PUCHAR)&Adapter->HWAddress;
     BindInfo.AddressLength = Adapter->HWAddressLength;
     BindInfo.Transmit      = LANTransmit;
+    BindInfo.TransmitPackets = LANTransmitPackets;
 
     IF = IPCreateInterface(&BindInfo);
 
@@ -1574,6 +1676,8 @@ NDIS_STATUS LANRegisterAdapter(
 	return NDIS_STATUS_NOT_ACCEPTED;
     }
 
+    LockProfileName(&IF->Lock, TCP_LOCK_SITE_ADAPTER);
+
     /* Add adapter to the adapter list */
     ExInterlockedInsertTailList(&AdapterListHead,
                                 &IF->ListEntry,
@@ -1694,6 +1798,7 @@ NTSTATUS LANRegisterProtocol(
 
     InitializeListHead(&AdapterListHead);
     KeInitializeSpinLock(&AdapterListLock);
+    LockProfileName(&AdapterListLock, TCP_LOCK_SITE_ADAPTER_LIST);
 
     /* Set up protocol characteristics */
     RtlZeroMemory(&ProtChars, sizeof(NDIS_PROTOCOL_CHARACTERISTICS));
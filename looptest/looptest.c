@@ -0,0 +1,183 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        looptest/looptest.c
+ * PURPOSE:     Sends UDP datagrams of several sizes through the loopback
+ *              adapter and checks that each arrives intact and in time
+ * NOTES:       Usage: looptest
+ *
+ *              Datagrams over the loopback MTU (16384) are fragmented
+ *              and reassembled. A send or receive that takes longer than
+ *              TIMEOUT_MS fails the test, which catches fragments that
+ *              only complete when reassembly times out.
+ *
+ *              127.0.0.1 is then pinged with a small and a fragmented
+ *              echo. The reply is sent by the loopback worker itself, so
+ *              a lost or late reply points at that worker waiting on its
+ *              own send.
+ *
+ *              Exits with 0 when every size passes, 1 otherwise.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <iphlpapi.h>
+#include <icmpapi.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TIMEOUT_MS      1000
+#define MAX_DATAGRAM    65507
+
+#define MAX_ECHO        20000
+
+static const int Sizes[] = { 512, 16384 - 28, 16384, 20000, 40000, MAX_DATAGRAM };
+static const int EchoSizes[] = { 32, MAX_ECHO };
+
+static char SendBuffer[MAX_DATAGRAM];
+static char ReceiveBuffer[MAX_DATAGRAM + 1];
+static char ReplyBuffer[sizeof(ICMP_ECHO_REPLY) + MAX_ECHO + 8];
+
+static int TestSize(SOCKET Sender, SOCKET Receiver, struct sockaddr_in *Address, int Size)
+{
+    DWORD Start, Elapsed;
+    int i, Received;
+
+    for (i = 0; i < Size; i++)
+        SendBuffer[i] = (char)(i * 7 + Size);
+
+    Start = GetTickCount();
+
+    if (sendto(Sender, SendBuffer, Size, 0, (struct sockaddr *)Address, sizeof(*Address)) != Size)
+    {
+        printf("%6d bytes: send failed (%d)\n", Size, WSAGetLastError());
+        return 1;
+    }
+
+    Elapsed = GetTickCount() - Start;
+    if (Elapsed > TIMEOUT_MS)
+    {
+        printf("%6d bytes: send took %lu ms\n", Size, Elapsed);
+        return 1;
+    }
+
+    Received = recv(Receiver, ReceiveBuffer, sizeof(ReceiveBuffer), 0);
+    if (Received == SOCKET_ERROR)
+    {
+        printf("%6d bytes: receive failed (%d)\n", Size, WSAGetLastError());
+        return 1;
+    }
+
+    if (Received != Size || memcmp(SendBuffer, ReceiveBuffer, Size))
+    {
+        printf("%6d bytes: received %d bytes that do not match\n", Size, Received);
+        return 1;
+    }
+
+    printf("%6d bytes: ok\n", Size);
+
+    return 0;
+}
+
+static int TestEcho(HANDLE Icmp, int Size)
+{
+    PICMP_ECHO_REPLY Reply = (PICMP_ECHO_REPLY)ReplyBuffer;
+    DWORD Start, Elapsed;
+    int i;
+
+    for (i = 0; i < Size; i++)
+        SendBuffer[i] = (char)(i * 5 + Size);
+
+    Start = GetTickCount();
+
+    if (!IcmpSendEcho(Icmp, htonl(INADDR_LOOPBACK), SendBuffer, (WORD)Size, NULL,
+                      ReplyBuffer, sizeof(ReplyBuffer), TIMEOUT_MS))
+    {
+        printf("%6d byte echo: no reply (%lu)\n", Size, GetLastError());
+        return 1;
+    }
+
+    Elapsed = GetTickCount() - Start;
+    if (Elapsed > TIMEOUT_MS)
+    {
+        printf("%6d byte echo: reply took %lu ms\n", Size, Elapsed);
+        return 1;
+    }
+
+    if (Reply->Status != IP_SUCCESS || Reply->DataSize != Size ||
+        memcmp(SendBuffer, Reply->Data, Size))
+    {
+        printf("%6d byte echo: bad reply (status %lu, %u bytes)\n",
+               Size, Reply->Status, Reply->DataSize);
+        return 1;
+    }
+
+    printf("%6d byte echo: ok\n", Size);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in Address;
+    SOCKET Sender, Receiver;
+    WSADATA WsaData;
+    HANDLE Icmp;
+    int Length, Timeout = TIMEOUT_MS, BufferSize = 4 * MAX_DATAGRAM;
+    int i, Failures = 0;
+
+    if (WSAStartup(MAKEWORD(2, 2), &WsaData))
+    {
+        fprintf(stderr, "Cannot start Winsock\n");
+        return 1;
+    }
+
+    Sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    Receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (Sender == INVALID_SOCKET || Receiver == INVALID_SOCKET)
+    {
+        fprintf(stderr, "Cannot create sockets (%d)\n", WSAGetLastError());
+        return 1;
+    }
+
+    memset(&Address, 0, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    Length = sizeof(Address);
+    if (bind(Receiver, (struct sockaddr *)&Address, sizeof(Address)) ||
+        getsockname(Receiver, (struct sockaddr *)&Address, &Length))
+    {
+        fprintf(stderr, "Cannot bind the receiver (%d)\n", WSAGetLastError());
+        return 1;
+    }
+
+    setsockopt(Receiver, SOL_SOCKET, SO_RCVTIMEO, (char *)&Timeout, sizeof(Timeout));
+    setsockopt(Receiver, SOL_SOCKET, SO_RCVBUF, (char *)&BufferSize, sizeof(BufferSize));
+    setsockopt(Sender, SOL_SOCKET, SO_SNDBUF, (char *)&BufferSize, sizeof(BufferSize));
+
+    for (i = 0; i < sizeof(Sizes) / sizeof(Sizes[0]); i++)
+        Failures += TestSize(Sender, Receiver, &Address, Sizes[i]);
+
+    closesocket(Sender);
+    closesocket(Receiver);
+
+    Icmp = IcmpCreateFile();
+    if (Icmp == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Cannot open the ICMP handle (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(EchoSizes) / sizeof(EchoSizes[0]); i++)
+        Failures += TestEcho(Icmp, EchoSizes[i]);
+
+    IcmpCloseHandle(Icmp);
+    WSACleanup();
+
+    printf("%s\n", Failures ? "FAILED" : "PASSED");
+
+    return Failures ? 1 : 0;
+}
+
+/* EOF */
@@ -54,6 +54,7 @@
 #include "lwip/stats.h"
 
 #include <string.h>
+#include <stddef.h>
 
 const char * const tcp_state_str[] = {
   "CLOSED",      
@@ -87,6 +88,11 @@ union tcp_listen_pcbs_t tcp_listen_pcbs;
 struct tcp_pcb *tcp_active_pcbs;
 /** List of all TCP PCBs in TIME-WAIT state */
 struct tcp_pcb *tcp_tw_pcbs;
+/** List of all closed connections in TIME-WAIT state, kept as struct tcp_tw
+ * in the order they expire (oldest first) */
+struct tcp_tw *tcp_tw_buckets;
+/** Number of half-open connections in the SYN cache */
+u16_t tcp_syn_count;
 
 #define NUM_TCP_PCB_LISTS               4
 #define NUM_TCP_PCB_LISTS_NO_TIME_WAIT  3
@@ -97,6 +103,26 @@ struct tcp_pcb ** const tcp_pcb_lists[] = {&tcp_listen_pcbs.pcbs, &tcp_bound_pcb
 /** Only used for temporary storage. */
 struct tcp_pcb *tcp_tmp_pcb;
 
+/** Hashed timing wheel of active and TIME-WAIT PCBs, indexed by the
+ * coarse grained timer tick at which each PCB needs attention next */
+static struct tcp_pcb *tcp_tmr_wheel[TCP_TMR_WHEEL_SIZE];
+/** PCBs with a delayed ACK or refused data pending (see tcp_fasttmr()) */
+static struct tcp_pcb *tcp_fast_pcbs;
+/** The 'tmr_next' field of the last entry on tcp_tw_buckets */
+static struct tcp_tw **tcp_tw_buckets_tail = &tcp_tw_buckets;
+/** TIME-WAIT buckets hashed on their 4-tuple (see tcp_tw_lookup()) */
+static struct tcp_tw *tcp_tw_hash[TCP_TW_HASH_SIZE];
+/** TIME-WAIT buckets hashed on their local port (see tcp_tw_port_used()) */
+static struct tcp_tw *tcp_tw_port_hash[TCP_TW_HASH_SIZE];
+/** Half-open connections hashed on their 4-tuple (see tcp_syn_lookup()) */
+static struct tcp_syn *tcp_syn_hash[TCP_SYN_HASH_SIZE];
+/** Half-open connections waiting for their nth SYN|ACK retransmission,
+ * each queue in the order the entries expire (see tcp_syn_tmr()) */
+static struct tcp_syn *tcp_syn_queue[TCP_SYN_CACHE_MAXRTX + 1];
+/** The 'tmr_next' field of the last entry on each tcp_syn_queue
+ * (NULL while the queue has never been used) */
+static struct tcp_syn **tcp_syn_queue_tail[TCP_SYN_CACHE_MAXRTX + 1];
+
 /** Timer counter to handle calling slow-timer from tcp_tmr() */ 
 static u8_t tcp_timer;
 static u16_t tcp_new_port(void);
@@ -157,7 +183,9 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
       /* move to TIME_WAIT since we close actively */
       TCP_RMV(&tcp_active_pcbs, pcb);
       pcb->state = TIME_WAIT;
+      pcb->tmr = tcp_ticks;
       TCP_REG(&tcp_tw_pcbs, pcb);
+      tcp_tw_enter(pcb);
 
       return ERR_OK;
     }
@@ -181,6 +209,7 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
     break;
   case LISTEN:
     err = ERR_OK;
+    tcp_syn_flush((struct tcp_pcb_listen *)pcb);
     tcp_pcb_remove(&tcp_listen_pcbs.pcbs, pcb);
     memp_free(MEMP_TCP_PCB_LISTEN, pcb);
     pcb = NULL;
@@ -216,6 +245,10 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
   default:
     /* Has already been closed, do nothing. */
     err = ERR_OK;
+    if (pcb->state == TIME_WAIT) {
+      /* ...except that TIME-WAIT can now be kept in a bucket */
+      tcp_tw_enter(pcb);
+    }
     pcb = NULL;
     break;
   }
@@ -251,6 +284,8 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
 err_t
 tcp_close(struct tcp_pcb *pcb)
 {
+  err_t err;
+
 #if TCP_DEBUG
   LWIP_DEBUGF(TCP_DEBUG, ("tcp_close: closing in "));
   tcp_debug_print_state(pcb->state);
@@ -259,9 +294,16 @@ tcp_close(struct tcp_pcb *pcb)
   if (pcb->state != LISTEN) {
     /* Set a flag not to receive any more data... */
     pcb->flags |= TF_RXCLOSED;
+    /* ... the application does not reference the pcb any more... */
+    pcb->detached = 1;
   }
   /* ... and close */
-  return tcp_close_shutdown(pcb, 1);
+  err = tcp_close_shutdown(pcb, 1);
+  if (err != ERR_OK) {
+    /* pcb is not freed and still owned by the application */
+    pcb->detached = 0;
+  }
+  return err;
 }
 
 /**
@@ -418,6 +460,9 @@ tcp_bind(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
 
   if (port == 0) {
     port = tcp_new_port();
+    if (port == 0) {
+      return ERR_BUF;
+    }
   }
 
   /* Check if the address already is in use (on all lists) */
@@ -441,6 +486,10 @@ tcp_bind(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port)
       }
     }
   }
+  /* Closed connections in TIME-WAIT are checked along with tcp_tw_pcbs */
+  if ((max_pcb_list == NUM_TCP_PCB_LISTS) && tcp_tw_port_used(ipaddr, port)) {
+    return ERR_USE;
+  }
 
   if (!ip_addr_isany(ipaddr)) {
     pcb->local_ip = *ipaddr;
@@ -480,7 +529,7 @@ tcp_accept_null(void *arg, struct tcp_pcb *pcb, err_t err)
  *             tpcb = tcp_listen(tpcb);
  */
 struct tcp_pcb *
-tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
+tcp_listen_with_backlog(struct tcp_pcb *pcb, u16_t backlog)
 {
   struct tcp_pcb_listen *lpcb;
 
@@ -600,15 +649,17 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
 }
 
 /**
- * A nastly hack featuring 'goto' statements that allocates a
- * new TCP local port.
+ * Allocates a new local TCP port in TCP_LOCAL_PORT_RANGE_START ..
+ * TCP_LOCAL_PORT_RANGE_END. The search starts at a random offset
+ * (RFC 6056, algorithm 1) when the port provides LWIP_RAND().
  *
- * @return a new (free) local TCP port number
+ * @return a new (free) local TCP port number, 0 if the range is exhausted
  */
 static u16_t
 tcp_new_port(void)
 {
   int i;
+  u32_t n;
   struct tcp_pcb *pcb;
 #ifndef TCP_LOCAL_PORT_RANGE_START
 /* From http://www.iana.org/assignments/port-numbers:
@@ -616,21 +667,122 @@ tcp_new_port(void)
 #define TCP_LOCAL_PORT_RANGE_START  0xc000
 #define TCP_LOCAL_PORT_RANGE_END    0xffff
 #endif
+#define TCP_LOCAL_PORT_RANGE_COUNT  ((u32_t)TCP_LOCAL_PORT_RANGE_END - TCP_LOCAL_PORT_RANGE_START + 1)
   static u16_t port = TCP_LOCAL_PORT_RANGE_START;
-  
- again:
-  if (port++ >= TCP_LOCAL_PORT_RANGE_END) {
-    port = TCP_LOCAL_PORT_RANGE_START;
-  }
-  /* Check all PCB lists. */
-  for (i = 0; i < NUM_TCP_PCB_LISTS; i++) {
-    for(pcb = *tcp_pcb_lists[i]; pcb != NULL; pcb = pcb->next) {
-      if (pcb->local_port == port) {
-        goto again;
+
+#ifdef LWIP_RAND
+  port = (u16_t)(TCP_LOCAL_PORT_RANGE_START + LWIP_RAND() % TCP_LOCAL_PORT_RANGE_COUNT);
+#endif /* LWIP_RAND */
+  for (n = 0; n < TCP_LOCAL_PORT_RANGE_COUNT; n++) {
+    if (port++ >= TCP_LOCAL_PORT_RANGE_END) {
+      port = TCP_LOCAL_PORT_RANGE_START;
+    }
+    /* Check all PCB lists. */
+    for (i = 0; i < NUM_TCP_PCB_LISTS; i++) {
+      for(pcb = *tcp_pcb_lists[i]; pcb != NULL; pcb = pcb->next) {
+        if (pcb->local_port == port) {
+          break;
+        }
       }
+      if (pcb != NULL) {
+        break;
+      }
+    }
+    if (i == NUM_TCP_PCB_LISTS && !tcp_tw_port_used(NULL, port)) {
+      return port;
     }
   }
-  return port;
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_new_port: no free local port\n"));
+  return 0;
+}
+
+/**
+ * Checks whether a connection (or a closed connection in TIME-WAIT)
+ * already uses a 4-tuple.
+ *
+ * @param local_ip local IP address
+ * @param local_port local port (host byte order)
+ * @param remote_ip remote IP address
+ * @param remote_port remote port (host byte order)
+ * @return 1 if the 4-tuple is in use, 0 otherwise
+ */
+u8_t
+tcp_tuple_used(ip_addr_t *local_ip, u16_t local_port,
+               ip_addr_t *remote_ip, u16_t remote_port)
+{
+  struct tcp_pcb *cpcb;
+  int i;
+
+  /* Don't check listen- and bound-PCBs, check active- and TIME-WAIT PCBs. */
+  for (i = 2; i < NUM_TCP_PCB_LISTS; i++) {
+    for(cpcb = *tcp_pcb_lists[i]; cpcb != NULL; cpcb = cpcb->next) {
+      if ((cpcb->local_port == local_port) &&
+          (cpcb->remote_port == remote_port) &&
+          ip_addr_cmp(&cpcb->local_ip, local_ip) &&
+          ip_addr_cmp(&cpcb->remote_ip, remote_ip)) {
+        return 1;
+      }
+    }
+  }
+  return tcp_tw_lookup(local_ip, local_port, remote_ip, remote_port) != NULL;
+}
+
+/**
+ * Lowers the MSS of the active connections to a remote host after its path
+ * MTU dropped (RFC 1191). Segments already queued keep their size.
+ *
+ * @param remote_ip remote IP address
+ * @param mtu the new path MTU
+ */
+void
+tcp_update_path_mtu(ip_addr_t *remote_ip, u16_t mtu)
+{
+  struct tcp_pcb *pcb;
+  u16_t mss;
+
+  if (mtu <= IP_HLEN + TCP_HLEN) {
+    return;
+  }
+  mss = mtu - IP_HLEN - TCP_HLEN;
+
+  for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if (ip_addr_cmp(&pcb->remote_ip, remote_ip) && pcb->mss > mss) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_update_path_mtu: mss %"U16_F" -> %"U16_F"\n", pcb->mss, mss));
+      pcb->mss = mss;
+    }
+  }
+}
+
+/**
+ * Finds the active connection an ICMP error is about. The quoted segment
+ * must carry a sequence number that is in flight, so that a forged message
+ * cannot change a connection it knows only the 4-tuple of (RFC 5927).
+ *
+ * @param local_ip local IP address of the quoted segment
+ * @param local_port local port (host byte order)
+ * @param remote_ip remote IP address of the quoted segment
+ * @param remote_port remote port (host byte order)
+ * @param seqno sequence number of the quoted segment
+ * @return the tcp_pcb the segment was sent on, NULL if there is none
+ */
+struct tcp_pcb *
+tcp_icmp_lookup(ip_addr_t *local_ip, u16_t local_port,
+                ip_addr_t *remote_ip, u16_t remote_port, u32_t seqno)
+{
+  struct tcp_pcb *pcb;
+
+  for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if ((pcb->local_port == local_port) &&
+        (pcb->remote_port == remote_port) &&
+        ip_addr_cmp(&pcb->local_ip, local_ip) &&
+        ip_addr_cmp(&pcb->remote_ip, remote_ip)) {
+      if (TCP_SEQ_GEQ(seqno, pcb->lastack) && TCP_SEQ_LT(seqno, pcb->snd_nxt)) {
+        return pcb;
+      }
+      return NULL;
+    }
+  }
+  return NULL;
 }
 
 /**
@@ -679,24 +831,17 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   old_local_port = pcb->local_port;
   if (pcb->local_port == 0) {
     pcb->local_port = tcp_new_port();
+    if (pcb->local_port == 0) {
+      return ERR_BUF;
+    }
   }
 #if SO_REUSE
   if ((pcb->so_options & SOF_REUSEADDR) != 0) {
     /* Since SOF_REUSEADDR allows reusing a local address, we have to make sure
        now that the 5-tuple is unique. */
-    struct tcp_pcb *cpcb;
-    int i;
-    /* Don't check listen- and bound-PCBs, check active- and TIME-WAIT PCBs. */
-    for (i = 2; i < NUM_TCP_PCB_LISTS; i++) {
-      for(cpcb = *tcp_pcb_lists[i]; cpcb != NULL; cpcb = cpcb->next) {
-        if ((cpcb->local_port == pcb->local_port) &&
-            (cpcb->remote_port == port) &&
-            ip_addr_cmp(&cpcb->local_ip, &pcb->local_ip) &&
-            ip_addr_cmp(&cpcb->remote_ip, ipaddr)) {
-          /* linux returns EISCONN here, but ERR_USE should be OK for us */
-          return ERR_USE;
-        }
-      }
+    if (tcp_tuple_used(&pcb->local_ip, pcb->local_port, ipaddr, port)) {
+      /* linux returns EISCONN here, but ERR_USE should be OK for us */
+      return ERR_USE;
     }
   }
 #endif /* SO_REUSE */
@@ -739,263 +884,855 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   return ret;
 }
 
+/** Unlinks an entry from a doubly linked list (wheel slot, fast list or
+ * one of the TIME-WAIT bucket lists) */
+#define TCP_TMR_UNLINK(npcb, nxt, pprev) do { \
+    *(npcb)->pprev = (npcb)->nxt; \
+    if ((npcb)->nxt != NULL) { \
+      (npcb)->nxt->pprev = (npcb)->pprev; \
+    } \
+    (npcb)->nxt = NULL; \
+    (npcb)->pprev = NULL; \
+  } while (0)
+
+/** Pushes an entry onto the head of a doubly linked list */
+#define TCP_TMR_LINK(head, npcb, nxt, pprev) do { \
+    (npcb)->nxt = *(head); \
+    if (*(head) != NULL) { \
+      (*(head))->pprev = &(npcb)->nxt; \
+    } \
+    (npcb)->pprev = (head); \
+    *(head) = (npcb); \
+  } while (0)
+
+/** Is tick a before tick b? (tcp_ticks wraps) */
+#define TCP_TMR_BEFORE(a, b)   ((s32_t)((a) - (b)) < 0)
+
+#define TCP_TMR_WHEEL_SLOT(tick) (&tcp_tmr_wheel[(tick) & (TCP_TMR_WHEEL_SIZE - 1)])
+
 /**
- * Called every 500 ms and implements the retransmission timer and the timer that
- * removes PCBs that have been in TIME-WAIT for enough time. It also increments
- * various timers such as the inactivity timer in each PCB.
+ * Arms the slow timer of a pcb so that tcp_slowtmr() looks at it again
+ * when tcp_ticks reaches 'due'.
  *
- * Automatically called from tcp_tmr().
+ * @param pcb the tcp_pcb to arm
+ * @param due slow timer tick at which the pcb needs attention
+ */
+static void
+tcp_tmr_arm(struct tcp_pcb *pcb, u32_t due)
+{
+  if (pcb->tmr_pprev != NULL) {
+    if (pcb->tmr_due == due) {
+      return;
+    }
+    TCP_TMR_UNLINK(pcb, tmr_next, tmr_pprev);
+  }
+  pcb->tmr_due = due;
+  TCP_TMR_LINK(TCP_TMR_WHEEL_SLOT(due), pcb, tmr_next, tmr_pprev);
+}
+
+/**
+ * Computes the slow timer tick at which a pcb needs attention next.
+ *
+ * Connections with a running retransmission or persist timer, unsent data
+ * or a poll callback are looked at on every tick so that rtime, persist_cnt
+ * and polltmr keep counting exactly as they always did. All other timeouts
+ * are measured from pcb->tmr and can be computed up front; they only ever
+ * move later when the connection sees traffic, so a pcb found on the wheel
+ * before it is really due is simply re-armed.
+ *
+ * @param pcb the tcp_pcb to look at
+ * @param due receives the slow timer tick at which the pcb is due
+ * @return 1 if a timer is pending on the pcb, 0 if the pcb can stay off the wheel
+ */
+static u8_t
+tcp_tmr_next_due(struct tcp_pcb *pcb, u32_t *due)
+{
+  u32_t next = 0, tmo;
+  u8_t pending = 0;
+
+#define TCP_TMR_CONSIDER(tick) do { \
+    tmo = (tick); \
+    if (!pending || TCP_TMR_BEFORE(tmo, next)) { \
+      next = tmo; \
+    } \
+    pending = 1; \
+  } while (0)
+
+  if (pcb->state == TIME_WAIT) {
+    TCP_TMR_CONSIDER(pcb->tmr + 2 * TCP_MSL / TCP_SLOW_INTERVAL + 1);
+  } else {
+    if ((pcb->rtime >= 0) || (pcb->persist_backoff > 0) || (pcb->nrtx > 0) ||
+        (pcb->unsent != NULL) ||
+#if LWIP_CALLBACK_API
+        (pcb->poll != NULL)
+#else /* LWIP_CALLBACK_API */
+        1
+#endif /* LWIP_CALLBACK_API */
+        ) {
+      TCP_TMR_CONSIDER(tcp_ticks + 1);
+    }
+
+    switch (pcb->state) {
+    case FIN_WAIT_2:
+      TCP_TMR_CONSIDER(pcb->tmr + TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+      break;
+    case SYN_RCVD:
+      TCP_TMR_CONSIDER(pcb->tmr + TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+      break;
+    case LAST_ACK:
+      TCP_TMR_CONSIDER(pcb->tmr + 2 * TCP_MSL / TCP_SLOW_INTERVAL + 1);
+      break;
+    default:
+      break;
+    }
+
+    if ((pcb->so_options & SOF_KEEPALIVE) &&
+       ((pcb->state == ESTABLISHED) ||
+        (pcb->state == CLOSE_WAIT))) {
+#if LWIP_TCP_KEEPALIVE
+      TCP_TMR_CONSIDER(pcb->tmr + (pcb->keep_idle + pcb->keep_cnt_sent * pcb->keep_intvl)
+                       / TCP_SLOW_INTERVAL + 1);
+#else
+      TCP_TMR_CONSIDER(pcb->tmr + (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEPINTVL_DEFAULT)
+                       / TCP_SLOW_INTERVAL + 1);
+#endif /* LWIP_TCP_KEEPALIVE */
+    }
+
+#if TCP_QUEUE_OOSEQ
+    if (pcb->ooseq != NULL) {
+      TCP_TMR_CONSIDER(pcb->tmr + pcb->rto * TCP_OOSEQ_TIMEOUT);
+    }
+#endif /* TCP_QUEUE_OOSEQ */
+  }
+#undef TCP_TMR_CONSIDER
+
+  if (pending && !TCP_TMR_BEFORE(tcp_ticks, next)) {
+    /* already expired: look at it on the next tick */
+    next = tcp_ticks + 1;
+  }
+  *due = next;
+  return pending;
+}
+
+/**
+ * Puts a pcb on the timing wheel at the tick its next timer expires, or
+ * takes it off the wheel if no timer is pending.
+ *
+ * @param pcb the tcp_pcb to reschedule
+ */
+static void
+tcp_tmr_schedule(struct tcp_pcb *pcb)
+{
+  u32_t due;
+
+  if (tcp_tmr_next_due(pcb, &due)) {
+    tcp_tmr_arm(pcb, due);
+  } else if (pcb->tmr_pprev != NULL) {
+    TCP_TMR_UNLINK(pcb, tmr_next, tmr_pprev);
+  }
+}
+
+/**
+ * Makes sure tcp_slowtmr() looks at a pcb on its next tick. Must be called
+ * whenever a timer is started on a pcb that may currently be off the wheel
+ * (e.g. the retransmission timer or the persist timer is started, or
+ * SOF_KEEPALIVE is set), since such pcbs are not looked at otherwise.
+ *
+ * @param pcb the tcp_pcb that has a new timer pending
  */
 void
-tcp_slowtmr(void)
+tcp_tmr_kick(struct tcp_pcb *pcb)
+{
+  u32_t due = tcp_ticks + 1;
+
+  if ((pcb->state == CLOSED) || (pcb->state == LISTEN)) {
+    return;
+  }
+  if ((pcb->tmr_pprev != NULL) && !TCP_TMR_BEFORE(due, pcb->tmr_due)) {
+    /* already due at least as soon */
+    return;
+  }
+  tcp_tmr_arm(pcb, due);
+}
+
+/**
+ * Takes a pcb off the timing wheel and the fast timer list. Called when
+ * the pcb leaves the active or TIME-WAIT list.
+ *
+ * @param pcb the tcp_pcb to disarm
+ */
+void
+tcp_tmr_disarm(struct tcp_pcb *pcb)
+{
+  if (pcb->tmr_pprev != NULL) {
+    TCP_TMR_UNLINK(pcb, tmr_next, tmr_pprev);
+  }
+  if (pcb->fast_pprev != NULL) {
+    TCP_TMR_UNLINK(pcb, fast_next, fast_pprev);
+  }
+}
+
+/**
+ * Puts a pcb on the list walked by tcp_fasttmr(). Called when a delayed
+ * ACK is scheduled or received data is refused by the application.
+ *
+ * @param pcb the tcp_pcb that needs the fast timer
+ */
+void
+tcp_fasttmr_needed(struct tcp_pcb *pcb)
+{
+  if (pcb->fast_pprev == NULL) {
+    TCP_TMR_LINK(&tcp_fast_pcbs, pcb, fast_next, fast_pprev);
+  }
+}
+
+/**
+ * Runs the slow timer for one pcb on the active list: retransmission,
+ * persist, keepalive and the various state timeouts. The pcb is either
+ * freed or put back on the timing wheel.
+ *
+ * @param pcb the active tcp_pcb whose slow timer is due
+ */
+static void
+tcp_slowtmr_active(struct tcp_pcb *pcb)
 {
-  struct tcp_pcb *pcb, *prev;
   u16_t eff_wnd;
   u8_t pcb_remove;      /* flag if a PCB should be removed */
   u8_t pcb_reset;       /* flag if a RST should be sent when removing */
   err_t err;
 
-  err = ERR_OK;
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: processing active pcb\n"));
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
 
-  ++tcp_ticks;
+  err = ERR_OK;
+  pcb_remove = 0;
+  pcb_reset = 0;
 
-  /* Steps through all of the active PCBs. */
-  prev = NULL;
-  pcb = tcp_active_pcbs;
-  if (pcb == NULL) {
-    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no active pcbs\n"));
+  if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
+    ++pcb_remove;
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
   }
-  while (pcb != NULL) {
-    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: processing active pcb\n"));
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
-
-    pcb_remove = 0;
-    pcb_reset = 0;
-
-    if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
-    }
-    else if (pcb->nrtx == TCP_MAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
+  else if (pcb->nrtx == TCP_MAXRTX) {
+    ++pcb_remove;
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
+  } else {
+    if (pcb->persist_backoff > 0) {
+      /* If snd_wnd is zero, use persist timer to send 1 byte probes
+       * instead of using the standard retransmission mechanism. */
+      pcb->persist_cnt++;
+      if (pcb->persist_cnt >= tcp_persist_backoff[pcb->persist_backoff-1]) {
+        pcb->persist_cnt = 0;
+        if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
+          pcb->persist_backoff++;
+        }
+        tcp_zero_window_probe(pcb);
+      }
     } else {
-      if (pcb->persist_backoff > 0) {
-        /* If snd_wnd is zero, use persist timer to send 1 byte probes
-         * instead of using the standard retransmission mechanism. */
-        pcb->persist_cnt++;
-        if (pcb->persist_cnt >= tcp_persist_backoff[pcb->persist_backoff-1]) {
-          pcb->persist_cnt = 0;
-          if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
-            pcb->persist_backoff++;
-          }
-          tcp_zero_window_probe(pcb);
+      /* Increase the retransmission timer if it is running */
+      if(pcb->rtime >= 0)
+        ++pcb->rtime;
+
+      if (pcb->unacked != NULL && pcb->rtime >= pcb->rto) {
+        /* Time for a retransmission. */
+        LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
+                                    " pcb->rto %"S16_F"\n",
+                                    pcb->rtime, pcb->rto));
+
+        /* Double retransmission time-out unless we are trying to
+         * connect to somebody (i.e., we are in SYN_SENT). */
+        if (pcb->state != SYN_SENT) {
+          pcb->rto = ((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx];
         }
-      } else {
-        /* Increase the retransmission timer if it is running */
-        if(pcb->rtime >= 0)
-          ++pcb->rtime;
-
-        if (pcb->unacked != NULL && pcb->rtime >= pcb->rto) {
-          /* Time for a retransmission. */
-          LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
-                                      " pcb->rto %"S16_F"\n",
-                                      pcb->rtime, pcb->rto));
-
-          /* Double retransmission time-out unless we are trying to
-           * connect to somebody (i.e., we are in SYN_SENT). */
-          if (pcb->state != SYN_SENT) {
-            pcb->rto = ((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx];
-          }
 
-          /* Reset the retransmission timer. */
-          pcb->rtime = 0;
+        /* Reset the retransmission timer. */
+        pcb->rtime = 0;
 
-          /* Reduce congestion window and ssthresh. */
-          eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
-          pcb->ssthresh = eff_wnd >> 1;
-          if (pcb->ssthresh < (pcb->mss << 1)) {
-            pcb->ssthresh = (pcb->mss << 1);
-          }
-          pcb->cwnd = pcb->mss;
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"U16_F
-                                       " ssthresh %"U16_F"\n",
-                                       pcb->cwnd, pcb->ssthresh));
- 
-          /* The following needs to be called AFTER cwnd is set to one
-             mss - STJ */
-          tcp_rexmit_rto(pcb);
+        /* Reduce congestion window and ssthresh. */
+        eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+        pcb->ssthresh = eff_wnd >> 1;
+        if (pcb->ssthresh < (pcb->mss << 1)) {
+          pcb->ssthresh = (pcb->mss << 1);
         }
+        pcb->cwnd = pcb->mss;
+        LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"U16_F
+                                     " ssthresh %"U16_F"\n",
+                                     pcb->cwnd, pcb->ssthresh));
+ 
+        /* The following needs to be called AFTER cwnd is set to one
+           mss - STJ */
+        tcp_rexmit_rto(pcb);
       }
     }
-    /* Check if this PCB has stayed too long in FIN-WAIT-2 */
-    if (pcb->state == FIN_WAIT_2) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) >
-          TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
-      }
+  }
+  /* Check if this PCB has stayed too long in FIN-WAIT-2 */
+  if (pcb->state == FIN_WAIT_2) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) >
+        TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
     }
+  }
 
-    /* Check if KEEPALIVE should be sent */
-    if((pcb->so_options & SOF_KEEPALIVE) &&
-       ((pcb->state == ESTABLISHED) ||
-        (pcb->state == CLOSE_WAIT))) {
+  /* Check if KEEPALIVE should be sent */
+  if((pcb->so_options & SOF_KEEPALIVE) &&
+     ((pcb->state == ESTABLISHED) ||
+      (pcb->state == CLOSE_WAIT))) {
 #if LWIP_TCP_KEEPALIVE
-      if((u32_t)(tcp_ticks - pcb->tmr) >
-         (pcb->keep_idle + (pcb->keep_cnt*pcb->keep_intvl))
-         / TCP_SLOW_INTERVAL)
+    if((u32_t)(tcp_ticks - pcb->tmr) >
+       (pcb->keep_idle + (pcb->keep_cnt*pcb->keep_intvl))
+       / TCP_SLOW_INTERVAL)
 #else      
-      if((u32_t)(tcp_ticks - pcb->tmr) >
-         (pcb->keep_idle + TCP_MAXIDLE) / TCP_SLOW_INTERVAL)
+    if((u32_t)(tcp_ticks - pcb->tmr) >
+       (pcb->keep_idle + TCP_MAXIDLE) / TCP_SLOW_INTERVAL)
 #endif /* LWIP_TCP_KEEPALIVE */
-      {
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to %"U16_F".%"U16_F".%"U16_F".%"U16_F".\n",
-                                ip4_addr1_16(&pcb->remote_ip), ip4_addr2_16(&pcb->remote_ip),
-                                ip4_addr3_16(&pcb->remote_ip), ip4_addr4_16(&pcb->remote_ip)));
-        
-        ++pcb_remove;
-        ++pcb_reset;
-      }
+    {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to %"U16_F".%"U16_F".%"U16_F".%"U16_F".\n",
+                              ip4_addr1_16(&pcb->remote_ip), ip4_addr2_16(&pcb->remote_ip),
+                              ip4_addr3_16(&pcb->remote_ip), ip4_addr4_16(&pcb->remote_ip)));
+      
+      ++pcb_remove;
+      ++pcb_reset;
+    }
 #if LWIP_TCP_KEEPALIVE
-      else if((u32_t)(tcp_ticks - pcb->tmr) > 
-              (pcb->keep_idle + pcb->keep_cnt_sent * pcb->keep_intvl)
-              / TCP_SLOW_INTERVAL)
+    else if((u32_t)(tcp_ticks - pcb->tmr) > 
+            (pcb->keep_idle + pcb->keep_cnt_sent * pcb->keep_intvl)
+            / TCP_SLOW_INTERVAL)
 #else
-      else if((u32_t)(tcp_ticks - pcb->tmr) > 
-              (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEPINTVL_DEFAULT) 
-              / TCP_SLOW_INTERVAL)
+    else if((u32_t)(tcp_ticks - pcb->tmr) > 
+            (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEPINTVL_DEFAULT) 
+            / TCP_SLOW_INTERVAL)
 #endif /* LWIP_TCP_KEEPALIVE */
-      {
-        tcp_keepalive(pcb);
-        pcb->keep_cnt_sent++;
-      }
+    {
+      tcp_keepalive(pcb);
+      pcb->keep_cnt_sent++;
     }
+  }
 
-    /* If this PCB has queued out of sequence data, but has been
-       inactive for too long, will drop the data (it will eventually
-       be retransmitted). */
+  /* If this PCB has queued out of sequence data, but has been
+     inactive for too long, will drop the data (it will eventually
+     be retransmitted). */
 #if TCP_QUEUE_OOSEQ
-    if (pcb->ooseq != NULL &&
-        (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
-      tcp_segs_free(pcb->ooseq);
-      pcb->ooseq = NULL;
-      LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
-    }
+  if (pcb->ooseq != NULL &&
+      (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
+    tcp_segs_free(pcb->ooseq);
+    pcb->ooseq = NULL;
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
+  }
 #endif /* TCP_QUEUE_OOSEQ */
 
-    /* Check if this PCB has stayed too long in SYN-RCVD */
-    if (pcb->state == SYN_RCVD) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) >
-          TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
-      }
+  /* Check if this PCB has stayed too long in SYN-RCVD */
+  if (pcb->state == SYN_RCVD) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) >
+        TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
     }
+  }
 
-    /* Check if this PCB has stayed too long in LAST-ACK */
-    if (pcb->state == LAST_ACK) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
-      }
+  /* Check if this PCB has stayed too long in LAST-ACK */
+  if (pcb->state == LAST_ACK) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
     }
+  }
 
-    /* If the PCB should be removed, do it. */
-    if (pcb_remove) {
-      struct tcp_pcb *pcb2;
-      tcp_pcb_purge(pcb);
-      /* Remove PCB from tcp_active_pcbs list. */
-      if (prev != NULL) {
-        LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_active_pcbs", pcb != tcp_active_pcbs);
-        prev->next = pcb->next;
-      } else {
-        /* This PCB was the first. */
-        LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_active_pcbs", tcp_active_pcbs == pcb);
-        tcp_active_pcbs = pcb->next;
-      }
+  /* If the PCB should be removed, do it. */
+  if (pcb_remove) {
+    tcp_pcb_purge(pcb);
+    /* Remove PCB from tcp_active_pcbs list (this also takes it off the wheel). */
+    TCP_RMV(&tcp_active_pcbs, pcb);
 
-      TCP_EVENT_ERR(pcb->errf, pcb->callback_arg, ERR_ABRT);
-      if (pcb_reset) {
-        tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->local_ip, &pcb->remote_ip,
-          pcb->local_port, pcb->remote_port);
-      }
+    TCP_EVENT_ERR(pcb->errf, pcb->callback_arg, ERR_ABRT);
+    if (pcb_reset) {
+      tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->local_ip, &pcb->remote_ip,
+        pcb->local_port, pcb->remote_port);
+    }
 
-      pcb2 = pcb;
-      pcb = pcb->next;
-      memp_free(MEMP_TCP_PCB, pcb2);
-    } else {
-      /* get the 'next' element now and work with 'prev' below (in case of abort) */
-      prev = pcb;
-      pcb = pcb->next;
-
-      /* We check if we should poll the connection. */
-      ++prev->polltmr;
-      if (prev->polltmr >= prev->pollinterval) {
-        prev->polltmr = 0;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
-        TCP_EVENT_POLL(prev, err);
-        /* if err == ERR_ABRT, 'prev' is already deallocated */
-        if (err == ERR_OK) {
-          tcp_output(prev);
-        }
+    memp_free(MEMP_TCP_PCB, pcb);
+  } else {
+    /* We check if we should poll the connection. */
+    ++pcb->polltmr;
+    if (pcb->polltmr >= pcb->pollinterval) {
+      pcb->polltmr = 0;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
+      TCP_EVENT_POLL(pcb, err);
+      /* if err == ERR_ABRT, 'pcb' is already deallocated */
+      if (err == ERR_ABRT) {
+        return;
+      }
+      if (err == ERR_OK) {
+        tcp_output(pcb);
       }
     }
+    tcp_tmr_schedule(pcb);
   }
+}
 
-  
-  /* Steps through all of the TIME-WAIT PCBs. */
-  prev = NULL;
-  pcb = tcp_tw_pcbs;
-  while (pcb != NULL) {
-    LWIP_ASSERT("tcp_slowtmr: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-    pcb_remove = 0;
-
-    /* Check if this PCB has stayed long enough in TIME-WAIT */
-    if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-      ++pcb_remove;
+/**
+ * Runs the slow timer for one pcb on the TIME-WAIT list: frees it once it
+ * has stayed in TIME-WAIT for 2 * MSL, otherwise puts it back on the wheel.
+ *
+ * @param pcb the TIME-WAIT tcp_pcb whose slow timer is due
+ */
+static void
+tcp_slowtmr_timewait(struct tcp_pcb *pcb)
+{
+  LWIP_ASSERT("tcp_slowtmr: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
+
+  /* Check if this PCB has stayed long enough in TIME-WAIT */
+  if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+    tcp_pcb_purge(pcb);
+    /* Remove PCB from tcp_tw_pcbs list (this also takes it off the wheel). */
+    TCP_RMV(&tcp_tw_pcbs, pcb);
+    memp_free(MEMP_TCP_PCB, pcb);
+  } else {
+    tcp_tmr_schedule(pcb);
+  }
+}
+
+/** Hash chain for the TIME-WAIT buckets of a 4-tuple */
+static struct tcp_tw **
+tcp_tw_hash_slot(u16_t local_port, ip_addr_t *remote_ip, u16_t remote_port)
+{
+  u32_t h;
+
+  h = ip4_addr_get_u32(remote_ip) ^ (((u32_t)remote_port << 16) | local_port);
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return &tcp_tw_hash[h & (TCP_TW_HASH_SIZE - 1)];
+}
+
+#define TCP_TW_PORT_SLOT(port) (&tcp_tw_port_hash[(port) & (TCP_TW_HASH_SIZE - 1)])
+
+/** Takes a TIME-WAIT bucket off tcp_tw_buckets */
+static void
+tcp_tw_dequeue(struct tcp_tw *tw)
+{
+  if (tw->tmr_next == NULL) {
+    tcp_tw_buckets_tail = tw->tmr_pprev;
+  }
+  TCP_TMR_UNLINK(tw, tmr_next, tmr_pprev);
+}
+
+/** The TIME-WAIT bucket whose 'tmr_next' field pprev points to */
+#define TCP_TW_FROM_TMR_PPREV(pprev) \
+  ((struct tcp_tw *)((u8_t *)(pprev) - offsetof(struct tcp_tw, tmr_next)))
+
+/**
+ * Puts a TIME-WAIT bucket on tcp_tw_buckets behind all buckets that do not
+ * expire later, so the queue stays in the order the buckets expire. Nearly
+ * every bucket expires last, so the place is searched from the end.
+ *
+ * @param tw the TIME-WAIT bucket, with tmr set and not on the queue
+ */
+static void
+tcp_tw_enqueue(struct tcp_tw *tw)
+{
+  struct tcp_tw **pprev = tcp_tw_buckets_tail;
+
+  while (pprev != &tcp_tw_buckets &&
+         TCP_TMR_BEFORE(tw->tmr, TCP_TW_FROM_TMR_PPREV(pprev)->tmr)) {
+    pprev = TCP_TW_FROM_TMR_PPREV(pprev)->tmr_pprev;
+  }
+  tw->tmr_next = *pprev;
+  tw->tmr_pprev = pprev;
+  if (tw->tmr_next != NULL) {
+    tw->tmr_next->tmr_pprev = &tw->tmr_next;
+  } else {
+    tcp_tw_buckets_tail = &tw->tmr_next;
+  }
+  *pprev = tw;
+}
+
+/**
+ * (Re)starts the 2 * MSL period of a TIME-WAIT bucket. The bucket goes to
+ * the end of tcp_tw_buckets, which is thus kept in the order the buckets
+ * expire.
+ *
+ * @param tw the TIME-WAIT bucket to restart
+ */
+void
+tcp_tw_restart(struct tcp_tw *tw)
+{
+  if (tw->tmr_pprev != NULL) {
+    tcp_tw_dequeue(tw);
+  }
+  tw->tmr = tcp_ticks;
+  tcp_tw_enqueue(tw);
+}
+
+/**
+ * Replaces a pcb in TIME-WAIT by a struct tcp_tw once the application has
+ * closed it. The bucket keeps the 4-tuple, the sequence numbers and the
+ * timestamp state, which is all tcp_input() needs to answer segments of
+ * the old connection. The 2 * MSL period already started by the pcb goes
+ * on, it is not restarted. If the application may still reference the pcb
+ * or no bucket is available, the pcb simply stays on tcp_tw_pcbs.
+ *
+ * @param pcb the tcp_pcb in TIME-WAIT (freed if a bucket was created)
+ */
+void
+tcp_tw_enter(struct tcp_pcb *pcb)
+{
+  struct tcp_tw *tw;
+
+  LWIP_ASSERT("tcp_tw_enter: pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
+
+  if (!pcb->detached) {
+    return;
+  }
+  tw = (struct tcp_tw *)memp_malloc(MEMP_TCP_TW);
+  if (tw == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_tw_enter: no TIME-WAIT bucket available, keeping pcb\n"));
+    return;
+  }
+  ip_addr_copy(tw->local_ip, pcb->local_ip);
+  ip_addr_copy(tw->remote_ip, pcb->remote_ip);
+  tw->local_port = pcb->local_port;
+  tw->remote_port = pcb->remote_port;
+  tw->rcv_nxt = pcb->rcv_nxt;
+  tw->snd_nxt = pcb->snd_nxt;
+  tw->rcv_wnd = pcb->rcv_wnd;
+  tw->rcv_ann_wnd = pcb->rcv_ann_wnd;
+  tw->ttl = pcb->ttl;
+  tw->tos = pcb->tos;
+  tw->flags = pcb->flags & TF_TIMESTAMP;
+#if LWIP_TCP_TIMESTAMPS
+  tw->ts_recent = pcb->ts_recent;
+#endif /* LWIP_TCP_TIMESTAMPS */
+
+  TCP_TMR_LINK(tcp_tw_hash_slot(tw->local_port, &tw->remote_ip, tw->remote_port),
+               tw, next, pprev);
+  TCP_TMR_LINK(TCP_TW_PORT_SLOT(tw->local_port), tw, port_next, port_pprev);
+  tw->tmr = pcb->tmr;
+  tcp_tw_enqueue(tw);
+
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_tw_enter: local port %"U16_F", foreign port %"U16_F"\n",
+                          tw->local_port, tw->remote_port));
+
+  if (pcb->refused_data != NULL) {
+    pbuf_free(pcb->refused_data);
+    pcb->refused_data = NULL;
+  }
+  TCP_RMV(&tcp_tw_pcbs, pcb);
+  memp_free(MEMP_TCP_PCB, pcb);
+}
+
+/**
+ * Finds the TIME-WAIT bucket of a closed connection.
+ *
+ * @param local_ip local IP address of the connection
+ * @param local_port local port of the connection
+ * @param remote_ip remote IP address of the connection
+ * @param remote_port remote port of the connection
+ * @return the TIME-WAIT bucket or NULL if there is none
+ */
+struct tcp_tw *
+tcp_tw_lookup(ip_addr_t *local_ip, u16_t local_port,
+              ip_addr_t *remote_ip, u16_t remote_port)
+{
+  struct tcp_tw *tw;
+
+  for (tw = *tcp_tw_hash_slot(local_port, remote_ip, remote_port); tw != NULL; tw = tw->next) {
+    if (tw->remote_port == remote_port &&
+        tw->local_port == local_port &&
+        ip_addr_cmp(&tw->remote_ip, remote_ip) &&
+        ip_addr_cmp(&tw->local_ip, local_ip)) {
+      return tw;
     }
-    
+  }
+  return NULL;
+}
 
+/**
+ * Checks whether a local address is still used by a closed connection
+ * in TIME-WAIT.
+ *
+ * @param local_ip local IP address (NULL or IP_ADDR_ANY matches any)
+ * @param local_port local port
+ * @return 1 if a TIME-WAIT bucket uses the address, 0 otherwise
+ */
+u8_t
+tcp_tw_port_used(ip_addr_t *local_ip, u16_t local_port)
+{
+  struct tcp_tw *tw;
 
-    /* If the PCB should be removed, do it. */
-    if (pcb_remove) {
-      struct tcp_pcb *pcb2;
-      tcp_pcb_purge(pcb);
-      /* Remove PCB from tcp_tw_pcbs list. */
-      if (prev != NULL) {
-        LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_tw_pcbs", pcb != tcp_tw_pcbs);
-        prev->next = pcb->next;
+  for (tw = *TCP_TW_PORT_SLOT(local_port); tw != NULL; tw = tw->port_next) {
+    if (tw->local_port == local_port &&
+        (ip_addr_isany(local_ip) || ip_addr_cmp(&tw->local_ip, local_ip))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Frees the TIME-WAIT buckets that have stayed in TIME-WAIT for 2 * MSL.
+ * tcp_tw_buckets is in expiry order, so only expired buckets are looked at.
+ */
+static void
+tcp_tw_tmr(void)
+{
+  struct tcp_tw *tw;
+
+  while ((tw = tcp_tw_buckets) != NULL &&
+         (u32_t)(tcp_ticks - tw->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+    tcp_tw_dequeue(tw);
+    TCP_TMR_UNLINK(tw, next, pprev);
+    TCP_TMR_UNLINK(tw, port_next, port_pprev);
+    memp_free(MEMP_TCP_TW, tw);
+  }
+}
+
+/** Initial SYN|ACK retransmission timeout in ticks, as for a new pcb */
+#define TCP_SYN_RTO (3000 / TCP_SLOW_INTERVAL)
+
+/** Hash chain for the half-open connections of a 4-tuple */
+static struct tcp_syn **
+tcp_syn_hash_slot(u16_t local_port, ip_addr_t *remote_ip, u16_t remote_port)
+{
+  u32_t h;
+
+  h = ip4_addr_get_u32(remote_ip) ^ (((u32_t)remote_port << 16) | local_port);
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return &tcp_syn_hash[h & (TCP_SYN_HASH_SIZE - 1)];
+}
+
+/** Appends a half-open connection to the retransmission queue for its nrtx */
+static void
+tcp_syn_enqueue(struct tcp_syn *syn)
+{
+  struct tcp_syn **tail = tcp_syn_queue_tail[syn->nrtx];
+
+  if (tail == NULL) {
+    tail = &tcp_syn_queue[syn->nrtx];
+  }
+  syn->tmr = tcp_ticks;
+  syn->tmr_next = NULL;
+  syn->tmr_pprev = tail;
+  *tail = syn;
+  tcp_syn_queue_tail[syn->nrtx] = &syn->tmr_next;
+}
+
+/** Takes a half-open connection off its retransmission queue */
+static void
+tcp_syn_dequeue(struct tcp_syn *syn)
+{
+  if (syn->tmr_next == NULL) {
+    tcp_syn_queue_tail[syn->nrtx] = syn->tmr_pprev;
+  }
+  TCP_TMR_UNLINK(syn, tmr_next, tmr_pprev);
+}
+
+/**
+ * Allocates an entry for the SYN cache. The caller fills it in and passes
+ * it to tcp_syn_insert().
+ *
+ * @return the new entry or NULL if the SYN cache is full
+ */
+struct tcp_syn *
+tcp_syn_alloc(void)
+{
+  struct tcp_syn *syn;
+
+  if (tcp_syn_count >= TCP_SYN_CACHE_SIZE) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_syn_alloc: SYN cache full\n"));
+    return NULL;
+  }
+  syn = (struct tcp_syn *)memp_malloc(MEMP_TCP_SYN);
+  if (syn == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_syn_alloc: could not allocate SYN cache entry\n"));
+    return NULL;
+  }
+  memset(syn, 0, sizeof(struct tcp_syn));
+  tcp_syn_count++;
+  return syn;
+}
+
+/**
+ * Enters a half-open connection into the SYN cache, just after its first
+ * SYN|ACK has been sent.
+ *
+ * @param syn the entry from tcp_syn_alloc(), filled in
+ */
+void
+tcp_syn_insert(struct tcp_syn *syn)
+{
+  TCP_TMR_LINK(tcp_syn_hash_slot(syn->local_port, &syn->remote_ip, syn->remote_port),
+               syn, next, pprev);
+  syn->nrtx = 0;
+  tcp_syn_enqueue(syn);
+  tcp_timer_needed();
+}
+
+/**
+ * Finds the half-open connection for a 4-tuple in the SYN cache.
+ *
+ * @param local_ip local IP address of the connection
+ * @param local_port local port of the connection
+ * @param remote_ip remote IP address of the connection
+ * @param remote_port remote port of the connection
+ * @return the SYN cache entry or NULL if there is none
+ */
+struct tcp_syn *
+tcp_syn_lookup(ip_addr_t *local_ip, u16_t local_port,
+               ip_addr_t *remote_ip, u16_t remote_port)
+{
+  struct tcp_syn *syn;
+
+  for (syn = *tcp_syn_hash_slot(local_port, remote_ip, remote_port); syn != NULL; syn = syn->next) {
+    if (syn->remote_port == remote_port &&
+        syn->local_port == local_port &&
+        ip_addr_cmp(&syn->remote_ip, remote_ip) &&
+        ip_addr_cmp(&syn->local_ip, local_ip)) {
+      return syn;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Removes a half-open connection from the SYN cache and frees it.
+ *
+ * @param syn the SYN cache entry to free
+ */
+void
+tcp_syn_free(struct tcp_syn *syn)
+{
+  if (syn->pprev != NULL) {
+    TCP_TMR_UNLINK(syn, next, pprev);
+    tcp_syn_dequeue(syn);
+  }
+  LWIP_ASSERT("tcp_syn_free: tcp_syn_count > 0", tcp_syn_count > 0);
+  tcp_syn_count--;
+  memp_free(MEMP_TCP_SYN, syn);
+}
+
+/**
+ * Frees all half-open connections of a listening pcb that is being closed.
+ *
+ * @param lpcb the listening pcb
+ */
+void
+tcp_syn_flush(struct tcp_pcb_listen *lpcb)
+{
+  struct tcp_syn *syn, *next;
+  u8_t n;
+
+  for (n = 0; n <= TCP_SYN_CACHE_MAXRTX && tcp_syn_count > 0; n++) {
+    for (syn = tcp_syn_queue[n]; syn != NULL; syn = next) {
+      next = syn->tmr_next;
+      if (syn->listener == lpcb) {
+        tcp_syn_free(syn);
+      }
+    }
+  }
+}
+
+/**
+ * Retransmits the SYN|ACK of half-open connections whose timeout expired,
+ * doubling the timeout each time, and drops them after TCP_SYN_CACHE_MAXRTX
+ * retransmissions. Each queue is in expiry order, so only expired entries
+ * are looked at.
+ */
+static void
+tcp_syn_tmr(void)
+{
+  struct tcp_syn *syn;
+  u8_t n;
+
+  for (n = 0; n <= TCP_SYN_CACHE_MAXRTX; n++) {
+    while ((syn = tcp_syn_queue[n]) != NULL &&
+           (u32_t)(tcp_ticks - syn->tmr) >= ((u32_t)TCP_SYN_RTO << n)) {
+      if (n == TCP_SYN_CACHE_MAXRTX) {
+        LWIP_DEBUGF(TCP_DEBUG, ("tcp_syn_tmr: no ACK for SYN|ACK, dropping half-open connection\n"));
+        tcp_syn_free(syn);
       } else {
-        /* This PCB was the first. */
-        LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_tw_pcbs", tcp_tw_pcbs == pcb);
-        tcp_tw_pcbs = pcb->next;
+        tcp_syn_dequeue(syn);
+        syn->nrtx++;
+        tcp_syn_enqueue(syn);
+        tcp_syn_ack(syn);
       }
-      pcb2 = pcb;
-      pcb = pcb->next;
-      memp_free(MEMP_TCP_PCB, pcb2);
+    }
+  }
+}
+
+/**
+ * Called every 500 ms and implements the retransmission timer and the timer that
+ * removes PCBs that have been in TIME-WAIT for enough time. It also increments
+ * various timers such as the inactivity timer in each PCB.
+ *
+ * Only the PCBs found in the timing wheel slot for the current tick are
+ * looked at, so idle connections cost nothing here until one of their
+ * timeouts actually expires.
+ *
+ * Automatically called from tcp_tmr().
+ */
+void
+tcp_slowtmr(void)
+{
+  struct tcp_pcb *due, *pcb;
+  struct tcp_pcb **slot;
+
+  ++tcp_ticks;
+
+  /* Detach the slot for this tick, so that PCBs which are re-armed into
+     the same slot (one lap later) or freed from a callback while we walk
+     it do not disturb the walk. */
+  slot = TCP_TMR_WHEEL_SLOT(tcp_ticks);
+  due = *slot;
+  *slot = NULL;
+  if (due == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no pcbs due\n"));
+  } else {
+    due->tmr_pprev = &due;
+  }
+
+  while ((pcb = due) != NULL) {
+    TCP_TMR_UNLINK(pcb, tmr_next, tmr_pprev);
+
+    if (TCP_TMR_BEFORE(tcp_ticks, pcb->tmr_due)) {
+      /* Hashed into this slot but due in a later revolution of the wheel */
+      tcp_tmr_arm(pcb, pcb->tmr_due);
+    } else if (pcb->state == TIME_WAIT) {
+      tcp_slowtmr_timewait(pcb);
     } else {
-      prev = pcb;
-      pcb = pcb->next;
+      tcp_slowtmr_active(pcb);
     }
   }
+
+  tcp_tw_tmr();
+  tcp_syn_tmr();
 }
 
 /**
  * Is called every TCP_FAST_INTERVAL (250 ms) and process data previously
  * "refused" by upper layer (application) and sends delayed ACKs.
  *
+ * Only PCBs that have put themselves on the fast timer list (see
+ * tcp_fasttmr_needed()) are looked at.
+ *
  * Automatically called from tcp_tmr().
  */
 void
 tcp_fasttmr(void)
 {
-  struct tcp_pcb *pcb = tcp_active_pcbs;
+  struct tcp_pcb *pending, *pcb;
+
+  /* Detach the list: callbacks may put PCBs back on it or free them */
+  pending = tcp_fast_pcbs;
+  tcp_fast_pcbs = NULL;
+  if (pending != NULL) {
+    pending->fast_pprev = &pending;
+  }
+
+  while((pcb = pending) != NULL) {
+    TCP_TMR_UNLINK(pcb, fast_next, fast_pprev);
 
-  while(pcb != NULL) {
-    struct tcp_pcb *next = pcb->next;
     /* If there is data which was previously "refused" by upper layer */
     if (pcb->refused_data != NULL) {
       /* Notify again application with data previously received. */
@@ -1007,6 +1744,9 @@ tcp_fasttmr(void)
       } else if (err == ERR_ABRT) {
         /* if err == ERR_ABRT, 'pcb' is already deallocated */
         pcb = NULL;
+      } else {
+        /* still refused: try again on the next fast timer tick */
+        tcp_fasttmr_needed(pcb);
       }
     }
 
@@ -1017,8 +1757,6 @@ tcp_fasttmr(void)
       tcp_output(pcb);
       pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
     }
-
-    pcb = next;
   }
 }
 
@@ -1351,6 +2089,8 @@ tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
   LWIP_UNUSED_ARG(poll);
 #endif /* LWIP_CALLBACK_API */  
   pcb->pollinterval = interval;
+  /* the poll callback is driven by the slow timer */
+  tcp_tmr_kick(pcb);
 }
 
 /**
@@ -1448,6 +2188,9 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 #if TCP_QUEUE_OOSEQ
     LWIP_ASSERT("ooseq segments leaking", pcb->ooseq == NULL);
 #endif /* TCP_QUEUE_OOSEQ */
+    /* tcp_output() above may have put it back on the timing wheel
+       (a tcp_pcb_listen has no timer fields) */
+    tcp_tmr_disarm(pcb);
   }
 
   pcb->state = CLOSED;
@@ -1473,7 +2216,8 @@ tcp_next_iss(void)
 /**
  * Calcluates the effective send mss that can be used for a specific IP address
  * by using ip_route to determin the netif used to send to the address and
- * calculating the minimum of TCP_MSS and that netif's mtu (if set).
+ * calculating the minimum of TCP_MSS and that netif's mtu (if set), or the
+ * path MTU the port reports through TCP_PATH_MTU_HOOK.
  */
 u16_t
 tcp_eff_send_mss(u16_t sendmss, ip_addr_t *addr)
@@ -1483,7 +2227,11 @@ tcp_eff_send_mss(u16_t sendmss, ip_addr_t *addr)
 
   outif = ip_route(addr);
   if ((outif != NULL) && (outif->mtu != 0)) {
+#ifdef TCP_PATH_MTU_HOOK
+    mss_s = TCP_PATH_MTU_HOOK(addr, outif->mtu) - IP_HLEN - TCP_HLEN;
+#else /* TCP_PATH_MTU_HOOK */
     mss_s = outif->mtu - IP_HLEN - TCP_HLEN;
+#endif /* TCP_PATH_MTU_HOOK */
     /* RFC 1122, chap 4.2.2.6:
      * Eff.snd.MSS = min(SendMSS+20, MMS_S) - TCPhdrsize - IPoptionsize
      * We correct for TCP options in tcp_write(), and don't support IP options.
@@ -1590,6 +2338,7 @@ void
 tcp_debug_print_pcbs(void)
 {
   struct tcp_pcb *pcb;
+  struct tcp_tw *tw;
   LWIP_DEBUGF(TCP_DEBUG, ("Active PCB states:\n"));
   for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
     LWIP_DEBUGF(TCP_DEBUG, ("Local port %"U16_F", foreign port %"U16_F" snd_nxt %"U32_F" rcv_nxt %"U32_F" ",
@@ -1611,6 +2360,12 @@ tcp_debug_print_pcbs(void)
                        pcb->snd_nxt, pcb->rcv_nxt));
     tcp_debug_print_state(pcb->state);
   }    
+  LWIP_DEBUGF(TCP_DEBUG, ("TIME-WAIT buckets:\n"));
+  for(tw = tcp_tw_buckets; tw != NULL; tw = tw->tmr_next) {
+    LWIP_DEBUGF(TCP_DEBUG, ("Local port %"U16_F", foreign port %"U16_F" snd_nxt %"U32_F" rcv_nxt %"U32_F"\n",
+                       tw->local_port, tw->remote_port,
+                       tw->snd_nxt, tw->rcv_nxt));
+  }
 }
 
 /**
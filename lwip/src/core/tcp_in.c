@@ -75,9 +75,11 @@ struct tcp_pcb *tcp_input_pcb;
 static err_t tcp_process(struct tcp_pcb *pcb);
 static void tcp_receive(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
+static void tcp_parseopts(u16_t *mss, u8_t *pcbflags, u32_t *ts_recent, u32_t ts_lastacksent);
 
-static err_t tcp_listen_input(struct tcp_pcb_listen *pcb);
+static struct tcp_pcb *tcp_listen_input(struct tcp_pcb_listen *pcb);
 static err_t tcp_timewait_input(struct tcp_pcb *pcb);
+static err_t tcp_tw_input(struct tcp_tw *tw);
 
 /**
  * The initial input processing of TCP. It verifies the TCP header, demultiplexes
@@ -93,6 +95,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
 {
   struct tcp_pcb *pcb, *prev;
   struct tcp_pcb_listen *lpcb;
+  struct tcp_tw *tw;
 #if SO_REUSE
   struct tcp_pcb *lpcb_prev = NULL;
   struct tcp_pcb_listen *lpcb_any = NULL;
@@ -222,6 +225,15 @@ tcp_input(struct pbuf *p, struct netif *inp)
       }
     }
 
+    /* Closed connections in TIME-WAIT are kept in a hash table. */
+    tw = tcp_tw_lookup(&current_iphdr_dest, tcphdr->dest, &current_iphdr_src, tcphdr->src);
+    if (tw != NULL) {
+      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for closed TIME_WAITing connection.\n"));
+      tcp_tw_input(tw);
+      pbuf_free(p);
+      return;
+    }
+
     /* Finally, if we still did not get a match, we check all PCBs that
        are LISTENing for incoming connections. */
     prev = NULL;
@@ -267,9 +279,12 @@ tcp_input(struct pbuf *p, struct netif *inp)
       }
     
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
-      tcp_listen_input(lpcb);
-      pbuf_free(p);
-      return;
+      pcb = tcp_listen_input(lpcb);
+      if (pcb == NULL) {
+        pbuf_free(p);
+        return;
+      }
+      /* The segment completed a handshake: process it on the new pcb */
     }
   }
 
@@ -371,6 +386,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
           /* If the upper layer can't receive this data, store it */
           if (err != ERR_OK) {
             pcb->refused_data = recv_data;
+            tcp_fasttmr_needed(pcb);
             LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: keep incoming packet, because pcb is \"full\"\n"));
           }
         }
@@ -397,6 +413,11 @@ tcp_input(struct pbuf *p, struct netif *inp)
         tcp_debug_print_state(pcb->state);
 #endif /* TCP_DEBUG */
 #endif /* TCP_INPUT_DEBUG */
+        if (pcb->state == TIME_WAIT) {
+          /* If the application has already closed the connection, TIME-WAIT
+             is kept in a bucket and the pcb is freed. */
+          tcp_tw_enter(pcb);
+        }
       }
     }
     /* Jump target if pcb has been aborted in a callback (by calling tcp_abort()).
@@ -430,91 +451,334 @@ aborted:
   PERF_STOP("tcp_input");
 }
 
+#if TCP_SYN_COOKIES
+/** Ticks per step of the SYN cookie counter (64 seconds) */
+#define TCP_SYN_COOKIE_PERIOD (64000 / TCP_SLOW_INTERVAL)
+
+/** MSS values that can be encoded in the 3 MSS bits of a SYN cookie */
+static const u16_t tcp_syn_cookie_mss[8] = {
+  216, 536, 1024, 1220, 1300, 1400, 1440, 1460
+};
+
+/** Key of the SYN cookie hash, chosen when the first cookie is sent */
+static u32_t tcp_syn_cookie_key[2];
+static u8_t tcp_syn_cookie_keyed;
+
+#define TCP_SYN_COOKIE_ROTL(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+#define TCP_SYN_COOKIE_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = TCP_SYN_COOKIE_ROTL(v1, 5); v1 ^= v0; v0 = TCP_SYN_COOKIE_ROTL(v0, 16); \
+    v2 += v3; v3 = TCP_SYN_COOKIE_ROTL(v3, 8); v3 ^= v2; \
+    v0 += v3; v3 = TCP_SYN_COOKIE_ROTL(v3, 7); v3 ^= v0; \
+    v2 += v1; v1 = TCP_SYN_COOKIE_ROTL(v1, 13); v1 ^= v2; v2 = TCP_SYN_COOKIE_ROTL(v2, 16); \
+  } while (0)
+
+/**
+ * Keyed hash (HalfSipHash-2-4) over the 4-tuple and the initial sequence
+ * number of a half-open connection and the counter/MSS bits of its cookie.
+ */
+static u32_t
+tcp_syn_cookie_hash(struct tcp_syn *syn, u32_t count)
+{
+  u32_t m[6];
+  u32_t v0, v1, v2, v3;
+  u8_t i, r;
+
+  m[0] = ip4_addr_get_u32(&syn->local_ip);
+  m[1] = ip4_addr_get_u32(&syn->remote_ip);
+  m[2] = ((u32_t)syn->local_port << 16) | syn->remote_port;
+  m[3] = syn->irs;
+  m[4] = count;
+  m[5] = (u32_t)(5 * 4) << 24;
+
+  v0 = tcp_syn_cookie_key[0];
+  v1 = tcp_syn_cookie_key[1];
+  v2 = 0x6c796765 ^ v0;
+  v3 = 0x74656462 ^ v1;
+  for (i = 0; i < 6; i++) {
+    v3 ^= m[i];
+    for (r = 0; r < 2; r++) {
+      TCP_SYN_COOKIE_ROUND(v0, v1, v2, v3);
+    }
+    v0 ^= m[i];
+  }
+  v2 ^= 0xff;
+  for (r = 0; r < 4; r++) {
+    TCP_SYN_COOKIE_ROUND(v0, v1, v2, v3);
+  }
+  return v1 ^ v3;
+}
+
+/**
+ * Makes the SYN cookie (RFC 4987) used as initial sequence number of a
+ * SYN|ACK when the SYN cache is full: 5 bits of a counter that advances
+ * every 64 seconds, 3 bits encoding the MSS and 24 bits of a keyed hash.
+ *
+ * @param syn the half-open connection (not in the SYN cache)
+ * @return the initial sequence number to send
+ */
+static u32_t
+tcp_syn_cookie_make(struct tcp_syn *syn)
+{
+  u32_t count = tcp_ticks / TCP_SYN_COOKIE_PERIOD;
+  u8_t mssind;
+
+  if (!tcp_syn_cookie_keyed) {
+#ifdef LWIP_RAND
+    tcp_syn_cookie_key[0] = LWIP_RAND();
+    tcp_syn_cookie_key[1] = LWIP_RAND();
+#else /* LWIP_RAND */
+    tcp_syn_cookie_key[0] = tcp_next_iss();
+    tcp_syn_cookie_key[1] = sys_now() ^ (u32_t)(mem_ptr_t)syn;
+#endif /* LWIP_RAND */
+    tcp_syn_cookie_keyed = 1;
+  }
+  /* the largest MSS we can encode that the peer accepts */
+  for (mssind = 7; mssind > 0 && tcp_syn_cookie_mss[mssind] > syn->mss; mssind--);
+
+  return ((count & 0x1f) << 27) | ((u32_t)mssind << 24) |
+    (tcp_syn_cookie_hash(syn, (count << 3) | mssind) & 0x00ffffff);
+}
+
+/**
+ * Checks whether the incoming ACK acknowledges a SYN cookie made within
+ * the last two counter periods. If it does, the connection's initial
+ * sequence numbers and MSS are recovered into syn.
+ *
+ * @param syn the half-open connection, with the 4-tuple and irs filled in
+ * @return 1 if the cookie is valid, 0 otherwise
+ */
+static u8_t
+tcp_syn_cookie_check(struct tcp_syn *syn)
+{
+  u32_t cookie = ackno - 1;
+  u32_t count = tcp_ticks / TCP_SYN_COOKIE_PERIOD;
+  u32_t age = (count - (cookie >> 27)) & 0x1f;
+  u8_t mssind = (u8_t)((cookie >> 24) & 7);
+
+  if (!tcp_syn_cookie_keyed || age > 1) {
+    return 0;
+  }
+  count -= age;
+  if ((tcp_syn_cookie_hash(syn, (count << 3) | mssind) & 0x00ffffff) != (cookie & 0x00ffffff)) {
+    return 0;
+  }
+  syn->iss = cookie;
+  syn->mss = LWIP_MIN(tcp_syn_cookie_mss[mssind], TCP_MSS);
+  return 1;
+}
+#endif /* TCP_SYN_COOKIES */
+
+/** Fills in the addresses and window of a half-open connection from the
+ * segment being processed */
+static void
+tcp_syn_from_segment(struct tcp_syn *syn, struct tcp_pcb_listen *pcb)
+{
+  syn->listener = pcb;
+  ip_addr_copy(syn->local_ip, current_iphdr_dest);
+  ip_addr_copy(syn->remote_ip, current_iphdr_src);
+  syn->local_port = tcphdr->dest;
+  syn->remote_port = tcphdr->src;
+  syn->snd_wnd = tcphdr->wnd;
+}
+
+/**
+ * Creates the tcp_pcb for a half-open connection whose handshake is being
+ * completed by the segment being processed. The new pcb is in SYN_RCVD
+ * with our SYN|ACK outstanding, so that tcp_process() takes it to
+ * ESTABLISHED on this very segment.
+ *
+ * @param pcb the tcp_pcb_listen the connection belongs to
+ * @param syn the half-open connection (not freed here)
+ * @return the new tcp_pcb, or NULL if the segment has to be dropped
+ */
+static struct tcp_pcb *
+tcp_syn_promote(struct tcp_pcb_listen *pcb, struct tcp_syn *syn)
+{
+  struct tcp_pcb *npcb;
+
+#if TCP_LISTEN_BACKLOG
+  if (pcb->accepts_pending >= pcb->backlog) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: listen backlog exceeded for port %"U16_F"\n", tcphdr->dest));
+    return NULL;
+  }
+#endif /* TCP_LISTEN_BACKLOG */
+  npcb = tcp_alloc(pcb->prio);
+  /* If a new PCB could not be created (probably due to lack of memory),
+     we drop the ACK and rely on our SYN|ACK being retransmitted (or, for
+     a cookie, on the peer sending more). */
+  if (npcb == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: could not allocate PCB\n"));
+    TCP_STATS_INC(tcp.memerr);
+    return NULL;
+  }
+#if TCP_LISTEN_BACKLOG
+  pcb->accepts_pending++;
+#endif /* TCP_LISTEN_BACKLOG */
+  /* Set up the new PCB. */
+  ip_addr_copy(npcb->local_ip, syn->local_ip);
+  npcb->local_port = pcb->local_port;
+  ip_addr_copy(npcb->remote_ip, syn->remote_ip);
+  npcb->remote_port = syn->remote_port;
+  npcb->state = SYN_RCVD;
+  npcb->rcv_nxt = syn->irs + 1;
+  /* Our SYN|ACK has been sent: account for it (and the window it
+     announced) as tcp_enqueue_flags() and tcp_output() would have, so
+     that this segment acknowledges it. */
+  npcb->rcv_ann_right_edge = npcb->rcv_nxt + npcb->rcv_ann_wnd;
+  npcb->snd_nxt = syn->iss + 1;
+  npcb->lastack = syn->iss;
+  npcb->snd_wl2 = syn->iss;
+  npcb->snd_lbb = syn->iss + 1;
+  npcb->snd_buf--;
+  npcb->snd_wnd = syn->snd_wnd;
+  npcb->ssthresh = npcb->snd_wnd;
+  npcb->snd_wl1 = syn->irs - 1;/* initialise to irs-1 to force window update */
+  npcb->callback_arg = pcb->callback_arg;
+#if LWIP_CALLBACK_API
+  npcb->accept = pcb->accept;
+#endif /* LWIP_CALLBACK_API */
+  /* inherit socket options */
+  npcb->so_options = pcb->so_options & SOF_INHERITED;
+  npcb->mss = syn->mss;
+#if TCP_CALCULATE_EFF_SEND_MSS
+  npcb->mss = tcp_eff_send_mss(npcb->mss, &(npcb->remote_ip));
+#endif /* TCP_CALCULATE_EFF_SEND_MSS */
+#if LWIP_TCP_TIMESTAMPS
+  npcb->flags |= syn->flags & TF_TIMESTAMP;
+  npcb->ts_recent = syn->ts_recent;
+  npcb->ts_lastacksent = npcb->rcv_nxt;
+#endif /* LWIP_TCP_TIMESTAMPS */
+  /* Register the new PCB so that we can begin receiving segments
+     for it. */
+  TCP_REG(&tcp_active_pcbs, npcb);
+  return npcb;
+}
+
 /**
  * Called by tcp_input() when a segment arrives for a listening
  * connection (from tcp_input()).
  *
+ * A SYN is answered with a SYN|ACK from a compact entry in the SYN cache
+ * (or, if the cache is full, with a SYN cookie); the tcp_pcb is only
+ * created when the ACK completing the handshake arrives.
+ *
  * @param pcb the tcp_pcb_listen for which a segment arrived
- * @return ERR_OK if the segment was processed
- *         another err_t on error
+ * @return the new tcp_pcb in SYN_RCVD if the segment completes a handshake
+ *         and must be processed further by tcp_input(), NULL otherwise
  *
- * @note the return value is not (yet?) used in tcp_input()
  * @note the segment which arrived is saved in global variables, therefore only the pcb
  *       involved is passed as a parameter to this function
  */
-static err_t
+static struct tcp_pcb *
 tcp_listen_input(struct tcp_pcb_listen *pcb)
 {
   struct tcp_pcb *npcb;
-  err_t rc;
+  struct tcp_syn *syn;
+#if TCP_SYN_COOKIES
+  struct tcp_syn cookie;
+#endif /* TCP_SYN_COOKIES */
+
+  syn = tcp_syn_lookup(&current_iphdr_dest, tcphdr->dest, &current_iphdr_src, tcphdr->src);
+  if (syn != NULL && syn->listener != pcb) {
+    /* Cached under a wildcard listener before this more specific one was
+       bound. The segment belongs to this listener now, so hand the
+       half-open connection over to it. */
+    syn->listener = pcb;
+  }
 
   /* In the LISTEN state, we check for incoming SYN segments,
-     creates a new PCB, and responds with a SYN|ACK. */
-  if (flags & TCP_ACK) {
-    /* For incoming segments with the ACK flag set, respond with a
+     remember them in the SYN cache, and respond with a SYN|ACK. */
+  if (flags & TCP_RST) {
+    /* A RST for our SYN|ACK drops the half-open connection */
+    if (syn != NULL && seqno == syn->irs + 1) {
+      LWIP_DEBUGF(TCP_RST_DEBUG, ("tcp_listen_input: RST for half-open connection\n"));
+      tcp_syn_free(syn);
+    }
+  } else if (flags & TCP_ACK) {
+    if (!(flags & TCP_SYN)) {
+      if (syn != NULL) {
+        if (ackno == syn->iss + 1) {
+          npcb = tcp_syn_promote(pcb, syn);
+          if (npcb != NULL) {
+            tcp_syn_free(syn);
+          }
+          return npcb;
+        }
+      }
+#if TCP_SYN_COOKIES
+      else {
+        tcp_syn_from_segment(&cookie, pcb);
+        cookie.irs = seqno - 1;
+        cookie.flags = 0;
+        if (tcp_syn_cookie_check(&cookie)) {
+          LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: valid SYN cookie\n"));
+          return tcp_syn_promote(pcb, &cookie);
+        }
+      }
+#endif /* TCP_SYN_COOKIES */
+    }
+    /* For other incoming segments with the ACK flag set, respond with a
        RST. */
     LWIP_DEBUGF(TCP_RST_DEBUG, ("tcp_listen_input: ACK in LISTEN, sending reset\n"));
-    tcp_rst(ackno + 1, seqno + tcplen,
+    tcp_rst(ackno, seqno + tcplen,
       ip_current_dest_addr(), ip_current_src_addr(),
       tcphdr->dest, tcphdr->src);
   } else if (flags & TCP_SYN) {
+    if (syn != NULL) {
+      if (seqno == syn->irs) {
+        /* The peer retransmitted its SYN, so our SYN|ACK was lost */
+        tcp_syn_ack(syn);
+        return NULL;
+      }
+      /* A new SYN replaces the half-open connection of the same 4-tuple */
+      tcp_syn_free(syn);
+    }
     LWIP_DEBUGF(TCP_DEBUG, ("TCP connection request %"U16_F" -> %"U16_F".\n", tcphdr->src, tcphdr->dest));
 #if TCP_LISTEN_BACKLOG
     if (pcb->accepts_pending >= pcb->backlog) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: listen backlog exceeded for port %"U16_F"\n", tcphdr->dest));
-      return ERR_ABRT;
+      return NULL;
     }
 #endif /* TCP_LISTEN_BACKLOG */
-    npcb = tcp_alloc(pcb->prio);
-    /* If a new PCB could not be created (probably due to lack of memory),
-       we don't do anything, but rely on the sender will retransmit the
-       SYN at a time when we have more memory available. */
-    if (npcb == NULL) {
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: could not allocate PCB\n"));
+    syn = tcp_syn_alloc();
+    if (syn == NULL) {
+#if TCP_SYN_COOKIES
+      syn = &cookie;
+#else /* TCP_SYN_COOKIES */
+      /* Rely on the sender to retransmit the SYN at a time when the
+         SYN cache has room again. */
       TCP_STATS_INC(tcp.memerr);
-      return ERR_MEM;
+      return NULL;
+#endif /* TCP_SYN_COOKIES */
     }
-#if TCP_LISTEN_BACKLOG
-    pcb->accepts_pending++;
-#endif /* TCP_LISTEN_BACKLOG */
-    /* Set up the new PCB. */
-    ip_addr_copy(npcb->local_ip, current_iphdr_dest);
-    npcb->local_port = pcb->local_port;
-    ip_addr_copy(npcb->remote_ip, current_iphdr_src);
-    npcb->remote_port = tcphdr->src;
-    npcb->state = SYN_RCVD;
-    npcb->rcv_nxt = seqno + 1;
-    npcb->rcv_ann_right_edge = npcb->rcv_nxt;
-    npcb->snd_wnd = tcphdr->wnd;
-    npcb->ssthresh = npcb->snd_wnd;
-    npcb->snd_wl1 = seqno - 1;/* initialise to seqno-1 to force window update */
-    npcb->callback_arg = pcb->callback_arg;
-#if LWIP_CALLBACK_API
-    npcb->accept = pcb->accept;
-#endif /* LWIP_CALLBACK_API */
-    /* inherit socket options */
-    npcb->so_options = pcb->so_options & SOF_INHERITED;
-    /* Register the new PCB so that we can begin receiving segments
-       for it. */
-    TCP_REG(&tcp_active_pcbs, npcb);
-
+    tcp_syn_from_segment(syn, pcb);
+    syn->irs = seqno;
+    syn->flags = 0;
     /* Parse any options in the SYN. */
-    tcp_parseopt(npcb);
-#if TCP_CALCULATE_EFF_SEND_MSS
-    npcb->mss = tcp_eff_send_mss(npcb->mss, &(npcb->remote_ip));
-#endif /* TCP_CALCULATE_EFF_SEND_MSS */
+    syn->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
+#if LWIP_TCP_TIMESTAMPS
+    tcp_parseopts(&syn->mss, &syn->flags, &syn->ts_recent, 0);
+#else /* LWIP_TCP_TIMESTAMPS */
+    tcp_parseopts(&syn->mss, &syn->flags, NULL, 0);
+#endif /* LWIP_TCP_TIMESTAMPS */
 
     snmp_inc_tcppassiveopens();
 
-    /* Send a SYN|ACK together with the MSS option. */
-    rc = tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK);
-    if (rc != ERR_OK) {
-      tcp_abandon(npcb, 0);
-      return rc;
+#if TCP_SYN_COOKIES
+    if (syn == &cookie) {
+      /* Nothing is kept to echo a timestamp from later on */
+      syn->flags = 0;
+      syn->iss = tcp_syn_cookie_make(syn);
+      tcp_syn_ack(syn);
+      return NULL;
     }
-    return tcp_output(npcb);
+#endif /* TCP_SYN_COOKIES */
+    /* Send a SYN|ACK together with the MSS option. */
+    syn->iss = tcp_next_iss();
+    tcp_syn_insert(syn);
+    tcp_syn_ack(syn);
   }
-  return ERR_OK;
+  return NULL;
 }
 
 /**
@@ -561,6 +825,42 @@ tcp_timewait_input(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+/**
+ * Called by tcp_input() when a segment arrives for a closed connection
+ * that is kept in TIME-WAIT as a struct tcp_tw. Same as
+ * tcp_timewait_input(), but without a pcb.
+ *
+ * @param tw the TIME-WAIT bucket for which a segment arrived
+ *
+ * @note the segment which arrived is saved in global variables, therefore only the
+ *       bucket involved is passed as a parameter to this function
+ */
+static err_t
+tcp_tw_input(struct tcp_tw *tw)
+{
+  /* RFC 1337: in TIME_WAIT, ignore RST and ACK FINs + any 'acceptable' segments */
+  if (flags & TCP_RST)  {
+    return ERR_OK;
+  }
+  if (flags & TCP_SYN) {
+    if (TCP_SEQ_BETWEEN(seqno, tw->rcv_nxt, tw->rcv_nxt+tw->rcv_wnd)) {
+      /* If the SYN is in the window it is an error, send a reset */
+      tcp_rst(ackno, seqno + tcplen, ip_current_dest_addr(), ip_current_src_addr(),
+        tcphdr->dest, tcphdr->src);
+      return ERR_OK;
+    }
+  } else if (flags & TCP_FIN) {
+    /* Remain in the TIME-WAIT state. Restart the 2 MSL time-wait timeout. */
+    tcp_tw_restart(tw);
+  }
+
+  if ((tcplen > 0))  {
+    /* Acknowledge data, FIN or out-of-window SYN */
+    return tcp_tw_ack(tw);
+  }
+  return ERR_OK;
+}
+
 /**
  * Implements the TCP state machine. Called by tcp_input. In some
  * states tcp_receive() is called to receive data. The tcp_seg
@@ -747,6 +1047,7 @@ tcp_process(struct tcp_pcb *pcb)
         tcp_pcb_purge(pcb);
         TCP_RMV(&tcp_active_pcbs, pcb);
         pcb->state = TIME_WAIT;
+        pcb->tmr = tcp_ticks;
         TCP_REG(&tcp_tw_pcbs, pcb);
       } else {
         tcp_ack_now(pcb);
@@ -764,6 +1065,7 @@ tcp_process(struct tcp_pcb *pcb)
       tcp_pcb_purge(pcb);
       TCP_RMV(&tcp_active_pcbs, pcb);
       pcb->state = TIME_WAIT;
+      pcb->tmr = tcp_ticks;
       TCP_REG(&tcp_tw_pcbs, pcb);
     }
     break;
@@ -774,6 +1076,7 @@ tcp_process(struct tcp_pcb *pcb)
       tcp_pcb_purge(pcb);
       TCP_RMV(&tcp_active_pcbs, pcb);
       pcb->state = TIME_WAIT;
+      pcb->tmr = tcp_ticks;
       TCP_REG(&tcp_tw_pcbs, pcb);
     }
     break;
@@ -1347,6 +1650,8 @@ tcp_receive(struct tcp_pcb *pcb)
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
           pcb->ooseq = tcp_seg_copy(&inseg);
+          /* start the out-of-sequence queue timeout */
+          tcp_tmr_kick(pcb);
         } else {
           /* If the queue is not empty, we walk through the queue and
              try to find a place where the sequence number of the
@@ -1486,19 +1791,26 @@ tcp_receive(struct tcp_pcb *pcb)
  * Parses the options contained in the incoming segment. 
  *
  * Called from tcp_listen_input() and tcp_process().
- * Currently, only the MSS option is supported!
+ * Currently, only the MSS and timestamp options are supported!
  *
- * @param pcb the tcp_pcb for which a segment arrived
+ * @param mss set to the MSS option, if present
+ * @param pcbflags gets TF_TIMESTAMP if a SYN carries the timestamp option
+ * @param ts_recent set to the timestamp value, if it is to be echoed
+ * @param ts_lastacksent rcv_nxt of the last ACK sent
  */
 static void
-tcp_parseopt(struct tcp_pcb *pcb)
+tcp_parseopts(u16_t *mss, u8_t *pcbflags, u32_t *ts_recent, u32_t ts_lastacksent)
 {
   u16_t c, max_c;
-  u16_t mss;
+  u16_t optmss;
   u8_t *opts, opt;
 #if LWIP_TCP_TIMESTAMPS
   u32_t tsval;
-#endif
+#else /* LWIP_TCP_TIMESTAMPS */
+  LWIP_UNUSED_ARG(pcbflags);
+  LWIP_UNUSED_ARG(ts_recent);
+  LWIP_UNUSED_ARG(ts_lastacksent);
+#endif /* LWIP_TCP_TIMESTAMPS */
 
   opts = (u8_t *)tcphdr + TCP_HLEN;
 
@@ -1525,9 +1837,9 @@ tcp_parseopt(struct tcp_pcb *pcb)
           return;
         }
         /* An MSS option with the right option length. */
-        mss = (opts[c + 2] << 8) | opts[c + 3];
+        optmss = (opts[c + 2] << 8) | opts[c + 3];
         /* Limit the mss to the configured TCP_MSS and prevent division by zero */
-        pcb->mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
+        *mss = ((optmss > TCP_MSS) || (optmss == 0)) ? TCP_MSS : optmss;
         /* Advance to next option */
         c += 0x04;
         break;
@@ -1543,10 +1855,10 @@ tcp_parseopt(struct tcp_pcb *pcb)
         tsval = (opts[c+2]) | (opts[c+3] << 8) | 
           (opts[c+4] << 16) | (opts[c+5] << 24);
         if (flags & TCP_SYN) {
-          pcb->ts_recent = ntohl(tsval);
-          pcb->flags |= TF_TIMESTAMP;
-        } else if (TCP_SEQ_BETWEEN(pcb->ts_lastacksent, seqno, seqno+tcplen)) {
-          pcb->ts_recent = ntohl(tsval);
+          *ts_recent = ntohl(tsval);
+          *pcbflags |= TF_TIMESTAMP;
+        } else if (TCP_SEQ_BETWEEN(ts_lastacksent, seqno, seqno+tcplen)) {
+          *ts_recent = ntohl(tsval);
         }
         /* Advance to next option */
         c += 0x0A;
@@ -1568,4 +1880,19 @@ tcp_parseopt(struct tcp_pcb *pcb)
   }
 }
 
+/**
+ * Parses the options contained in the incoming segment into a pcb.
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ */
+static void
+tcp_parseopt(struct tcp_pcb *pcb)
+{
+#if LWIP_TCP_TIMESTAMPS
+  tcp_parseopts(&pcb->mss, &pcb->flags, &pcb->ts_recent, pcb->ts_lastacksent);
+#else /* LWIP_TCP_TIMESTAMPS */
+  tcp_parseopts(&pcb->mss, &pcb->flags, NULL, 0);
+#endif /* LWIP_TCP_TIMESTAMPS */
+}
+
 #endif /* LWIP_TCP */
@@ -882,6 +882,130 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+/**
+ * Send an ACK without data for a closed connection that is kept in
+ * TIME-WAIT as a struct tcp_tw (see tcp_tw_enter()).
+ *
+ * @param tw the TIME-WAIT bucket to send the ACK for
+ */
+err_t
+tcp_tw_ack(struct tcp_tw *tw)
+{
+  struct pbuf *p;
+  struct tcp_hdr *tcphdr;
+  u8_t optlen = 0;
+
+#if LWIP_TCP_TIMESTAMPS
+  if (tw->flags & TF_TIMESTAMP) {
+    optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
+  }
+#endif
+
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
+  if (p == NULL) {
+    LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_tw_ack: could not allocate pbuf\n"));
+    return ERR_BUF;
+  }
+  LWIP_ASSERT("check that first pbuf can hold struct tcp_hdr",
+              (p->len >= TCP_HLEN + optlen));
+  tcphdr = (struct tcp_hdr *)p->payload;
+  tcphdr->src = htons(tw->local_port);
+  tcphdr->dest = htons(tw->remote_port);
+  tcphdr->seqno = htonl(tw->snd_nxt);
+  tcphdr->ackno = htonl(tw->rcv_nxt);
+  TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4), TCP_ACK);
+  tcphdr->wnd = htons(tw->rcv_ann_wnd);
+  tcphdr->chksum = 0;
+  tcphdr->urgp = 0;
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, 
+              ("tcp_tw_ack: sending ACK for %"U32_F"\n", tw->rcv_nxt));
+
+#if LWIP_TCP_TIMESTAMPS
+  if (tw->flags & TF_TIMESTAMP) {
+    u32_t *opts = (u32_t *)(tcphdr + 1);
+    /* Same layout as tcp_build_timestamp_option() */
+    opts[0] = PP_HTONL(0x0101080A);
+    opts[1] = htonl(sys_now());
+    opts[2] = htonl(tw->ts_recent);
+  }
+#endif
+
+#if CHECKSUM_GEN_TCP
+  tcphdr->chksum = inet_chksum_pseudo(p, &(tw->local_ip), &(tw->remote_ip),
+        IP_PROTO_TCP, p->tot_len);
+#endif
+  ip_output(p, &(tw->local_ip), &(tw->remote_ip), tw->ttl, tw->tos,
+      IP_PROTO_TCP);
+  pbuf_free(p);
+
+  return ERR_OK;
+}
+
+/**
+ * Send the SYN|ACK for a half-open connection in the SYN cache (see
+ * tcp_listen_input()), with the MSS option and, if the peer sent one, the
+ * timestamp option.
+ *
+ * @param syn the SYN cache entry to send the SYN|ACK for
+ */
+err_t
+tcp_syn_ack(struct tcp_syn *syn)
+{
+  struct pbuf *p;
+  struct tcp_hdr *tcphdr;
+  u32_t *opts;
+  u8_t optflags = TF_SEG_OPTS_MSS;
+  u8_t optlen;
+
+#if LWIP_TCP_TIMESTAMPS
+  if (syn->flags & TF_TIMESTAMP) {
+    optflags |= TF_SEG_OPTS_TS;
+  }
+#endif
+  optlen = LWIP_TCP_OPT_LENGTH(optflags);
+
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN + optlen, PBUF_RAM);
+  if (p == NULL) {
+    LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_syn_ack: could not allocate pbuf\n"));
+    return ERR_BUF;
+  }
+  LWIP_ASSERT("check that first pbuf can hold struct tcp_hdr",
+              (p->len >= TCP_HLEN + optlen));
+  tcphdr = (struct tcp_hdr *)p->payload;
+  tcphdr->src = htons(syn->local_port);
+  tcphdr->dest = htons(syn->remote_port);
+  tcphdr->seqno = htonl(syn->iss);
+  tcphdr->ackno = htonl(syn->irs + 1);
+  TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4), TCP_SYN | TCP_ACK);
+  tcphdr->wnd = PP_HTONS(TCP_WND);
+  tcphdr->chksum = 0;
+  tcphdr->urgp = 0;
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG,
+              ("tcp_syn_ack: sending SYN|ACK for %"U32_F", nrtx %"U16_F"\n",
+               syn->irs + 1, (u16_t)syn->nrtx));
+
+  opts = (u32_t *)(void *)(tcphdr + 1);
+  TCP_BUILD_MSS_OPTION(*opts);
+#if LWIP_TCP_TIMESTAMPS
+  if (syn->flags & TF_TIMESTAMP) {
+    /* Same layout as tcp_build_timestamp_option() */
+    opts[1] = PP_HTONL(0x0101080A);
+    opts[2] = htonl(sys_now());
+    opts[3] = htonl(syn->ts_recent);
+  }
+#endif
+
+#if CHECKSUM_GEN_TCP
+  tcphdr->chksum = inet_chksum_pseudo(p, &(syn->local_ip), &(syn->remote_ip),
+        IP_PROTO_TCP, p->tot_len);
+#endif
+  snmp_inc_tcpoutsegs();
+  ip_output(p, &(syn->local_ip), &(syn->remote_ip), TCP_TTL, 0, IP_PROTO_TCP);
+  pbuf_free(p);
+
+  return ERR_OK;
+}
+
 /**
  * Find out what we can send and send it
  *
@@ -1033,6 +1157,12 @@ tcp_output(struct tcp_pcb *pcb)
     pcb->persist_backoff = 1;
   }
 
+  if (seg != NULL) {
+    /* data left on the unsent queue (or persist timer started):
+       make sure the slow timer keeps looking at this pcb */
+    tcp_tmr_kick(pcb);
+  }
+
   pcb->flags &= ~TF_NAGLEMEMERR;
   return ERR_OK;
 }
@@ -1083,6 +1213,7 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
      This must be set before checking the route. */
   if (pcb->rtime == -1) {
     pcb->rtime = 0;
+    tcp_tmr_kick(pcb);
   }
 
   /* If we don't have a local IP address, we get one by
@@ -41,3 +41,10 @@ sys_arch_unprotect(sys_prot_t lev);
 void
 sys_shutdown(void);
 
+/* Nonzero if called from the thread created by sys_thread_new */
+int
+sys_arch_is_lwip_thread(void);
+
+u32_t
+sys_rand(void);
+
@@ -83,9 +83,15 @@ extern const u16_t memp_sizes[MEMP_MAX];
 
 #include "mem.h"
 
+#if MEMP_PORT_MALLOC
+void  memp_init(void);
+void *memp_malloc(memp_t type);
+void  memp_free(memp_t type, void *mem);
+#else /* MEMP_PORT_MALLOC */
 #define memp_init()
 #define memp_malloc(type)     mem_malloc(memp_sizes[type])
 #define memp_free(type, mem)  mem_free(mem)
+#endif /* MEMP_PORT_MALLOC */
 
 #else /* MEMP_MEM_MALLOC */
 
@@ -42,6 +42,8 @@ LWIP_MEMPOOL(UDP_PCB,        MEMP_NUM_UDP_PCB,         sizeof(struct udp_pcb),
 LWIP_MEMPOOL(TCP_PCB,        MEMP_NUM_TCP_PCB,         sizeof(struct tcp_pcb),        "TCP_PCB")
 LWIP_MEMPOOL(TCP_PCB_LISTEN, MEMP_NUM_TCP_PCB_LISTEN,  sizeof(struct tcp_pcb_listen), "TCP_PCB_LISTEN")
 LWIP_MEMPOOL(TCP_SEG,        MEMP_NUM_TCP_SEG,         sizeof(struct tcp_seg),        "TCP_SEG")
+LWIP_MEMPOOL(TCP_TW,         MEMP_NUM_TCP_TW,          sizeof(struct tcp_tw),         "TCP_TW")
+LWIP_MEMPOOL(TCP_SYN,        MEMP_NUM_TCP_SYN,         sizeof(struct tcp_syn),        "TCP_SYN")
 #endif /* LWIP_TCP */
 
 #if IP_REASSEMBLY
@@ -115,6 +115,14 @@
 #define MEMP_MEM_MALLOC                 0
 #endif
 
+/**
+ * MEMP_PORT_MALLOC==1: With MEMP_MEM_MALLOC, the port implements memp_init,
+ * memp_malloc and memp_free itself, e.g. with a cache per pool type.
+ */
+#ifndef MEMP_PORT_MALLOC
+#define MEMP_PORT_MALLOC                0
+#endif
+
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> #define MEM_ALIGNMENT 4
@@ -267,6 +275,25 @@
 #define MEMP_NUM_TCP_SEG                16
 #endif
 
+/**
+ * MEMP_NUM_TCP_TW: the number of closed TCP connections that can be kept
+ * in TIME-WAIT as a compact struct tcp_tw. When this pool is exhausted,
+ * connections stay in TIME-WAIT as a full tcp_pcb.
+ * (requires the LWIP_TCP option)
+ */
+#ifndef MEMP_NUM_TCP_TW
+#define MEMP_NUM_TCP_TW                 MEMP_NUM_TCP_PCB
+#endif
+
+/**
+ * MEMP_NUM_TCP_SYN: the number of half-open connections that can be kept
+ * in the SYN cache of listening pcbs (see TCP_SYN_CACHE_SIZE).
+ * (requires the LWIP_TCP option)
+ */
+#ifndef MEMP_NUM_TCP_SYN
+#define MEMP_NUM_TCP_SYN                TCP_SYN_CACHE_SIZE
+#endif
+
 /**
  * MEMP_NUM_REASSDATA: the number of IP packets simultaneously queued for
  * reassembly (whole packets, not fragments!)
@@ -1027,6 +1054,62 @@
 #define TCP_WND_UPDATE_THRESHOLD   (TCP_WND / 4)
 #endif
 
+/**
+ * TCP_TMR_WHEEL_SIZE: Number of slots in the hashed timing wheel that
+ * tcp_slowtmr() uses to find the pcbs whose timers are due. One slot per
+ * coarse grained timer tick; deadlines further out than one revolution
+ * simply stay in their slot for another lap. Must be a power of two.
+ */
+#ifndef TCP_TMR_WHEEL_SIZE
+#define TCP_TMR_WHEEL_SIZE              256
+#endif
+
+/**
+ * TCP_TW_HASH_SIZE: Number of hash buckets used to find closed connections
+ * in TIME-WAIT, both by 4-tuple (tcp_input()) and by local port (port
+ * reuse checks). Must be a power of two.
+ */
+#ifndef TCP_TW_HASH_SIZE
+#define TCP_TW_HASH_SIZE                256
+#endif
+
+/**
+ * TCP_SYN_CACHE_SIZE: Maximum number of half-open connections (SYN
+ * received, SYN|ACK sent) kept for all listening pcbs together. A tcp_pcb
+ * is only allocated once the handshake completes. Also enforced when
+ * MEMP_MEM_MALLOC is used.
+ */
+#ifndef TCP_SYN_CACHE_SIZE
+#define TCP_SYN_CACHE_SIZE              MEMP_NUM_TCP_PCB
+#endif
+
+/**
+ * TCP_SYN_HASH_SIZE: Number of hash buckets used to find half-open
+ * connections in the SYN cache. Must be a power of two.
+ */
+#ifndef TCP_SYN_HASH_SIZE
+#define TCP_SYN_HASH_SIZE               256
+#endif
+
+/**
+ * TCP_SYN_CACHE_MAXRTX: Number of SYN|ACK retransmissions for a
+ * half-open connection in the SYN cache. The first timeout is 3 seconds
+ * and doubles each time, so the default of 2 drops the entry after 21
+ * seconds.
+ */
+#ifndef TCP_SYN_CACHE_MAXRTX
+#define TCP_SYN_CACHE_MAXRTX            2
+#endif
+
+/**
+ * TCP_SYN_COOKIES==1: When the SYN cache is full, answer SYNs with a
+ * SYN|ACK carrying a SYN cookie (RFC 4987) instead of dropping them.
+ * Connections set up from a cookie do not use the timestamp option.
+ */
+#ifndef TCP_SYN_COOKIES
+#define TCP_SYN_COOKIES                 1
+#endif
+
 /**
  * LWIP_EVENT_API and LWIP_CALLBACK_API: Only one of these should be set to 1.
  *     LWIP_EVENT_API==1: The user defines lwip_tcp_event() to receive all
@@ -196,6 +196,18 @@ struct tcp_pcb {
   /* Timers */
   u32_t tmr;
   u8_t polltmr, pollinterval;
+
+  /* Timing wheel linkage: tcp_slowtmr() looks at this pcb again at tcp_ticks == tmr_due */
+  struct tcp_pcb *tmr_next;
+  struct tcp_pcb **tmr_pprev;
+  u32_t tmr_due;
+  /* Fast timer linkage: pcb has a delayed ACK or refused data pending */
+  struct tcp_pcb *fast_next;
+  struct tcp_pcb **fast_pprev;
+
+  /* Set by tcp_close(): the application no longer references this pcb,
+     so once it reaches TIME-WAIT it can be replaced by a struct tcp_tw */
+  u8_t detached;
   
   /* Retransmission timer. */
   s16_t rtime;
@@ -286,8 +298,8 @@ struct tcp_pcb_listen {
   TCP_PCB_COMMON(struct tcp_pcb_listen);
 
 #if TCP_LISTEN_BACKLOG
-  u8_t backlog;
-  u8_t accepts_pending;
+  u16_t backlog;
+  u16_t accepts_pending;
 #endif /* TCP_LISTEN_BACKLOG */
 };
 
@@ -342,7 +354,7 @@ err_t            tcp_bind    (struct tcp_pcb *pcb, ip_addr_t *ipaddr,
 err_t            tcp_connect (struct tcp_pcb *pcb, ip_addr_t *ipaddr,
                               u16_t port, tcp_connected_fn connected);
 
-struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog);
+struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb *pcb, u16_t backlog);
 #define          tcp_listen(pcb) tcp_listen_with_backlog(pcb, TCP_DEFAULT_LISTEN_BACKLOG)
 
 void             tcp_abort (struct tcp_pcb *pcb);
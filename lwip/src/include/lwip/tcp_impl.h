@@ -296,6 +296,59 @@ struct tcp_seg {
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
+/* This structure stands in for a connection in TIME-WAIT once the
+   application has closed it (see tcp_tw_enter()). Only what is needed to
+   answer segments of the old connection and to keep its 4-tuple from
+   being reused is kept. */
+struct tcp_tw {
+  struct tcp_tw *next;        /* hash chain on the 4-tuple (demux) */
+  struct tcp_tw **pprev;
+  struct tcp_tw *port_next;   /* hash chain on the local port (port reuse checks) */
+  struct tcp_tw **port_pprev;
+  struct tcp_tw *tmr_next;    /* tcp_tw_buckets, in the order the buckets expire */
+  struct tcp_tw **tmr_pprev;
+  ip_addr_t local_ip;
+  ip_addr_t remote_ip;
+  u16_t local_port;           /* ports are in host byte order */
+  u16_t remote_port;
+  u32_t rcv_nxt;
+  u32_t snd_nxt;
+  u16_t rcv_wnd;
+  u16_t rcv_ann_wnd;
+  u8_t ttl;
+  u8_t tos;
+  u8_t flags;                 /* only TF_TIMESTAMP is kept */
+#if LWIP_TCP_TIMESTAMPS
+  u32_t ts_recent;
+#endif /* LWIP_TCP_TIMESTAMPS */
+  u32_t tmr;                  /* tcp_ticks when TIME-WAIT was (re)started */
+};
+
+/* A half-open connection of a listening pcb: the SYN has been answered
+   with a SYN|ACK, but no tcp_pcb is allocated until the ACK completing the
+   handshake arrives (see tcp_listen_input()). */
+struct tcp_syn {
+  struct tcp_syn *next;       /* hash chain on the 4-tuple */
+  struct tcp_syn **pprev;
+  struct tcp_syn *tmr_next;   /* retransmission queue for nrtx, oldest first */
+  struct tcp_syn **tmr_pprev;
+  struct tcp_pcb_listen *listener;
+  ip_addr_t local_ip;
+  ip_addr_t remote_ip;
+  u16_t local_port;           /* ports are in host byte order */
+  u16_t remote_port;
+  u32_t irs;                  /* sequence number of the peer's SYN */
+  u32_t iss;                  /* sequence number of our SYN|ACK */
+  u16_t snd_wnd;              /* window advertised in the SYN */
+  u16_t mss;                  /* MSS option of the SYN */
+  u8_t flags;                 /* only TF_TIMESTAMP is kept */
+  u8_t nrtx;                  /* SYN|ACK retransmissions so far */
+#if LWIP_TCP_TIMESTAMPS
+  u32_t ts_recent;
+#endif /* LWIP_TCP_TIMESTAMPS */
+  u32_t tmr;                  /* tcp_ticks when the SYN|ACK was last sent */
+};
+
 #define LWIP_TCP_OPT_LENGTH(flags)              \
   (flags & TF_SEG_OPTS_MSS ? 4  : 0) +          \
   (flags & TF_SEG_OPTS_TS  ? 12 : 0)
@@ -321,6 +374,10 @@ extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
               state in which they accept or send
               data. */
 extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+extern struct tcp_tw *tcp_tw_buckets;    /* List of all closed connections in
+              TIME-WAIT, oldest first. */
+extern u16_t tcp_syn_count;              /* Number of half-open connections in
+              the SYN cache. */
 
 extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
@@ -329,9 +386,14 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
    2) A PCB is only in one of the lists.
    3) All PCBs in the tcp_listen_pcbs list is in LISTEN state.
    4) All PCBs in the tcp_tw_pcbs list is in TIME-WAIT state.
+   5) A connection in TIME-WAIT is either a PCB on tcp_tw_pcbs or a
+      struct tcp_tw on tcp_tw_buckets, never both.
 */
 /* Define two macros, TCP_REG and TCP_RMV that registers a TCP PCB
-   with a PCB list or removes a PCB from a list, respectively. */
+   with a PCB list or removes a PCB from a list, respectively.
+   PCBs on the active and TIME-WAIT lists are also put on (and taken
+   off) the timing wheel that drives tcp_slowtmr(). */
+#define TCP_PCB_LIST_TIMED(pcbs) (((pcbs) == &tcp_active_pcbs) || ((pcbs) == &tcp_tw_pcbs))
 #ifndef TCP_DEBUG_PCB_LISTS
 #define TCP_DEBUG_PCB_LISTS 0
 #endif
@@ -349,6 +411,9 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                             *(pcbs) = (npcb); \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
               tcp_timer_needed(); \
+                            if (TCP_PCB_LIST_TIMED(pcbs)) { \
+                              tcp_tmr_kick(npcb); \
+                            } \
                             } while(0)
 #define TCP_RMV(pcbs, npcb) do { \
                             LWIP_ASSERT("TCP_RMV: pcbs != NULL", *(pcbs) != NULL); \
@@ -362,6 +427,9 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
                                } \
                             } \
                             (npcb)->next = NULL; \
+                            if (TCP_PCB_LIST_TIMED(pcbs)) { \
+                              tcp_tmr_disarm(npcb); \
+                            } \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removed %p from %p\n", (npcb), *(pcbs))); \
                             } while(0)
@@ -373,6 +441,9 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
     (npcb)->next = *pcbs;                          \
     *(pcbs) = (npcb);                              \
     tcp_timer_needed();                            \
+    if (TCP_PCB_LIST_TIMED(pcbs)) {                \
+      tcp_tmr_kick(npcb);                          \
+    }                                              \
   } while (0)
 
 #define TCP_RMV(pcbs, npcb)                        \
@@ -391,6 +462,9 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
       }                                            \
     }                                              \
     (npcb)->next = NULL;                           \
+    if (TCP_PCB_LIST_TIMED(pcbs)) {                \
+      tcp_tmr_disarm(npcb);                        \
+    }                                              \
   } while(0)
 
 #endif /* LWIP_DEBUG */
@@ -413,6 +487,7 @@ struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
     }                                              \
     else {                                         \
       (pcb)->flags |= TF_ACK_DELAY;                \
+      tcp_fasttmr_needed(pcb);                     \
     }                                              \
   } while (0)
 
@@ -433,10 +508,41 @@ void tcp_rst(u32_t seqno, u32_t ackno,
 u32_t tcp_next_iss(void);
 
 void tcp_keepalive(struct tcp_pcb *pcb);
+
+/* Timing wheel maintenance (see tcp_slowtmr() and tcp_fasttmr()) */
+void tcp_tmr_kick(struct tcp_pcb *pcb);
+void tcp_tmr_disarm(struct tcp_pcb *pcb);
+void tcp_fasttmr_needed(struct tcp_pcb *pcb);
 void tcp_zero_window_probe(struct tcp_pcb *pcb);
 
+/* TIME-WAIT buckets (see tcp_tw_enter()) */
+void tcp_tw_enter(struct tcp_pcb *pcb);
+struct tcp_tw *tcp_tw_lookup(ip_addr_t *local_ip, u16_t local_port,
+       ip_addr_t *remote_ip, u16_t remote_port);
+u8_t tcp_tw_port_used(ip_addr_t *local_ip, u16_t local_port);
+u8_t tcp_tuple_used(ip_addr_t *local_ip, u16_t local_port,
+       ip_addr_t *remote_ip, u16_t remote_port);
+void tcp_update_path_mtu(ip_addr_t *remote_ip, u16_t mtu);
+struct tcp_pcb *tcp_icmp_lookup(ip_addr_t *local_ip, u16_t local_port,
+       ip_addr_t *remote_ip, u16_t remote_port, u32_t seqno);
+void tcp_tw_restart(struct tcp_tw *tw);
+err_t tcp_tw_ack(struct tcp_tw *tw);
+
+/* SYN cache of the listening pcbs (see tcp_listen_input()) */
+struct tcp_syn *tcp_syn_alloc(void);
+void tcp_syn_insert(struct tcp_syn *syn);
+struct tcp_syn *tcp_syn_lookup(ip_addr_t *local_ip, u16_t local_port,
+       ip_addr_t *remote_ip, u16_t remote_port);
+void tcp_syn_free(struct tcp_syn *syn);
+void tcp_syn_flush(struct tcp_pcb_listen *lpcb);
+err_t tcp_syn_ack(struct tcp_syn *syn);
+
 #if TCP_CALCULATE_EFF_SEND_MSS
 u16_t tcp_eff_send_mss(u16_t sendmss, ip_addr_t *addr);
+#ifdef TCP_PATH_MTU_HOOK
+/* Provided by the port: the path MTU to addr, at most mtu */
+u16_t TCP_PATH_MTU_HOOK(ip_addr_t *addr, u16_t mtu);
+#endif /* TCP_PATH_MTU_HOOK */
 #endif /* TCP_CALCULATE_EFF_SEND_MSS */
 
 #if LWIP_CALLBACK_API
@@ -8,6 +8,9 @@
 #define MEM_LIBC_MALLOC                 1
 #define MEMP_MEM_MALLOC                 1
 
+/* rosmem.c gives every memp type its own object cache */
+#define MEMP_PORT_MALLOC                1
+
 /* Define LWIP_COMPAT_MUTEX if the port has no mutexes and binary semaphores
  should be used instead */
 #define LWIP_COMPAT_MUTEX               1
@@ -74,6 +77,22 @@
 
 #define TCP_LISTEN_BACKLOG              1
 
+#define TCP_SYN_CACHE_SIZE              4096
+
+#define TCP_SYN_HASH_SIZE               1024
+
+#define TCP_SYN_COOKIES                 1
+
+#define LWIP_RAND()                     sys_rand()
+
+/* Must match TCP_STARTING_PORT and TCP_DYNAMIC_PORTS in the driver's tcp.h */
+#define TCP_LOCAL_PORT_RANGE_START      0xC000
+
+#define TCP_LOCAL_PORT_RANGE_END        0xFFFF
+
+/* tcp_eff_send_mss asks the driver's path MTU cache, see TCPGetPathMTU */
+#define TCP_PATH_MTU_HOOK               TCPGetPathMTU
+
 #define LWIP_TCP_TIMESTAMPS             1
 
 #define LWIP_CALLBACK_API               1
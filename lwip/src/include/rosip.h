@@ -36,12 +36,14 @@ struct lwip_callback_msg
         } Bind;
         struct {
             PCONNECTION_ENDPOINT Connection;
-            u8_t Backlog;
+            u16_t Backlog;
         } Listen;
         struct {
             PCONNECTION_ENDPOINT Connection;
-            void *Data;
-            u16_t DataLength;
+            PMDL Mdl;
+            ULONG Offset;
+            ULONG DataLength;
+            ULONGLONG Timestamp;
         } Send;
         struct {
             PCONNECTION_ENDPOINT Connection;
@@ -57,6 +59,22 @@ struct lwip_callback_msg
             PCONNECTION_ENDPOINT Connection;
             int Callback;
         } Close;
+        struct {
+            struct ip_addr *LocalAddress;
+            const u16_t *LocalPorts;
+            u16_t Count;
+            struct ip_addr *RemoteAddress;
+            u16_t RemotePort;
+        } FreeTuple;
+        struct {
+            struct ip_addr LocalAddress;
+            u16_t LocalPort;
+            struct ip_addr RemoteAddress;
+            u16_t RemotePort;
+            u32_t SequenceNumber;
+            u16_t NextHopMTU;
+            u16_t DatagramSize;
+        } PathMTU;
     } Input;
     
     /* Output */
@@ -73,6 +91,8 @@ struct lwip_callback_msg
         struct {
             err_t Error;
             u32_t Information;
+            PMDL Mdl;
+            ULONG Offset;
         } Send;
         struct {
             err_t Error;
@@ -83,6 +103,9 @@ struct lwip_callback_msg
         struct {
             err_t Error;
         } Close;
+        struct {
+            u16_t Index;
+        } FreeTuple;
     } Output;
 };
 
@@ -94,23 +117,36 @@ extern void TCPAcceptEventHandler(void *arg, PTCP_PCB newpcb);
 extern void TCPSendEventHandler(void *arg, const u16_t space);
 extern void TCPFinEventHandler(void *arg, const err_t err);
 extern void TCPRecvEventHandler(void *arg);
+extern u16_t TCPLearnPathMTU(ip_addr_t *addr, u16_t nexthopmtu, u16_t datagramsize);
+
+/* LATENCY_STAMP() of the send being pushed out by tcp_output, tcpip thread only */
+extern ULONGLONG LibTCPOutputTimestamp;
 
 /* TCP functions */
 PTCP_PCB    LibTCPSocket(void *arg);
 err_t       LibTCPBind(PCONNECTION_ENDPOINT Connection, struct ip_addr *const ipaddr, const u16_t port);
-PTCP_PCB    LibTCPListen(PCONNECTION_ENDPOINT Connection, const u8_t backlog);
-err_t       LibTCPSend(PCONNECTION_ENDPOINT Connection, void *const dataptr, const u16_t len, u32_t *sent, const int safe);
+PTCP_PCB    LibTCPListen(PCONNECTION_ENDPOINT Connection, const u16_t backlog);
+err_t       LibTCPSend(PCONNECTION_ENDPOINT Connection, PMDL *Mdl, ULONG *Offset, const ULONG len, u32_t *sent, const int safe);
+err_t       LibTCPPushSend(PCONNECTION_ENDPOINT Connection);
 err_t       LibTCPConnect(PCONNECTION_ENDPOINT Connection, struct ip_addr *const ipaddr, const u16_t port);
 err_t       LibTCPShutdown(PCONNECTION_ENDPOINT Connection, const int shut_rx, const int shut_tx);
 err_t       LibTCPClose(PCONNECTION_ENDPOINT Connection, const int safe, const int callback);
+u16_t       LibTCPFindFreeTuple(struct ip_addr *const local, const u16_t *localports, const u16_t count, struct ip_addr *const remote, const u16_t remoteport);
+void        LibTCPFragmentationNeeded(struct ip_addr *const local, const u16_t localport, struct ip_addr *const remote, const u16_t remoteport,
+                                      const u32_t seqno, const u16_t nexthopmtu, const u16_t datagramsize);
 
 err_t       LibTCPGetPeerName(PTCP_PCB pcb, struct ip_addr *const ipaddr, u16_t *const port);
 err_t       LibTCPGetHostName(PTCP_PCB pcb, struct ip_addr *const ipaddr, u16_t *const port);
 void        LibTCPAccept(PTCP_PCB pcb, struct tcp_pcb *listen_pcb, void *arg);
 
 /* IP functions */
-void LibIPInsertPacket(void *ifarg, const void *const data, const u32_t size);
+void LibIPInsertPacket(void *ifarg, const void *const data, const u32_t size, ULONGLONG Timestamp);
+err_t LibIPLoopPacket(void *ifarg, struct pbuf *q, ULONGLONG Timestamp);
+ULONGLONG LibIPPacketTimestamp(struct pbuf *p);
 void LibIPInitialize(void);
 void LibIPShutdown(void);
 
+/* Memory functions */
+void LibMemShutdown(void);
+
 #endif
\ No newline at end of file
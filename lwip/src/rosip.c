@@ -7,10 +7,47 @@
 
 typedef struct netif* PNETIF;
 
+/* Received packets carry their latency stamp in front of the payload,
+   hidden from lwIP by pbuf_header */
+typedef struct _LIBIP_STAMP
+{
+    ULONG Magic;
+    ULONG Reserved;
+    ULONGLONG Timestamp;
+} LIBIP_STAMP, *PLIBIP_STAMP;
+
+#define LIBIP_STAMP_MAGIC 'pmtS'
+#define LIBIP_STAMP_SIZE  LWIP_MEM_ALIGN_SIZE(sizeof(LIBIP_STAMP))
+
+static
+struct pbuf *
+LibIPAllocatePacket(const u32_t size, ULONGLONG Timestamp)
+{
+    struct pbuf *p;
+    PLIBIP_STAMP Stamp;
+
+    p = pbuf_alloc(PBUF_RAW, size + LIBIP_STAMP_SIZE, PBUF_RAM);
+    if (p)
+    {
+        ASSERT(p->tot_len == p->len);
+        ASSERT(p->len == size + LIBIP_STAMP_SIZE);
+
+        Stamp = p->payload;
+        Stamp->Magic = LIBIP_STAMP_MAGIC;
+        Stamp->Reserved = 0;
+        Stamp->Timestamp = Timestamp;
+
+        pbuf_header(p, -(s16_t)LIBIP_STAMP_SIZE);
+    }
+
+    return p;
+}
+
 void
 LibIPInsertPacket(void *ifarg,
                   const void *const data,
-                  const u32_t size)
+                  const u32_t size,
+                  ULONGLONG Timestamp)
 {
     struct pbuf *p;
 
@@ -18,18 +55,58 @@ LibIPInsertPacket(void *ifarg,
     ASSERT(data);
     ASSERT(size > 0);
 
-    p = pbuf_alloc(PBUF_RAW, size, PBUF_RAM);
+    p = LibIPAllocatePacket(size, Timestamp);
     if (p)
     {
-        ASSERT(p->tot_len == p->len);
-        ASSERT(p->len == size);
-
         RtlCopyMemory(p->payload, data, p->len);
 
         ((PNETIF)ifarg)->input(p, (PNETIF)ifarg);
     }
 }
 
+err_t
+LibIPLoopPacket(void *ifarg,
+                struct pbuf *q,
+                ULONGLONG Timestamp)
+{
+    struct pbuf *p;
+    err_t Error;
+
+    ASSERT(ifarg);
+    ASSERT(q);
+
+    /* The sender keeps q for retransmission, so the peer gets a copy. This
+       is called from tcp_output, input only queues it to the tcpip thread
+       so tcp_input is not reentered */
+    p = LibIPAllocatePacket(q->tot_len, Timestamp);
+    if (!p)
+        return ERR_MEM;
+
+    pbuf_copy_partial(q, p->payload, q->tot_len, 0);
+
+    Error = ((PNETIF)ifarg)->input(p, (PNETIF)ifarg);
+    if (Error != ERR_OK)
+        pbuf_free(p);
+
+    return Error;
+}
+
+ULONGLONG
+LibIPPacketTimestamp(struct pbuf *p)
+{
+    PLIBIP_STAMP Stamp;
+
+    /* Only pbufs built by LibIPInsertPacket have a stamp */
+    if (p->type != PBUF_RAM)
+        return 0;
+
+    Stamp = (PLIBIP_STAMP)LWIP_MEM_ALIGN((u8_t *)p + SIZEOF_STRUCT_PBUF);
+    if ((u8_t *)p->payload < (u8_t *)(Stamp + 1) || Stamp->Magic != LIBIP_STAMP_MAGIC)
+        return 0;
+
+    return Stamp->Timestamp;
+}
+
 void
 LibIPInitialize(void)
 {
@@ -42,4 +119,7 @@ LibIPShutdown(void)
 {
     /* This is synchronous */
     sys_shutdown();
+
+    /* Nothing runs on the tcpip thread any more */
+    LibMemShutdown();
 }
\ No newline at end of file
@@ -2,38 +2,176 @@
 
 #include "lwip/def.h"
 #include "lwip/mem.h"
+#include "lwip/memp.h"
 
-#ifndef LWIP_TAG
-    #define LWIP_TAG 'PIwl'
-#endif
+#include "rosip.h"
+
+#include <slab.h>
+
+/* Every memp type and every small malloc size class has its own object
+ * cache, so segments, pbufs and messages come from per-processor magazines
+ * instead of the pool. Only mallocs larger than the biggest class still go
+ * to the pool. */
+
+/* malloc blocks start with their size class */
+typedef struct _MEM_HEADER
+{
+    ULONG Class;            /* Index into MemCaches, MEM_CLASSES if from the pool */
+    ULONG Size;             /* Usable bytes */
+} MEM_HEADER, *PMEM_HEADER;
+
+/* Usable bytes of each class. 2048 holds a full Ethernet frame in a PBUF_RAM */
+static const ULONG MemClassSizes[] = { 64, 128, 256, 512, 1024, 2048 };
+static const char *const MemClassNames[] = { "MEM_64", "MEM_128", "MEM_256",
+                                             "MEM_512", "MEM_1024", "MEM_2048" };
+
+#define MEM_CLASSES (sizeof(MemClassSizes) / sizeof(MemClassSizes[0]))
+
+static PSLAB_CACHE MemCaches[MEM_CLASSES];
+
+static const char *const MempNames[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc)  (desc),
+#include "lwip/memp_std.h"
+};
+
+static PSLAB_CACHE MempCaches[MEMP_MAX];
+
+void
+memp_init(void)
+{
+    ULONG i;
+
+    for (i = 0; i < MEMP_MAX; i++)
+        MempCaches[i] = SlabCreateCache(MempNames[i], memp_sizes[i], LWIP_TAG);
+
+    /* MEM_LIBC_MALLOC leaves mem_init empty, so the malloc classes start here too */
+    for (i = 0; i < MEM_CLASSES; i++)
+        MemCaches[i] = SlabCreateCache(MemClassNames[i], sizeof(MEM_HEADER) + MemClassSizes[i], LWIP_TAG);
+}
+
+void
+LibMemShutdown(void)
+{
+    ULONG i;
+
+    for (i = 0; i < MEMP_MAX; i++)
+    {
+        if (MempCaches[i])
+        {
+            SlabDestroyCache(MempCaches[i]);
+            MempCaches[i] = NULL;
+        }
+    }
+
+    for (i = 0; i < MEM_CLASSES; i++)
+    {
+        if (MemCaches[i])
+        {
+            SlabDestroyCache(MemCaches[i]);
+            MemCaches[i] = NULL;
+        }
+    }
+}
+
+void *
+memp_malloc(memp_t type)
+{
+    /* A cache that could not be created falls back to malloc */
+    if (!MempCaches[type])
+        return mem_malloc(memp_sizes[type]);
+
+    return SlabAllocate(MempCaches[type]);
+}
+
+void
+memp_free(memp_t type, void *mem)
+{
+    if (!MempCaches[type])
+        mem_free(mem);
+    else
+        SlabFree(MempCaches[type], mem);
+}
 
 void *
 malloc(mem_size_t size)
 {
-    return ExAllocatePoolWithTag(NonPagedPool, size, LWIP_TAG);
+    PMEM_HEADER Header = NULL;
+    ULONG Class;
+
+    for (Class = 0; Class < MEM_CLASSES; Class++)
+    {
+        if (size <= MemClassSizes[Class])
+            break;
+    }
+
+    if (Class < MEM_CLASSES && MemCaches[Class])
+    {
+        Header = SlabAllocate(MemCaches[Class]);
+        size = MemClassSizes[Class];
+    }
+    else
+    {
+        Class = MEM_CLASSES;
+        Header = ExAllocatePoolWithTag(NonPagedPool, sizeof(MEM_HEADER) + size, LWIP_TAG);
+    }
+
+    if (!Header)
+        return NULL;
+
+    Header->Class = Class;
+    Header->Size = (ULONG)size;
+
+    return Header + 1;
 }
 
 void *
 calloc(mem_size_t count, mem_size_t size)
 {
     void *mem = malloc(count * size);
-    
+
     if (!mem) return NULL;
-    
+
     RtlZeroMemory(mem, count * size);
-    
+
     return mem;
 }
 
 void
 free(void *mem)
 {
-    ExFreePoolWithTag(mem, LWIP_TAG);
+    PMEM_HEADER Header;
+
+    if (!mem)
+        return;
+
+    Header = (PMEM_HEADER)mem - 1;
+
+    if (Header->Class == MEM_CLASSES)
+        ExFreePoolWithTag(Header, LWIP_TAG);
+    else
+        SlabFree(MemCaches[Header->Class], Header);
 }
 
 void *
 realloc(void *mem, size_t size)
 {
-    free(mem);
-    return malloc(size);
-}
\ No newline at end of file
+    PMEM_HEADER Header;
+    void *new_mem;
+
+    if (!mem)
+        return malloc(size);
+
+    /* mem_trim only ever shrinks, which fits in place */
+    Header = (PMEM_HEADER)mem - 1;
+    if (size <= Header->Size)
+        return mem;
+
+    new_mem = malloc(size);
+    if (new_mem)
+    {
+        RtlCopyMemory(new_mem, mem, Header->Size);
+        free(mem);
+    }
+
+    return new_mem;
+}
@@ -1,5 +1,6 @@
 #include "lwip/sys.h"
 #include "lwip/tcpip.h"
+#include "lwip/tcp_impl.h"
 
 #include "rosip.h"
 
@@ -31,6 +32,8 @@ extern KEVENT TerminationEvent;
 extern NPAGED_LOOKASIDE_LIST MessageLookasideList;
 extern NPAGED_LOOKASIDE_LIST QueueEntryLookasideList;
 
+ULONGLONG LibTCPOutputTimestamp = 0;
+
 /* Required for ERR_T to NTSTATUS translation in receive error handling */
 NTSTATUS TCPTranslateError(const err_t err);
 
@@ -215,11 +218,16 @@ InternalRecvEventHandler(void *arg, PTCP_PCB pcb, struct pbuf *p, const err_t er
 
     if (p)
     {
+        Connection->ReceiveTimestamp = LibIPPacketTimestamp(p);
+        LATENCY_RECORD(TCP_LATENCY_RX_LWIP, Connection->ReceiveTimestamp);
+
         LibTCPEnqueuePacket(Connection, p);
 
         tcp_recved(pcb, p->tot_len);
 
         TCPRecvEventHandler(arg);
+
+        Connection->ReceiveTimestamp = 0;
     }
     else if (err == ERR_OK)
     {
@@ -434,7 +442,7 @@ done:
 }
 
 PTCP_PCB
-LibTCPListen(PCONNECTION_ENDPOINT Connection, const u8_t backlog)
+LibTCPListen(PCONNECTION_ENDPOINT Connection, const u16_t backlog)
 {
     struct lwip_callback_msg *msg;
     PTCP_PCB ret;
@@ -467,11 +475,18 @@ LibTCPSendCallback(void *arg)
 {
     struct lwip_callback_msg *msg = arg;
     PTCP_PCB pcb = msg->Input.Send.Connection->SocketContext;
-    ULONG SendLength;
+    PMDL Mdl = msg->Input.Send.Mdl;
+    ULONG Offset = msg->Input.Send.Offset;
+    ULONG Remaining = msg->Input.Send.DataLength;
+    ULONG MdlLength, SendLength;
+    PUCHAR Data;
     UCHAR SendFlags;
+    err_t Error = ERR_OK;
 
     ASSERT(msg);
 
+    msg->Output.Send.Information = 0;
+
     if (!msg->Input.Send.Connection->SocketContext)
     {
         msg->Output.Send.Error = ERR_CLSD;
@@ -484,45 +499,76 @@ LibTCPSendCallback(void *arg)
         goto done;
     }
 
-    SendFlags = TCP_WRITE_FLAG_COPY;
-    SendLength = msg->Input.Send.DataLength;
-    if (tcp_sndbuf(pcb) == 0)
-    {
-        /* No buffer space so return pending */
-        msg->Output.Send.Error = ERR_INPROGRESS;
-        goto done;
-    }
-    else if (tcp_sndbuf(pcb) < SendLength)
+    /* Walk the MDL chain and queue references to the locked pages. lwIP wraps
+     * uncopied data in PBUF_ROM pbufs which hold onto it until it is acknowledged,
+     * so the caller must keep the pages around until then. */
+    while (Remaining != 0 && tcp_sndbuf(pcb) != 0)
     {
-        /* We've got some room so let's send what we can */
-        SendLength = tcp_sndbuf(pcb);
+        if (!Mdl)
+        {
+            /* The chain is shorter than the send length */
+            Error = ERR_ARG;
+            break;
+        }
+
+        MdlLength = MmGetMdlByteCount(Mdl);
+        if (Offset >= MdlLength)
+        {
+            Mdl = Mdl->Next;
+            Offset = 0;
+            continue;
+        }
+
+        Data = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (!Data)
+        {
+            Error = ERR_MEM;
+            break;
+        }
+
+        SendLength = MIN(MdlLength - Offset, Remaining);
+        SendLength = MIN(SendLength, tcp_sndbuf(pcb));
+        SendLength = MIN(SendLength, 0xFFFF);
+
+        /* Only push once the last byte of the request is queued */
+        SendFlags = (SendLength < Remaining) ? TCP_WRITE_FLAG_MORE : 0;
+
+        Error = tcp_write(pcb, Data + Offset, (u16_t)SendLength, SendFlags);
+        if (Error != ERR_OK)
+            break;
 
-        /* Don't set the push flag */
-        SendFlags |= TCP_WRITE_FLAG_MORE;
+        msg->Output.Send.Information += SendLength;
+        Remaining -= SendLength;
+        Offset += SendLength;
     }
 
-    msg->Output.Send.Error = tcp_write(pcb,
-                                       msg->Input.Send.Data,
-                                       SendLength,
-                                       SendFlags);
-    if (msg->Output.Send.Error == ERR_OK)
+    msg->Output.Send.Mdl = Mdl;
+    msg->Output.Send.Offset = Offset;
+
+    if (msg->Output.Send.Information != 0)
     {
         /* Queued successfully so try to send it */
-        tcp_output((PTCP_PCB)msg->Input.Send.Connection->SocketContext);
-        msg->Output.Send.Information = SendLength;
+        LibTCPOutputTimestamp = msg->Input.Send.Timestamp;
+        tcp_output(pcb);
+        LibTCPOutputTimestamp = 0;
+        msg->Output.Send.Error = ERR_OK;
     }
-    else if (msg->Output.Send.Error == ERR_MEM)
+    else if (Error == ERR_OK || Error == ERR_MEM)
     {
-        /* The queue is too long */
+        /* No buffer space or the queue is too long so return pending */
         msg->Output.Send.Error = ERR_INPROGRESS;
     }
+    else
+    {
+        msg->Output.Send.Error = Error;
+    }
 
 done:
     KeSetEvent(&msg->Event, IO_NO_INCREMENT, FALSE);
 }
 
 err_t
-LibTCPSend(PCONNECTION_ENDPOINT Connection, void *const dataptr, const u16_t len, u32_t *sent, const int safe)
+LibTCPSend(PCONNECTION_ENDPOINT Connection, PMDL *Mdl, ULONG *Offset, const ULONG len, u32_t *sent, const int safe)
 {
     err_t ret;
     struct lwip_callback_msg *msg;
@@ -532,8 +578,10 @@ LibTCPSend(PCONNECTION_ENDPOINT Connection, void *const dataptr, const u16_t len
     {
         KeInitializeEvent(&msg->Event, NotificationEvent, FALSE);
         msg->Input.Send.Connection = Connection;
-        msg->Input.Send.Data = dataptr;
+        msg->Input.Send.Mdl = *Mdl;
+        msg->Input.Send.Offset = *Offset;
         msg->Input.Send.DataLength = len;
+        msg->Input.Send.Timestamp = LATENCY_STAMP();
 
         if (safe)
             LibTCPSendCallback(msg);
@@ -546,7 +594,11 @@ LibTCPSend(PCONNECTION_ENDPOINT Connection, void *const dataptr, const u16_t len
             ret = ERR_CLSD;
 
         if (ret == ERR_OK)
+        {
             *sent = msg->Output.Send.Information;
+            *Mdl = msg->Output.Send.Mdl;
+            *Offset = msg->Output.Send.Offset;
+        }
         else
             *sent = 0;
 
@@ -558,6 +610,56 @@ LibTCPSend(PCONNECTION_ENDPOINT Connection, void *const dataptr, const u16_t len
     return ERR_MEM;
 }
 
+static
+void
+LibTCPPushSendCallback(void *arg)
+{
+    struct lwip_callback_msg *msg = arg;
+
+    ASSERT(msg);
+
+    if (!msg->Input.Send.Connection->SocketContext)
+    {
+        msg->Output.Send.Error = ERR_CLSD;
+        goto done;
+    }
+
+    /* Hand the queued send requests to lwIP from the tcpip thread */
+    TCPSendEventHandler(msg->Input.Send.Connection, 0);
+
+    msg->Output.Send.Error = ERR_OK;
+
+done:
+    KeSetEvent(&msg->Event, IO_NO_INCREMENT, FALSE);
+}
+
+err_t
+LibTCPPushSend(PCONNECTION_ENDPOINT Connection)
+{
+    err_t ret;
+    struct lwip_callback_msg *msg;
+
+    msg = ExAllocateFromNPagedLookasideList(&MessageLookasideList);
+    if (msg)
+    {
+        KeInitializeEvent(&msg->Event, NotificationEvent, FALSE);
+        msg->Input.Send.Connection = Connection;
+
+        tcpip_callback_with_block(LibTCPPushSendCallback, msg, 1);
+
+        if (WaitForEventSafely(&msg->Event))
+            ret = msg->Output.Send.Error;
+        else
+            ret = ERR_CLSD;
+
+        ExFreeToNPagedLookasideList(&MessageLookasideList, msg);
+
+        return ret;
+    }
+
+    return ERR_MEM;
+}
+
 static
 void
 LibTCPConnectCallback(void *arg)
@@ -617,6 +719,115 @@ LibTCPConnect(PCONNECTION_ENDPOINT Connection, struct ip_addr *const ipaddr, con
     return ERR_MEM;
 }
 
+static
+void
+LibTCPFindFreeTupleCallback(void *arg)
+{
+    struct lwip_callback_msg *msg = arg;
+    u16_t i;
+
+    ASSERT(arg);
+
+    for (i = 0; i < msg->Input.FreeTuple.Count; i++)
+    {
+        if (!tcp_tuple_used(msg->Input.FreeTuple.LocalAddress,
+                            ntohs(msg->Input.FreeTuple.LocalPorts[i]),
+                            msg->Input.FreeTuple.RemoteAddress,
+                            ntohs(msg->Input.FreeTuple.RemotePort)))
+            break;
+    }
+
+    msg->Output.FreeTuple.Index = i;
+
+    KeSetEvent(&msg->Event, IO_NO_INCREMENT, FALSE);
+}
+
+/* Finds the first of several local ports whose 4-tuple is not used by an
+ * active connection or one in TIME-WAIT (ports in network byte order).
+ * All ports are checked in one trip to the tcpip thread. Returns the index
+ * of the port, count if every one is in use */
+u16_t
+LibTCPFindFreeTuple(struct ip_addr *const local, const u16_t *localports, const u16_t count, struct ip_addr *const remote, const u16_t remoteport)
+{
+    struct lwip_callback_msg *msg;
+    u16_t ret;
+
+    msg = ExAllocateFromNPagedLookasideList(&MessageLookasideList);
+    if (msg)
+    {
+        KeInitializeEvent(&msg->Event, NotificationEvent, FALSE);
+        msg->Input.FreeTuple.LocalAddress = local;
+        msg->Input.FreeTuple.LocalPorts = localports;
+        msg->Input.FreeTuple.Count = count;
+        msg->Input.FreeTuple.RemoteAddress = remote;
+        msg->Input.FreeTuple.RemotePort = remoteport;
+
+        tcpip_callback_with_block(LibTCPFindFreeTupleCallback, msg, 1);
+
+        if (WaitForEventSafely(&msg->Event))
+            ret = msg->Output.FreeTuple.Index;
+        else
+            ret = count;
+
+        ExFreeToNPagedLookasideList(&MessageLookasideList, msg);
+
+        return ret;
+    }
+
+    return count;
+}
+
+static
+void
+LibTCPFragmentationNeededCallback(void *arg)
+{
+    struct lwip_callback_msg *msg = arg;
+    u16_t mtu;
+
+    ASSERT(arg);
+
+    if (tcp_icmp_lookup(&msg->Input.PathMTU.LocalAddress,
+                        ntohs(msg->Input.PathMTU.LocalPort),
+                        &msg->Input.PathMTU.RemoteAddress,
+                        ntohs(msg->Input.PathMTU.RemotePort),
+                        ntohl(msg->Input.PathMTU.SequenceNumber)))
+    {
+        mtu = TCPLearnPathMTU(&msg->Input.PathMTU.RemoteAddress,
+                              msg->Input.PathMTU.NextHopMTU,
+                              msg->Input.PathMTU.DatagramSize);
+        if (mtu)
+            tcp_update_path_mtu(&msg->Input.PathMTU.RemoteAddress, mtu);
+    }
+
+    ExFreeToNPagedLookasideList(&MessageLookasideList, msg);
+}
+
+/* Handles a "fragmentation needed" message quoting one of our segments
+ * (ports and sequence number in network byte order). The path MTU is only
+ * lowered if the segment belongs to a connection. Called from ICMP receive,
+ * so it does not wait for the tcpip thread */
+void
+LibTCPFragmentationNeeded(struct ip_addr *const local, const u16_t localport, struct ip_addr *const remote, const u16_t remoteport,
+                          const u32_t seqno, const u16_t nexthopmtu, const u16_t datagramsize)
+{
+    struct lwip_callback_msg *msg;
+
+    msg = ExAllocateFromNPagedLookasideList(&MessageLookasideList);
+    if (msg)
+    {
+        msg->Input.PathMTU.LocalAddress = *local;
+        msg->Input.PathMTU.LocalPort = localport;
+        msg->Input.PathMTU.RemoteAddress = *remote;
+        msg->Input.PathMTU.RemotePort = remoteport;
+        msg->Input.PathMTU.SequenceNumber = seqno;
+        msg->Input.PathMTU.NextHopMTU = nexthopmtu;
+        msg->Input.PathMTU.DatagramSize = datagramsize;
+
+        if (tcpip_callback_with_block(LibTCPFragmentationNeededCallback, msg, 0) != ERR_OK)
+            ExFreeToNPagedLookasideList(&MessageLookasideList, msg);
+    }
+}
+
 static
 void
 LibTCPShutdownCallback(void *arg)
@@ -687,6 +898,51 @@ LibTCPShutdown(PCONNECTION_ENDPOINT Connection, const int shut_rx, const int shu
     return ERR_MEM;
 }
 
+static
+BOOLEAN
+LibTCPDetachSegments(struct tcp_seg *seg)
+{
+    struct pbuf *prev, *q, *copy;
+
+    for (; seg != NULL; seg = seg->next)
+    {
+        /* The first pbuf always holds the headers */
+        for (prev = seg->p, q = seg->p->next; q != NULL; prev = q, q = q->next)
+        {
+            if (q->type != PBUF_ROM)
+                continue;
+
+            /* Someone else still references the client's pages */
+            if (q->ref != 1)
+                return FALSE;
+
+            copy = pbuf_alloc(PBUF_RAW, q->len, PBUF_RAM);
+            if (!copy)
+                return FALSE;
+
+            MEMCPY(copy->payload, q->payload, q->len);
+            copy->tot_len = q->tot_len;
+            copy->next = q->next;
+            prev->next = copy;
+
+            q->next = NULL;
+            pbuf_free(q);
+            q = copy;
+        }
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+LibTCPDetachSendData(PTCP_PCB pcb)
+{
+    /* Sends are completed when the connection is closed, so copy any
+     * zero-copy data lwIP may still (re)transmit out of the client's pages */
+    return LibTCPDetachSegments(pcb->unsent) && LibTCPDetachSegments(pcb->unacked);
+}
+
 static
 void
 LibTCPCloseCallback(void *arg)
@@ -718,10 +974,11 @@ LibTCPCloseCallback(void *arg)
            break;
 
         default:
-           if (msg->Input.Close.Connection->SendShutdown &&
-               msg->Input.Close.Connection->ReceiveShutdown)
+           if ((msg->Input.Close.Connection->SendShutdown &&
+                msg->Input.Close.Connection->ReceiveShutdown) ||
+               !LibTCPDetachSendData(pcb))
            {
-               /* Abort the connection */
+               /* Abort the connection (or drop data we couldn't take off the client's pages) */
                tcp_abort(pcb);
 
                /* Aborts always succeed */
@@ -729,8 +986,13 @@ LibTCPCloseCallback(void *arg)
            }
            else
            {
+               /* The sends are completed by our caller so stop acknowledgement callbacks */
+               tcp_sent(pcb, NULL);
+
                /* Start the graceful close process (or send RST for pending data) */
                msg->Output.Close.Error = tcp_close(pcb);
+               if (msg->Output.Close.Error)
+                   tcp_sent(pcb, InternalSendEventHandler);
            }
            break;
     }
@@ -11,15 +11,20 @@
 static LIST_ENTRY ThreadListHead;
 static KSPIN_LOCK ThreadListLock;
 
+/* The tcpip thread, the only one lwIP creates in this configuration */
+static PKTHREAD LwipThread;
+
 KEVENT TerminationEvent;
 NPAGED_LOOKASIDE_LIST MessageLookasideList;
 NPAGED_LOOKASIDE_LIST QueueEntryLookasideList;
 
 static LARGE_INTEGER StartTime;
+static ULONG RandomSeed;
 
 typedef struct _thread_t
 {
     HANDLE Handle;
+    PKTHREAD Thread;
     void (* ThreadFunction)(void *arg);
     void *ThreadContext;
     LIST_ENTRY ListEntry;
@@ -34,6 +39,13 @@ u32_t sys_now(void)
     return (CurrentTime.QuadPart - StartTime.QuadPart) / 10000;
 }
 
+u32_t sys_rand(void)
+{
+    /* RtlRandomEx only returns 31 random bits per call. Concurrent callers
+     * may race on the seed, which at worst repeats a value. */
+    return (RtlRandomEx(&RandomSeed) << 16) ^ RtlRandomEx(&RandomSeed);
+}
+
 void
 sys_arch_protect(sys_prot_t *lev)
 {
@@ -263,10 +275,16 @@ LwipThreadMain(PVOID Context)
     thread_t Container = (thread_t)Context;
     KIRQL OldIrql;
     
+    Container->Thread = KeGetCurrentThread();
     ExInterlockedInsertHeadList(&ThreadListHead, &Container->ListEntry, &ThreadListLock);
+
+    ASSERT(!LwipThread);
+    LwipThread = Container->Thread;
     
     Container->ThreadFunction(Container->ThreadContext);
     
+    LwipThread = NULL;
+
     KeAcquireSpinLock(&ThreadListLock, &OldIrql);
     RemoveEntryList(&Container->ListEntry);
     KeReleaseSpinLock(&ThreadListLock, OldIrql);
@@ -276,6 +294,13 @@ LwipThreadMain(PVOID Context)
     PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
+int
+sys_arch_is_lwip_thread(void)
+{
+    /* Called for every TCP request completion, so no lock and no list walk */
+    return LwipThread == KeGetCurrentThread();
+}
+
 sys_thread_t
 sys_thread_new(const char *name, lwip_thread_fn thread, void *arg, int stacksize, int prio)
 {
@@ -314,6 +339,8 @@ sys_init(void)
     
     KeQuerySystemTime(&StartTime);
     
+    RandomSeed = StartTime.LowPart ^ KeQueryPerformanceCounter(NULL).LowPart;
+    
     KeInitializeEvent(&TerminationEvent, NotificationEvent, FALSE);
     
     ExInitializeNPagedLookasideList(&MessageLookasideList,
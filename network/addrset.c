@@ -0,0 +1,416 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        network/addrset.c
+ * PURPOSE:     Precomputed set of local, broadcast and on-link addresses
+ * NOTES:       The set is rebuilt from the interface list whenever an
+ *              interface or its addresses change and is published with a
+ *              single pointer exchange. Readers raise to DISPATCH_LEVEL
+ *              while they probe it. Replaced sets are freed by a worker
+ *              once it has run on every processor, which guarantees that
+ *              no reader still holds them.
+ */
+
+#include "precomp.h"
+
+/* Kinds of set entries, 0 marks an empty slot */
+#define ADDR_SET_UNICAST   1
+#define ADDR_SET_BROADCAST 2
+#define ADDR_SET_ON_LINK   3
+
+/* Entries per interface: unicast, broadcast and on-link prefix */
+#define ADDR_SET_ENTRIES_PER_IF 3
+
+typedef struct _ADDR_SET_ENTRY {
+    IPv4_RAW_ADDRESS Address;   /* Unicast, broadcast or network address */
+    IPv4_RAW_ADDRESS Broadcast; /* Interface broadcast address (unicast entries) */
+    UCHAR Kind;                 /* ADDR_SET_XXX */
+    UCHAR PrefixLength;         /* Prefix length (on-link entries) */
+    PIP_INTERFACE Interface;    /* Interface owning the address */
+} ADDR_SET_ENTRY, *PADDR_SET_ENTRY;
+
+typedef struct _ADDR_SET {
+    LIST_ENTRY ListEntry;       /* Entry on retired list */
+    ULONG Version;              /* Incremented on every rebuild */
+    ULONG HashMask;             /* Number of entries minus one */
+    UINT PrefixLengthCount;     /* Number of distinct on-link prefix lengths */
+    UCHAR PrefixLengths[33];    /* Distinct on-link prefix lengths, longest first */
+    ADDR_SET_ENTRY Entries[1];  /* Open addressed hash table */
+} ADDR_SET, *PADDR_SET;
+
+static PADDR_SET volatile AddressSet = NULL;
+static ULONG AddressSetVersion = 0;
+static KSPIN_LOCK AddressSetLock;
+static LIST_ENTRY AddressSetRetiredList;
+static BOOLEAN AddressSetReclaimQueued = FALSE;
+
+static ULONG AddrSetHash(
+    IPv4_RAW_ADDRESS Address,
+    UCHAR Kind,
+    UCHAR PrefixLength)
+{
+    ULONG Hash = Address ^ ((ULONG)Kind << 24) ^ PrefixLength;
+
+    Hash *= 0x9E3779B1;
+
+    return Hash ^ (Hash >> 16);
+}
+
+static PADDR_SET_ENTRY AddrSetProbe(
+    PADDR_SET Set,
+    IPv4_RAW_ADDRESS Address,
+    UCHAR Kind,
+    UCHAR PrefixLength)
+{
+    ULONG i = AddrSetHash(Address, Kind, PrefixLength) & Set->HashMask;
+    PADDR_SET_ENTRY Entry;
+
+    /* The table is never more than half full so this terminates */
+    for (;;) {
+        Entry = &Set->Entries[i];
+
+        if (Entry->Kind == 0)
+            return NULL;
+
+        if (Entry->Kind == Kind &&
+            Entry->Address == Address &&
+            Entry->PrefixLength == PrefixLength)
+            return Entry;
+
+        i = (i + 1) & Set->HashMask;
+    }
+}
+
+static IPv4_RAW_ADDRESS AddrSetPrefixMask(
+    UINT PrefixLength)
+{
+    return PrefixLength ? DH2N(0xFFFFFFFF << (32 - PrefixLength)) : 0;
+}
+
+static VOID AddrSetInsert(
+    PADDR_SET Set,
+    IPv4_RAW_ADDRESS Address,
+    IPv4_RAW_ADDRESS Broadcast,
+    UCHAR Kind,
+    UCHAR PrefixLength,
+    PIP_INTERFACE Interface)
+{
+    ULONG i = AddrSetHash(Address, Kind, PrefixLength) & Set->HashMask;
+    PADDR_SET_ENTRY Entry;
+
+    for (;;) {
+        Entry = &Set->Entries[i];
+
+        if (Entry->Kind == 0)
+            break;
+
+        /* Keep the interface that comes first in the interface list */
+        if (Entry->Kind == Kind &&
+            Entry->Address == Address &&
+            Entry->PrefixLength == PrefixLength)
+            return;
+
+        i = (i + 1) & Set->HashMask;
+    }
+
+    Entry->Address = Address;
+    Entry->Broadcast = Broadcast;
+    Entry->Kind = Kind;
+    Entry->PrefixLength = PrefixLength;
+    Entry->Interface = Interface;
+}
+
+static VOID AddrSetAddPrefixLength(
+    PADDR_SET Set,
+    UCHAR PrefixLength)
+{
+    UINT i, j;
+
+    for (i = 0; i < Set->PrefixLengthCount; i++) {
+        if (Set->PrefixLengths[i] == PrefixLength)
+            return;
+        if (Set->PrefixLengths[i] < PrefixLength)
+            break;
+    }
+
+    for (j = Set->PrefixLengthCount; j > i; j--)
+        Set->PrefixLengths[j] = Set->PrefixLengths[j - 1];
+
+    Set->PrefixLengths[i] = PrefixLength;
+    Set->PrefixLengthCount++;
+}
+
+static VOID AddrSetReclaimWorker(
+    PVOID Context)
+/*
+ * FUNCTION: Frees address sets that have been replaced
+ * ARGUMENTS:
+ *     Context = Unused
+ * NOTES:
+ *     Readers only touch a set at DISPATCH_LEVEL, so once this thread has
+ *     been scheduled on every processor no reader can still see the sets
+ *     that were retired before we started
+ */
+{
+    LIST_ENTRY Retired;
+    PLIST_ENTRY CurrentEntry;
+    KIRQL OldIrql;
+    CCHAR i;
+
+    InitializeListHead(&Retired);
+
+    TcpipAcquireSpinLock(&AddressSetLock, &OldIrql);
+    while (!IsListEmpty(&AddressSetRetiredList)) {
+        CurrentEntry = RemoveHeadList(&AddressSetRetiredList);
+        InsertTailList(&Retired, CurrentEntry);
+    }
+    AddressSetReclaimQueued = FALSE;
+    TcpipReleaseSpinLock(&AddressSetLock, OldIrql);
+
+    for (i = 0; i < KeNumberProcessors; i++)
+        KeSetSystemAffinityThread((KAFFINITY)1 << i);
+    KeRevertToUserAffinityThread();
+
+    while (!IsListEmpty(&Retired)) {
+        CurrentEntry = RemoveHeadList(&Retired);
+        ExFreePoolWithTag(CONTAINING_RECORD(CurrentEntry, ADDR_SET, ListEntry),
+                          ADDR_SET_TAG);
+    }
+}
+
+VOID AddrSetRebuild(
+    VOID)
+/*
+ * FUNCTION: Rebuilds the address set from the interface list
+ * NOTES:
+ *     Must be called after an interface is registered or unregistered and
+ *     after the addresses of an interface have changed. The caller must
+ *     not hold InterfaceListLock
+ */
+{
+    PADDR_SET Set, OldSet;
+    ULONG Size, Count = 0;
+    KIRQL OldIrql, OldIrql2;
+    UINT PrefixLength;
+    IPv4_RAW_ADDRESS Unicast, Broadcast, Mask;
+    IF_LIST_ITER(CurrentIF);
+
+    TcpipAcquireSpinLock(&AddressSetLock, &OldIrql);
+    TcpipAcquireSpinLock(&InterfaceListLock, &OldIrql2);
+
+    ForEachInterface(CurrentIF) {
+        Count++;
+    } EndFor(CurrentIF);
+
+    /* Keep the table at most half full */
+    Size = 16;
+    while (Size < Count * ADDR_SET_ENTRIES_PER_IF * 2)
+        Size <<= 1;
+
+    Set = ExAllocatePoolWithTag(NonPagedPool,
+                                FIELD_OFFSET(ADDR_SET, Entries[Size]),
+                                ADDR_SET_TAG);
+    if (!Set) {
+        TcpipReleaseSpinLock(&InterfaceListLock, OldIrql2);
+        TcpipReleaseSpinLock(&AddressSetLock, OldIrql);
+        TI_DbgPrint(MIN_TRACE, ("Insufficient resources to rebuild address set.\n"));
+        return;
+    }
+
+    RtlZeroMemory(Set, FIELD_OFFSET(ADDR_SET, Entries[Size]));
+    Set->HashMask = Size - 1;
+    Set->Version = ++AddressSetVersion;
+
+    ForEachInterface(CurrentIF) {
+        Unicast = CurrentIF->Unicast.Address.IPv4Address;
+        Broadcast = CurrentIF->Broadcast.Address.IPv4Address;
+
+        if (Unicast != 0)
+            AddrSetInsert(Set, Unicast, Broadcast, ADDR_SET_UNICAST, 0, CurrentIF);
+
+        if (Broadcast != 0)
+            AddrSetInsert(Set, Broadcast, 0, ADDR_SET_BROADCAST, 0, CurrentIF);
+
+        /* Unconfigured interfaces keep their 0.0.0.0/0 prefix so that
+           limited broadcasts can still leave through them */
+        PrefixLength = AddrCountPrefixBits(&CurrentIF->Netmask);
+        Mask = AddrSetPrefixMask(PrefixLength);
+        AddrSetInsert(Set, Unicast & Mask, 0, ADDR_SET_ON_LINK,
+                      (UCHAR)PrefixLength, CurrentIF);
+        AddrSetAddPrefixLength(Set, (UCHAR)PrefixLength);
+    } EndFor(CurrentIF);
+
+    TcpipReleaseSpinLock(&InterfaceListLock, OldIrql2);
+
+    OldSet = InterlockedExchangePointer((PVOID *)&AddressSet, Set);
+
+    TI_DbgPrint(DEBUG_IP, ("Address set version %d with %d interfaces.\n",
+                           Set->Version, Count));
+
+    if (OldSet)
+        InsertTailList(&AddressSetRetiredList, &OldSet->ListEntry);
+
+    if (!IsListEmpty(&AddressSetRetiredList) && !AddressSetReclaimQueued)
+        AddressSetReclaimQueued = ChewCreate(AddrSetReclaimWorker, NULL);
+
+    TcpipReleaseSpinLock(&AddressSetLock, OldIrql);
+}
+
+PIP_INTERFACE AddrSetLocateInterface(
+    PIP_ADDRESS Address)
+/*
+ * FUNCTION: Finds the interface owning a local unicast or broadcast address
+ * ARGUMENTS:
+ *     Address = Pointer to address to look up
+ * RETURNS:
+ *     Pointer to interface, NULL if the address is not local
+ */
+{
+    PADDR_SET Set;
+    PADDR_SET_ENTRY Entry = NULL;
+    PIP_INTERFACE Interface = NULL;
+    KIRQL OldIrql;
+
+    if (Address->Type != IP_ADDRESS_V4 || Address->Address.IPv4Address == 0)
+        return NULL;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Set = AddressSet;
+    if (Set) {
+        Entry = AddrSetProbe(Set, Address->Address.IPv4Address, ADDR_SET_UNICAST, 0);
+        if (!Entry)
+            Entry = AddrSetProbe(Set, Address->Address.IPv4Address, ADDR_SET_BROADCAST, 0);
+    }
+
+    /* The set may be freed once we lower the IRQL */
+    if (Entry)
+        Interface = Entry->Interface;
+
+    KeLowerIrql(OldIrql);
+
+    return Interface;
+}
+
+BOOLEAN AddrSetIsBroadcastMatch(
+    PIP_ADDRESS UnicastAddress,
+    PIP_ADDRESS BroadcastAddress)
+/*
+ * FUNCTION: Determines whether a broadcast address belongs to an interface
+ * ARGUMENTS:
+ *     UnicastAddress   = Pointer to unicast address of the interface, or
+ *                        unspecified address to match any interface
+ *     BroadcastAddress = Pointer to broadcast address
+ * RETURNS:
+ *     TRUE if an interface with these addresses exists, FALSE if not
+ */
+{
+    PADDR_SET Set;
+    PADDR_SET_ENTRY Entry;
+    BOOLEAN Match = FALSE;
+    KIRQL OldIrql;
+
+    if (BroadcastAddress->Type != IP_ADDRESS_V4 ||
+        BroadcastAddress->Address.IPv4Address == 0)
+        return FALSE;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Set = AddressSet;
+    if (Set) {
+        if (AddrIsUnspecified(UnicastAddress)) {
+            Match = AddrSetProbe(Set, BroadcastAddress->Address.IPv4Address,
+                                 ADDR_SET_BROADCAST, 0) != NULL;
+        } else if (UnicastAddress->Type == IP_ADDRESS_V4) {
+            Entry = AddrSetProbe(Set, UnicastAddress->Address.IPv4Address,
+                                 ADDR_SET_UNICAST, 0);
+            Match = Entry &&
+                    Entry->Broadcast == BroadcastAddress->Address.IPv4Address;
+        }
+    }
+
+    KeLowerIrql(OldIrql);
+
+    return Match;
+}
+
+PIP_INTERFACE AddrSetFindOnLinkInterface(
+    PIP_ADDRESS Address)
+/*
+ * FUNCTION: Finds the interface with the longest on-link prefix for an address
+ * ARGUMENTS:
+ *     Address = Pointer to address to check
+ * RETURNS:
+ *     Pointer to interface if address is on-link, NULL if not
+ */
+{
+    PADDR_SET Set;
+    PADDR_SET_ENTRY Entry = NULL;
+    PIP_INTERFACE Interface = NULL;
+    KIRQL OldIrql;
+    UINT i;
+
+    if (Address->Type != IP_ADDRESS_V4)
+        return NULL;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Set = AddressSet;
+    if (Set) {
+        for (i = 0; i < Set->PrefixLengthCount && !Entry; i++) {
+            Entry = AddrSetProbe(Set,
+                                 Address->Address.IPv4Address &
+                                 AddrSetPrefixMask(Set->PrefixLengths[i]),
+                                 ADDR_SET_ON_LINK,
+                                 Set->PrefixLengths[i]);
+        }
+    }
+
+    /* The set may be freed once we lower the IRQL */
+    if (Entry)
+        Interface = Entry->Interface;
+
+    KeLowerIrql(OldIrql);
+
+    return Interface;
+}
+
+VOID AddrSetStartup(
+    VOID)
+/*
+ * FUNCTION: Initializes the address set
+ */
+{
+    KeInitializeSpinLock(&AddressSetLock);
+    LockProfileName(&AddressSetLock, TCP_LOCK_SITE_ADDRESS_SET);
+    InitializeListHead(&AddressSetRetiredList);
+}
+
+VOID AddrSetShutdown(
+    VOID)
+/*
+ * FUNCTION: Frees the address set
+ * NOTES:
+ *     Called after all interfaces are gone and no more packets arrive
+ */
+{
+    PADDR_SET Set;
+    PLIST_ENTRY CurrentEntry;
+    KIRQL OldIrql;
+
+    TcpipAcquireSpinLock(&AddressSetLock, &OldIrql);
+
+    Set = InterlockedExchangePointer((PVOID *)&AddressSet, NULL);
+    if (Set)
+        InsertTailList(&AddressSetRetiredList, &Set->ListEntry);
+
+    while (!IsListEmpty(&AddressSetRetiredList)) {
+        CurrentEntry = RemoveHeadList(&AddressSetRetiredList);
+        ExFreePoolWithTag(CONTAINING_RECORD(CurrentEntry, ADDR_SET, ListEntry),
+                          ADDR_SET_TAG);
+    }
+
+    TcpipReleaseSpinLock(&AddressSetLock, OldIrql);
+}
+
+/* EOF */
@@ -90,7 +90,7 @@ BOOLEAN PrepareICMPPacket(
     /* Length of data and header */
     IPHeader->TotalLength = WH2N((USHORT)DataSize + sizeof(IPv4_HEADER));
     /* Identification */
-    IPHeader->Id = (USHORT)Random();
+    IPHeader->Id = WH2N((USHORT)InterlockedIncrement(&IPv4Identification));
     /* One fragment at offset 0 */
     IPHeader->FlagsFragOfs = 0;
     /* Set TTL */
@@ -206,6 +206,58 @@ NTSTATUS ICMPSendDatagram(
 }
 
 
+static VOID ICMPFragmentationNeeded(
+    PIP_PACKET IPPacket)
+/*
+ * FUNCTION: Learns a path MTU from a "fragmentation needed" message
+ * ARGUMENTS:
+ *     IPPacket = Pointer to the received ICMP packet
+ * NOTES:
+ *     The message quotes the header of the datagram we sent. RFC 1191
+ *     puts the MTU of the next hop in the low half of the unused field.
+ *     A TCP segment is checked against its connection first (RFC 5927)
+ */
+{
+    PICMP_HEADER ICMPHeader = (PICMP_HEADER)IPPacket->Data;
+    PIPv4_HEADER Header = (PIPv4_HEADER)(ICMPHeader + 1);
+    IP_ADDRESS Source, Destination;
+    UINT HeaderLength, NextHopMTU;
+
+    if (IPPacket->TotalSize - IPPacket->HeaderSize <
+        sizeof(ICMP_HEADER) + sizeof(IPv4_HEADER))
+        return;
+
+    if ((Header->VerIHL & 0xF0) != 0x40)
+        return;
+
+    /* The quoted header and the first 64 bits of its data */
+    HeaderLength = (Header->VerIHL & 0x0F) << 2;
+    if (HeaderLength < sizeof(IPv4_HEADER) ||
+        IPPacket->TotalSize - IPPacket->HeaderSize <
+        sizeof(ICMP_HEADER) + HeaderLength + 8)
+        return;
+
+    /* We only fragment datagrams without DF, a router has no reason to complain */
+    if (!(WN2H(Header->FlagsFragOfs) & IPv4_DF_MASK))
+        return;
+
+    /* Only datagrams we sent can tell us about our paths */
+    AddrInitIPv4(&Source, Header->SrcAddr);
+    if (!AddrLocateInterface(&Source))
+        return;
+
+    AddrInitIPv4(&Destination, Header->DstAddr);
+
+    NextHopMTU = WN2H(((PUSHORT)&ICMPHeader->Unused)[1]);
+
+    /* Only TCP can check the quoted segment against a connection, and
+       only TCP sets DF. Anything else would be an unchecked forgery */
+    if (Header->Protocol == IPPROTO_TCP)
+        TCPFragmentationNeeded(&Source, &Destination, (PUCHAR)Header + HeaderLength,
+                               NextHopMTU, WN2H(Header->TotalLength));
+}
+
+
 VOID ICMPReceive(
     PIP_INTERFACE Interface,
     PIP_PACKET IPPacket)
@@ -249,6 +301,11 @@ VOID ICMPReceive(
         case ICMP_TYPE_ECHO_REPLY:
             break;
 
+        case ICMP_TYPE_DEST_UNREACH:
+            if (ICMPHeader->Code == ICMP_CODE_DU_FRAG_DF_SET)
+                ICMPFragmentationNeeded(IPPacket);
+            break;
+
         default:
             TI_DbgPrint(DEBUG_ICMP,
                         ("Discarded ICMP datagram of unknown type %d.\n",
@@ -84,23 +84,7 @@ NTSTATUS GetInterfaceName( PIP_INTERFACE Interface,
 PIP_INTERFACE AddrLocateInterface(
     PIP_ADDRESS MatchAddress)
 {
-    KIRQL OldIrql;
-    PIP_INTERFACE RetIF = NULL;
-    IF_LIST_ITER(CurrentIF);
-
-    TcpipAcquireSpinLock(&InterfaceListLock, &OldIrql);
-
-    ForEachInterface(CurrentIF) {
-	if( AddrIsEqual( &CurrentIF->Unicast, MatchAddress ) ||
-            AddrIsEqual( &CurrentIF->Broadcast, MatchAddress ) ) {
-            RetIF = CurrentIF;
-            break;
-	}
-    } EndFor(CurrentIF);
-
-    TcpipReleaseSpinLock(&InterfaceListLock, OldIrql);
-
-    return RetIF;
+    return AddrSetLocateInterface(MatchAddress);
 }
 
 BOOLEAN HasPrefix(
@@ -172,28 +156,13 @@ PIP_INTERFACE FindOnLinkInterface(PIP_ADDRESS Address)
  *     Pointer to interface if address is on-link, NULL if not
  */
 {
-    KIRQL OldIrql;
-    IF_LIST_ITER(CurrentIF);
-
     TI_DbgPrint(DEBUG_ROUTER, ("Called. Address (0x%X)\n", Address));
     TI_DbgPrint(DEBUG_ROUTER, ("Address (%s)\n", A2S(Address)));
 
     if (AddrIsUnspecified(Address))
         return GetDefaultInterface();
 
-    TcpipAcquireSpinLock(&InterfaceListLock, &OldIrql);
-
-    ForEachInterface(CurrentIF) {
-        if (HasPrefix(Address, &CurrentIF->Unicast,
-		      AddrCountPrefixBits(&CurrentIF->Netmask))) {
-	    TcpipReleaseSpinLock(&InterfaceListLock, OldIrql);
-            return CurrentIF;
-	}
-    } EndFor(CurrentIF);
-
-    TcpipReleaseSpinLock(&InterfaceListLock, OldIrql);
-
-    return NULL;
+    return AddrSetFindOnLinkInterface(Address);
 }
 
 NTSTATUS GetInterfaceConnectionStatus(PIP_INTERFACE Interface, PULONG Result)
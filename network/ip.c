@@ -18,6 +18,7 @@ LIST_ENTRY InterfaceListHead;
 KSPIN_LOCK InterfaceListLock;
 LIST_ENTRY NetTableListHead;
 KSPIN_LOCK NetTableListLock;
+LONG IPv4Identification = 0;
 BOOLEAN IPInitialized = FALSE;
 BOOLEAN IpWorkItemQueued = FALSE;
 /* Work around calling timer at Dpc level */
@@ -65,8 +66,13 @@ VOID DeinitializePacket(
         }
     }
 
+    /* Check if a receiver shares our header */
+    if (IPPacket->HeaderBuffer)
+    {
+        IPDereferencePacketBuffer(IPPacket->HeaderBuffer);
+    }
     /* Check if we have a pool-allocated header */
-    if (!IPPacket->MappedHeader && IPPacket->Header)
+    else if (!IPPacket->MappedHeader && IPPacket->Header)
     {
         /* Free it */
         TI_DbgPrint(MAX_TRACE, ("Freeing header: 0x%p\n",
@@ -107,6 +113,62 @@ PIP_PACKET IPInitializePacket(
 }
 
 
+PIP_PACKET_BUFFER IPReferencePacketBuffer(
+    PIP_PACKET IPPacket)
+/*
+ * FUNCTION: References the pool buffer holding a received packet
+ * ARGUMENTS:
+ *     IPPacket = Pointer to IP packet
+ * RETURNS:
+ *     Pointer to the buffer reference, NULL if the header is not pool
+ *     allocated or there are not enough free resources
+ * NOTES:
+ *     The first reference moves ownership of IPPacket->Header to a shared
+ *     object. The packet keeps its own reference, which is dropped when
+ *     the packet is freed
+ */
+{
+    PIP_PACKET_BUFFER PacketBuffer = IPPacket->HeaderBuffer;
+
+    if (PacketBuffer)
+    {
+        InterlockedIncrement(&PacketBuffer->RefCount);
+        return PacketBuffer;
+    }
+
+    if (IPPacket->MappedHeader || !IPPacket->Header)
+        return NULL;
+
+    PacketBuffer = ExAllocatePoolWithTag(NonPagedPool,
+                                         sizeof(IP_PACKET_BUFFER),
+                                         PACKET_BUFFER_REF_TAG);
+    if (!PacketBuffer)
+        return NULL;
+
+    PacketBuffer->RefCount = 2;
+    PacketBuffer->Buffer = IPPacket->Header;
+    IPPacket->HeaderBuffer = PacketBuffer;
+
+    return PacketBuffer;
+}
+
+
+VOID IPDereferencePacketBuffer(
+    PIP_PACKET_BUFFER PacketBuffer)
+/*
+ * FUNCTION: Drops a reference to a received packet buffer
+ * ARGUMENTS:
+ *     PacketBuffer = Pointer to buffer reference
+ */
+{
+    if (InterlockedDecrement(&PacketBuffer->RefCount) == 0)
+    {
+        ExFreePoolWithTag(PacketBuffer->Buffer, PACKET_BUFFER_TAG);
+        ExFreePoolWithTag(PacketBuffer, PACKET_BUFFER_REF_TAG);
+    }
+}
+
+
 VOID NTAPI IPTimeoutDpcFn(PKDPC Dpc,
                           PVOID DeferredContext,
                           PVOID SystemArgument1,
@@ -127,6 +189,9 @@ VOID NTAPI IPTimeoutDpcFn(PKDPC Dpc,
 
     /* Clean possible outdated cached neighbor addresses */
     NBTimeout();
+
+    /* Forget path MTUs learned long ago */
+    PMTUTimeout();
 }
 
 
@@ -154,16 +219,27 @@ VOID IPDispatchProtocol(
     case IP_ADDRESS_V6:
         /* FIXME: IPv6 adresses not supported */
         TI_DbgPrint(MIN_TRACE, ("IPv6 datagram discarded.\n"));
+        IP_STAT_INC(InHdrErrors);
+        TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
         return;
     default:
         TI_DbgPrint(MIN_TRACE, ("Unrecognized datagram discarded.\n"));
+        IP_STAT_INC(InHdrErrors);
+        TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
         return;
     }
 
     NBResetNeighborTimeout(&SrcAddress);
 
+    TRACE_EVENT(TCP_TRACE_IP_DISPATCH, 0, Protocol, IPPacket->TotalSize,
+                SrcAddress.Address.IPv4Address);
+
     if (Protocol < IP_PROTOCOL_TABLE_SIZE)
     {
+       /* The default handler counts unknown protocols itself */
+       if (ProtocolTable[Protocol] != DefaultProtocolHandler)
+           IP_STAT_INC(InDelivers);
+
        /* Call the appropriate protocol handler */
        (*ProtocolTable[Protocol])(Interface, IPPacket);
     }
@@ -209,6 +285,7 @@ PIP_INTERFACE IPCreateInterface(
     IF->Address       = BindInfo->Address;
     IF->AddressLength = BindInfo->AddressLength;
     IF->Transmit      = BindInfo->Transmit;
+    IF->TransmitPackets = BindInfo->TransmitPackets;
 
 	IF->Unicast.Type = IP_ADDRESS_V4;
 	IF->PointToPoint.Type = IP_ADDRESS_V4;
@@ -217,12 +294,21 @@ PIP_INTERFACE IPCreateInterface(
 
     TcpipInitializeSpinLock(&IF->Lock);
 
+    IF->Stats = STATS_ALLOCATE(SEND_RECV_STATS);
+    if (!IF->Stats) {
+        ExFreePoolWithTag(IF, IP_INTERFACE_TAG);
+        return NULL;
+    }
+
     IF->TCPContext = ExAllocatePool
 	( NonPagedPool, sizeof(struct netif));
     if (!IF->TCPContext) {
+        StatsFree(IF->Stats);
         ExFreePoolWithTag(IF, IP_INTERFACE_TAG);
         return NULL;
     }
+
+    LockProfileName(&IF->Lock, TCP_LOCK_SITE_INTERFACE);
     
     TCPRegisterInterface(IF);
 
@@ -251,6 +337,8 @@ VOID IPDestroyInterface(
     TCPUnregisterInterface(IF);
 
     ExFreePool(IF->TCPContext);
+    StatsFree(IF->Stats);
+    LockProfileForget(&IF->Lock);
     ExFreePoolWithTag(IF, IP_INTERFACE_TAG);
 }
 
@@ -278,6 +366,8 @@ VOID IPAddInterfaceRoute( PIP_INTERFACE IF ) {
     if (IF != Loopback)
        ARPTransmit(NULL, NULL, IF);
     
+    AddrSetRebuild();
+
     TCPUpdateInterfaceIPInformation(IF);
 }
 
@@ -320,6 +410,8 @@ BOOLEAN IPRegisterInterface(
 
     TcpipReleaseSpinLock(&IF->Lock, OldIrql);
 
+    AddrSetRebuild();
+
     return TRUE;
 }
 
@@ -358,6 +450,8 @@ VOID IPUnregisterInterface(
     TcpipAcquireSpinLock(&InterfaceListLock, &OldIrql3);
     RemoveEntryList(&IF->ListEntry);
     TcpipReleaseSpinLock(&InterfaceListLock, OldIrql3);
+
+    AddrSetRebuild();
 }
 
 
@@ -374,7 +468,10 @@ VOID DefaultProtocolHandler(
     TI_DbgPrint(MID_TRACE, ("[IF %x] Packet of unknown Internet protocol "
 			    "discarded.\n", Interface));
 
-    Interface->Stats.InDiscardedUnknownProto++;
+    IF_STAT_INC(Interface, InDiscardedUnknownProto);
+    IP_STAT_INC(InUnknownProtos);
+    TRACE_DROP(TCP_DROP_IP_UNKNOWN_PROTO,
+               ((PIPv4_HEADER)IPPacket->Header)->Protocol, 0);
 }
 
 
@@ -446,6 +543,12 @@ NTSTATUS IPStartup(PUNICODE_STRING RegistryPath)
     /* Start neighbor cache subsystem */
     NBStartup();
 
+    /* Start local address set */
+    AddrSetStartup();
+
+    /* Start path MTU cache */
+    PMTUStartup();
+
     /* Fill the protocol dispatch table with pointers
        to the default protocol handler */
     for (i = 0; i < IP_PROTOCOL_TABLE_SIZE; i++)
@@ -454,10 +557,12 @@ NTSTATUS IPStartup(PUNICODE_STRING RegistryPath)
     /* Initialize NTE list and protecting lock */
     InitializeListHead(&NetTableListHead);
     TcpipInitializeSpinLock(&NetTableListLock);
+    LockProfileName(&NetTableListLock, TCP_LOCK_SITE_NET_TABLE_LIST);
 
     /* Initialize reassembly list and protecting lock */
     InitializeListHead(&ReassemblyListHead);
     TcpipInitializeSpinLock(&ReassemblyListLock);
+    LockProfileName(&ReassemblyListLock, TCP_LOCK_SITE_REASSEMBLY_LIST);
 
     IPInitialized = TRUE;
 
@@ -484,6 +589,12 @@ NTSTATUS IPShutdown(
     /* Shutdown routing subsystem */
     RouterShutdown();
 
+    /* Free local address set */
+    AddrSetShutdown();
+
+    /* Free path MTU cache */
+    PMTUShutdown();
+
     IPFreeReassemblyList();
 
     /* Destroy lookaside lists */
@@ -15,19 +15,31 @@ VOID TcpipInitializeSpinLock( PKSPIN_LOCK SpinLock ) {
 }
 
 VOID TcpipAcquireSpinLock( PKSPIN_LOCK SpinLock, PKIRQL Irql ) {
-    KeAcquireSpinLock( SpinLock, Irql );
+    if (LockProfileEnabled)
+        LockProfileAcquire( SpinLock, Irql, LOCK_SITE_LOOKUP );
+    else
+        KeAcquireSpinLock( SpinLock, Irql );
 }
 
 VOID TcpipAcquireSpinLockAtDpcLevel( PKSPIN_LOCK SpinLock ) {
-    KeAcquireSpinLockAtDpcLevel( SpinLock );
+    if (LockProfileEnabled)
+        LockProfileAcquireAtDpcLevel( SpinLock, LOCK_SITE_LOOKUP );
+    else
+        KeAcquireSpinLockAtDpcLevel( SpinLock );
 }
 
 VOID TcpipReleaseSpinLock( PKSPIN_LOCK SpinLock, KIRQL Irql ) {
-    KeReleaseSpinLock( SpinLock, Irql );
+    if (LockProfileEnabled)
+        LockProfileRelease( SpinLock, Irql );
+    else
+        KeReleaseSpinLock( SpinLock, Irql );
 }
 
 VOID TcpipReleaseSpinLockFromDpcLevel( PKSPIN_LOCK SpinLock ) {
-    KeReleaseSpinLockFromDpcLevel( SpinLock );
+    if (LockProfileEnabled)
+        LockProfileReleaseFromDpcLevel( SpinLock );
+    else
+        KeReleaseSpinLockFromDpcLevel( SpinLock );
 }
 
 VOID TcpipInterlockedInsertTailList( PLIST_ENTRY ListHead,
@@ -26,9 +26,10 @@ VOID NBCompleteSend( PVOID Context,
 }
 
 VOID NBSendPackets( PNEIGHBOR_CACHE_ENTRY NCE ) {
+    PNDIS_PACKET Batch[LL_TRANSMIT_BATCH];
     PLIST_ENTRY PacketEntry;
     PNEIGHBOR_PACKET Packet;
-    UINT HashValue;
+    UINT HashValue, Count, i;
 
     ASSERT(!(NCE->State & NUD_INCOMPLETE));
 
@@ -38,27 +39,49 @@ VOID NBSendPackets( PNEIGHBOR_CACHE_ENTRY NCE ) {
     HashValue ^= HashValue >> 4;
     HashValue &= NB_HASHMASK;
 
-    /* Send any waiting packets */
-    while ((PacketEntry = ExInterlockedRemoveHeadList(&NCE->PacketQueue,
-                                              &NeighborCache[HashValue].Lock)) != NULL)
-    {
-	Packet = CONTAINING_RECORD( PacketEntry, NEIGHBOR_PACKET, Next );
-
-	TI_DbgPrint
-	    (MID_TRACE,
-	     ("PacketEntry: %x, NdisPacket %x\n",
-	      PacketEntry, Packet->Packet));
-
-	PC(Packet->Packet)->DLComplete = NBCompleteSend;
-	PC(Packet->Packet)->Context  = Packet;
-
-	NCE->Interface->Transmit
-	    ( NCE->Interface->Context,
-	      Packet->Packet,
-	      0,
-	      NCE->LinkAddress,
-	      LAN_PROTO_IPv4 );
-    }
+    /* Send any waiting packets, several at a time if the link layer can */
+    do {
+	Count = 0;
+	while (Count < LL_TRANSMIT_BATCH &&
+	       (PacketEntry = ExInterlockedRemoveHeadList(&NCE->PacketQueue,
+							  &NeighborCache[HashValue].Lock)) != NULL)
+	{
+	    Packet = CONTAINING_RECORD( PacketEntry, NEIGHBOR_PACKET, Next );
+
+	    TI_DbgPrint
+		(MID_TRACE,
+		 ("PacketEntry: %x, NdisPacket %x\n",
+		  PacketEntry, Packet->Packet));
+
+	    PC(Packet->Packet)->DLComplete = NBCompleteSend;
+	    PC(Packet->Packet)->Context  = Packet;
+
+	    Batch[Count++] = Packet->Packet;
+
+	    if (!NCE->Interface->TransmitPackets)
+		break;
+	}
+
+	if (Count > 1)
+	{
+	    NCE->Interface->TransmitPackets
+		( NCE->Interface->Context,
+		  Batch,
+		  Count,
+		  NCE->LinkAddress,
+		  LAN_PROTO_IPv4 );
+	}
+	else
+	{
+	    for (i = 0; i < Count; i++)
+		NCE->Interface->Transmit
+		    ( NCE->Interface->Context,
+		      Batch[i],
+		      0,
+		      NCE->LinkAddress,
+		      LAN_PROTO_IPv4 );
+	}
+    } while (Count != 0);
 }
 
 /* Must be called with table lock acquired */
@@ -79,6 +102,8 @@ VOID NBFlushPacketQueue( PNEIGHBOR_CACHE_ENTRY NCE,
 	     ("PacketEntry: %x, NdisPacket %x\n",
 	      PacketEntry, Packet->Packet));
 
+        TRACE_DROP(TCP_DROP_NEIGHBOR, NCE->Address.Address.IPv4Address, ErrorCode);
+
         ASSERT_KM_POINTER(Packet->Complete);
 	Packet->Complete( Packet->Context,
                           Packet->Packet,
@@ -178,6 +203,7 @@ VOID NBStartup(VOID)
     for (i = 0; i <= NB_HASHMASK; i++) {
 	NeighborCache[i].Cache = NULL;
 	TcpipInitializeSpinLock(&NeighborCache[i].Lock);
+	LockProfileName(&NeighborCache[i].Lock, TCP_LOCK_SITE_NEIGHBOR);
     }
 }
 
@@ -229,6 +255,8 @@ VOID NBSendSolicit(PNEIGHBOR_CACHE_ENTRY NCE)
 {
     TI_DbgPrint(DEBUG_NCACHE, ("Called. NCE (0x%X).\n", NCE));
 
+    TRACE_EVENT(TCP_TRACE_NEIGHBOR_SOLICIT, 0, NCE->Address.Address.IPv4Address, 0, 0);
+
     ARPTransmit(&NCE->Address,
                 (NCE->State & NUD_INCOMPLETE) ? NULL : NCE->LinkAddress,
                 NCE->Interface);
@@ -376,6 +404,8 @@ VOID NBUpdateNeighbor(
 
     TcpipReleaseSpinLock(&NeighborCache[HashValue].Lock, OldIrql);
 
+    TRACE_EVENT(TCP_TRACE_NEIGHBOR_UPDATE, 0, NCE->Address.Address.IPv4Address, State, 0);
+
     if( !(NCE->State & NUD_INCOMPLETE) )
     {
         if (NCE->EventTimer) NCE->EventTimer = ARP_COMPLETE_TIMEOUT;
@@ -544,6 +574,74 @@ BOOLEAN NBQueuePacket(
   return TRUE;
 }
 
+BOOLEAN NBQueuePackets(
+  PNEIGHBOR_CACHE_ENTRY NCE,
+  PNDIS_PACKET *NdisPackets,
+  UINT Count,
+  PNEIGHBOR_PACKET_COMPLETE PacketComplete,
+  PVOID *PacketContexts)
+/*
+ * FUNCTION: Queues several packets on an NCE for later transmission
+ * ARGUMENTS:
+ *   NCE            = Pointer to NCE to queue packets on
+ *   NdisPackets    = Array of NDIS packets to queue
+ *   Count          = Number of packets in the array
+ *   PacketComplete = Completion routine, called once per packet
+ *   PacketContexts = Array of completion contexts, one per packet
+ * RETURNS:
+ *   TRUE if all packets were queued, FALSE if none were
+ * NOTES:
+ *   The queue is only taken once, so a resolved neighbor hands the whole
+ *   batch to the link layer together
+ */
+{
+  KIRQL OldIrql;
+  PNEIGHBOR_PACKET Packet;
+  LIST_ENTRY Packets;
+  UINT HashValue, i;
+
+  TI_DbgPrint
+      (DEBUG_NCACHE,
+       ("Called. NCE (0x%X)  %d packets.\n", NCE, Count));
+
+  InitializeListHead(&Packets);
+
+  for (i = 0; i < Count; i++) {
+      Packet = ExAllocatePoolWithTag( NonPagedPool, sizeof(NEIGHBOR_PACKET),
+                                      NEIGHBOR_PACKET_TAG );
+      if( !Packet ) {
+          while (!IsListEmpty(&Packets)) {
+              Packet = CONTAINING_RECORD(RemoveHeadList(&Packets), NEIGHBOR_PACKET, Next);
+              ExFreePoolWithTag( Packet, NEIGHBOR_PACKET_TAG );
+          }
+          return FALSE;
+      }
+
+      Packet->Complete = PacketComplete;
+      Packet->Context = PacketContexts[i];
+      Packet->Packet = NdisPackets[i];
+      InsertTailList( &Packets, &Packet->Next );
+  }
+
+  HashValue  = *(PULONG)(&NCE->Address.Address);
+  HashValue ^= HashValue >> 16;
+  HashValue ^= HashValue >> 8;
+  HashValue ^= HashValue >> 4;
+  HashValue &= NB_HASHMASK;
+
+  TcpipAcquireSpinLock(&NeighborCache[HashValue].Lock, &OldIrql);
+
+  while (!IsListEmpty(&Packets))
+      InsertTailList( &NCE->PacketQueue, RemoveHeadList(&Packets) );
+
+  TcpipReleaseSpinLock(&NeighborCache[HashValue].Lock, OldIrql);
+
+  if( !(NCE->State & NUD_INCOMPLETE) )
+      NBSendPackets( NCE );
+
+  return TRUE;
+}
+
 VOID NBRemoveNeighbor(
   PNEIGHBOR_CACHE_ENTRY NCE)
 /*
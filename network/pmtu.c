@@ -0,0 +1,327 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        network/pmtu.c
+ * PURPOSE:     Path MTU cache
+ * NOTES:       Path MTU discovery as in RFC 1191. ICMP "fragmentation
+ *              needed" messages lower the path MTU of a destination, and
+ *              the entry is forgotten after PMTU_TIMEOUT so that a larger
+ *              MTU is found again once the path changes. Destinations
+ *              without an entry use the MTU of the outgoing interface.
+ *
+ *              Reports below PMTU_MINIMUM are not believed as such. The
+ *              entry stays at PMTU_MINIMUM but is locked, and datagrams
+ *              to a locked destination go out without DF so that the
+ *              small hop can still fragment them.
+ */
+
+#include "precomp.h"
+
+/* Number of hash buckets, a power of two */
+#define PMTU_HASH_SIZE 64
+
+/* Entries kept at most, the oldest one in the bucket makes room after that */
+#define PMTU_MAX_ENTRIES 1024
+
+/* Lowest path MTU believed, 512 bytes of data behind TCP/IP headers. Every
+   link carries at least 68 bytes (RFC 791), but a forged message would
+   shrink segments to almost nothing. Lower reports lock the entry instead */
+#define PMTU_MINIMUM 552
+
+/* Ten minutes as RFC 1191 suggests, in IPTimeoutDpcFn calls */
+#define PMTU_TIMEOUT (10 * 60 * 1000 / IP_TIMEOUT)
+
+typedef struct _PMTU_ENTRY {
+    LIST_ENTRY ListEntry;           /* Entry on hash bucket */
+    IPv4_RAW_ADDRESS Destination;   /* Remote address */
+    UINT PathMTU;                   /* Largest datagram that gets through */
+    BOOLEAN Locked;                 /* The path is below PMTU_MINIMUM, send without DF */
+    ULONG Age;                      /* Timeouts since the path MTU was lowered */
+} PMTU_ENTRY, *PPMTU_ENTRY;
+
+/* Plateaus from RFC 1191 section 7, used when a router does not report its MTU */
+static const USHORT PMTUPlateaus[] = {
+    32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68 };
+
+static LIST_ENTRY PMTUCache[PMTU_HASH_SIZE];
+static KSPIN_LOCK PMTULock;
+static volatile LONG PMTUEntries = 0;
+
+static ULONG PMTUHash(
+    IPv4_RAW_ADDRESS Address)
+{
+    ULONG Hash = Address * 0x9E3779B1;
+
+    return (Hash ^ (Hash >> 16)) & (PMTU_HASH_SIZE - 1);
+}
+
+static PPMTU_ENTRY PMTULocate(
+    IPv4_RAW_ADDRESS Address)
+/*
+ * FUNCTION: Finds the entry of a destination
+ * ARGUMENTS:
+ *     Address = Destination address
+ * RETURNS:
+ *     Pointer to entry, NULL if there is none
+ * NOTES:
+ *     PMTULock must be held
+ */
+{
+    PLIST_ENTRY Bucket = &PMTUCache[PMTUHash(Address)];
+    PLIST_ENTRY CurrentEntry;
+    PPMTU_ENTRY Entry;
+
+    for (CurrentEntry = Bucket->Flink;
+         CurrentEntry != Bucket;
+         CurrentEntry = CurrentEntry->Flink)
+    {
+        Entry = CONTAINING_RECORD(CurrentEntry, PMTU_ENTRY, ListEntry);
+        if (Entry->Destination == Address)
+            return Entry;
+    }
+
+    return NULL;
+}
+
+static UINT PMTUPlateau(
+    UINT DatagramSize)
+/*
+ * FUNCTION: Guesses the MTU that made a router drop a datagram
+ * ARGUMENTS:
+ *     DatagramSize = Total length of the dropped datagram
+ * RETURNS:
+ *     The largest plateau below DatagramSize
+ */
+{
+    UINT i;
+
+    for (i = 0; i < sizeof(PMTUPlateaus) / sizeof(PMTUPlateaus[0]) - 1; i++)
+    {
+        if (PMTUPlateaus[i] < DatagramSize)
+            break;
+    }
+
+    return PMTUPlateaus[i];
+}
+
+UINT PMTUGetPathMTU(
+    PIP_ADDRESS Destination,
+    UINT InterfaceMTU,
+    PBOOLEAN Locked)
+/*
+ * FUNCTION: Returns the path MTU to a destination
+ * ARGUMENTS:
+ *     Destination  = Pointer to destination address
+ *     InterfaceMTU = MTU of the interface the path starts on
+ *     Locked       = Address of buffer for whether DF must stay clear (may be NULL)
+ * RETURNS:
+ *     The path MTU, never more than InterfaceMTU
+ */
+{
+    PPMTU_ENTRY Entry;
+    UINT PathMTU = InterfaceMTU;
+    KIRQL OldIrql;
+
+    if (Locked)
+        *Locked = FALSE;
+
+    /* Most of the time nothing was learned, don't touch the lock then */
+    if (PMTUEntries == 0 || Destination->Type != IP_ADDRESS_V4)
+        return InterfaceMTU;
+
+    TcpipAcquireSpinLock(&PMTULock, &OldIrql);
+
+    Entry = PMTULocate(Destination->Address.IPv4Address);
+    if (Entry && Entry->PathMTU < PathMTU)
+        PathMTU = Entry->PathMTU;
+    if (Entry && Locked)
+        *Locked = Entry->Locked;
+
+    TcpipReleaseSpinLock(&PMTULock, OldIrql);
+
+    return PathMTU;
+}
+
+UINT PMTUUpdate(
+    PIP_ADDRESS Destination,
+    UINT NextHopMTU,
+    UINT DatagramSize)
+/*
+ * FUNCTION: Lowers the path MTU to a destination
+ * ARGUMENTS:
+ *     Destination  = Pointer to destination address
+ *     NextHopMTU   = MTU reported by the router, 0 if it did not report one
+ *     DatagramSize = Total length of the datagram the router dropped
+ * RETURNS:
+ *     The new path MTU, 0 if the path MTU did not change
+ * NOTES:
+ *     The path MTU is never raised here, only by the entry timing out
+ */
+{
+    PPMTU_ENTRY Entry, Oldest;
+    PLIST_ENTRY Bucket, CurrentEntry;
+    BOOLEAN Locked = FALSE;
+    KIRQL OldIrql;
+
+    if (Destination->Type != IP_ADDRESS_V4)
+        return 0;
+
+    /* Routers older than RFC 1191 leave the MTU field zero */
+    if (NextHopMTU == 0)
+        NextHopMTU = PMTUPlateau(DatagramSize);
+
+    /* The datagram would have got through, the message is bogus */
+    if (DatagramSize != 0 && NextHopMTU >= DatagramSize)
+        return 0;
+
+    if (NextHopMTU < PMTU_MINIMUM)
+    {
+        NextHopMTU = PMTU_MINIMUM;
+        Locked = TRUE;
+    }
+
+    TcpipAcquireSpinLock(&PMTULock, &OldIrql);
+
+    Entry = PMTULocate(Destination->Address.IPv4Address);
+    if (Entry)
+    {
+        if (Entry->PathMTU < NextHopMTU ||
+            (Entry->PathMTU == NextHopMTU && (Entry->Locked || !Locked)))
+        {
+            TcpipReleaseSpinLock(&PMTULock, OldIrql);
+            return 0;
+        }
+    }
+    else if (PMTUEntries < PMTU_MAX_ENTRIES)
+    {
+        Entry = ExAllocatePoolWithTag(NonPagedPool, sizeof(PMTU_ENTRY), PMTU_TAG);
+        if (!Entry)
+        {
+            TcpipReleaseSpinLock(&PMTULock, OldIrql);
+            return 0;
+        }
+
+        Entry->Destination = Destination->Address.IPv4Address;
+        InsertTailList(&PMTUCache[PMTUHash(Entry->Destination)], &Entry->ListEntry);
+        PMTUEntries++;
+    }
+    else
+    {
+        /* Full, take over the oldest entry of the bucket */
+        Bucket = &PMTUCache[PMTUHash(Destination->Address.IPv4Address)];
+        Oldest = NULL;
+
+        for (CurrentEntry = Bucket->Flink;
+             CurrentEntry != Bucket;
+             CurrentEntry = CurrentEntry->Flink)
+        {
+            Entry = CONTAINING_RECORD(CurrentEntry, PMTU_ENTRY, ListEntry);
+            if (!Oldest || Entry->Age > Oldest->Age)
+                Oldest = Entry;
+        }
+
+        Entry = Oldest;
+        if (!Entry)
+        {
+            TcpipReleaseSpinLock(&PMTULock, OldIrql);
+            return 0;
+        }
+
+        Entry->Destination = Destination->Address.IPv4Address;
+    }
+
+    Entry->PathMTU = NextHopMTU;
+    Entry->Locked = Locked;
+    Entry->Age = 0;
+
+    TcpipReleaseSpinLock(&PMTULock, OldIrql);
+
+    TI_DbgPrint(MID_TRACE, ("Path MTU to 0x%X is now %d%s.\n",
+                            Destination->Address.IPv4Address, NextHopMTU,
+                            Locked ? " (locked)" : ""));
+
+    return NextHopMTU;
+}
+
+VOID PMTUTimeout(
+    VOID)
+/*
+ * FUNCTION: Path MTU cache timeout handler
+ * NOTES:
+ *     This routine is called by IPTimeout to remove entries that have
+ *     reached PMTU_TIMEOUT
+ */
+{
+    PLIST_ENTRY CurrentEntry, NextEntry;
+    PPMTU_ENTRY Entry;
+    UINT i;
+
+    if (PMTUEntries == 0)
+        return;
+
+    TcpipAcquireSpinLockAtDpcLevel(&PMTULock);
+
+    for (i = 0; i < PMTU_HASH_SIZE; i++)
+    {
+        for (CurrentEntry = PMTUCache[i].Flink;
+             CurrentEntry != &PMTUCache[i];
+             CurrentEntry = NextEntry)
+        {
+            NextEntry = CurrentEntry->Flink;
+            Entry = CONTAINING_RECORD(CurrentEntry, PMTU_ENTRY, ListEntry);
+
+            if (++Entry->Age >= PMTU_TIMEOUT)
+            {
+                RemoveEntryList(&Entry->ListEntry);
+                ExFreePoolWithTag(Entry, PMTU_TAG);
+                PMTUEntries--;
+            }
+        }
+    }
+
+    TcpipReleaseSpinLockFromDpcLevel(&PMTULock);
+}
+
+VOID PMTUStartup(
+    VOID)
+/*
+ * FUNCTION: Initializes the path MTU cache
+ */
+{
+    UINT i;
+
+    for (i = 0; i < PMTU_HASH_SIZE; i++)
+        InitializeListHead(&PMTUCache[i]);
+
+    KeInitializeSpinLock(&PMTULock);
+    LockProfileName(&PMTULock, TCP_LOCK_SITE_PATH_MTU);
+}
+
+VOID PMTUShutdown(
+    VOID)
+/*
+ * FUNCTION: Frees the path MTU cache
+ */
+{
+    PLIST_ENTRY CurrentEntry;
+    KIRQL OldIrql;
+    UINT i;
+
+    TcpipAcquireSpinLock(&PMTULock, &OldIrql);
+
+    for (i = 0; i < PMTU_HASH_SIZE; i++)
+    {
+        while (!IsListEmpty(&PMTUCache[i]))
+        {
+            CurrentEntry = RemoveHeadList(&PMTUCache[i]);
+            ExFreePoolWithTag(CONTAINING_RECORD(CurrentEntry, PMTU_ENTRY, ListEntry),
+                              PMTU_TAG);
+        }
+    }
+
+    PMTUEntries = 0;
+
+    TcpipReleaseSpinLock(&PMTULock, OldIrql);
+}
+
+/* EOF */
@@ -10,16 +10,155 @@
 
 #include "precomp.h"
 
+#define PORTS_ROTL(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+#define PORTS_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = PORTS_ROTL(v1, 5); v1 ^= v0; v0 = PORTS_ROTL(v0, 16); \
+    v2 += v3; v3 = PORTS_ROTL(v3, 8); v3 ^= v2; \
+    v0 += v3; v3 = PORTS_ROTL(v3, 7); v3 ^= v0; \
+    v2 += v1; v1 = PORTS_ROTL(v1, 13); v1 ^= v2; v2 = PORTS_ROTL(v2, 16); \
+} while (0)
+
+/* The keyed function F() of RFC 6056 (HalfSipHash-2-4 over the
+ * connection identifiers) */
+static ULONG PortsHash( PPORT_SET PortSet, ULONG LocalAddress,
+                        ULONG RemoteAddress, ULONG RemotePort ) {
+    ULONG Message[4];
+    ULONG v0, v1, v2, v3;
+    UINT i;
+
+    Message[0] = LocalAddress;
+    Message[1] = RemoteAddress;
+    Message[2] = RemotePort;
+    Message[3] = (3 * 4) << 24;
+
+    v0 = PortSet->Secret[0];
+    v1 = PortSet->Secret[1];
+    v2 = v0 ^ 0x6c796765;
+    v3 = v1 ^ 0x74656462;
+    for( i = 0; i < 4; i++ ) {
+        v3 ^= Message[i];
+        PORTS_ROUND(v0, v1, v2, v3);
+        PORTS_ROUND(v0, v1, v2, v3);
+        v0 ^= Message[i];
+    }
+    v2 ^= 0xff;
+    for( i = 0; i < 4; i++ )
+        PORTS_ROUND(v0, v1, v2, v3);
+
+    return v1 ^ v3;
+}
+
+/* Reserves the first free ephemeral port at or after the given offset into
+ * the ephemeral range, wrapping around at its end. The port set lock must
+ * be held. Returns the port in host byte order or -1 if the range is full. */
+static ULONG PortsReserveEphemeral( PPORT_SET PortSet, ULONG Offset ) {
+    ULONG First = PortSet->EphemeralFirst - PortSet->StartingPort;
+    ULONG Index;
+
+    Index = RtlFindClearBits( &PortSet->ProtoBitmap, 1, First + Offset );
+    if( Index == (ULONG)-1 ||
+        Index < First || Index >= First + PortSet->EphemeralCount ) {
+        /* Ran off the end of the range, so try again from its start */
+        Index = RtlFindClearBits( &PortSet->ProtoBitmap, 1, First );
+        if( Index == (ULONG)-1 ||
+            Index < First || Index >= First + PortSet->EphemeralCount )
+            return -1;
+    }
+
+    RtlSetBit( &PortSet->ProtoBitmap, Index );
+    return Index + PortSet->StartingPort;
+}
+
+/* Fills a processor's cache with ports from random points of the
+ * ephemeral range. Called at DISPATCH_LEVEL with the cache lock held,
+ * where RtlRandomEx may not run, so the points come from the keyed hash
+ * of a counter instead. */
+static VOID PortsRefillCache( PPORT_SET PortSet, PPORT_CACHE Cache ) {
+    ULONG Port;
+
+    TcpipAcquireSpinLockAtDpcLevel( &PortSet->Lock );
+    while( Cache->Count < PORT_CACHE_BATCH ) {
+        Port = PortsReserveEphemeral( PortSet,
+                                      PortsHash( PortSet, 0, 0,
+                                                 PortSet->NextRandom++ ) %
+                                      PortSet->EphemeralCount );
+        if( Port == (ULONG)-1 ) break;
+        Cache->Ports[Cache->Count++] = (USHORT)Port;
+    }
+    TcpipReleaseSpinLockFromDpcLevel( &PortSet->Lock );
+}
+
+/* Takes a port (host byte order) that a processor has reserved but not
+ * handed out yet out of its cache */
+static BOOLEAN PortsTakeFromCaches( PPORT_SET PortSet, ULONG Port ) {
+    PPORT_CACHE Cache;
+    BOOLEAN Found = FALSE;
+    KIRQL OldIrql;
+    ULONG i, j;
+
+    for( i = 0; i < PortSet->CacheCount && !Found; i++ ) {
+        Cache = &PortSet->Caches[i];
+        TcpipAcquireSpinLock( &Cache->Lock, &OldIrql );
+        for( j = 0; j < Cache->Count; j++ ) {
+            if( Cache->Ports[j] == Port ) {
+                Cache->Ports[j] = Cache->Ports[--Cache->Count];
+                Found = TRUE;
+                break;
+            }
+        }
+        TcpipReleaseSpinLock( &Cache->Lock, OldIrql );
+    }
+
+    return Found;
+}
+
 NTSTATUS PortsStartup( PPORT_SET PortSet,
 		   UINT StartingPort,
-		   UINT PortsToManage ) {
+		   UINT PortsToManage,
+		   UINT EphemeralFirst,
+		   UINT EphemeralCount ) {
+    LARGE_INTEGER Now;
+    ULONG i;
+
+    ASSERT(EphemeralFirst >= StartingPort);
+    ASSERT(EphemeralCount > 0);
+    ASSERT(EphemeralFirst + EphemeralCount <= StartingPort + PortsToManage);
+
     PortSet->StartingPort = StartingPort;
     PortSet->PortsToOversee = PortsToManage;
+    PortSet->EphemeralFirst = EphemeralFirst;
+    PortSet->EphemeralCount = EphemeralCount;
 
     PortSet->ProtoBitBuffer =
 	ExAllocatePoolWithTag( NonPagedPool, (PortSet->PortsToOversee + 7) / 8,
                                PORT_SET_TAG );
     if(!PortSet->ProtoBitBuffer) return STATUS_INSUFFICIENT_RESOURCES;
+
+    PortSet->CacheCount = KeNumberProcessors;
+    PortSet->Caches =
+	ExAllocatePoolWithTag( NonPagedPool,
+			       PortSet->CacheCount * sizeof(PORT_CACHE),
+			       PORT_SET_TAG );
+    if(!PortSet->Caches) {
+	ExFreePoolWithTag( PortSet->ProtoBitBuffer, PORT_SET_TAG );
+	return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    for( i = 0; i < PortSet->CacheCount; i++ ) {
+	TcpipInitializeSpinLock( &PortSet->Caches[i].Lock );
+	PortSet->Caches[i].Count = 0;
+    }
+
+    /* Seed the generator behind the random port choices and the key of
+     * the RFC 6056 hash */
+    KeQuerySystemTime( &Now );
+    PortSet->RandomSeed = Now.LowPart ^ KeQueryPerformanceCounter( NULL ).LowPart;
+    PortSet->Secret[0] = (RtlRandomEx( &PortSet->RandomSeed ) << 16) ^
+                         RtlRandomEx( &PortSet->RandomSeed );
+    PortSet->Secret[1] = (RtlRandomEx( &PortSet->RandomSeed ) << 16) ^
+                         RtlRandomEx( &PortSet->RandomSeed );
+    PortSet->NextEphemeral = RtlRandomEx( &PortSet->RandomSeed );
+    PortSet->NextRandom = 0;
+
     RtlInitializeBitMap( &PortSet->ProtoBitmap,
 			 PortSet->ProtoBitBuffer,
 			 PortSet->PortsToOversee );
@@ -29,6 +168,7 @@ NTSTATUS PortsStartup( PPORT_SET PortSet,
 }
 
 VOID PortsShutdown( PPORT_SET PortSet ) {
+    ExFreePoolWithTag( PortSet->Caches, PORT_SET_TAG );
     ExFreePoolWithTag( PortSet->ProtoBitBuffer, PORT_SET_TAG );
 }
 
@@ -63,20 +203,56 @@ BOOLEAN AllocatePort( PPORT_SET PortSet, ULONG Port ) {
     if( Clear ) RtlSetBits( &PortSet->ProtoBitmap, Port, 1 );
     KeReleaseSpinLock( &PortSet->Lock, OldIrql );
 
+    /* An ephemeral port may only be reserved by a processor's cache */
+    Port += PortSet->StartingPort;
+    if( !Clear &&
+        Port >= PortSet->EphemeralFirst &&
+        Port < PortSet->EphemeralFirst + PortSet->EphemeralCount )
+        Clear = PortsTakeFromCaches( PortSet, Port );
+
     return Clear;
 }
 
+/* Hands out a random ephemeral port from the current processor's cache,
+ * refilling it from the bitmap when it runs dry */
 ULONG AllocateAnyPort( PPORT_SET PortSet ) {
-    ULONG AllocatedPort;
+    PPORT_CACHE Cache;
+    ULONG AllocatedPort = (ULONG)-1;
     KIRQL OldIrql;
 
+    KeRaiseIrql( DISPATCH_LEVEL, &OldIrql );
+    Cache = &PortSet->Caches[KeGetCurrentProcessorNumber() % PortSet->CacheCount];
+    TcpipAcquireSpinLockAtDpcLevel( &Cache->Lock );
+    if( !Cache->Count ) PortsRefillCache( PortSet, Cache );
+    if( Cache->Count ) AllocatedPort = htons(Cache->Ports[--Cache->Count]);
+    TcpipReleaseSpinLockFromDpcLevel( &Cache->Lock );
+    KeLowerIrql( OldIrql );
+
+    return AllocatedPort;
+}
+
+/* Picks an ephemeral port for a connection to a known peer as in RFC 6056
+ * algorithm 3: each (local, remote) pair walks the range from its own
+ * keyed offset, so ports used towards one peer do not reveal those used
+ * towards another and consecutive connections to the same peer get
+ * different ports. Addresses and RemotePort are in network byte order;
+ * the port returned is too, or -1 if the range is full. */
+ULONG AllocatePortForPeer( PPORT_SET PortSet, ULONG LocalAddress,
+                           ULONG RemoteAddress, ULONG RemotePort ) {
+    ULONG Offset, Index, i;
+    KIRQL OldIrql;
+
+    Offset = PortsHash( PortSet, LocalAddress, RemoteAddress, RemotePort );
+
     KeAcquireSpinLock( &PortSet->Lock, &OldIrql );
-    AllocatedPort = RtlFindClearBits( &PortSet->ProtoBitmap, 1, 0 );
-    if( AllocatedPort != (ULONG)-1 ) {
-	RtlSetBit( &PortSet->ProtoBitmap, AllocatedPort );
-	AllocatedPort += PortSet->StartingPort;
-	KeReleaseSpinLock( &PortSet->Lock, OldIrql );
-	return htons(AllocatedPort);
+    for( i = 0; i < PortSet->EphemeralCount; i++ ) {
+        Index = PortSet->EphemeralFirst - PortSet->StartingPort +
+            (Offset + PortSet->NextEphemeral++) % PortSet->EphemeralCount;
+        if( !RtlCheckBit( &PortSet->ProtoBitmap, Index ) ) {
+            RtlSetBit( &PortSet->ProtoBitmap, Index );
+            KeReleaseSpinLock( &PortSet->Lock, OldIrql );
+            return htons(Index + PortSet->StartingPort);
+        }
     }
     KeReleaseSpinLock( &PortSet->Lock, OldIrql );
 
@@ -92,7 +92,11 @@ VOID FreeIPDR(
     TI_DbgPrint(DEBUG_IP, ("Freeing fragment packet at (0x%X).\n", CurrentF->Packet));
 
     /* Free the fragment data buffer */
-    if (CurrentF->ReturnPacket)
+    if (!CurrentF->Packet)
+    {
+        /* Handed over to the reassembled datagram */
+    }
+    else if (CurrentF->ReturnPacket)
     {
         NdisReturnPackets(&CurrentF->Packet, 1);
     }
@@ -214,8 +218,9 @@ ReassembleDatagram(
   RtlCopyMemory(&IPPacket->SrcAddr, &IPDR->SrcAddr, sizeof(IP_ADDRESS));
   RtlCopyMemory(&IPPacket->DstAddr, &IPDR->DstAddr, sizeof(IP_ADDRESS));
 
-  /* Allocate space for full IP datagram */
-  IPPacket->Header = ExAllocatePoolWithTag(PagedPool, IPPacket->TotalSize, PACKET_BUFFER_TAG);
+  /* Allocate space for full IP datagram. Receivers may keep it queued and
+     read it at DISPATCH_LEVEL */
+  IPPacket->Header = ExAllocatePoolWithTag(NonPagedPool, IPPacket->TotalSize, PACKET_BUFFER_TAG);
   if (!IPPacket->Header) {
     TI_DbgPrint(MIN_TRACE, ("Insufficient resources.\n"));
     (*IPPacket->Free)(IPPacket);
@@ -234,15 +239,28 @@ ReassembleDatagram(
   while (CurrentEntry != &IPDR->FragmentListHead) {
     Fragment = CONTAINING_RECORD(CurrentEntry, IP_FRAGMENT, ListEntry);
 
-    /* Copy fragment data into datagram buffer */
-    CopyPacketToBuffer(Data + Fragment->Offset,
-                       Fragment->Packet,
-                       Fragment->PacketOffset,
-                       Fragment->Size);
+    /* Copy fragment data into datagram buffer, the cursor was left at
+       the data when the fragment arrived */
+    CursorPull(&Fragment->Cursor,
+               Data + Fragment->Offset,
+               Fragment->Size);
 
     CurrentEntry = CurrentEntry->Flink;
   }
 
+  /* A datagram that arrived whole keeps the miniport's packet, so receivers
+     can be handed its buffers instead of a copy (see DGDeliverData) */
+  Fragment = CONTAINING_RECORD(IPDR->FragmentListHead.Flink, IP_FRAGMENT, ListEntry);
+  if (Fragment->ListEntry.Flink == &IPDR->FragmentListHead &&
+      Fragment->Offset == 0 && Fragment->ReturnPacket) {
+    IPPacket->NdisPacket   = Fragment->Packet;
+    IPPacket->ReturnPacket = TRUE;
+    IPPacket->Position     = Fragment->PacketOffset - IPDR->HeaderSize;
+
+    /* Disassociate the NDIS packet so FreeIPDR() doesn't return it */
+    Fragment->Packet = NULL;
+  }
+
   return TRUE;
 }
 
@@ -262,6 +280,9 @@ __inline VOID Cleanup(
 {
   TI_DbgPrint(MIN_TRACE, ("Insufficient resources.\n"));
 
+  IP_STAT_INC(InDiscards);
+  TRACE_DROP(TCP_DROP_IP_RESOURCES, 0, 0);
+
   TcpipReleaseSpinLock(Lock, OldIrql);
   RemoveIPDR(IPDR);
   FreeIPDR(IPDR);
@@ -288,6 +309,7 @@ VOID ProcessFragment(
   USHORT FragFirst;
   USHORT FragLast;
   BOOLEAN MoreFragments;
+  BOOLEAN Fragmented;
   PIPv4_HEADER IPv4Header;
   IP_PACKET Datagram;
   PIP_FRAGMENT Fragment;
@@ -297,6 +319,13 @@ VOID ProcessFragment(
 
   IPv4Header = (PIPv4_HEADER)IPPacket->Header;
 
+  /* Whole datagrams take the same path, but only fragments count as
+     reassemblies */
+  Fragmented = (WN2H(IPv4Header->FlagsFragOfs) &
+                (IPv4_FRAGOFS_MASK | IPv4_MF_MASK)) != 0;
+  if (Fragmented)
+    IP_STAT_INC(ReasmReqds);
+
   /* Check if we already have an reassembly structure for this datagram */
   IPDR = GetReassemblyInfo(IPPacket);
   if (IPDR) {
@@ -311,9 +340,12 @@ VOID ProcessFragment(
 
     /* We don't have a reassembly structure, create one */
     IPDR = ExAllocateFromNPagedLookasideList(&IPDRList);
-    if (!IPDR)
+    if (!IPDR) {
       /* We don't have the resources to process this packet, discard it */
+      IP_STAT_INC(InDiscards);
+      TRACE_DROP(TCP_DROP_IP_RESOURCES, 0, 0);
       return;
+    }
 
     /* Create a descriptor spanning from zero to infinity.
        Actually, we use a value slightly greater than the
@@ -321,6 +353,8 @@ VOID ProcessFragment(
     Hole = CreateHoleDescriptor(0, 65536);
     if (!Hole) {
       /* We don't have the resources to process this packet, discard it */
+      IP_STAT_INC(InDiscards);
+      TRACE_DROP(TCP_DROP_IP_RESOURCES, 0, 0);
       ExFreeToNPagedLookasideList(&IPDRList, IPDR);
       return;
     }
@@ -433,6 +467,7 @@ VOID ProcessFragment(
     Fragment->Packet = IPPacket->NdisPacket;
     Fragment->ReturnPacket = IPPacket->ReturnPacket;
     Fragment->PacketOffset = IPPacket->Position + IPPacket->HeaderSize;
+    Fragment->Cursor = IPPacket->Cursor;
     Fragment->Offset = FragFirst;
 
     /* Disassociate the NDIS packet so it isn't freed upon return from IPReceive() */
@@ -465,9 +500,20 @@ VOID ProcessFragment(
 
     FreeIPDR(IPDR);
 
-    if (!Success)
+    if (!Success) {
       /* Not enough free resources, discard the packet */
+      IP_STAT_INC(InDiscards);
+      TRACE_DROP(TCP_DROP_IP_RESOURCES, 0, 0);
+      if (Fragmented)
+        IP_STAT_INC(ReasmFails);
       return;
+    }
+
+    if (Fragmented)
+      IP_STAT_INC(ReasmOks);
+
+    /* Time the datagram from its last fragment */
+    Datagram.Timestamp = IPPacket->Timestamp;
 
     DISPLAY_IP_PACKET(&Datagram);
 
@@ -534,6 +580,9 @@ VOID IPDatagramReassemblyTimeout(
 
        if (++CurrentIPDR->TimeoutCount == MAX_TIMEOUT_COUNT)
        {
+           IP_STAT_INC(ReasmFails);
+           TRACE_DROP(TCP_DROP_IP_REASSEMBLY, CurrentIPDR->SrcAddr.Address.IPv4Address,
+                      CurrentIPDR->Id);
            TcpipReleaseSpinLockFromDpcLevel(&CurrentIPDR->Lock);
            RemoveEntryList(CurrentEntry);
            FreeIPDR(CurrentIPDR);
@@ -550,69 +599,106 @@ VOID IPDatagramReassemblyTimeout(
     TcpipReleaseSpinLockFromDpcLevel(&ReassemblyListLock);
 }
 
+static BOOLEAN IPv4IsUnicast(
+    PIP_INTERFACE IF,
+    IPv4_RAW_ADDRESS Address)
+/*
+ * FUNCTION: Tells unicast destinations from broadcasts and multicasts
+ * ARGUMENTS:
+ *     IF      = Interface the datagram was received on
+ *     Address = Destination address (in network byte order)
+ * RETURNS:
+ *     TRUE if the address is a unicast address
+ */
+{
+    if (Address == 0xFFFFFFFF ||
+        (Address != 0 && Address == IF->Broadcast.Address.IPv4Address))
+        return FALSE;
+
+    /* Class D */
+    return (((PUCHAR)&Address)[0] & 0xF0) != 0xE0;
+}
+
 VOID IPv4Receive(PIP_INTERFACE IF, PIP_PACKET IPPacket)
 /*
  * FUNCTION: Receives an IPv4 datagram (or fragment)
  * ARGUMENTS:
  *     Context  = Pointer to context information (IP_INTERFACE)
  *     IPPacket = Pointer to IP packet
+ * NOTES:
+ *     IPPacket->Cursor is at the IP header and is left at the data
  */
 {
-    UCHAR FirstByte;
-    ULONG BytesCopied;
+    PUCHAR FirstByte;
+    PVOID Header;
     
     TI_DbgPrint(DEBUG_IP, ("Received IPv4 datagram.\n"));
     
-    /* Read in the first IP header byte for size information */
-    BytesCopied = CopyPacketToBuffer((PCHAR)&FirstByte,
-                                     IPPacket->NdisPacket,
-                                     IPPacket->Position,
-                                     sizeof(UCHAR));
-    if (BytesCopied != sizeof(UCHAR))
+    /* Look at the first IP header byte for size information */
+    FirstByte = CursorPeek(&IPPacket->Cursor, sizeof(UCHAR));
+    if (!FirstByte)
     {
         TI_DbgPrint(MIN_TRACE, ("Failed to copy in first byte\n"));
         /* Discard packet */
         return;
     }
 
-    IPPacket->HeaderSize = (FirstByte & 0x0F) << 2;
+    IPPacket->HeaderSize = (*FirstByte & 0x0F) << 2;
     TI_DbgPrint(DEBUG_IP, ("IPPacket->HeaderSize = %d\n", IPPacket->HeaderSize));
 
     if (IPPacket->HeaderSize > IPv4_MAX_HEADER_SIZE) {
         TI_DbgPrint(MIN_TRACE, ("Datagram received with incorrect header size (%d).\n",
 	      IPPacket->HeaderSize));
+        IP_STAT_INC(InHdrErrors);
+        TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
         /* Discard packet */
         return;
     }
 
-    /* This is freed by IPPacket->Free() */
-    IPPacket->Header = ExAllocatePoolWithTag(NonPagedPool,
-                                             IPPacket->HeaderSize,
-                                             PACKET_BUFFER_TAG);
-    if (!IPPacket->Header)
+    /* A header within one buffer is used where it is, it stays valid
+       until the NDIS packet is freed after ProcessFragment() */
+    Header = CursorPeek(&IPPacket->Cursor, IPPacket->HeaderSize);
+    if (Header)
     {
-        TI_DbgPrint(MIN_TRACE, ("No resources to allocate header\n"));
-        /* Discard packet */
-        return;
+        IPPacket->Header = Header;
+        IPPacket->MappedHeader = TRUE;
+        CursorPull(&IPPacket->Cursor, NULL, IPPacket->HeaderSize);
     }
+    else
+    {
+        /* This is freed by IPPacket->Free() */
+        IPPacket->Header = ExAllocatePoolWithTag(NonPagedPool,
+                                                 IPPacket->HeaderSize,
+                                                 PACKET_BUFFER_TAG);
+        if (!IPPacket->Header)
+        {
+            TI_DbgPrint(MIN_TRACE, ("No resources to allocate header\n"));
+            IP_STAT_INC(InDiscards);
+            TRACE_DROP(TCP_DROP_IP_RESOURCES, 0, 0);
+            /* Discard packet */
+            return;
+        }
 
-    IPPacket->MappedHeader = FALSE;
+        IPPacket->MappedHeader = FALSE;
 
-    BytesCopied = CopyPacketToBuffer((PCHAR)IPPacket->Header,
-                                     IPPacket->NdisPacket,
-                                     IPPacket->Position,
-                                     IPPacket->HeaderSize);
-    if (BytesCopied != IPPacket->HeaderSize)
-    {
-        TI_DbgPrint(MIN_TRACE, ("Failed to copy in header\n"));
-        /* Discard packet */
-        return;
+        if (CursorPull(&IPPacket->Cursor,
+                       IPPacket->Header,
+                       IPPacket->HeaderSize) != IPPacket->HeaderSize)
+        {
+            TI_DbgPrint(MIN_TRACE, ("Failed to copy in header\n"));
+            IP_STAT_INC(InHdrErrors);
+            TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
+            /* Discard packet */
+            return;
+        }
     }
 
     /* Checksum IPv4 header */
     if (!IPv4CorrectChecksum(IPPacket->Header, IPPacket->HeaderSize)) {
         TI_DbgPrint(MIN_TRACE, ("Datagram received with bad checksum. Checksum field (0x%X)\n",
 	      WN2H(((PIPv4_HEADER)IPPacket->Header)->Checksum)));
+        IP_STAT_INC(InHdrErrors);
+        TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
         /* Discard packet */
         return;
     }
@@ -621,6 +707,11 @@ VOID IPv4Receive(PIP_INTERFACE IF, PIP_PACKET IPPacket)
 
     AddrInitIPv4(&IPPacket->SrcAddr, ((PIPv4_HEADER)IPPacket->Header)->SrcAddr);
     AddrInitIPv4(&IPPacket->DstAddr, ((PIPv4_HEADER)IPPacket->Header)->DstAddr);
+
+    if (IPv4IsUnicast(IF, IPPacket->DstAddr.Address.IPv4Address))
+        IF_STAT_INC(IF, InUnicast);
+    else
+        IF_STAT_INC(IF, InNUnicast);
     
     TI_DbgPrint(MID_TRACE,("IPPacket->Position = %d\n",
                            IPPacket->Position));
@@ -639,25 +730,35 @@ VOID IPReceive( PIP_INTERFACE IF, PIP_PACKET IPPacket )
  * ARGUMENTS:
  *     IF       = Interface
  *     IPPacket = Pointer to IP packet
+ * NOTES:
+ *     The link layer may leave IPPacket->Cursor at Position, otherwise
+ *     it is placed there
  */
 {
-    UCHAR FirstByte;
-    UINT Version, BytesCopied;
-
-    /* Read in the first IP header byte for version information */
-    BytesCopied = CopyPacketToBuffer((PCHAR)&FirstByte,
-                                     IPPacket->NdisPacket,
-                                     IPPacket->Position,
-                                     sizeof(UCHAR));
-    if (BytesCopied != sizeof(UCHAR))
+    PUCHAR FirstByte;
+    UINT Version;
+
+    LATENCY_RECORD(TCP_LATENCY_RX_IP, IPPacket->Timestamp);
+
+    if (IPPacket->Cursor.Packet != IPPacket->NdisPacket ||
+        IPPacket->Cursor.Offset != IPPacket->Position)
+        CursorInitialize(&IPPacket->Cursor, IPPacket->NdisPacket, IPPacket->Position);
+
+    /* Look at the first IP header byte for version information */
+    FirstByte = CursorPeek(&IPPacket->Cursor, sizeof(UCHAR));
+    IP_STAT_INC(InReceives);
+
+    if (!FirstByte)
     {
         TI_DbgPrint(MIN_TRACE, ("Failed to copy in first byte\n"));
+        IP_STAT_INC(InHdrErrors);
+        TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
         IPPacket->Free(IPPacket);
         return;
     }
 
     /* Check that IP header has a supported version */
-    Version = (FirstByte >> 4);
+    Version = (*FirstByte >> 4);
 
     switch (Version) {
         case 4:
@@ -667,9 +768,13 @@ VOID IPReceive( PIP_INTERFACE IF, PIP_PACKET IPPacket )
         case 6:
             IPPacket->Type = IP_ADDRESS_V6;
             TI_DbgPrint(MAX_TRACE, ("Datagram of type IPv6 discarded.\n"));
+            IP_STAT_INC(InHdrErrors);
+            TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
             break;
         default:
             TI_DbgPrint(MIN_TRACE, ("Datagram has an unsupported IP version %d.\n", Version));
+            IP_STAT_INC(InHdrErrors);
+            TRACE_DROP(TCP_DROP_IP_HEADER, 0, 0);
             break;
     }
 
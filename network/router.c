@@ -335,6 +335,10 @@ PNEIGHBOR_CACHE_ENTRY RouteGetRouteToDestination(PIP_ADDRESS Destination)
 
     if( NCE )
 	TI_DbgPrint(DEBUG_ROUTER,("Interface->MTU: %d\n", NCE->Interface->MTU));
+    else {
+	IP_STAT_INC(OutNoRoutes);
+	TRACE_DROP(TCP_DROP_NO_ROUTE, Destination->Address.IPv4Address, 0);
+    }
 
     return NCE;
 }
@@ -493,6 +497,7 @@ NTSTATUS RouterStartup(
     /* Initialize the Forward Information Base */
     InitializeListHead(&FIBListHead);
     TcpipInitializeSpinLock(&FIBLock);
+    LockProfileName(&FIBLock, TCP_LOCK_SITE_FIB);
 
     return STATUS_SUCCESS;
 }
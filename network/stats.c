@@ -0,0 +1,144 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        network/stats.c
+ * PURPOSE:     Per-processor statistics counters
+ */
+
+#include "precomp.h"
+
+PTCPIP_IP_STATS IPStats = NULL;
+PTCPIP_UDP_STATS UDPStats = NULL;
+PTCPIP_TCP_STATS TCPStats = NULL;
+
+PVOID StatsAllocate(
+    ULONG Stride)
+/*
+ * FUNCTION: Allocates a zeroed counter block for every processor
+ * ARGUMENTS:
+ *     Stride = Size of one block, rounded up to a cache line
+ * RETURNS:
+ *     Pointer to the first block, NULL if there was not enough memory
+ * NOTES:
+ *     Requests of at least a page come back page aligned, which keeps
+ *     every block on cache lines of its own
+ */
+{
+    ULONG Size = max(Stride * KeNumberProcessors, PAGE_SIZE);
+    PVOID Stats;
+
+    Stats = ExAllocatePoolWithTag(NonPagedPool, Size, STATS_TAG);
+    if (!Stats)
+        return NULL;
+
+    RtlZeroMemory(Stats, Size);
+
+    return Stats;
+}
+
+VOID StatsFree(
+    PVOID Stats)
+{
+    if (Stats)
+        ExFreePoolWithTag(Stats, STATS_TAG);
+}
+
+VOID StatsSum(
+    PVOID Stats,
+    ULONG Stride,
+    ULONG Size,
+    PULONGLONG Total)
+/*
+ * FUNCTION: Adds up the per-processor copies of a counter block
+ * ARGUMENTS:
+ *     Stats  = Pointer to the first block
+ *     Stride = Distance between the blocks
+ *     Size   = Size of a block, made of ULONGLONG counters only
+ *     Total  = Address of a block to receive the sums
+ * NOTES:
+ *     Counters are read with an interlocked compare and written through
+ *     STATS_COUNT, so a 64-bit value being bumped on another processor
+ *     is never seen torn. The sum is not a snapshot, counters may move
+ *     while the blocks are added up
+ */
+{
+    PULONGLONG Counters;
+    ULONG Cpu, i;
+
+    RtlZeroMemory(Total, Size);
+
+    if (!Stats)
+        return;
+
+    for (Cpu = 0; Cpu < (ULONG)KeNumberProcessors; Cpu++)
+    {
+        Counters = (PULONGLONG)((PUCHAR)Stats + Stride * Cpu);
+
+        for (i = 0; i < Size / sizeof(ULONGLONG); i++)
+            Total[i] += (ULONGLONG)InterlockedCompareExchange64((PLONGLONG)&Counters[i], 0, 0);
+    }
+}
+
+VOID StatsReset(
+    PVOID Stats,
+    ULONG Stride,
+    ULONG Size)
+/*
+ * FUNCTION: Clears the per-processor copies of a counter block
+ * ARGUMENTS:
+ *     Stats  = Pointer to the first block
+ *     Stride = Distance between the blocks
+ *     Size   = Size of a block, made of ULONGLONG counters only
+ * NOTES:
+ *     A counter bumped while it is being cleared may keep or lose
+ *     that one update
+ */
+{
+    PULONGLONG Counters;
+    ULONG Cpu, i;
+
+    if (!Stats)
+        return;
+
+    for (Cpu = 0; Cpu < (ULONG)KeNumberProcessors; Cpu++)
+    {
+        Counters = (PULONGLONG)((PUCHAR)Stats + Stride * Cpu);
+
+        for (i = 0; i < Size / sizeof(ULONGLONG); i++)
+            InterlockedExchange64((PLONGLONG)&Counters[i], 0);
+    }
+}
+
+NTSTATUS StatsStartup(VOID)
+/*
+ * FUNCTION: Allocates the protocol counters
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    IPStats = STATS_ALLOCATE(TCPIP_IP_STATS);
+    UDPStats = STATS_ALLOCATE(TCPIP_UDP_STATS);
+    TCPStats = STATS_ALLOCATE(TCPIP_TCP_STATS);
+
+    if (!IPStats || !UDPStats || !TCPStats)
+    {
+        StatsShutdown();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID StatsShutdown(VOID)
+{
+    StatsFree(IPStats);
+    IPStats = NULL;
+
+    StatsFree(UDPStats);
+    UDPStats = NULL;
+
+    StatsFree(TCPStats);
+    TCPStats = NULL;
+}
+
+/* EOF */
@@ -107,6 +107,10 @@ BOOLEAN PrepareNextFragment(
             FragOfs &= ~IPv4_MF_MASK;
 
         Header = IFC->Header;
+
+        /* Keep DF, SendFragments never splits a datagram that has it */
+        FragOfs |= WN2H(Header->FlagsFragOfs) & IPv4_DF_MASK;
+
         Header->FlagsFragOfs = WH2N(FragOfs);
         Header->TotalLength = WH2N((USHORT)(DataSize + IFC->HeaderSize));
 
@@ -142,18 +146,27 @@ NTSTATUS SendFragments(
  * RETURNS:
  *     Status of operation
  * NOTES:
- *     IP datagram is larger than PathMTU when this is called
+ *     IP datagram is larger than PathMTU when this is called. A datagram
+ *     with DF set that does not fit is dropped
  */
 {
     PIPFRAGMENT_CONTEXT IFC;
     NDIS_STATUS NdisStatus;
     PVOID Data;
-    UINT BufferSize = PathMTU, InSize;
+    UINT BufferSize = PathMTU, InSize, Fragments = 0;
     PCHAR InData;
 
     TI_DbgPrint(MAX_TRACE, ("Called. IPPacket (0x%X)  NCE (0x%X)  PathMTU (%d).\n",
         IPPacket, NCE, PathMTU));
 
+    if (IPPacket->TotalSize > PathMTU &&
+        (WN2H(((PIPv4_HEADER)IPPacket->Header)->FlagsFragOfs) & IPv4_DF_MASK))
+    {
+        IP_STAT_INC(FragFails);
+        IPPacket->Free(IPPacket);
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
     /* Make a smaller buffer if we will only send one fragment */
     GetDataPtr( IPPacket->NdisPacket, IPPacket->Position, &InData, &InSize );
     if( InSize < BufferSize ) BufferSize = InSize;
@@ -163,6 +176,7 @@ NTSTATUS SendFragments(
     IFC = ExAllocatePoolWithTag(NonPagedPool, sizeof(IPFRAGMENT_CONTEXT), IFC_TAG);
     if (IFC == NULL)
     {
+        IP_STAT_INC(OutDiscards);
         IPPacket->Free(IPPacket);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
@@ -172,6 +186,7 @@ NTSTATUS SendFragments(
 	( &IFC->NdisPacket, NULL, BufferSize );
 
     if( !NT_SUCCESS(NdisStatus) ) {
+        IP_STAT_INC(OutDiscards);
         IPPacket->Free(IPPacket);
         ExFreePoolWithTag( IFC, IFC_TAG );
         return NdisStatus;
@@ -179,6 +194,8 @@ NTSTATUS SendFragments(
 
     GetDataPtr( IFC->NdisPacket, 0, (PCHAR *)&Data, &InSize );
 
+    PC(IFC->NdisPacket)->Timestamp = IPPacket->Timestamp;
+
     IFC->Header       = ((PCHAR)Data);
     IFC->Datagram     = IPPacket->NdisPacket;
     IFC->DatagramData = ((PCHAR)IPPacket->Header) + IPPacket->HeaderSize;
@@ -198,6 +215,8 @@ NTSTATUS SendFragments(
 
     while (PrepareNextFragment(IFC))
     {
+        Fragments++;
+
         NdisStatus = IPSendFragment(IFC->NdisPacket, NCE, IFC);
         if (NT_SUCCESS(NdisStatus))
         {
@@ -213,6 +232,17 @@ NTSTATUS SendFragments(
             break;
     }
 
+    if (IPPacket->TotalSize > PathMTU)
+    {
+        if (NT_SUCCESS(NdisStatus))
+        {
+            IP_STAT_INC(FragOks);
+            IP_STAT_ADD(FragCreates, Fragments);
+        }
+        else
+            IP_STAT_INC(FragFails);
+    }
+
     FreeNdisPacket(IFC->NdisPacket);
     ExFreePoolWithTag(IFC, IFC_TAG);
     IPPacket->Free(IPPacket);
@@ -220,6 +250,26 @@ NTSTATUS SendFragments(
     return NdisStatus;
 }
 
+static UINT IPPathMTU(
+    PIP_PACKET IPPacket,
+    PNEIGHBOR_CACHE_ENTRY NCE)
+/*
+ * FUNCTION: Returns the path MTU to the destination of a datagram
+ * ARGUMENTS:
+ *     IPPacket = Pointer to an IP packet with its header built
+ *     NCE      = Pointer to NCE for first hop to destination
+ * RETURNS:
+ *     Path MTU, the interface MTU if none was learned
+ */
+{
+    IP_ADDRESS Destination;
+
+    /* Not every sender fills in DstAddr, the header always has it */
+    AddrInitIPv4(&Destination, ((PIPv4_HEADER)IPPacket->Header)->DstAddr);
+
+    return PMTUGetPathMTU(&Destination, NCE->Interface->MTU, NULL);
+}
+
 NTSTATUS IPSendDatagram(PIP_PACKET IPPacket, PNEIGHBOR_CACHE_ENTRY NCE)
 /*
  * FUNCTION: Sends an IP datagram to a remote address
@@ -234,14 +284,309 @@ NTSTATUS IPSendDatagram(PIP_PACKET IPPacket, PNEIGHBOR_CACHE_ENTRY NCE)
  *     send routine (IPSendFragment)
  */
 {
+    UINT PathMTU;
+
     TI_DbgPrint(MAX_TRACE, ("Called. IPPacket (0x%X)  NCE (0x%X)\n", IPPacket, NCE));
 
     DISPLAY_IP_PACKET(IPPacket);
 
+    IP_STAT_INC(OutRequests);
+
     /* Fetch path MTU now, because it may change */
-    TI_DbgPrint(MID_TRACE,("PathMTU: %d\n", NCE->Interface->MTU));
+    PathMTU = IPPathMTU(IPPacket, NCE);
+    TI_DbgPrint(MID_TRACE,("PathMTU: %d\n", PathMTU));
+
+    return SendFragments(IPPacket, NCE, PathMTU);
+}
+
+VOID IPSendBatchComplete
+(PVOID Context, PNDIS_PACKET NdisPacket, NDIS_STATUS NdisStatus)
+/*
+ * FUNCTION: Batched IP datagram send completion handler
+ * ARGUMENTS:
+ *     Context    = Unused
+ *     Packet     = Pointer to NDIS packet that was sent
+ *     NdisStatus = NDIS status of operation
+ */
+{
+    TI_DbgPrint
+	(MAX_TRACE,
+	 ("Called. NdisPacket (0x%X)  NdisStatus (0x%X)\n",
+	  NdisPacket, NdisStatus));
+
+    FreeNdisPacket(NdisPacket);
+}
+
+static NTSTATUS IPQueueBatch(
+    PNEIGHBOR_CACHE_ENTRY NCE,
+    PNDIS_PACKET *Batch,
+    PVOID *Contexts,
+    UINT Count)
+{
+    if (NBQueuePackets(NCE, Batch, Count, IPSendBatchComplete, Contexts))
+        return STATUS_SUCCESS;
+
+    IP_STAT_ADD(OutDiscards, Count);
+
+    while (Count > 0)
+        FreeNdisPacket(Batch[--Count]);
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS IPSendDatagramBatch(
+    PIP_PACKET IPPackets,
+    UINT Count,
+    PNEIGHBOR_CACHE_ENTRY NCE,
+    PUINT Sent)
+/*
+ * FUNCTION: Sends several IP datagrams through the same first hop
+ * ARGUMENTS:
+ *     IPPackets = Array of IP packets, all freed on return
+ *     Count     = Number of packets in the array
+ *     NCE       = Pointer to NCE for first hop to destination
+ *     Sent      = Address of buffer to place the number of datagrams sent in
+ * RETURNS:
+ *     Status of the failed send, STATUS_SUCCESS if none failed
+ * NOTES:
+ *     Datagrams that fit the path MTU are queued on the NCE together and
+ *     complete asynchronously; larger ones take the fragmenting path.
+ *     Sending stops at the first failure and the datagrams behind it are
+ *     dropped, so the ones counted in Sent are the first of the array
+ */
+{
+    PNDIS_PACKET Batch[LL_TRANSMIT_BATCH];
+    PVOID Contexts[LL_TRANSMIT_BATCH];
+    NTSTATUS Status, Result = STATUS_SUCCESS;
+    PIP_PACKET IPPacket;
+    PIPv4_HEADER Header;
+    UINT i, PathMTU, Queued = 0;
+
+    TI_DbgPrint(MAX_TRACE, ("Called. %d packets  NCE (0x%X)\n", Count, NCE));
+
+    IP_STAT_ADD(OutRequests, Count);
+
+    *Sent = 0;
+
+    for (i = 0; i < Count; i++)
+    {
+        IPPacket = &IPPackets[i];
+
+        if (!NT_SUCCESS(Result))
+        {
+            IP_STAT_INC(OutDiscards);
+            IPPacket->Free(IPPacket);
+            continue;
+        }
+
+        DISPLAY_IP_PACKET(IPPacket);
+
+        PathMTU = IPPathMTU(IPPacket, NCE);
+        if (IPPacket->TotalSize > PathMTU)
+        {
+            /* Keep datagrams in order */
+            if (Queued > 0)
+            {
+                Result = IPQueueBatch(NCE, Batch, Contexts, Queued);
+                if (NT_SUCCESS(Result))
+                    *Sent += Queued;
+                Queued = 0;
+
+                if (!NT_SUCCESS(Result))
+                {
+                    IP_STAT_INC(OutDiscards);
+                    IPPacket->Free(IPPacket);
+                    continue;
+                }
+            }
+
+            Status = SendFragments(IPPacket, NCE, PathMTU);
+            if (NT_SUCCESS(Status))
+                (*Sent)++;
+            else
+                Result = Status;
+            continue;
+        }
+
+        /* Not going through PrepareNextFragment, so checksum here */
+        Header = IPPacket->Header;
+        Header->Checksum = 0;
+        Header->Checksum = (USHORT)IPv4Checksum(Header, IPPacket->HeaderSize, 0);
+
+        /* The NDIS packet now belongs to the batch */
+        PC(IPPacket->NdisPacket)->Timestamp = IPPacket->Timestamp;
+        Batch[Queued] = IPPacket->NdisPacket;
+        Contexts[Queued] = NULL;
+        Queued++;
+        IPPacket->NdisPacket = NULL;
+        IPPacket->Free(IPPacket);
+
+        if (Queued == LL_TRANSMIT_BATCH)
+        {
+            Result = IPQueueBatch(NCE, Batch, Contexts, Queued);
+            if (NT_SUCCESS(Result))
+                *Sent += Queued;
+            Queued = 0;
+        }
+    }
+
+    if (Queued > 0)
+    {
+        Result = IPQueueBatch(NCE, Batch, Contexts, Queued);
+        if (NT_SUCCESS(Result))
+            *Sent += Queued;
+    }
+
+    return Result;
+}
+
+static USHORT IPSegmentChecksum(
+    PIPv4_HEADER Header,
+    PUDP_HEADER UDPHeader,
+    UINT Length)
+/*
+ * FUNCTION: Calculates the UDP checksum of one segment
+ * ARGUMENTS:
+ *     Header    = IPv4 header of the segment
+ *     UDPHeader = UDP header followed by the payload, checksum field zeroed
+ *     Length    = Length of UDP header and payload
+ * RETURNS:
+ *     Checksum in network byte order
+ */
+{
+    UDP_PSEUDO_HEADER Pseudo;
+    ULONG Sum;
+    USHORT Checksum;
+
+    Pseudo.SourceAddress = Header->SrcAddr;
+    Pseudo.DestAddress = Header->DstAddr;
+    Pseudo.Zero = 0;
+    Pseudo.Protocol = IPPROTO_UDP;
+    Pseudo.UDPLength = WH2N((USHORT)Length);
+
+    Sum = csum_partial((PUCHAR)&Pseudo, sizeof(Pseudo), 0);
+    Sum = csum_partial((PUCHAR)UDPHeader, Length, Sum);
+    Checksum = (USHORT)~ChecksumFold(Sum);
+
+    /* Zero means no checksum was computed */
+    return Checksum ? Checksum : 0xFFFF;
+}
+
+NTSTATUS IPSendSegments(
+    PIP_PACKET Template,
+    PCHAR Data,
+    UINT DataSize,
+    UINT SegmentSize,
+    PNEIGHBOR_CACHE_ENTRY NCE,
+    PUINT DataSent)
+/*
+ * FUNCTION: Splits a large UDP send into datagrams of equal size
+ * ARGUMENTS:
+ *     Template    = IP packet holding only the IPv4 and UDP headers, freed on return
+ *     Data        = Payload to split
+ *     DataSize    = Size of the payload
+ *     SegmentSize = Payload size of each datagram, the last one may be shorter
+ *     NCE         = Pointer to NCE for first hop to destination
+ *     DataSent    = Address of buffer to place the payload bytes sent in
+ * RETURNS:
+ *     Status of operation, STATUS_SUCCESS if at least one datagram was sent
+ * NOTES:
+ *     Each datagram is the template headers with its length, id and
+ *     checksums patched, followed by its part of the payload. The data is
+ *     copied once, straight into the packet handed to the link layer.
+ *     NDIS 5 miniports cannot segment UDP themselves, so this is the
+ *     latest point it can be done at
+ */
+{
+    PNDIS_PACKET Batch[LL_TRANSMIT_BATCH];
+    PVOID Contexts[LL_TRANSMIT_BATCH];
+    PIPv4_HEADER Header;
+    PUDP_HEADER UDPHeader;
+    PCHAR Buffer;
+    UINT HeadersSize, Offset, Size, BufferSize, Queued = 0, QueuedSize = 0;
+    USHORT Id;
+    NTSTATUS Status = STATUS_SUCCESS, QueueStatus;
+
+    *DataSent = 0;
+
+    TI_DbgPrint(MAX_TRACE, ("Called. %d bytes in %d byte segments  NCE (0x%X)\n",
+                            DataSize, SegmentSize, NCE));
+
+    ASSERT(((PIPv4_HEADER)Template->Header)->Protocol == IPPROTO_UDP);
+
+    HeadersSize = Template->HeaderSize + sizeof(UDP_HEADER);
+
+    /* Segments are never fragmented, so they have to fit the path */
+    if (SegmentSize == 0 || HeadersSize + SegmentSize > IPPathMTU(Template, NCE))
+    {
+        Template->Free(Template);
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    /* One id per segment, taken together so no other sender gets one in between */
+    Id = (USHORT)InterlockedExchangeAdd(&IPv4Identification,
+                                        (DataSize + SegmentSize - 1) / SegmentSize) + 1;
+
+    for (Offset = 0; Offset < DataSize; Offset += Size, Id++)
+    {
+        Size = MIN(SegmentSize, DataSize - Offset);
+
+        IP_STAT_INC(OutRequests);
+
+        if (AllocatePacketWithBuffer(&Batch[Queued], NULL, HeadersSize + Size) != NDIS_STATUS_SUCCESS)
+        {
+            IP_STAT_INC(OutDiscards);
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        GetDataPtr(Batch[Queued], 0, &Buffer, &BufferSize);
+
+        RtlCopyMemory(Buffer, Template->Header, HeadersSize);
+        RtlCopyMemory(Buffer + HeadersSize, Data + Offset, Size);
+
+        Header = (PIPv4_HEADER)Buffer;
+        Header->TotalLength = WH2N((USHORT)(HeadersSize + Size));
+        Header->Id = WH2N(Id);
+        Header->Checksum = 0;
+        Header->Checksum = (USHORT)IPv4Checksum(Header, Template->HeaderSize, 0);
+
+        UDPHeader = (PUDP_HEADER)(Buffer + Template->HeaderSize);
+        UDPHeader->Length = WH2N((USHORT)(sizeof(UDP_HEADER) + Size));
+        UDPHeader->Checksum = 0;
+        UDPHeader->Checksum = IPSegmentChecksum(Header, UDPHeader, sizeof(UDP_HEADER) + Size);
+
+        PC(Batch[Queued])->Timestamp = Template->Timestamp;
+        Contexts[Queued] = NULL;
+        QueuedSize += Size;
+
+        if (++Queued == LL_TRANSMIT_BATCH)
+        {
+            Status = IPQueueBatch(NCE, Batch, Contexts, Queued);
+            if (NT_SUCCESS(Status))
+                *DataSent += QueuedSize;
+            Queued = QueuedSize = 0;
+            if (!NT_SUCCESS(Status))
+                break;
+        }
+    }
+
+    if (Queued > 0)
+    {
+        QueueStatus = IPQueueBatch(NCE, Batch, Contexts, Queued);
+        if (NT_SUCCESS(QueueStatus))
+            *DataSent += QueuedSize;
+        else if (NT_SUCCESS(Status))
+            Status = QueueStatus;
+    }
+
+    Template->Free(Template);
+
+    /* The datagrams that went out are not taken back, report them */
+    if (*DataSent > 0)
+        return STATUS_SUCCESS;
 
-    return SendFragments(IPPacket, NCE, NCE->Interface->MTU);
+    return Status;
 }
 
 /* EOF */
@@ -57,6 +57,32 @@ TDI_STATUS SetAddressFileInfo(TDIObjectID *ID,
 
          return TDI_SUCCESS;
 
+      case AO_OPTION_WINDOW:
+         if (BufferSize < sizeof(UINT))
+             return TDI_INVALID_PARAMETER;
+
+         /* Already queued datagrams are kept, new ones are dropped until
+            the queue drains below the new limit */
+         LockObject(AddrFile, &OldIrql);
+         AddrFile->ReceiveBufferSize = *((PUINT)Buffer);
+         UnlockObject(AddrFile, OldIrql);
+
+         return TDI_SUCCESS;
+
+      case AO_OPTION_UDP_SEGMENT_SIZE:
+         if (BufferSize < sizeof(UINT))
+             return TDI_INVALID_PARAMETER;
+
+         if (AddrFile->Protocol != IPPROTO_UDP ||
+             *((PUINT)Buffer) > UDP_MAX_SEGMENT_SIZE)
+             return TDI_INVALID_PARAMETER;
+
+         LockObject(AddrFile, &OldIrql);
+         AddrFile->SegmentSize = *((PUINT)Buffer);
+         UnlockObject(AddrFile, OldIrql);
+
+         return TDI_SUCCESS;
+
       default:
          DbgPrint("Unimplemented option %x\n", ID->toi_id);
 
@@ -69,7 +95,25 @@ TDI_STATUS GetAddressFileInfo(TDIObjectID *ID,
                               PVOID Buffer,
                               PUINT BufferSize)
 {
-    UNIMPLEMENTED
+    ULONG Value;
+
+    switch (ID->toi_id)
+    {
+      case AO_OPTION_WINDOW:
+         Value = AddrFile->ReceiveBufferSize;
+         return InfoCopyOut((PCHAR)&Value, sizeof(ULONG), Buffer, BufferSize);
 
-    return TDI_INVALID_REQUEST;
+      case AO_OPTION_RCVBUF_DROPS:
+         Value = AddrFile->ReceiveDrops;
+         return InfoCopyOut((PCHAR)&Value, sizeof(ULONG), Buffer, BufferSize);
+
+      case AO_OPTION_UDP_SEGMENT_SIZE:
+         Value = AddrFile->SegmentSize;
+         return InfoCopyOut((PCHAR)&Value, sizeof(ULONG), Buffer, BufferSize);
+
+      default:
+         UNIMPLEMENTED
+
+         return TDI_INVALID_REQUEST;
+    }
 }
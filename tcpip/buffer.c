@@ -323,14 +323,222 @@ void GetDataPtr( PNDIS_PACKET Packet,
     SkipToOffset( Buffer, Offset, DataOut, Size );
 }
 
+static VOID CursorSettle(
+    PPACKET_CURSOR Cursor)
+/*
+ * FUNCTION: Moves a cursor off the end of its buffer
+ * ARGUMENTS:
+ *     Cursor = Cursor that may have no bytes left in its buffer
+ * NOTES:
+ *     Afterwards Left is zero only past the end of the chain
+ */
+{
+    while (Cursor->Left == 0 && Cursor->Buffer) {
+        NdisGetNextBuffer(Cursor->Buffer, &Cursor->Buffer);
+        if (Cursor->Buffer)
+            NdisQueryBuffer(Cursor->Buffer, (PVOID)&Cursor->Data, &Cursor->Left);
+    }
+}
+
+
+BOOLEAN CursorInitialize(
+    PPACKET_CURSOR Cursor,
+    PNDIS_PACKET Packet,
+    UINT Offset)
+/*
+ * FUNCTION: Places a cursor into an NDIS packet
+ * ARGUMENTS:
+ *     Cursor = Cursor to set up
+ *     Packet = Pointer to NDIS packet to read
+ *     Offset = Offset of the first byte to read
+ * RETURNS:
+ *     FALSE if the packet is smaller than Offset bytes
+ */
+{
+    Cursor->Packet = Packet;
+    Cursor->Data   = NULL;
+    Cursor->Left   = 0;
+    Cursor->Offset = 0;
+
+    NdisQueryPacket(Packet, NULL, NULL, &Cursor->Buffer, NULL);
+    if (Cursor->Buffer)
+        NdisQueryBuffer(Cursor->Buffer, (PVOID)&Cursor->Data, &Cursor->Left);
+
+    CursorSettle(Cursor);
+
+    return CursorPull(Cursor, NULL, Offset) == Offset;
+}
+
+
+PVOID CursorPeek(
+    PPACKET_CURSOR Cursor,
+    UINT Length)
+/*
+ * FUNCTION: Looks at the next bytes without moving the cursor
+ * ARGUMENTS:
+ *     Cursor = Cursor to read at
+ *     Length = Number of bytes wanted
+ * RETURNS:
+ *     Pointer to the bytes, NULL if they are not contiguous
+ */
+{
+    return (Length <= Cursor->Left) ? Cursor->Data : NULL;
+}
+
+
+UINT CursorPull(
+    PPACKET_CURSOR Cursor,
+    PVOID Destination,
+    UINT Length)
+/*
+ * FUNCTION: Copies the next bytes out and moves the cursor past them
+ * ARGUMENTS:
+ *     Cursor      = Cursor to read at
+ *     Destination = Pointer to buffer, NULL to only skip the bytes
+ *     Length      = Number of bytes to pull
+ * RETURNS:
+ *     Number of bytes pulled, less than Length at the end of the packet
+ */
+{
+    UINT BytesToCopy, BytesCopied = 0;
+
+    while (Length && Cursor->Left) {
+        BytesToCopy = MIN(Cursor->Left, Length);
+
+        if (Destination) {
+            RtlCopyMemory(Destination, Cursor->Data, BytesToCopy);
+            Destination = (PCHAR)Destination + BytesToCopy;
+        }
+
+        Cursor->Data   += BytesToCopy;
+        Cursor->Left   -= BytesToCopy;
+        Cursor->Offset += BytesToCopy;
+        BytesCopied    += BytesToCopy;
+        Length         -= BytesToCopy;
+
+        CursorSettle(Cursor);
+    }
+
+    return BytesCopied;
+}
+
+
+PVOID CursorLinearize(
+    PPACKET_CURSOR Cursor,
+    PVOID Scratch,
+    UINT Length)
+/*
+ * FUNCTION: Gets the next bytes in one piece and moves the cursor past them
+ * ARGUMENTS:
+ *     Cursor  = Cursor to read at
+ *     Scratch = Buffer of at least Length bytes, used only if the bytes
+ *               span buffers
+ *     Length  = Number of bytes wanted
+ * RETURNS:
+ *     Pointer to the bytes in the packet or in Scratch, NULL if the
+ *     packet is too short
+ */
+{
+    PVOID Data = CursorPeek(Cursor, Length);
+
+    if (Data) {
+        CursorPull(Cursor, NULL, Length);
+        return Data;
+    }
+
+    if (CursorPull(Cursor, Scratch, Length) != Length)
+        return NULL;
+
+    return Scratch;
+}
+
+/* Freed packets keep their buffer and wait on a per-processor stack of
+   their size class, so most allocations take neither a pool allocation nor
+   an NDIS descriptor. A class is picked by the smallest size that fits. */
+static const UINT PacketCacheSizes[TCP_PACKET_CACHE_CLASSES] =
+    { 128, 256, 1536, 65536 };          /* Headers only, small, MTU, largest datagram */
+static const UINT PacketCacheDepths[TCP_PACKET_CACHE_CLASSES] =
+    { 32, 32, 32, 4 };
+
+#define PACKET_CACHE_DEPTH 32           /* Largest of PacketCacheDepths */
+
+/* Packets held by all caches together. Each processor may hold 100, which
+   on a large machine would take most of the 2000 descriptors of
+   GlobalPacketPool (see DriverEntry) away from everybody else */
+#define PACKET_CACHE_LIMIT 400
+
+typedef struct _PACKET_CACHE_CPU {
+    PNDIS_PACKET Packets[TCP_PACKET_CACHE_CLASSES][PACKET_CACHE_DEPTH];
+    ULONG Count[TCP_PACKET_CACHE_CLASSES];
+    ULONGLONG Allocations[TCP_PACKET_CACHE_CLASSES];
+    ULONGLONG Hits[TCP_PACKET_CACHE_CLASSES];
+    ULONGLONG Frees[TCP_PACKET_CACHE_CLASSES];
+    ULONGLONG Recycled[TCP_PACKET_CACHE_CLASSES];
+} PACKET_CACHE_CPU, *PPACKET_CACHE_CPU;
+
+static PPACKET_CACHE_CPU PacketCache = NULL;
+static volatile LONG PacketCacheTotal = 0;
+
+static UINT PacketCacheClass(
+    UINT Len)
+{
+    UINT Class;
+
+    for (Class = 0; Class < TCP_PACKET_CACHE_CLASSES; Class++)
+    {
+        if (Len <= PacketCacheSizes[Class])
+            break;
+    }
+
+    return Class;
+}
+
 NDIS_STATUS AllocatePacketWithBuffer( PNDIS_PACKET *NdisPacket,
 				      PCHAR Data, UINT Len ) {
-    PNDIS_PACKET Packet;
+    PNDIS_PACKET Packet = NULL;
     PNDIS_BUFFER Buffer;
+    PPACKET_CACHE_CPU Cpu;
     NDIS_STATUS Status;
     PCHAR NewData;
+    UINT Class, Size;
+    KIRQL OldIrql;
+
+    Class = PacketCacheClass(Len);
+
+    if( Class < TCP_PACKET_CACHE_CLASSES && PacketCache ) {
+	KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+	Cpu = STATS_CPU(PacketCache, PACKET_CACHE_CPU);
+	STATS_COUNT(Cpu->Allocations[Class], 1);
+	if( Cpu->Count[Class] ) {
+	    Packet = Cpu->Packets[Class][--Cpu->Count[Class]];
+	    STATS_COUNT(Cpu->Hits[Class], 1);
+	    InterlockedDecrement(&PacketCacheTotal);
+	}
+
+	KeLowerIrql(OldIrql);
+
+	if( Packet ) {
+	    Buffer = PC(Packet)->CacheBuffer;
+	    NdisAdjustBufferLength( Buffer, Len );
+
+	    if( Data ) {
+		NdisQueryBuffer( Buffer, (PVOID)&NewData, &Size );
+		RtlCopyMemory(NewData, Data, Len);
+	    }
+
+	    *NdisPacket = Packet;
+	    return NDIS_STATUS_SUCCESS;
+	}
+
+	/* Describe the whole class so the packet can be reused for any size in it */
+	Size = PacketCacheSizes[Class];
+    } else {
+	Class = TCP_PACKET_CACHE_CLASSES;
+	Size = Len;
+    }
 
-    NewData = ExAllocatePoolWithTag( NonPagedPool, Len, PACKET_BUFFER_TAG );
+    NewData = ExAllocatePoolWithTag( NonPagedPool, Size, PACKET_BUFFER_TAG );
     if( !NewData ) return NDIS_STATUS_RESOURCES;
 
     if( Data ) RtlCopyMemory(NewData, Data, Len);
@@ -341,32 +549,36 @@ NDIS_STATUS AllocatePacketWithBuffer( PNDIS_PACKET *NdisPacket,
 	return Status;
     }
 
-    NdisAllocateBuffer( &Status, &Buffer, GlobalBufferPool, NewData, Len );
+    NdisAllocateBuffer( &Status, &Buffer, GlobalBufferPool, NewData, Size );
     if( Status != NDIS_STATUS_SUCCESS ) {
 	ExFreePoolWithTag( NewData, PACKET_BUFFER_TAG );
-	FreeNdisPacket( Packet );
+	NdisFreePacket( Packet );
 	return Status;
     }
 
+    if( Size != Len ) NdisAdjustBufferLength( Buffer, Len );
+
     NdisChainBufferAtFront( Packet, Buffer );
+    PC(Packet)->Timestamp = 0;
+    PC(Packet)->References = 0;
+    PC(Packet)->CacheClass = Class;
+    PC(Packet)->CacheBuffer = (Class < TCP_PACKET_CACHE_CLASSES) ? Buffer : NULL;
     *NdisPacket = Packet;
 
     return NDIS_STATUS_SUCCESS;
 }
 
 
-VOID FreeNdisPacket
+static VOID ReleaseNdisPacket
 ( PNDIS_PACKET Packet )
 /*
- * FUNCTION: Frees an NDIS packet
+ * FUNCTION: Frees an NDIS packet, its buffers and their data
  * ARGUMENTS:
  *     Packet = Pointer to NDIS packet to be freed
  */
 {
     PNDIS_BUFFER Buffer, NextBuffer;
 
-    TI_DbgPrint(DEBUG_PBUFFER, ("Packet (0x%X)\n", Packet));
-
     /* Free all the buffers in the packet first */
     NdisQueryPacket(Packet, NULL, NULL, &Buffer, NULL);
     for (; Buffer != NULL; Buffer = NextBuffer) {
@@ -384,3 +596,161 @@ VOID FreeNdisPacket
     /* Finally free the NDIS packet discriptor */
     NdisFreePacket(Packet);
 }
+
+
+VOID FreeNdisPacket
+( PNDIS_PACKET Packet )
+/*
+ * FUNCTION: Frees an NDIS packet
+ * ARGUMENTS:
+ *     Packet = Pointer to NDIS packet to be freed
+ * NOTES:
+ *     A packet from AllocatePacketWithBuffer that still holds only its
+ *     own buffer goes back to the cache of its size class. A lent packet
+ *     (References set) is completed to its sender instead
+ */
+{
+    PPACKET_CACHE_CPU Cpu;
+    PNDIS_BUFFER Buffer, FirstBuffer;
+    BOOLEAN Recycled = FALSE;
+    UINT Class, BufferCount;
+    KIRQL OldIrql;
+
+    TI_DbgPrint(DEBUG_PBUFFER, ("Packet (0x%X)\n", Packet));
+
+    /* A packet lent to a receiver goes back to its sender once released */
+    if (PC(Packet)->References) {
+        if (InterlockedDecrement(&PC(Packet)->References) == 0)
+            (*PC(Packet)->DLComplete)(PC(Packet)->Context, Packet, NDIS_STATUS_SUCCESS);
+        return;
+    }
+
+    Buffer = PC(Packet)->CacheBuffer;
+
+    if (Buffer && PacketCache) {
+        NdisQueryPacket(Packet, NULL, &BufferCount, &FirstBuffer, NULL);
+
+        if (FirstBuffer == Buffer && BufferCount == 1) {
+            Class = PC(Packet)->CacheClass;
+
+            /* Start the next user off like a new packet */
+            NdisReinitializePacket(Packet);
+            NdisSetPacketFlags(Packet, 0);
+            RtlZeroMemory(NDIS_OOB_DATA_FROM_PACKET(Packet), sizeof(NDIS_PACKET_OOB_DATA));
+            RtlZeroMemory(NDIS_PACKET_EXTENSION_FROM_PACKET(Packet), sizeof(NDIS_PACKET_EXTENSION));
+            NdisChainBufferAtFront(Packet, Buffer);
+            RtlZeroMemory(PC(Packet), FIELD_OFFSET(PACKET_CONTEXT, CacheClass));
+
+            KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+            Cpu = STATS_CPU(PacketCache, PACKET_CACHE_CPU);
+            STATS_COUNT(Cpu->Frees[Class], 1);
+            if (Cpu->Count[Class] < PacketCacheDepths[Class]) {
+                if (InterlockedIncrement(&PacketCacheTotal) <= PACKET_CACHE_LIMIT) {
+                    Cpu->Packets[Class][Cpu->Count[Class]++] = Packet;
+                    STATS_COUNT(Cpu->Recycled[Class], 1);
+                    Recycled = TRUE;
+                } else {
+                    InterlockedDecrement(&PacketCacheTotal);
+                }
+            }
+
+            KeLowerIrql(OldIrql);
+
+            if (Recycled)
+                return;
+        }
+    }
+
+    ReleaseNdisPacket(Packet);
+}
+
+
+NTSTATUS PacketCacheStartup(VOID)
+{
+    PacketCache = STATS_ALLOCATE(PACKET_CACHE_CPU);
+    if (!PacketCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID PacketCacheShutdown(VOID)
+/*
+ * FUNCTION: Frees the packets waiting in the caches
+ * NOTES:
+ *     Packets freed afterwards are released right away
+ */
+{
+    PPACKET_CACHE_CPU Cache = PacketCache, Cpu;
+    UINT i, Class;
+
+    if (!Cache)
+        return;
+
+    PacketCache = NULL;
+
+    for (i = 0; i < (UINT)KeNumberProcessors; i++)
+    {
+        Cpu = (PPACKET_CACHE_CPU)((PUCHAR)Cache + STATS_STRIDE(PACKET_CACHE_CPU) * i);
+
+        for (Class = 0; Class < TCP_PACKET_CACHE_CLASSES; Class++)
+        {
+            while (Cpu->Count[Class])
+                ReleaseNdisPacket(Cpu->Packets[Class][--Cpu->Count[Class]]);
+        }
+    }
+
+    PacketCacheTotal = 0;
+
+    StatsFree(Cache);
+}
+
+
+TDI_STATUS InfoTdiQueryGetPacketCache(
+    PNDIS_BUFFER Buffer,
+    PUINT BufferSize)
+/*
+ * FUNCTION: Returns the counters of the packet caches
+ * ARGUMENTS:
+ *   Buffer     = Pointer to buffer with data to use
+ *   BufferSize = Pointer to buffer with size of Buffer. On return
+ *                this is filled with number of bytes returned
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    TCPIP_PACKET_CACHE_INFO Info;
+    PTCPIP_PACKET_CACHE_STATS Stats;
+    PPACKET_CACHE_CPU Cpu;
+    UINT i, Class;
+
+    RtlZeroMemory(&Info, sizeof(Info));
+    Info.Classes = TCP_PACKET_CACHE_CLASSES;
+
+    for (Class = 0; Class < TCP_PACKET_CACHE_CLASSES; Class++)
+    {
+        Stats = &Info.Class[Class];
+        Stats->BufferSize = PacketCacheSizes[Class];
+
+        if (!PacketCache)
+            continue;
+
+        for (i = 0; i < (UINT)KeNumberProcessors; i++)
+        {
+            Cpu = (PPACKET_CACHE_CPU)((PUCHAR)PacketCache + STATS_STRIDE(PACKET_CACHE_CPU) * i);
+
+            Stats->Cached += Cpu->Count[Class];
+            Stats->Allocations += InterlockedCompareExchange64((PLONGLONG)&Cpu->Allocations[Class], 0, 0);
+            Stats->Hits += InterlockedCompareExchange64((PLONGLONG)&Cpu->Hits[Class], 0, 0);
+            Stats->Frees += InterlockedCompareExchange64((PLONGLONG)&Cpu->Frees[Class], 0, 0);
+            Stats->Recycled += InterlockedCompareExchange64((PLONGLONG)&Cpu->Recycled[Class], 0, 0);
+        }
+
+        /* A packet freed on another processor may be counted before its allocation */
+        Stats->Outstanding = (Stats->Allocations > Stats->Frees) ? Stats->Allocations - Stats->Frees : 0;
+    }
+
+    return InfoCopyOut((PCHAR)&Info, sizeof(Info), Buffer, BufferSize);
+}
@@ -23,6 +23,11 @@ NTSTATUS IRPFinish( PIRP Irp, NTSTATUS Status ) {
 	(void)IoSetCancelRoutine( Irp, NULL );
         IoReleaseCancelSpinLock(OldIrql);
 
+        TRACE_IRP(TCP_TRACE_IRP_COMPLETE, Irp, Status, Irp->IoStatus.Information);
+
+        if (LatencyEnabled)
+            LatencyRecordIrp(Irp);
+
 	IoCompleteRequest( Irp, IO_NETWORK_INCREMENT );
     }
 
@@ -58,6 +63,8 @@ NTSTATUS DispPrepareIrpForCancel(
         (void)IoSetCancelRoutine(Irp, CancelRoutine);
         IoReleaseCancelSpinLock(OldIrql);
 
+        TRACE_IRP(TCP_TRACE_IRP_QUEUE, Irp, IrpSp->MinorFunction, 0);
+
         TI_DbgPrint(DEBUG_IRP, ("Leaving (IRP at 0x%X can now be cancelled).\n", Irp));
 
         return STATUS_SUCCESS;
@@ -137,6 +144,8 @@ VOID NTAPI DispCancelRequest(
     Irp->IoStatus.Status = STATUS_CANCELLED;
     Irp->IoStatus.Information = 0;
 
+    TRACE_IRP(TCP_TRACE_IRP_CANCEL, Irp, MinorFunction, 0);
+
 #if DBG
     if (!Irp->Cancel)
         TI_DbgPrint(MIN_TRACE, ("Irp->Cancel is FALSE, should be TRUE.\n"));
@@ -223,6 +232,8 @@ VOID NTAPI DispCancelListenRequest(
 
     TI_DbgPrint(DEBUG_IRP, ("IRP at (0x%X).\n", Irp));
 
+    TRACE_IRP(TCP_TRACE_IRP_CANCEL, Irp, IrpSp->MinorFunction, 0);
+
 #if DBG
     if (!Irp->Cancel)
         TI_DbgPrint(MIN_TRACE, ("Irp->Cancel is FALSE, should be TRUE.\n"));
@@ -796,6 +807,9 @@ NTSTATUS DispTdiReceive(
   IrpSp = IoGetCurrentIrpStackLocation(Irp);
   ReceiveInfo = (PTDI_REQUEST_KERNEL_RECEIVE)&(IrpSp->Parameters);
 
+  /* Stamped by the packet that completes it */
+  IRP_LATENCY_STAMP(Irp) = 0;
+
   TranContext = IrpSp->FileObject->FsContext;
   if (TranContext == NULL)
     {
@@ -827,6 +841,7 @@ NTSTATUS DispTdiReceive(
 	  &BytesReceived,
 	  ReceiveInfo->ReceiveFlags,
 	  DispDataRequestComplete,
+	  Irp,
 	  Irp);
     }
 
@@ -864,6 +879,9 @@ NTSTATUS DispTdiReceiveDatagram(
   IrpSp     = IoGetCurrentIrpStackLocation(Irp);
   DgramInfo = (PTDI_REQUEST_KERNEL_RECEIVEDG)&(IrpSp->Parameters);
 
+  /* Stamped by the packet that completes it */
+  IRP_LATENCY_STAMP(Irp) = 0;
+
   TranContext = IrpSp->FileObject->FsContext;
   if (TranContext == NULL)
     {
@@ -937,6 +955,8 @@ NTSTATUS DispTdiSend(
   IrpSp = IoGetCurrentIrpStackLocation(Irp);
   SendInfo = (PTDI_REQUEST_KERNEL_SEND)&(IrpSp->Parameters);
 
+  IRP_LATENCY_STAMP(Irp) = LATENCY_STAMP();
+
   TranContext = IrpSp->FileObject->FsContext;
   if (TranContext == NULL)
     {
@@ -960,27 +980,30 @@ NTSTATUS DispTdiSend(
   TI_DbgPrint(MID_TRACE,("TCPIP<<< Got an MDL: %x\n", Irp->MdlAddress));
   if (NT_SUCCESS(Status))
     {
-	PVOID Data;
-	UINT Len;
-
-	NdisQueryBuffer( Irp->MdlAddress, &Data, &Len );
+	/* Once queued, the tcpip thread may complete the send before
+	 * TCPSendData returns, so the IRP has to be pending already */
+	IoMarkIrpPending(Irp);
 
 	TI_DbgPrint(MID_TRACE,("About to TCPSendData\n"));
 	Status = TCPSendData(
 	    TranContext->Handle.ConnectionContext,
-	    Data,
+	    (PNDIS_BUFFER)Irp->MdlAddress,
 	    SendInfo->SendLength,
 	    &BytesSent,
 	    SendInfo->SendFlags,
 	    DispDataRequestComplete,
 	    Irp);
+
+	if (Status != STATUS_PENDING)
+	    DispDataRequestComplete(Irp, Status, BytesSent);
+
+	TI_DbgPrint(DEBUG_IRP, ("Leaving. Status is (0x%X)\n", Status));
+
+	return STATUS_PENDING;
     }
 
 done:
-   if (Status != STATUS_PENDING) {
-       DispDataRequestComplete(Irp, Status, BytesSent);
-   } else
-       IoMarkIrpPending(Irp);
+  DispDataRequestComplete(Irp, Status, BytesSent);
 
   TI_DbgPrint(DEBUG_IRP, ("Leaving. Status is (0x%X)\n", Status));
 
@@ -1009,6 +1032,8 @@ NTSTATUS DispTdiSendDatagram(
     IrpSp       = IoGetCurrentIrpStackLocation(Irp);
     DgramInfo   = (PTDI_REQUEST_KERNEL_SENDDG)&(IrpSp->Parameters);
 
+    IRP_LATENCY_STAMP(Irp) = LATENCY_STAMP();
+
     TranContext = IrpSp->FileObject->FsContext;
     if (TranContext == NULL)
     {
@@ -1191,6 +1216,11 @@ NTSTATUS DispTdiSetEventHandler(PIRP Irp)
     if (Parameters->EventHandler == NULL) {
       AddrFile->ChainedReceiveHandlerContext    = NULL;
       AddrFile->RegisteredChainedReceiveHandler = FALSE;
+    } else if (AddrFile->Protocol == IPPROTO_TCP) {
+      /* lwIP owns the receive buffers, there are no descriptors to
+         lend out and return later, so TCP data is only indicated
+         through TDI_EVENT_RECEIVE */
+      Status = STATUS_NOT_SUPPORTED;
     } else {
       AddrFile->ChainedReceiveHandler =
         (PTDI_IND_CHAINED_RECEIVE)Parameters->EventHandler;
@@ -1600,8 +1630,383 @@ NTSTATUS DispTdiDeleteIPAddress( PIRP Irp, PIO_STACK_LOCATION IrpSp ) {
         }
     } EndFor(IF);
 
+    if (NT_SUCCESS(Status))
+        AddrSetRebuild();
+
     Irp->IoStatus.Status = Status;
     return Status;
 }
 
+static NTSTATUS DispSendDatagramsRaw(
+    PADDRESS_FILE AddrFile,
+    PTCP_SEND_DATAGRAMS Batch,
+    PCHAR Data,
+    PULONG Sent)
+/*
+ * FUNCTION: Sends a datagram batch one datagram at a time
+ * ARGUMENTS:
+ *     AddrFile = Address file without a batched send routine
+ *     Batch    = Validated datagram descriptors
+ *     Data     = Mapped data buffer
+ *     Sent     = Address of buffer to place the number of datagrams sent in
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    TDI_CONNECTION_INFORMATION ConnInfo;
+    TA_IP_ADDRESS Remote;
+    NTSTATUS Status = STATUS_SUCCESS;
+    ULONG DataUsed, i;
+
+    RtlZeroMemory(&ConnInfo, sizeof(ConnInfo));
+    ConnInfo.RemoteAddressLength = sizeof(Remote);
+    ConnInfo.RemoteAddress = &Remote;
+
+    Remote.TAAddressCount = 1;
+    Remote.Address[0].AddressLength = TDI_ADDRESS_LENGTH_IP;
+    Remote.Address[0].AddressType = TDI_ADDRESS_TYPE_IP;
+    RtlZeroMemory(Remote.Address[0].Address[0].sin_zero, 8);
+
+    *Sent = 0;
+
+    for (i = 0; i < Batch->Count; i++)
+    {
+        Remote.Address[0].Address[0].sin_port = Batch->Datagrams[i].RemotePort;
+        Remote.Address[0].Address[0].in_addr = Batch->Datagrams[i].RemoteAddress;
+
+        Status = AddrFile->Send(AddrFile,
+                                &ConnInfo,
+                                Data + Batch->Datagrams[i].Offset,
+                                Batch->Datagrams[i].Length,
+                                &DataUsed);
+        if (!NT_SUCCESS(Status))
+            break;
+
+        (*Sent)++;
+    }
+
+    return (*Sent > 0) ? STATUS_SUCCESS : Status;
+}
+
+NTSTATUS DispTcpSendDatagrams(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_SEND_DATAGRAMS handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_SEND_DATAGRAMS Batch = Irp->AssociatedIrp.SystemBuffer;
+    PTRANSPORT_CONTEXT TranContext = IrpSp->FileObject->FsContext;
+    PADDRESS_FILE AddrFile;
+    PUDP_SEND_ENTRY Entries;
+    PCHAR Data = NULL;
+    ULONG DataLength = 0, Sent = 0, i;
+    NTSTATUS Status;
+
+    if (!TranContext ||
+        IrpSp->FileObject->FsContext2 != (PVOID)TDI_TRANSPORT_ADDRESS_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    AddrFile = TranContext->Handle.AddressHandle;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < FIELD_OFFSET(TCP_SEND_DATAGRAMS, Datagrams) ||
+        Batch->Count == 0 || Batch->Count > TCP_DATAGRAM_BATCH_MAX ||
+        IrpSp->Parameters.DeviceIoControl.InputBufferLength <
+            FIELD_OFFSET(TCP_SEND_DATAGRAMS, Datagrams) + Batch->Count * sizeof(TCP_DATAGRAM_DESC))
+        return STATUS_INVALID_PARAMETER;
+
+    if (Irp->MdlAddress)
+    {
+        Data = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+        if (!Data)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        DataLength = MmGetMdlByteCount(Irp->MdlAddress);
+    }
+
+    for (i = 0; i < Batch->Count; i++)
+    {
+        if (Batch->Datagrams[i].Offset > DataLength ||
+            Batch->Datagrams[i].Length > DataLength - Batch->Datagrams[i].Offset)
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    if (AddrFile->Protocol != IPPROTO_UDP)
+    {
+        Status = DispSendDatagramsRaw(AddrFile, Batch, Data, &Sent);
+        Irp->IoStatus.Information = Sent;
+        return Status;
+    }
+
+    Entries = ExAllocatePoolWithTag(NonPagedPool,
+                                    Batch->Count * sizeof(UDP_SEND_ENTRY),
+                                    DATAGRAM_BATCH_TAG);
+    if (!Entries)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (i = 0; i < Batch->Count; i++)
+    {
+        AddrInitIPv4(&Entries[i].RemoteAddress, Batch->Datagrams[i].RemoteAddress);
+        Entries[i].RemotePort = Batch->Datagrams[i].RemotePort;
+        Entries[i].Data = Data + Batch->Datagrams[i].Offset;
+        Entries[i].DataSize = Batch->Datagrams[i].Length;
+    }
+
+    Status = UDPSendDatagrams(AddrFile, Entries, Batch->Count, &Sent);
+
+    ExFreePoolWithTag(Entries, DATAGRAM_BATCH_TAG);
+
+    TI_DbgPrint(MID_TRACE, ("Sent %d of %d datagrams (0x%X).\n",
+                            Sent, Batch->Count, Status));
+
+    Irp->IoStatus.Information = Sent;
+
+    return Status;
+}
+
+/* Pending IOCTL_TCP_RECEIVE_DATAGRAMS request */
+typedef struct _DATAGRAM_BATCH {
+    PIRP Irp;
+    PADDRESS_FILE AddrFile;
+    PUCHAR Slots;                       /* Mapped output buffer */
+    ULONG Count;
+    ULONG SlotSize;
+    TDI_CONNECTION_INFORMATION Filter;  /* Empty, any sender matches */
+    TDI_CONNECTION_INFORMATION ReturnInfo;
+    TA_IP_ADDRESS Sender;
+} DATAGRAM_BATCH, *PDATAGRAM_BATCH;
+
+static VOID DispInitReturnInfo(
+    PTDI_CONNECTION_INFORMATION ReturnInfo,
+    PTA_IP_ADDRESS Sender)
+{
+    RtlZeroMemory(ReturnInfo, sizeof(TDI_CONNECTION_INFORMATION));
+    RtlZeroMemory(Sender, sizeof(TA_IP_ADDRESS));
+    ReturnInfo->RemoteAddressLength = sizeof(TA_IP_ADDRESS);
+    ReturnInfo->RemoteAddress = Sender;
+}
+
+static VOID DispStoreSlot(
+    PUCHAR Slot,
+    PTA_IP_ADDRESS Sender,
+    NTSTATUS Status,
+    ULONG Length)
+{
+    PTCP_DATAGRAM_SLOT Header = (PTCP_DATAGRAM_SLOT)Slot;
+
+    Header->RemoteAddress = Sender->Address[0].Address[0].in_addr;
+    Header->RemotePort = Sender->Address[0].Address[0].sin_port;
+    Header->Reserved = 0;
+    Header->Length = Length;
+    Header->Status = Status;
+}
+
+static ULONG DispDrainDatagrams(
+    PADDRESS_FILE AddrFile,
+    PUCHAR Slots,
+    ULONG First,
+    ULONG Count,
+    ULONG SlotSize)
+/*
+ * FUNCTION: Fills receive slots from the datagrams already queued
+ * ARGUMENTS:
+ *     AddrFile = Address file to receive on
+ *     Slots    = Mapped slot array
+ *     First    = First slot to fill
+ *     Count    = Number of slots in the array
+ *     SlotSize = Size of each slot
+ * RETURNS:
+ *     Number of slots filled
+ */
+{
+    TDI_CONNECTION_INFORMATION ReturnInfo;
+    TA_IP_ADDRESS Sender;
+    ULONG Received, i;
+    NTSTATUS Status;
+    PUCHAR Slot;
+
+    for (i = First; i < Count; i++)
+    {
+        Slot = Slots + i * SlotSize;
+
+        DispInitReturnInfo(&ReturnInfo, &Sender);
+
+        if (!DGReceiveQueued(AddrFile,
+                             (PCHAR)(Slot + sizeof(TCP_DATAGRAM_SLOT)),
+                             SlotSize - sizeof(TCP_DATAGRAM_SLOT),
+                             &ReturnInfo,
+                             &Received,
+                             &Status))
+            break;
+
+        DispStoreSlot(Slot, &Sender, Status, Received);
+    }
+
+    return i - First;
+}
+
+static VOID DispDatagramBatchComplete(
+    PVOID Context,
+    NTSTATUS Status,
+    ULONG Count)
+/*
+ * FUNCTION: Completes a pending IOCTL_TCP_RECEIVE_DATAGRAMS request
+ * ARGUMENTS:
+ *     Context = Pointer to context information (DATAGRAM_BATCH)
+ *     Status  = Status of the receive into the first slot
+ *     Count   = Number of bytes received into the first slot
+ * NOTES:
+ *     Whatever else was queued behind the first datagram fills the
+ *     remaining slots before the IRP is completed
+ */
+{
+    PDATAGRAM_BATCH Batch = Context;
+    PIRP Irp = Batch->Irp;
+    ULONG Filled = 0;
+
+    if (NT_SUCCESS(Status) || Status == STATUS_BUFFER_OVERFLOW)
+    {
+        DispStoreSlot(Batch->Slots, &Batch->Sender, Status, Count);
+        Filled = 1 + DispDrainDatagrams(Batch->AddrFile,
+                                        Batch->Slots,
+                                        1,
+                                        Batch->Count,
+                                        Batch->SlotSize);
+        Status = STATUS_SUCCESS;
+    }
+
+    ExFreePoolWithTag(Batch, DATAGRAM_BATCH_TAG);
+
+    DispDataRequestComplete(Irp, Status, Filled);
+}
+
+static VOID NTAPI DispCancelDatagramBatch(
+    PDEVICE_OBJECT Device,
+    PIRP Irp)
+/*
+ * FUNCTION: Cancels a pending IOCTL_TCP_RECEIVE_DATAGRAMS request
+ * ARGUMENTS:
+ *     Device = Pointer to device object
+ *     Irp    = Pointer to an I/O request packet
+ */
+{
+    PIO_STACK_LOCATION IrpSp;
+    PTRANSPORT_CONTEXT TranContext;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    IrpSp       = IoGetCurrentIrpStackLocation(Irp);
+    TranContext = (PTRANSPORT_CONTEXT)IrpSp->FileObject->FsContext;
+
+    /* If the receive is no longer queued, it is being completed already */
+    if (DGRemoveIRP(TranContext->Handle.AddressHandle, Irp))
+    {
+        ExFreePoolWithTag(Irp->Tail.Overlay.DriverContext[0], DATAGRAM_BATCH_TAG);
+        Irp->IoStatus.Information = 0;
+        IRPFinish(Irp, STATUS_CANCELLED);
+    }
+}
+
+NTSTATUS DispTcpReceiveDatagrams(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_RECEIVE_DATAGRAMS handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_RECEIVE_DATAGRAMS Request = Irp->AssociatedIrp.SystemBuffer;
+    PTRANSPORT_CONTEXT TranContext = IrpSp->FileObject->FsContext;
+    PADDRESS_FILE AddrFile;
+    PDATAGRAM_BATCH Batch;
+    ULONG Count, SlotSize, Filled, Received = 0;
+    PUCHAR Slots;
+    NTSTATUS Status;
+
+    if (!TranContext ||
+        IrpSp->FileObject->FsContext2 != (PVOID)TDI_TRANSPORT_ADDRESS_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    AddrFile = TranContext->Handle.AddressHandle;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_RECEIVE_DATAGRAMS) ||
+        !Irp->MdlAddress)
+        return STATUS_INVALID_PARAMETER;
+
+    Count = Request->Count;
+    SlotSize = Request->SlotSize;
+
+    if (Count == 0 || Count > TCP_DATAGRAM_BATCH_MAX ||
+        SlotSize <= sizeof(TCP_DATAGRAM_SLOT) ||
+        SlotSize > IrpSp->Parameters.DeviceIoControl.OutputBufferLength / Count)
+        return STATUS_INVALID_PARAMETER;
+
+    Slots = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (!Slots)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Filled = DispDrainDatagrams(AddrFile, Slots, 0, Count, SlotSize);
+    if (Filled > 0 || (Request->Flags & TCP_RECEIVE_DATAGRAMS_NOWAIT))
+    {
+        Irp->IoStatus.Information = Filled;
+        return STATUS_SUCCESS;
+    }
+
+    /* Nothing queued, wait for the first datagram */
+    Batch = ExAllocatePoolWithTag(NonPagedPool, sizeof(DATAGRAM_BATCH), DATAGRAM_BATCH_TAG);
+    if (!Batch)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Batch->Irp = Irp;
+    Batch->AddrFile = AddrFile;
+    Batch->Slots = Slots;
+    Batch->Count = Count;
+    Batch->SlotSize = SlotSize;
+    RtlZeroMemory(&Batch->Filter, sizeof(Batch->Filter));
+    DispInitReturnInfo(&Batch->ReturnInfo, &Batch->Sender);
+
+    Irp->Tail.Overlay.DriverContext[0] = Batch;
+
+    Status = DispPrepareIrpForCancel(TranContext, Irp, DispCancelDatagramBatch);
+    if (!NT_SUCCESS(Status))
+    {
+        ExFreePoolWithTag(Batch, DATAGRAM_BATCH_TAG);
+        return Status;
+    }
+
+    Status = DGReceiveDatagram(AddrFile,
+                               &Batch->Filter,
+                               (PCHAR)(Slots + sizeof(TCP_DATAGRAM_SLOT)),
+                               SlotSize - sizeof(TCP_DATAGRAM_SLOT),
+                               0,
+                               &Batch->ReturnInfo,
+                               &Received,
+                               DispDatagramBatchComplete,
+                               Batch,
+                               Irp);
+    if (Status == STATUS_PENDING)
+        return Status;
+
+    /* A datagram arrived in the meantime and was taken at once */
+    if (NT_SUCCESS(Status) || Status == STATUS_BUFFER_OVERFLOW)
+    {
+        DispStoreSlot(Slots, &Batch->Sender, Status, Received);
+        Irp->IoStatus.Information = 1 + DispDrainDatagrams(AddrFile, Slots, 1, Count, SlotSize);
+        Status = STATUS_SUCCESS;
+    }
+
+    ExFreePoolWithTag(Batch, DATAGRAM_BATCH_TAG);
+
+    return Status;
+}
+
 /* EOF */
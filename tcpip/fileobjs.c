@@ -19,6 +19,44 @@ KSPIN_LOCK AddressFileListLock;
 LIST_ENTRY ConnectionEndpointListHead;
 KSPIN_LOCK ConnectionEndpointListLock;
 
+/* Hash of UDP and raw address files keyed by (protocol, port). TCP address
+   files only live on AddressFileListHead because their port is assigned
+   after they are opened */
+AF_HASH_BUCKET AddressFileHash[ADDRESS_FILE_HASH_SIZE];
+
+static PAF_HASH_BUCKET AddrFileHashBucket(
+    USHORT Port,
+    USHORT Protocol)
+{
+    ULONG Hash = ((ULONG)Port << 8) ^ Protocol;
+
+    Hash ^= Hash >> 8;
+
+    return &AddressFileHash[Hash & (ADDRESS_FILE_HASH_SIZE - 1)];
+}
+
+static BOOLEAN AddrFileIsHashed(
+    PADDRESS_FILE AddrFile)
+{
+    return AddrFile->Protocol != IPPROTO_TCP;
+}
+
+/*
+ * FUNCTION: Initializes the address file hash
+ */
+VOID AddrFileHashStartup(
+    VOID)
+{
+    ULONG i;
+
+    for (i = 0; i < ADDRESS_FILE_HASH_SIZE; i++)
+    {
+        InitializeListHead(&AddressFileHash[i].ListHead);
+        KeInitializeSpinLock(&AddressFileHash[i].Lock);
+        LockProfileName(&AddressFileHash[i].Lock, TCP_LOCK_SITE_ADDRESS_FILE_HASH);
+    }
+}
+
 /*
  * FUNCTION: Searches through address file entries to find the first match
  * ARGUMENTS:
@@ -28,6 +66,9 @@ KSPIN_LOCK ConnectionEndpointListLock;
  *     SearchContext = Pointer to search context
  * RETURNS:
  *     Pointer to address file, NULL if none was found
+ * NOTES:
+ *     Only the bucket for (Protocol, Port) is searched. Wildcard binds
+ *     are returned before specific local address binds
  */
 PADDRESS_FILE AddrSearchFirst(
     PIP_ADDRESS Address,
@@ -36,19 +77,20 @@ PADDRESS_FILE AddrSearchFirst(
     PAF_SEARCH SearchContext)
 {
     KIRQL OldIrql;
-    
+
     SearchContext->Address  = Address;
     SearchContext->Port     = Port;
     SearchContext->Protocol = Protocol;
+    SearchContext->Bucket   = AddrFileHashBucket(Port, Protocol);
 
-    TcpipAcquireSpinLock(&AddressFileListLock, &OldIrql);
+    TcpipAcquireSpinLock(&SearchContext->Bucket->Lock, &OldIrql);
 
-    SearchContext->Next = AddressFileListHead.Flink;
+    SearchContext->Next = SearchContext->Bucket->ListHead.Flink;
 
-    if (!IsListEmpty(&AddressFileListHead))
-        ReferenceObject(CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, ListEntry));
+    if (!IsListEmpty(&SearchContext->Bucket->ListHead))
+        ReferenceObject(CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, HashEntry));
 
-    TcpipReleaseSpinLock(&AddressFileListLock, OldIrql);
+    TcpipReleaseSpinLock(&SearchContext->Bucket->Lock, OldIrql);
 
     return AddrSearchNext(SearchContext);
 }
@@ -56,16 +98,7 @@ PADDRESS_FILE AddrSearchFirst(
 BOOLEAN AddrIsBroadcastMatch(
     PIP_ADDRESS UnicastAddress,
     PIP_ADDRESS BroadcastAddress ) {
-    IF_LIST_ITER(IF);
-
-    ForEachInterface(IF) {
-        if ((AddrIsUnspecified(UnicastAddress) ||
-             AddrIsEqual(&IF->Unicast, UnicastAddress)) &&
-            (AddrIsEqual(&IF->Broadcast, BroadcastAddress)))
-            return TRUE;
-    } EndFor(IF);
-
-    return FALSE;
+    return AddrSetIsBroadcastMatch(UnicastAddress, BroadcastAddress);
 }
 
 BOOLEAN AddrReceiveMatch(
@@ -104,15 +137,31 @@ PADDRESS_FILE AddrFindShared(
     USHORT Port,
     USHORT Protocol)
 {
-    PLIST_ENTRY CurrentEntry;
+    PLIST_ENTRY CurrentEntry, ListHead;
+    PKSPIN_LOCK ListLock;
     KIRQL OldIrql;
     PADDRESS_FILE Current = NULL;
+    PAF_HASH_BUCKET Bucket;
+    BOOLEAN Hashed = (Protocol != IPPROTO_TCP);
+
+    if (Hashed)
+    {
+        Bucket = AddrFileHashBucket(Port, Protocol);
+        ListHead = &Bucket->ListHead;
+        ListLock = &Bucket->Lock;
+    }
+    else
+    {
+        ListHead = &AddressFileListHead;
+        ListLock = &AddressFileListLock;
+    }
 
-    TcpipAcquireSpinLock(&AddressFileListLock, &OldIrql);
+    TcpipAcquireSpinLock(ListLock, &OldIrql);
 
-    CurrentEntry = AddressFileListHead.Flink;
-    while (CurrentEntry != &AddressFileListHead) {
-        Current = CONTAINING_RECORD(CurrentEntry, ADDRESS_FILE, ListEntry);
+    CurrentEntry = ListHead->Flink;
+    while (CurrentEntry != ListHead) {
+        Current = Hashed ? CONTAINING_RECORD(CurrentEntry, ADDRESS_FILE, HashEntry) :
+                           CONTAINING_RECORD(CurrentEntry, ADDRESS_FILE, ListEntry);
 
         /* See if this address matches the search criteria */
         if ((Current->Port == Port) &&
@@ -128,7 +177,7 @@ PADDRESS_FILE AddrFindShared(
         Current = NULL;
     }
 
-    TcpipReleaseSpinLock(&AddressFileListLock, OldIrql);
+    TcpipReleaseSpinLock(ListLock, OldIrql);
 
     return Current;
 }
@@ -147,23 +196,25 @@ PADDRESS_FILE AddrSearchNext(
     PIP_ADDRESS IPAddress;
     KIRQL OldIrql;
     PADDRESS_FILE Current = NULL;
+    PADDRESS_FILE Start;
+    PAF_HASH_BUCKET Bucket = SearchContext->Bucket;
     BOOLEAN Found = FALSE;
-    
-    TcpipAcquireSpinLock(&AddressFileListLock, &OldIrql);
 
-    if (SearchContext->Next == &AddressFileListHead)
+    TcpipAcquireSpinLock(&Bucket->Lock, &OldIrql);
+
+    if (SearchContext->Next == &Bucket->ListHead)
     {
-        TcpipReleaseSpinLock(&AddressFileListLock, OldIrql);
+        TcpipReleaseSpinLock(&Bucket->Lock, OldIrql);
         return NULL;
     }
 
-    /* Remove the extra reference we added to keep this address file in memory */
-    DereferenceObject(CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, ListEntry));
+    /* This address file is kept linked by the extra reference we added */
+    Start = CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, HashEntry);
 
     CurrentEntry = SearchContext->Next;
 
-    while (CurrentEntry != &AddressFileListHead) {
-        Current = CONTAINING_RECORD(CurrentEntry, ADDRESS_FILE, ListEntry);
+    while (CurrentEntry != &Bucket->ListHead) {
+        Current = CONTAINING_RECORD(CurrentEntry, ADDRESS_FILE, HashEntry);
 
         IPAddress = &Current->Address;
 
@@ -190,16 +241,20 @@ PADDRESS_FILE AddrSearchNext(
     {
         SearchContext->Next = CurrentEntry->Flink;
 
-        if (SearchContext->Next != &AddressFileListHead)
+        if (SearchContext->Next != &Bucket->ListHead)
         {
             /* Reference the next address file to prevent the link from disappearing behind our back */
-            ReferenceObject(CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, ListEntry));
+            ReferenceObject(CONTAINING_RECORD(SearchContext->Next, ADDRESS_FILE, HashEntry));
         }
     }
     else
         Current = NULL;
 
-    TcpipReleaseSpinLock(&AddressFileListLock, OldIrql);
+    TcpipReleaseSpinLock(&Bucket->Lock, OldIrql);
+
+    /* Remove the extra reference outside the bucket lock since dropping
+       the last one unlinks the address file */
+    DereferenceObject(Start);
 
     return Current;
 }
@@ -217,6 +272,7 @@ VOID AddrFileFree(
   PDATAGRAM_RECEIVE_REQUEST ReceiveRequest;
   PDATAGRAM_SEND_REQUEST SendRequest;
   PLIST_ENTRY CurrentEntry;
+  PAF_HASH_BUCKET Bucket;
 
   TI_DbgPrint(MID_TRACE, ("Called.\n"));
 
@@ -228,6 +284,15 @@ VOID AddrFileFree(
   RemoveEntryList(&AddrFile->ListEntry);
   TcpipReleaseSpinLock(&AddressFileListLock, OldIrql);
 
+  /* Remove address file from its hash bucket */
+  if (AddrFileIsHashed(AddrFile))
+  {
+    Bucket = AddrFileHashBucket(AddrFile->Port, AddrFile->Protocol);
+    TcpipAcquireSpinLock(&Bucket->Lock, &OldIrql);
+    RemoveEntryList(&AddrFile->HashEntry);
+    TcpipReleaseSpinLock(&Bucket->Lock, OldIrql);
+  }
+
   /* FIXME: Kill TCP connections on this address file object */
 
   /* Return pending requests with error */
@@ -250,6 +315,9 @@ VOID AddrFileFree(
     ExFreePoolWithTag(SendRequest, DATAGRAM_SEND_TAG);
   }
 
+  /* Drop datagrams nobody asked for */
+  DGFlushReceivedQueue(AddrFile);
+
   /* Protocol specific handling */
   switch (AddrFile->Protocol) {
   case IPPROTO_TCP:
@@ -301,6 +369,7 @@ NTSTATUS FileOpenAddress(
   PVOID Options)
 {
   PADDRESS_FILE AddrFile;
+  PAF_HASH_BUCKET Bucket;
 
   TI_DbgPrint(MID_TRACE, ("Called (Proto %d).\n", Protocol));
 
@@ -333,6 +402,7 @@ NTSTATUS FileOpenAddress(
   AddrFile->DF = 0;
   AddrFile->BCast = 1;
   AddrFile->HeaderIncl = 1;
+  AddrFile->SegmentSize = 0;
 
   /* Make sure address is a local unicast address or 0 */
   /* FIXME: IPv4 only */
@@ -382,7 +452,7 @@ NTSTATUS FileOpenAddress(
       }
       else
       {
-          /* The client wants an unspecified port with an unspecified address so we wait to see what the TCP library gives us */
+          /* The client wants an unspecified port with an unspecified address, so TCPConnect or TCPListen picks one when the address file is used */
           AddrFile->Port = 0;
       }
 
@@ -443,6 +513,8 @@ NTSTATUS FileOpenAddress(
   /* Initialize receive and transmit queues */
   InitializeListHead(&AddrFile->ReceiveQueue);
   InitializeListHead(&AddrFile->TransmitQueue);
+  InitializeListHead(&AddrFile->ReceivedQueue);
+  AddrFile->ReceiveBufferSize = DEFAULT_RECEIVE_BUFFER_SIZE;
 
   /* Initialize spin lock that protects the address file object */
   KeInitializeSpinLock(&AddrFile->Lock);
@@ -456,6 +528,16 @@ NTSTATUS FileOpenAddress(
     &AddrFile->ListEntry,
     &AddressFileListLock);
 
+  /* Add address file to its hash bucket, wildcard binds first */
+  if (AddrFileIsHashed(AddrFile))
+  {
+    Bucket = AddrFileHashBucket(AddrFile->Port, AddrFile->Protocol);
+    if (AddrIsUnspecified(&AddrFile->Address))
+      ExInterlockedInsertHeadList(&Bucket->ListHead, &AddrFile->HashEntry, &Bucket->Lock);
+    else
+      ExInterlockedInsertTailList(&Bucket->ListHead, &AddrFile->HashEntry, &Bucket->Lock);
+  }
+
   TI_DbgPrint(MAX_TRACE, ("Leaving.\n"));
 
   return STATUS_SUCCESS;
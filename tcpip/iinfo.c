@@ -16,6 +16,7 @@ TDI_STATUS InfoTdiQueryGetInterfaceMIB(TDIEntityID ID,
 				       PUINT BufferSize) {
     TDI_STATUS Status = TDI_INVALID_REQUEST;
     PIFENTRY OutData;
+    SEND_RECV_STATS Stats;
     PLAN_ADAPTER IF;
     PCHAR IFDescr;
     ULONG Size;
@@ -57,6 +58,20 @@ TDI_STATUS InfoTdiQueryGetInterfaceMIB(TDIEntityID ID,
 
     IFDescr = (PCHAR)&OutData[1];
 
+    /* Truncated to the 32-bit MIB, MIB_STATS_EX_ID returns the full values */
+    STATS_SUM(Interface->Stats, SEND_RECV_STATS, &Stats);
+    OutData->InOctets = (ULONG)Stats.InBytes;
+    OutData->InUcastPackets = (ULONG)Stats.InUnicast;
+    OutData->InNUcastPackets = (ULONG)Stats.InNUnicast;
+    OutData->InDiscards = (ULONG)Stats.InDiscarded;
+    OutData->InErrors = (ULONG)Stats.InErrors;
+    OutData->InUnknownProtos = (ULONG)Stats.InDiscardedUnknownProto;
+    OutData->OutOctets = (ULONG)Stats.OutBytes;
+    OutData->OutUcastPackets = (ULONG)Stats.OutUnicast;
+    OutData->OutNUcastPackets = (ULONG)Stats.OutNUnicast;
+    OutData->OutDiscards = (ULONG)Stats.OutDiscarded;
+    OutData->OutErrors = (ULONG)Stats.OutErrors;
+
     if( IF ) {
 	GetInterfaceSpeed( Interface, (PUINT)&OutData->Speed );
 	TI_DbgPrint(DEBUG_INFO,
@@ -64,15 +79,13 @@ TDI_STATUS InfoTdiQueryGetInterfaceMIB(TDIEntityID ID,
 	memcpy(OutData->PhysAddr,Interface->Address,Interface->AddressLength);
 	TI_DbgPrint(DEBUG_INFO, ("Got HWAddr\n"));
 
-        memcpy(&OutData->InOctets, &Interface->Stats, sizeof(SEND_RECV_STATS));
-
         NdisStatus = NDISCall(IF,
                               NdisRequestQueryInformation,
                               OID_GEN_XMIT_ERROR,
                               &OutData->OutErrors,
                               sizeof(ULONG));
         if (NdisStatus != NDIS_STATUS_SUCCESS)
-            OutData->OutErrors = 0;
+            OutData->OutErrors = (ULONG)Stats.OutErrors;
 
         TI_DbgPrint(DEBUG_INFO, ("OutErrors = %d\n", OutData->OutErrors));
 
@@ -82,7 +95,7 @@ TDI_STATUS InfoTdiQueryGetInterfaceMIB(TDIEntityID ID,
                               &OutData->InErrors,
                               sizeof(ULONG));
         if (NdisStatus != NDIS_STATUS_SUCCESS)
-            OutData->InErrors = 0;
+            OutData->InErrors = (ULONG)Stats.InErrors;
 
         TI_DbgPrint(DEBUG_INFO, ("InErrors = %d\n", OutData->InErrors));
     }
@@ -179,6 +179,63 @@ TDI_STATUS InfoTdiQueryListEntities(PNDIS_BUFFER Buffer,
     return TDI_SUCCESS;
 }
 
+TDI_STATUS InfoTdiQueryGetStatsEx(
+  TDIEntityID ID,
+  PVOID Context,
+  PNDIS_BUFFER Buffer,
+  PUINT BufferSize)
+/*
+ * FUNCTION: Returns the 64-bit counters of an entity
+ * ARGUMENTS:
+ *   ID         = Entity to return the counters of
+ *   Context    = Entity context, the interface for IF_ENTITY
+ *   Buffer     = Pointer to buffer with data to use
+ *   BufferSize = Pointer to buffer with size of Buffer. On return
+ *                this is filled with number of bytes returned
+ * RETURNS:
+ *   Status of operation
+ * NOTES:
+ *   Network and transport counters are global, any instance returns them
+ */
+{
+    union {
+        TCPIP_IF_STATS If;
+        TCPIP_IP_STATS Ip;
+        TCPIP_UDP_STATS Udp;
+        TCPIP_TCP_STATS Tcp;
+    } Stats;
+    UINT Size;
+
+    switch (ID.tei_entity)
+    {
+        case IF_ENTITY:
+            STATS_SUM(((PIP_INTERFACE)Context)->Stats, SEND_RECV_STATS, &Stats.If);
+            Size = sizeof(Stats.If);
+            break;
+
+        case CL_NL_ENTITY:
+        case CO_NL_ENTITY:
+            STATS_SUM(IPStats, TCPIP_IP_STATS, &Stats.Ip);
+            Size = sizeof(Stats.Ip);
+            break;
+
+        case CL_TL_ENTITY:
+            STATS_SUM(UDPStats, TCPIP_UDP_STATS, &Stats.Udp);
+            Size = sizeof(Stats.Udp);
+            break;
+
+        case CO_TL_ENTITY:
+            STATS_SUM(TCPStats, TCPIP_TCP_STATS, &Stats.Tcp);
+            Size = sizeof(Stats.Tcp);
+            break;
+
+        default:
+            return TDI_INVALID_PARAMETER;
+    }
+
+    return InfoCopyOut((PCHAR)&Stats, Size, Buffer, BufferSize);
+}
+
 TDI_STATUS InfoTdiQueryInformationEx(
   PTDI_REQUEST Request,
   TDIObjectID *ID,
@@ -258,6 +315,42 @@ TDI_STATUS InfoTdiQueryInformationEx(
                  else
                      return TDI_INVALID_PARAMETER;
 
+              case MIB_STATS_EX_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 if (ID->toi_entity.tei_entity == IF_ENTITY)
+                     if ((EntityListContext = GetContext(ID->toi_entity)))
+                         return InfoTdiQueryGetStatsEx(ID->toi_entity, EntityListContext, Buffer, BufferSize);
+                     else
+                         return TDI_INVALID_PARAMETER;
+                 else
+                     return InfoTdiQueryGetStatsEx(ID->toi_entity, NULL, Buffer, BufferSize);
+
+              case MIB_LATENCY_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiQueryGetLatency(Buffer, BufferSize, Context);
+
+              case MIB_LOCK_PROFILE_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiQueryGetLockProfile(Buffer, BufferSize, Context);
+
+              case MIB_SLAB_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiQueryGetSlab(Buffer, BufferSize);
+
+              case MIB_PACKET_CACHE_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiQueryGetPacketCache(Buffer, BufferSize);
+
               case IP_MIB_ADDRTABLE_ENTRY_ID:
                  if (ID->toi_entity.tei_entity != CL_NL_ENTITY && 
                      ID->toi_entity.tei_entity != CO_NL_ENTITY)
@@ -354,6 +447,18 @@ TDI_STATUS InfoTdiSetInformationEx
                  else
                      return TDI_INVALID_PARAMETER;
 
+              case MIB_LATENCY_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiSetLatency(Buffer, BufferSize);
+
+              case MIB_LOCK_PROFILE_ID:
+                 if (ID->toi_type != INFO_TYPE_PROVIDER)
+                     return TDI_INVALID_PARAMETER;
+
+                 return InfoTdiSetLockProfile(Buffer, BufferSize);
+
               default:
                 return TDI_INVALID_REQUEST;
 	  }
@@ -0,0 +1,197 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/latency.c
+ * PURPOSE:     Per-stage latency histograms
+ */
+
+#include "precomp.h"
+
+volatile BOOLEAN LatencyEnabled = FALSE;
+
+static PTCPIP_LATENCY_STATS LatencyStats = NULL;
+static ULONGLONG LatencyStartTimestamp;
+static LARGE_INTEGER LatencyStartCounter;
+
+static ULONG LatencyBucket(
+    ULONGLONG Ticks)
+/*
+ * FUNCTION: Maps a tick count to its histogram bucket
+ * ARGUMENTS:
+ *     Ticks = Elapsed time stamp counter ticks
+ * RETURNS:
+ *     Bucket index, see TCP_LATENCY_BUCKET_LOW
+ */
+{
+    ULONG High, Bit, Bucket;
+
+    if (Ticks < 4)
+        return (ULONG)Ticks;
+
+    High = (ULONG)(Ticks >> 32);
+    if (High)
+    {
+        _BitScanReverse(&Bit, High);
+        Bit += 32;
+    }
+    else
+    {
+        _BitScanReverse(&Bit, (ULONG)Ticks);
+    }
+
+    Bucket = (Bit - 1) * 4 + (ULONG)((Ticks >> (Bit - 2)) & 3);
+
+    return min(Bucket, TCP_LATENCY_BUCKETS - 1);
+}
+
+VOID LatencyRecord(
+    ULONG Stage,
+    ULONGLONG Start)
+/*
+ * FUNCTION: Counts the time since a stamp in the histogram of a stage
+ * ARGUMENTS:
+ *     Stage = TCP_LATENCY_* stage reached
+ *     Start = LATENCY_STAMP() value of the first stage
+ * NOTES:
+ *     Called through LATENCY_RECORD
+ */
+{
+    LONGLONG Ticks = (LONGLONG)(__rdtsc() - Start);
+
+    /* Counters of different processors may be slightly apart */
+    if (Ticks < 0)
+        Ticks = 0;
+
+    STAT_INC(LatencyStats, TCPIP_LATENCY_STATS, Count[Stage][LatencyBucket(Ticks)]);
+}
+
+VOID LatencyRecordIrp(
+    PIRP Irp)
+/*
+ * FUNCTION: Counts a completing send or receive IRP
+ * ARGUMENTS:
+ *     Irp = IRP about to be completed
+ * NOTES:
+ *     Only TDI send and receive requests carry a stamp, the driver
+ *     context of anything else is left alone
+ */
+{
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IrpSp->MajorFunction != IRP_MJ_INTERNAL_DEVICE_CONTROL &&
+        IrpSp->MajorFunction != IRP_MJ_DEVICE_CONTROL)
+        return;
+
+    switch (IrpSp->MinorFunction)
+    {
+    case TDI_SEND:
+    case TDI_SEND_DATAGRAM:
+        LATENCY_RECORD(TCP_LATENCY_TX_COMPLETE, IRP_LATENCY_STAMP(Irp));
+        break;
+
+    case TDI_RECEIVE:
+    case TDI_RECEIVE_DATAGRAM:
+        LATENCY_RECORD(TCP_LATENCY_RX_COMPLETE, IRP_LATENCY_STAMP(Irp));
+        break;
+    }
+}
+
+TDI_STATUS InfoTdiQueryGetLatency(
+    PNDIS_BUFFER Buffer,
+    PUINT BufferSize,
+    PVOID Context)
+/*
+ * FUNCTION: Returns the latency histograms
+ * ARGUMENTS:
+ *   Buffer     = Pointer to buffer with data to use
+ *   BufferSize = Pointer to buffer with size of Buffer. On return
+ *                this is filled with number of bytes returned
+ *   Context    = Query context, TCP_LATENCY_QUERY_RESET clears the
+ *                histograms after they are read
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    PTCPIP_LATENCY_INFO Info;
+    TDI_STATUS Status;
+    UINT Room = *BufferSize;
+
+    Info = ExAllocatePoolWithTag(NonPagedPool, sizeof(TCPIP_LATENCY_INFO), LATENCY_TAG);
+    if (!Info)
+        return TDI_NO_RESOURCES;
+
+    Info->Enabled = LatencyEnabled;
+    Info->Reserved = 0;
+    Info->TimestampFrequency = TraceEstimateTimestampFrequency(LatencyStartTimestamp,
+                                                          LatencyStartCounter);
+
+    STATS_SUM(LatencyStats, TCPIP_LATENCY_STATS, &Info->Stats);
+
+    Status = InfoCopyOut((PCHAR)Info, sizeof(TCPIP_LATENCY_INFO), Buffer, BufferSize);
+
+    /* InfoCopyOut succeeds without copying into a short buffer */
+    if (Status == TDI_SUCCESS && Buffer && Room >= sizeof(TCPIP_LATENCY_INFO) &&
+        *(PULONG)Context == TCP_LATENCY_QUERY_RESET)
+        STATS_RESET(LatencyStats, TCPIP_LATENCY_STATS);
+
+    ExFreePoolWithTag(Info, LATENCY_TAG);
+
+    return Status;
+}
+
+TDI_STATUS InfoTdiSetLatency(
+    PVOID Buffer,
+    UINT BufferSize)
+/*
+ * FUNCTION: Turns latency timing on or off
+ * ARGUMENTS:
+ *   Buffer     = Pointer to a TCP_LATENCY_CONTROL
+ *   BufferSize = Size of Buffer
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    PTCP_LATENCY_CONTROL Control = Buffer;
+
+    if (BufferSize < sizeof(TCP_LATENCY_CONTROL))
+        return TDI_INVALID_PARAMETER;
+
+    if (Control->Enable && !LatencyEnabled)
+    {
+        LatencyStartTimestamp = __rdtsc();
+        LatencyStartCounter = KeQueryPerformanceCounter(NULL);
+    }
+
+    LatencyEnabled = Control->Enable ? TRUE : FALSE;
+
+    TI_DbgPrint(MIN_TRACE, ("Latency timing %s.\n",
+                            LatencyEnabled ? "enabled" : "disabled"));
+
+    return TDI_SUCCESS;
+}
+
+NTSTATUS LatencyStartup(VOID)
+/*
+ * FUNCTION: Allocates the latency histograms
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Timing stays off until it is turned on through MIB_LATENCY_ID
+ */
+{
+    LatencyStats = STATS_ALLOCATE(TCPIP_LATENCY_STATS);
+    if (!LatencyStats)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    return STATUS_SUCCESS;
+}
+
+VOID LatencyShutdown(VOID)
+{
+    LatencyEnabled = FALSE;
+
+    StatsFree(LatencyStats);
+    LatencyStats = NULL;
+}
+
+/* EOF */
@@ -0,0 +1,393 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/lockprof.c
+ * PURPOSE:     Spin lock contention profile
+ * NOTES:       Lock names live in an open addressed table keyed by the
+ *              lock address. A spin lock is released on the processor
+ *              that took it, so hold times are tracked in a small table
+ *              of held locks per processor.
+ */
+
+#include "precomp.h"
+#include <intrin.h>
+
+#define LOCK_NAME_BITS  10
+#define LOCK_NAMES      (1 << LOCK_NAME_BITS)
+
+/* Marks a slot whose lock was forgotten, lookups probe past it */
+#define LOCK_NAME_FREED ((PKSPIN_LOCK)1)
+
+typedef struct _LOCK_NAME {
+    PKSPIN_LOCK Lock;
+    ULONG Site;
+} LOCK_NAME, *PLOCK_NAME;
+
+/* Deepest lock nesting whose hold times are measured */
+#define LOCK_HELD_SLOTS 8
+
+typedef struct _LOCK_HELD {
+    PKSPIN_LOCK Lock;           /* NULL if the slot is free */
+    ULONG Site;
+    LONG Generation;            /* LockGeneration when the lock was taken */
+    ULONGLONG Start;
+} LOCK_HELD, *PLOCK_HELD;
+
+typedef struct _LOCK_HELD_TABLE {
+    LOCK_HELD Held[LOCK_HELD_SLOTS];
+} LOCK_HELD_TABLE, *PLOCK_HELD_TABLE;
+
+volatile BOOLEAN LockProfileEnabled = FALSE;
+
+static LOCK_NAME LockNames[LOCK_NAMES];
+static PTCPIP_LOCK_STATS LockStats = NULL;
+static PLOCK_HELD_TABLE LockHeld = NULL;
+static volatile LONG LockGeneration = 0;
+static ULONGLONG LockStartTimestamp;
+static LARGE_INTEGER LockStartCounter;
+
+static const CHAR LockSiteNames[TCP_LOCK_SITES][TCP_LOCK_NAME_LENGTH] = {
+    "Other",
+    "FIBLock",
+    "AddressFileListLock",
+    "AddressFileHash",
+    "ConnectionEndpointListLock",
+    "ReassemblyListLock",
+    "NeighborCache",
+    "InterfaceListLock",
+    "NetTableListLock",
+    "Interface",
+    "AdapterListLock",
+    "Adapter",
+    "EntityListLock",
+    "AddressSetLock",
+    "Object",
+    "PMTULock"
+};
+
+static ULONG LockNameHash(
+    PKSPIN_LOCK SpinLock)
+{
+    return ((ULONG)((ULONG_PTR)SpinLock >> 2) * 2654435761U) >> (32 - LOCK_NAME_BITS);
+}
+
+VOID LockProfileName(
+    PKSPIN_LOCK SpinLock,
+    ULONG Site)
+/*
+ * FUNCTION: Names the site a lock is counted under
+ * ARGUMENTS:
+ *     SpinLock = Initialized spin lock
+ *     Site     = TCP_LOCK_SITE_* site of the lock
+ * NOTES:
+ *     Locks in memory that is freed again must be forgotten first.
+ *     If the table is full the lock stays counted as TCP_LOCK_SITE_OTHER
+ */
+{
+    PLOCK_NAME Name;
+    PKSPIN_LOCK Old;
+    ULONG Hash, i;
+
+    Hash = LockNameHash(SpinLock);
+
+    for (i = 0; i < LOCK_NAMES; i++)
+    {
+        Name = &LockNames[(Hash + i) & (LOCK_NAMES - 1)];
+        Old = Name->Lock;
+
+        if (Old == SpinLock ||
+            ((Old == NULL || Old == LOCK_NAME_FREED) &&
+             InterlockedCompareExchangePointer((PVOID *)&Name->Lock, SpinLock, Old) == Old))
+        {
+            Name->Site = Site;
+            return;
+        }
+    }
+
+    TI_DbgPrint(MIN_TRACE, ("No room to name lock %p.\n", SpinLock));
+}
+
+VOID LockProfileForget(
+    PKSPIN_LOCK SpinLock)
+/*
+ * FUNCTION: Drops the name of a lock about to be freed
+ * ARGUMENTS:
+ *     SpinLock = Spin lock named with LockProfileName
+ */
+{
+    PLOCK_NAME Name;
+    ULONG Hash, i;
+
+    Hash = LockNameHash(SpinLock);
+
+    for (i = 0; i < LOCK_NAMES; i++)
+    {
+        Name = &LockNames[(Hash + i) & (LOCK_NAMES - 1)];
+
+        if (Name->Lock == SpinLock)
+        {
+            Name->Site = TCP_LOCK_SITE_OTHER;
+            InterlockedExchangePointer((PVOID *)&Name->Lock, LOCK_NAME_FREED);
+            return;
+        }
+
+        if (Name->Lock == NULL)
+            return;
+    }
+}
+
+static ULONG LockProfileSite(
+    PKSPIN_LOCK SpinLock)
+{
+    PLOCK_NAME Name;
+    ULONG Hash, i;
+
+    Hash = LockNameHash(SpinLock);
+
+    for (i = 0; i < LOCK_NAMES; i++)
+    {
+        Name = &LockNames[(Hash + i) & (LOCK_NAMES - 1)];
+
+        if (Name->Lock == SpinLock)
+            return Name->Site;
+
+        if (Name->Lock == NULL)
+            break;
+    }
+
+    return TCP_LOCK_SITE_OTHER;
+}
+
+VOID LockProfileAcquireAtDpcLevel(
+    PKSPIN_LOCK SpinLock,
+    ULONG Site)
+/*
+ * FUNCTION: Takes a spin lock and counts the acquisition
+ * ARGUMENTS:
+ *     SpinLock = Spin lock to take
+ *     Site     = TCP_LOCK_SITE_* site, or LOCK_SITE_LOOKUP
+ * NOTES:
+ *     Called at DISPATCH_LEVEL through the lock wrappers while
+ *     profiling is on
+ */
+{
+    PTCPIP_LOCK_SITE_STATS Stats;
+    PLOCK_HELD_TABLE Table;
+    PLOCK_HELD Held;
+    ULONGLONG Start;
+    LONG Generation;
+    ULONG i;
+
+    if (Site == LOCK_SITE_LOOKUP)
+        Site = LockProfileSite(SpinLock);
+
+    Stats = &STATS_CPU(LockStats, TCPIP_LOCK_STATS)->Site[Site];
+
+    if (!KeTryToAcquireSpinLockAtDpcLevel(SpinLock))
+    {
+        Start = __rdtsc();
+        KeAcquireSpinLockAtDpcLevel(SpinLock);
+
+        STATS_COUNT(Stats->Contentions, 1);
+        STATS_COUNT(Stats->SpinTicks, __rdtsc() - Start);
+    }
+
+    STATS_COUNT(Stats->Acquisitions, 1);
+
+    /* Slots left over from an earlier profiling run count as free */
+    Generation = LockGeneration;
+    Table = STATS_CPU(LockHeld, LOCK_HELD_TABLE);
+
+    for (i = 0; i < LOCK_HELD_SLOTS; i++)
+    {
+        Held = &Table->Held[i];
+
+        if (!Held->Lock || Held->Generation != Generation)
+        {
+            Held->Lock = SpinLock;
+            Held->Site = Site;
+            Held->Generation = Generation;
+            Held->Start = __rdtsc();
+            return;
+        }
+    }
+
+    /* Nested too deep, this hold goes unmeasured */
+}
+
+VOID LockProfileAcquire(
+    PKSPIN_LOCK SpinLock,
+    PKIRQL Irql,
+    ULONG Site)
+/*
+ * FUNCTION: Raises to DISPATCH_LEVEL and takes a spin lock
+ * ARGUMENTS:
+ *     SpinLock = Spin lock to take
+ *     Irql     = Address of a variable to receive the previous IRQL
+ *     Site     = TCP_LOCK_SITE_* site, or LOCK_SITE_LOOKUP
+ */
+{
+    KeRaiseIrql(DISPATCH_LEVEL, Irql);
+    LockProfileAcquireAtDpcLevel(SpinLock, Site);
+}
+
+VOID LockProfileReleaseFromDpcLevel(
+    PKSPIN_LOCK SpinLock)
+/*
+ * FUNCTION: Releases a spin lock and counts how long it was held
+ * ARGUMENTS:
+ *     SpinLock = Spin lock to release
+ * NOTES:
+ *     A lock taken before profiling was turned on is released without
+ *     being counted
+ */
+{
+    PTCPIP_LOCK_SITE_STATS Stats;
+    PLOCK_HELD_TABLE Table;
+    PLOCK_HELD Held;
+    ULONG i;
+
+    Table = STATS_CPU(LockHeld, LOCK_HELD_TABLE);
+
+    for (i = 0; i < LOCK_HELD_SLOTS; i++)
+    {
+        Held = &Table->Held[i];
+
+        if (Held->Lock == SpinLock && Held->Generation == LockGeneration)
+        {
+            Stats = &STATS_CPU(LockStats, TCPIP_LOCK_STATS)->Site[Held->Site];
+            STATS_COUNT(Stats->HoldTicks, __rdtsc() - Held->Start);
+            STATS_COUNT(Stats->Holds, 1);
+
+            Held->Lock = NULL;
+            break;
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel(SpinLock);
+}
+
+VOID LockProfileRelease(
+    PKSPIN_LOCK SpinLock,
+    KIRQL Irql)
+/*
+ * FUNCTION: Releases a spin lock and lowers the IRQL
+ * ARGUMENTS:
+ *     SpinLock = Spin lock to release
+ *     Irql     = IRQL returned when the lock was taken
+ */
+{
+    LockProfileReleaseFromDpcLevel(SpinLock);
+    KeLowerIrql(Irql);
+}
+
+TDI_STATUS InfoTdiQueryGetLockProfile(
+    PNDIS_BUFFER Buffer,
+    PUINT BufferSize,
+    PVOID Context)
+/*
+ * FUNCTION: Returns the spin lock profile
+ * ARGUMENTS:
+ *   Buffer     = Pointer to buffer with data to use
+ *   BufferSize = Pointer to buffer with size of Buffer. On return
+ *                this is filled with number of bytes returned
+ *   Context    = Query context, TCP_LOCK_PROFILE_QUERY_RESET clears the
+ *                counters after they are read
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    TCPIP_LOCK_PROFILE_INFO Info;
+    TDI_STATUS Status;
+    UINT Room = *BufferSize;
+
+    RtlZeroMemory(&Info, sizeof(Info));
+
+    Info.Enabled = LockProfileEnabled;
+    Info.Sites = TCP_LOCK_SITES;
+    Info.TimestampFrequency = TraceEstimateTimestampFrequency(LockStartTimestamp,
+                                                         LockStartCounter);
+    RtlCopyMemory(Info.Names, LockSiteNames, sizeof(Info.Names));
+
+    STATS_SUM(LockStats, TCPIP_LOCK_STATS, &Info.Stats);
+
+    Status = InfoCopyOut((PCHAR)&Info, sizeof(Info), Buffer, BufferSize);
+
+    /* InfoCopyOut succeeds without copying into a short buffer */
+    if (Status == TDI_SUCCESS && Buffer && Room >= sizeof(Info) &&
+        *(PULONG)Context == TCP_LOCK_PROFILE_QUERY_RESET)
+        STATS_RESET(LockStats, TCPIP_LOCK_STATS);
+
+    return Status;
+}
+
+TDI_STATUS InfoTdiSetLockProfile(
+    PVOID Buffer,
+    UINT BufferSize)
+/*
+ * FUNCTION: Turns lock profiling on or off
+ * ARGUMENTS:
+ *   Buffer     = Pointer to a TCP_LOCK_PROFILE_CONTROL
+ *   BufferSize = Size of Buffer
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    PTCP_LOCK_PROFILE_CONTROL Control = Buffer;
+
+    if (BufferSize < sizeof(TCP_LOCK_PROFILE_CONTROL))
+        return TDI_INVALID_PARAMETER;
+
+    if (Control->Enable && !LockProfileEnabled)
+    {
+        InterlockedIncrement(&LockGeneration);
+
+        LockStartTimestamp = __rdtsc();
+        LockStartCounter = KeQueryPerformanceCounter(NULL);
+    }
+
+    LockProfileEnabled = Control->Enable ? TRUE : FALSE;
+
+    TI_DbgPrint(MIN_TRACE, ("Lock profiling %s.\n",
+                            LockProfileEnabled ? "enabled" : "disabled"));
+
+    return TDI_SUCCESS;
+}
+
+NTSTATUS LockProfileStartup(VOID)
+/*
+ * FUNCTION: Allocates the lock counters
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Profiling stays off until it is turned on through
+ *     MIB_LOCK_PROFILE_ID
+ */
+{
+    LockStats = STATS_ALLOCATE(TCPIP_LOCK_STATS);
+    if (!LockStats)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    LockHeld = STATS_ALLOCATE(LOCK_HELD_TABLE);
+    if (!LockHeld)
+    {
+        StatsFree(LockStats);
+        LockStats = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID LockProfileShutdown(VOID)
+{
+    LockProfileEnabled = FALSE;
+
+    StatsFree(LockHeld);
+    LockHeld = NULL;
+
+    StatsFree(LockStats);
+    LockStats = NULL;
+}
+
+/* EOF */
@@ -21,7 +21,6 @@ KSPIN_LOCK EntityListLock;
 TDIEntityInfo *EntityList        = NULL;
 ULONG EntityCount                = 0;
 ULONG EntityMax                  = 0;
-UDP_STATISTICS UDPStats;
 
 /* Network timers */
 KTIMER IPTimer;
@@ -88,6 +87,21 @@ VOID NTAPI TiUnload(
   /* Shutdown network level protocol subsystem */
   IPShutdown();
 
+  /* Free the protocol counters */
+  StatsShutdown();
+
+  /* Free the trace rings */
+  TraceShutdown();
+
+  /* Free the latency histograms */
+  LatencyShutdown();
+
+  /* Free the lock counters */
+  LockProfileShutdown();
+
+  /* Free the packets kept for reuse */
+  PacketCacheShutdown();
+
   /* Free NDIS buffer descriptors */
   if (GlobalBufferPool)
     NdisFreeBufferPool(GlobalBufferPool);
@@ -160,6 +174,7 @@ NTSTATUS TiCreateFileObject(
     }
 
     Context->CancelIrps = FALSE;
+    Context->Ring = NULL;
 
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
     IrpSp->FileObject->FsContext = Context;
@@ -321,6 +336,10 @@ NTSTATUS TiCloseFileObject(
         return STATUS_INVALID_PARAMETER;
     }
 
+    /* The ring goes away once its outstanding requests complete */
+    RingDetach(Context);
+    RegionCloseFileObject(IrpSp->FileObject);
+
     switch ((ULONG_PTR)IrpSp->FileObject->FsContext2)
     {
         case TDI_TRANSPORT_ADDRESS_FILE:
@@ -550,6 +569,42 @@ TiDispatch(
       Status = DispTdiDeleteIPAddress(Irp, IrpSp);
       break;
 
+    case IOCTL_TCP_RING_SETUP:
+      TI_DbgPrint(MIN_TRACE, ("TCP_RING_SETUP\n"));
+      Status = DispTcpRingSetup(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_RING_ENTER:
+      Status = DispTcpRingEnter(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_REGISTER_BUFFER:
+      TI_DbgPrint(MIN_TRACE, ("TCP_REGISTER_BUFFER\n"));
+      Status = DispTcpRegisterBuffer(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_DEREGISTER_BUFFER:
+      TI_DbgPrint(MIN_TRACE, ("TCP_DEREGISTER_BUFFER\n"));
+      Status = DispTcpDeregisterBuffer(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_SEND_DATAGRAMS:
+      Status = DispTcpSendDatagrams(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_RECEIVE_DATAGRAMS:
+      Status = DispTcpReceiveDatagrams(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_TRACE_CONTROL:
+      TI_DbgPrint(MIN_TRACE, ("TCP_TRACE_CONTROL\n"));
+      Status = DispTcpTraceControl(Irp, IrpSp);
+      break;
+
+    case IOCTL_TCP_QUERY_TRACE:
+      Status = DispTcpQueryTrace(Irp, IrpSp);
+      break;
+
     default:
       TI_DbgPrint(MIN_TRACE, ("Unknown IOCTL 0x%X\n",
           IrpSp->Parameters.DeviceIoControl.IoControlCode));
@@ -560,6 +615,10 @@ TiDispatch(
 
   TI_DbgPrint(DEBUG_IRP, ("[TCPIP, TiDispatch] Leaving. Status = (0x%X).\n", Status));
 
+  /* A pending request was marked by its handler and may be completed already */
+  if (Status == STATUS_PENDING)
+    return Status;
+
   return IRPFinish( Irp, Status );
 
 
@@ -601,7 +660,12 @@ DriverEntry(
     return Status;
   }
 
-  ChewInit( IPDeviceObject );
+  Status = ChewInit( IPDeviceObject );
+  if (!NT_SUCCESS(Status)) {
+    TI_DbgPrint(MIN_TRACE, ("Failed to start CHEW workers. Status (0x%X).\n", Status));
+    TiUnload(DriverObject);
+    return Status;
+  }
 	 
 
   /* Create RawIP device object */
@@ -634,6 +698,7 @@ DriverEntry(
 
   /* Setup network layer and transport layer entities */
   KeInitializeSpinLock(&EntityListLock);
+  LockProfileName(&EntityListLock, TCP_LOCK_SITE_ENTITY_LIST);
   EntityList = ExAllocatePoolWithTag(NonPagedPool,
                                      sizeof(TDIEntityID) * MAX_TDI_ENTITIES,
                                      TDI_ENTITY_TAG );
@@ -661,19 +726,58 @@ DriverEntry(
     return STATUS_INSUFFICIENT_RESOURCES;
   }
 
+  /* Allocate the per-processor packet caches */
+  Status = PacketCacheStartup();
+  if( !NT_SUCCESS(Status) ) {
+      TiUnload(DriverObject);
+      return Status;
+  }
+
   /* Initialize address file list and protecting spin lock */
   InitializeListHead(&AddressFileListHead);
   KeInitializeSpinLock(&AddressFileListLock);
+  LockProfileName(&AddressFileListLock, TCP_LOCK_SITE_ADDRESS_FILE_LIST);
+  AddrFileHashStartup();
 
   /* Initialize connection endpoint list and protecting spin lock */
   InitializeListHead(&ConnectionEndpointListHead);
   KeInitializeSpinLock(&ConnectionEndpointListLock);
+  LockProfileName(&ConnectionEndpointListLock, TCP_LOCK_SITE_CONNECTION_LIST);
 
   /* Initialize interface list and protecting spin lock */
   InitializeListHead(&InterfaceListHead);
   KeInitializeSpinLock(&InterfaceListLock);
+  LockProfileName(&InterfaceListLock, TCP_LOCK_SITE_INTERFACE_LIST);
+
+  /* Initialize the registered buffer table */
+  RegionStartup();
+
+  /* Initialize the event trace, which stays off until enabled */
+  TraceStartup();
+
+  /* Initialize the object cache list, lwIP creates its caches in TCPStartup */
+  SlabStartup();
+
+  /* Allocate the protocol counters */
+  Status = StatsStartup();
+  if( !NT_SUCCESS(Status) ) {
+      TiUnload(DriverObject);
+      return Status;
+  }
 
+  /* Allocate the latency histograms, timing is off until requested */
+  Status = LatencyStartup();
+  if( !NT_SUCCESS(Status) ) {
+      TiUnload(DriverObject);
+      return Status;
+  }
 
+  /* Allocate the lock counters, profiling is off until requested */
+  Status = LockProfileStartup();
+  if( !NT_SUCCESS(Status) ) {
+      TiUnload(DriverObject);
+      return Status;
+  }
 
   /* Initialize network level protocol subsystem */
   IPStartup(RegistryPath);
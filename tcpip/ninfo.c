@@ -159,6 +159,7 @@ TDI_STATUS InfoTdiQueryGetIPSnmpInfo( TDIEntityID ID,
 				      PNDIS_BUFFER Buffer,
 				      PUINT BufferSize ) {
     IPSNMP_INFO SnmpInfo;
+    TCPIP_IP_STATS Stats;
     UINT IfCount = CountInterfaces();
     UINT RouteCount = CountFIBs(IF);
     TDI_STATUS Status = TDI_INVALID_REQUEST;
@@ -167,6 +168,24 @@ TDI_STATUS InfoTdiQueryGetIPSnmpInfo( TDIEntityID ID,
 
     RtlZeroMemory(&SnmpInfo, sizeof(IPSNMP_INFO));
 
+    /* Truncated to the 32-bit MIB, MIB_STATS_EX_ID returns the full values */
+    STATS_SUM(IPStats, TCPIP_IP_STATS, &Stats);
+    SnmpInfo.InReceives = (ULONG)Stats.InReceives;
+    SnmpInfo.InHdrErrors = (ULONG)Stats.InHdrErrors;
+    SnmpInfo.InAddrErrors = (ULONG)Stats.InAddrErrors;
+    SnmpInfo.InUnknownProtos = (ULONG)Stats.InUnknownProtos;
+    SnmpInfo.InDiscards = (ULONG)Stats.InDiscards;
+    SnmpInfo.InDelivers = (ULONG)Stats.InDelivers;
+    SnmpInfo.OutRequests = (ULONG)Stats.OutRequests;
+    SnmpInfo.OutDiscards = (ULONG)Stats.OutDiscards;
+    SnmpInfo.OutNoRoutes = (ULONG)Stats.OutNoRoutes;
+    SnmpInfo.ReasmReqds = (ULONG)Stats.ReasmReqds;
+    SnmpInfo.ReasmOks = (ULONG)Stats.ReasmOks;
+    SnmpInfo.ReasmFails = (ULONG)Stats.ReasmFails;
+    SnmpInfo.FragOks = (ULONG)Stats.FragOks;
+    SnmpInfo.FragFails = (ULONG)Stats.FragFails;
+    SnmpInfo.FragCreates = (ULONG)Stats.FragCreates;
+
     SnmpInfo.NumIf = IfCount;
     SnmpInfo.NumAddr = 1;
     SnmpInfo.NumRoutes = RouteCount;
@@ -25,4 +25,7 @@
 #include "address.h"
 #include "ipifcons.h"
 #include "titypes.h"
+#include "regbuf.h"
+#include "ring.h"
+#include "slab.h"
 #include "pseh/pseh2.h"
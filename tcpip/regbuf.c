@@ -0,0 +1,302 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/regbuf.c
+ * PURPOSE:     Registered buffer regions
+ * NOTES:       A region is probed, locked and mapped once when it is
+ *              registered. Requests then name it by (id, offset, length)
+ *              and only need a partial MDL over the locked pages.
+ */
+
+#include "precomp.h"
+
+#define TCP_MAX_REGIONS 1024
+
+typedef struct _REGION_SLOT {
+    PTCP_REGION Region;
+    USHORT Sequence;            /* Bumped on reuse so stale ids miss */
+} REGION_SLOT, *PREGION_SLOT;
+
+static REGION_SLOT RegionTable[TCP_MAX_REGIONS];
+static KSPIN_LOCK RegionTableLock;
+
+VOID RegionStartup(VOID)
+{
+    ULONG i;
+
+    KeInitializeSpinLock(&RegionTableLock);
+
+    for (i = 0; i < TCP_MAX_REGIONS; i++)
+    {
+        RegionTable[i].Region = NULL;
+        RegionTable[i].Sequence = 1;
+    }
+}
+
+NTSTATUS RegionCreate(
+    PVOID Base,
+    ULONG Length,
+    KPROCESSOR_MODE Mode,
+    PTCP_REGION *Region)
+/*
+ * FUNCTION: Locks and maps a client buffer
+ * ARGUMENTS:
+ *     Base   = Client address of the buffer
+ *     Length = Size of the buffer
+ *     Mode   = Mode to probe the buffer for
+ *     Region = Address of a pointer to receive the new region
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_REGION NewRegion;
+    NTSTATUS Status = STATUS_SUCCESS;
+    BOOLEAN Locked = FALSE;
+
+    if (Length == 0)
+        return STATUS_INVALID_PARAMETER;
+
+    NewRegion = ExAllocatePoolWithTag(NonPagedPool, sizeof(TCP_REGION), TCP_REGION_TAG);
+    if (!NewRegion)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    NewRegion->Mdl = IoAllocateMdl(Base, Length, FALSE, FALSE, NULL);
+    if (!NewRegion->Mdl)
+    {
+        ExFreePoolWithTag(NewRegion, TCP_REGION_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    _SEH2_TRY {
+        MmProbeAndLockPages(NewRegion->Mdl, Mode, IoModifyAccess);
+        Locked = TRUE;
+    } _SEH2_EXCEPT(EXCEPTION_EXECUTE_HANDLER) {
+        Status = _SEH2_GetExceptionCode();
+    } _SEH2_END;
+
+    if (NT_SUCCESS(Status))
+    {
+        NewRegion->SystemVa = MmGetSystemAddressForMdlSafe(NewRegion->Mdl, NormalPagePriority);
+        if (!NewRegion->SystemVa)
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        if (Locked)
+            MmUnlockPages(NewRegion->Mdl);
+        IoFreeMdl(NewRegion->Mdl);
+        ExFreePoolWithTag(NewRegion, TCP_REGION_TAG);
+        return Status;
+    }
+
+    NewRegion->RefCount = 1;
+    NewRegion->Id = 0;
+    NewRegion->Process = PsGetCurrentProcess();
+    NewRegion->Owner = NULL;
+    NewRegion->Length = Length;
+
+    *Region = NewRegion;
+
+    return STATUS_SUCCESS;
+}
+
+PTCP_REGION RegionReference(
+    ULONG Id)
+/*
+ * FUNCTION: Looks up a registered region of the current process
+ * ARGUMENTS:
+ *     Id = Region identifier
+ * RETURNS:
+ *     Referenced region, or NULL if there is none
+ */
+{
+    PTCP_REGION Region = NULL;
+    ULONG Index = Id & 0xFFFF;
+    KIRQL OldIrql;
+
+    if (Index >= TCP_MAX_REGIONS)
+        return NULL;
+
+    KeAcquireSpinLock(&RegionTableLock, &OldIrql);
+    if (RegionTable[Index].Region &&
+        RegionTable[Index].Region->Id == Id &&
+        RegionTable[Index].Region->Process == PsGetCurrentProcess())
+    {
+        Region = RegionTable[Index].Region;
+        InterlockedIncrement(&Region->RefCount);
+    }
+    KeReleaseSpinLock(&RegionTableLock, OldIrql);
+
+    return Region;
+}
+
+VOID RegionDereference(
+    PTCP_REGION Region)
+{
+    if (InterlockedDecrement(&Region->RefCount) != 0)
+        return;
+
+    MmUnlockPages(Region->Mdl);
+    IoFreeMdl(Region->Mdl);
+    ExFreePoolWithTag(Region, TCP_REGION_TAG);
+}
+
+VOID RegionBuildMdl(
+    PTCP_REGION Region,
+    ULONG Offset,
+    ULONG Length,
+    PMDL Mdl)
+/*
+ * FUNCTION: Describes part of a region without probing or mapping it again
+ * ARGUMENTS:
+ *     Region = Region, the range must already be validated
+ *     Offset = Offset of the range in the region
+ *     Length = Length of the range
+ *     Mdl    = MDL with room for the pages of the range
+ * NOTES:
+ *     The MDL inherits the system mapping of the region
+ */
+{
+    PUCHAR Va = (PUCHAR)MmGetMdlVirtualAddress(Region->Mdl) + Offset;
+
+    MmInitializeMdl(Mdl, Va, Length);
+    if (Length)
+        IoBuildPartialMdl(Region->Mdl, Mdl, Va, Length);
+}
+
+static PTCP_REGION RegionRemove(
+    ULONG Index)
+{
+    PTCP_REGION Region = RegionTable[Index].Region;
+
+    RegionTable[Index].Region = NULL;
+    if (++RegionTable[Index].Sequence == 0)
+        RegionTable[Index].Sequence = 1;
+
+    return Region;
+}
+
+VOID RegionCloseFileObject(
+    PFILE_OBJECT FileObject)
+/*
+ * FUNCTION: Deregisters every region registered on a file object
+ * ARGUMENTS:
+ *     FileObject = File object being closed
+ */
+{
+    PTCP_REGION Region;
+    KIRQL OldIrql;
+    ULONG i;
+
+    for (i = 0; i < TCP_MAX_REGIONS; i++)
+    {
+        if (!RegionTable[i].Region)
+            continue;
+
+        Region = NULL;
+
+        KeAcquireSpinLock(&RegionTableLock, &OldIrql);
+        if (RegionTable[i].Region && RegionTable[i].Region->Owner == FileObject)
+            Region = RegionRemove(i);
+        KeReleaseSpinLock(&RegionTableLock, OldIrql);
+
+        /* In-flight requests keep their own reference */
+        if (Region)
+            RegionDereference(Region);
+    }
+}
+
+NTSTATUS DispTcpRegisterBuffer(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_REGISTER_BUFFER handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_REGISTER_BUFFER Register = Irp->AssociatedIrp.SystemBuffer;
+    PTCP_REGION Region;
+    NTSTATUS Status;
+    KIRQL OldIrql;
+    ULONG i;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_REGISTER_BUFFER) ||
+        IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(TCP_REGISTER_BUFFER))
+        return STATUS_INVALID_PARAMETER;
+
+    Status = RegionCreate(Register->Base, Register->Length, Irp->RequestorMode, &Region);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Region->Owner = IrpSp->FileObject;
+
+    KeAcquireSpinLock(&RegionTableLock, &OldIrql);
+    for (i = 0; i < TCP_MAX_REGIONS; i++)
+    {
+        if (!RegionTable[i].Region)
+        {
+            Region->Id = ((ULONG)RegionTable[i].Sequence << 16) | i;
+            RegionTable[i].Region = Region;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&RegionTableLock, OldIrql);
+
+    if (i == TCP_MAX_REGIONS)
+    {
+        RegionDereference(Region);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    TI_DbgPrint(MID_TRACE, ("Registered region %x (%d bytes).\n",
+                            Region->Id, Region->Length));
+
+    Register->RegionId = Region->Id;
+    Irp->IoStatus.Information = sizeof(TCP_REGISTER_BUFFER);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS DispTcpDeregisterBuffer(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_DEREGISTER_BUFFER handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_REGISTER_BUFFER Register = Irp->AssociatedIrp.SystemBuffer;
+    PTCP_REGION Region = NULL;
+    ULONG Index;
+    KIRQL OldIrql;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_REGISTER_BUFFER))
+        return STATUS_INVALID_PARAMETER;
+
+    Index = Register->RegionId & 0xFFFF;
+    if (Index >= TCP_MAX_REGIONS)
+        return STATUS_INVALID_PARAMETER;
+
+    KeAcquireSpinLock(&RegionTableLock, &OldIrql);
+    if (RegionTable[Index].Region &&
+        RegionTable[Index].Region->Id == Register->RegionId &&
+        RegionTable[Index].Region->Owner == IrpSp->FileObject)
+        Region = RegionRemove(Index);
+    KeReleaseSpinLock(&RegionTableLock, OldIrql);
+
+    if (!Region)
+        return STATUS_INVALID_PARAMETER;
+
+    RegionDereference(Region);
+
+    return STATUS_SUCCESS;
+}
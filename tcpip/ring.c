@@ -0,0 +1,473 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/ring.c
+ * PURPOSE:     Batched I/O submission and completion rings
+ */
+
+#include "precomp.h"
+
+#define TCP_RING_MAX_IO_PAGES (TCP_RING_MAX_IO / PAGE_SIZE + 1)
+
+typedef struct _TCP_RING
+{
+    LONG RefCount;                  /* One for the file object, one per request */
+    KEVENT SubmitLock;              /* Serializes IOCTL_TCP_RING_ENTER */
+    KSPIN_LOCK CqLock;              /* Protects CqTail and InFlight */
+
+    PTCP_REGION RingRegion;         /* Locked ring memory */
+    PTCP_RING_HEADER Header;
+    PTCP_RING_SQE Sq;
+    PTCP_RING_CQE Cq;
+    ULONG SqEntries;
+    ULONG CqEntries;
+    ULONG SqHead;                   /* Our copies; the shared ones are untrusted */
+    ULONG CqTail;
+    ULONG InFlight;                 /* Submitted requests not yet posted */
+
+    PTCP_REGION DataRegion;         /* Data area named by RegionId 0, if any */
+
+    PKEVENT Event;
+    NPAGED_LOOKASIDE_LIST RequestList;
+} TCP_RING, *PTCP_RING;
+
+typedef struct _RING_REQUEST
+{
+    PTCP_RING Ring;
+    ULONGLONG UserData;
+    ULONG Opcode;
+    PTCP_REGION Region;             /* Region the data lives in */
+    TDI_CONNECTION_INFORMATION ConnInfo;
+    TDI_CONNECTION_INFORMATION ReturnInfo;
+    TA_IP_ADDRESS Address;
+    MDL Mdl;                        /* Partial MDL over the data area */
+    PFN_NUMBER Pages[TCP_RING_MAX_IO_PAGES];
+} RING_REQUEST, *PRING_REQUEST;
+
+static VOID RingDereference(PTCP_RING Ring)
+{
+    if (InterlockedDecrement(&Ring->RefCount) != 0)
+        return;
+
+    if (Ring->DataRegion)
+        RegionDereference(Ring->DataRegion);
+    if (Ring->RingRegion)
+        RegionDereference(Ring->RingRegion);
+
+    if (Ring->Event)
+        ObDereferenceObject(Ring->Event);
+
+    ExDeleteNPagedLookasideList(&Ring->RequestList);
+    ExFreePoolWithTag(Ring, TCP_RING_TAG);
+}
+
+static VOID RingPostCompletion(
+    PTCP_RING Ring,
+    ULONGLONG UserData,
+    NTSTATUS Status,
+    ULONG Information,
+    PTA_IP_ADDRESS Address)
+{
+    PTCP_RING_CQE Cqe;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&Ring->CqLock, &OldIrql);
+
+    /* Submission keeps InFlight plus unreaped entries within the queue */
+    Cqe = &Ring->Cq[Ring->CqTail & (Ring->CqEntries - 1)];
+    Cqe->UserData = UserData;
+    Cqe->Status = Status;
+    Cqe->Information = Information;
+    if (Address)
+    {
+        Cqe->RemoteAddress = Address->Address[0].Address[0].in_addr;
+        Cqe->RemotePort = Address->Address[0].Address[0].sin_port;
+    }
+    else
+    {
+        Cqe->RemoteAddress = 0;
+        Cqe->RemotePort = 0;
+    }
+
+    /* Publish the entry before the new tail */
+    Ring->CqTail++;
+    InterlockedExchange((PLONG)&Ring->Header->CqTail, Ring->CqTail);
+    Ring->InFlight--;
+
+    KeReleaseSpinLock(&Ring->CqLock, OldIrql);
+
+    if (Ring->Event)
+        KeSetEvent(Ring->Event, IO_NETWORK_INCREMENT, FALSE);
+}
+
+static VOID RingRequestComplete(
+    PVOID Context,
+    NTSTATUS Status,
+    ULONG Count)
+{
+    PRING_REQUEST Request = Context;
+    PTCP_RING Ring = Request->Ring;
+
+    TI_DbgPrint(DEBUG_IRP, ("Ring request %I64x completed (%x, %d).\n",
+                            Request->UserData, Status, Count));
+
+    RingPostCompletion(Ring,
+                       Request->UserData,
+                       Status,
+                       Count,
+                       Request->Opcode == TCP_RING_OP_RECEIVE_DATAGRAM ?
+                       &Request->Address : NULL);
+
+    if (Request->Mdl.MdlFlags & MDL_PARTIAL_HAS_BEEN_MAPPED)
+        MmPrepareMdlForReuse(&Request->Mdl);
+
+    if (Request->Region)
+        RegionDereference(Request->Region);
+
+    ExFreeToNPagedLookasideList(&Ring->RequestList, Request);
+
+    RingDereference(Ring);
+}
+
+static NTSTATUS RingStartRequest(
+    PTCP_RING Ring,
+    PTRANSPORT_CONTEXT Context,
+    ULONG_PTR FileType,
+    PTCP_RING_SQE Sqe,
+    PRING_REQUEST Request,
+    PULONG Information)
+{
+    PADDRESS_FILE AddrFile;
+    PTCP_REGION Region;
+    BOOLEAN Connection;
+
+    switch (Sqe->Opcode)
+    {
+    case TCP_RING_OP_SEND:
+    case TCP_RING_OP_RECEIVE:
+        Connection = TRUE;
+        break;
+
+    case TCP_RING_OP_SEND_DATAGRAM:
+    case TCP_RING_OP_RECEIVE_DATAGRAM:
+        Connection = FALSE;
+        break;
+
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Connection ? (FileType != TDI_CONNECTION_FILE ||
+                      !Context->Handle.ConnectionContext) :
+                     (FileType != TDI_TRANSPORT_ADDRESS_FILE ||
+                      !Context->Handle.AddressHandle))
+        return STATUS_INVALID_PARAMETER;
+
+    /* Region 0 is the data area given at setup, others are registered */
+    if (Sqe->RegionId)
+    {
+        Region = RegionReference(Sqe->RegionId);
+    }
+    else
+    {
+        Region = Ring->DataRegion;
+        if (Region)
+            InterlockedIncrement(&Region->RefCount);
+    }
+
+    if (!Region)
+        return STATUS_INVALID_PARAMETER;
+
+    Request->Region = Region;
+
+    if (Sqe->Length > TCP_RING_MAX_IO ||
+        Sqe->Offset > Region->Length ||
+        Sqe->Length > Region->Length - Sqe->Offset)
+        return STATUS_INVALID_PARAMETER;
+
+    RegionBuildMdl(Region, Sqe->Offset, Sqe->Length, &Request->Mdl);
+
+    RtlZeroMemory(&Request->ConnInfo, sizeof(Request->ConnInfo));
+    RtlZeroMemory(&Request->ReturnInfo, sizeof(Request->ReturnInfo));
+    RtlZeroMemory(&Request->Address, sizeof(Request->Address));
+
+    switch (Sqe->Opcode)
+    {
+    case TCP_RING_OP_SEND:
+        return TCPSendData(Context->Handle.ConnectionContext,
+                           (PNDIS_BUFFER)&Request->Mdl,
+                           Sqe->Length,
+                           Information,
+                           Sqe->Flags,
+                           RingRequestComplete,
+                           Request);
+
+    case TCP_RING_OP_RECEIVE:
+        return TCPReceiveData(Context->Handle.ConnectionContext,
+                              (PNDIS_BUFFER)&Request->Mdl,
+                              Sqe->Length,
+                              Information,
+                              Sqe->Flags,
+                              RingRequestComplete,
+                              Request,
+                              NULL);
+
+    case TCP_RING_OP_SEND_DATAGRAM:
+        AddrFile = Context->Handle.AddressHandle;
+        if (!AddrFile->Send)
+            return STATUS_INVALID_PARAMETER;
+
+        Request->Address.TAAddressCount = 1;
+        Request->Address.Address[0].AddressLength = TDI_ADDRESS_LENGTH_IP;
+        Request->Address.Address[0].AddressType = TDI_ADDRESS_TYPE_IP;
+        Request->Address.Address[0].Address[0].in_addr = Sqe->RemoteAddress;
+        Request->Address.Address[0].Address[0].sin_port = Sqe->RemotePort;
+        Request->ConnInfo.RemoteAddress = &Request->Address;
+        Request->ConnInfo.RemoteAddressLength = sizeof(Request->Address);
+
+        return AddrFile->Send(AddrFile,
+                              &Request->ConnInfo,
+                              (PCHAR)Region->SystemVa + Sqe->Offset,
+                              Sqe->Length,
+                              Information);
+
+    default:
+        Request->ReturnInfo.RemoteAddress = &Request->Address;
+        Request->ReturnInfo.RemoteAddressLength = sizeof(Request->Address);
+
+        return DGReceiveDatagram(Context->Handle.AddressHandle,
+                                 &Request->ConnInfo,
+                                 (PCHAR)Region->SystemVa + Sqe->Offset,
+                                 Sqe->Length,
+                                 Sqe->Flags,
+                                 &Request->ReturnInfo,
+                                 Information,
+                                 (PDATAGRAM_COMPLETION_ROUTINE)RingRequestComplete,
+                                 Request,
+                                 NULL);
+    }
+}
+
+static VOID RingSubmit(
+    PTCP_RING Ring,
+    PTRANSPORT_CONTEXT Context,
+    ULONG_PTR FileType,
+    PTCP_RING_SQE Sqe)
+/*
+ * FUNCTION: Starts one submission entry
+ * NOTES:
+ *     Every entry gets exactly one completion entry, errors included
+ */
+{
+    PRING_REQUEST Request;
+    NTSTATUS Status;
+    ULONG Information = 0;
+
+    Request = ExAllocateFromNPagedLookasideList(&Ring->RequestList);
+    if (!Request)
+    {
+        RingPostCompletion(Ring, Sqe->UserData, STATUS_INSUFFICIENT_RESOURCES, 0, NULL);
+        return;
+    }
+
+    InterlockedIncrement(&Ring->RefCount);
+    Request->Ring = Ring;
+    Request->UserData = Sqe->UserData;
+    Request->Opcode = Sqe->Opcode;
+    Request->Region = NULL;
+    Request->Mdl.MdlFlags = 0;
+
+    Status = RingStartRequest(Ring, Context, FileType, Sqe, Request, &Information);
+    if (Status != STATUS_PENDING)
+        RingRequestComplete(Request, Status, Information);
+}
+
+NTSTATUS DispTcpRingSetup(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: Attaches a batched I/O ring to a connection or address file
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTRANSPORT_CONTEXT Context = IrpSp->FileObject->FsContext;
+    PTCP_RING_SETUP Setup = Irp->AssociatedIrp.SystemBuffer;
+    PTCP_RING Ring;
+    ULONG SqOffset, CqOffset, Needed;
+    PUCHAR RingVa;
+    NTSTATUS Status;
+
+    if (!Context ||
+        ((ULONG_PTR)IrpSp->FileObject->FsContext2 != TDI_CONNECTION_FILE &&
+         (ULONG_PTR)IrpSp->FileObject->FsContext2 != TDI_TRANSPORT_ADDRESS_FILE))
+        return STATUS_INVALID_PARAMETER;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_RING_SETUP))
+        return STATUS_INVALID_PARAMETER;
+
+    if (Setup->Entries == 0 ||
+        Setup->Entries > TCP_RING_MAX_ENTRIES ||
+        (Setup->Entries & (Setup->Entries - 1)) != 0)
+        return STATUS_INVALID_PARAMETER;
+
+    SqOffset = sizeof(TCP_RING_HEADER);
+    CqOffset = SqOffset + Setup->Entries * sizeof(TCP_RING_SQE);
+    Needed = CqOffset + 2 * Setup->Entries * sizeof(TCP_RING_CQE);
+    if (Setup->RingLength < Needed)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    Ring = ExAllocatePoolWithTag(NonPagedPool, sizeof(TCP_RING), TCP_RING_TAG);
+    if (!Ring)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Ring, sizeof(TCP_RING));
+    Ring->RefCount = 1;
+    KeInitializeEvent(&Ring->SubmitLock, SynchronizationEvent, TRUE);
+    KeInitializeSpinLock(&Ring->CqLock);
+    Ring->SqEntries = Setup->Entries;
+    Ring->CqEntries = 2 * Setup->Entries;
+    ExInitializeNPagedLookasideList(&Ring->RequestList,
+                                    NULL,
+                                    NULL,
+                                    0,
+                                    sizeof(RING_REQUEST),
+                                    TCP_RING_TAG,
+                                    0);
+
+    Status = RegionCreate(Setup->RingBase,
+                          Needed,
+                          Irp->RequestorMode,
+                          &Ring->RingRegion);
+    if (NT_SUCCESS(Status) && Setup->DataLength)
+    {
+        Status = RegionCreate(Setup->DataBase,
+                              Setup->DataLength,
+                              Irp->RequestorMode,
+                              &Ring->DataRegion);
+    }
+
+    if (NT_SUCCESS(Status) && Setup->Event)
+    {
+        Status = ObReferenceObjectByHandle(Setup->Event,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           Irp->RequestorMode,
+                                           (PVOID*)&Ring->Event,
+                                           NULL);
+        if (!NT_SUCCESS(Status))
+            Ring->Event = NULL;
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        RingDereference(Ring);
+        return Status;
+    }
+
+    RingVa = Ring->RingRegion->SystemVa;
+    Ring->Header = (PTCP_RING_HEADER)RingVa;
+    Ring->Sq = (PTCP_RING_SQE)(RingVa + SqOffset);
+    Ring->Cq = (PTCP_RING_CQE)(RingVa + CqOffset);
+
+    Ring->Header->SqHead = 0;
+    Ring->Header->SqTail = 0;
+    Ring->Header->CqHead = 0;
+    Ring->Header->CqTail = 0;
+    Ring->Header->SqEntries = Ring->SqEntries;
+    Ring->Header->CqEntries = Ring->CqEntries;
+    Ring->Header->SqOffset = SqOffset;
+    Ring->Header->CqOffset = CqOffset;
+
+    if (InterlockedCompareExchangePointer((PVOID*)&Context->Ring, Ring, NULL) != NULL)
+    {
+        RingDereference(Ring);
+        return STATUS_ADDRESS_ALREADY_ASSOCIATED;
+    }
+
+    TI_DbgPrint(MID_TRACE, ("Ring %x set up with %d entries.\n", Ring, Ring->SqEntries));
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS DispTcpRingEnter(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: Consumes submission entries from a ring
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Stops early when the completion queue could overflow; the client
+ *     reaps completions and enters again
+ */
+{
+    PTRANSPORT_CONTEXT Context = IrpSp->FileObject->FsContext;
+    PTCP_RING_ENTER Enter = Irp->AssociatedIrp.SystemBuffer;
+    TCP_RING_SQE Sqe;
+    PTCP_RING Ring;
+    ULONG Available, Unreaped, Submitted = 0;
+    KIRQL OldIrql;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_RING_ENTER) ||
+        IrpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(TCP_RING_ENTER))
+        return STATUS_INVALID_PARAMETER;
+
+    Ring = Context ? Context->Ring : NULL;
+    if (!Ring)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    KeWaitForSingleObject(&Ring->SubmitLock, Executive, KernelMode, FALSE, NULL);
+
+    Available = Ring->Header->SqTail - Ring->SqHead;
+    if (Available > Ring->SqEntries)
+    {
+        KeSetEvent(&Ring->SubmitLock, 0, FALSE);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    while (Submitted < Enter->ToSubmit && Submitted < Available)
+    {
+        KeAcquireSpinLock(&Ring->CqLock, &OldIrql);
+        Unreaped = Ring->CqTail - Ring->Header->CqHead;
+        if (Unreaped > Ring->CqEntries ||
+            Ring->InFlight + Unreaped >= Ring->CqEntries)
+        {
+            KeReleaseSpinLock(&Ring->CqLock, OldIrql);
+            break;
+        }
+        Ring->InFlight++;
+        KeReleaseSpinLock(&Ring->CqLock, OldIrql);
+
+        /* The client may rewrite the entry under us, so work from a copy */
+        Sqe = Ring->Sq[Ring->SqHead & (Ring->SqEntries - 1)];
+        Ring->SqHead++;
+        Ring->Header->SqHead = Ring->SqHead;
+
+        RingSubmit(Ring, Context, (ULONG_PTR)IrpSp->FileObject->FsContext2, &Sqe);
+        Submitted++;
+    }
+
+    KeSetEvent(&Ring->SubmitLock, 0, FALSE);
+
+    Enter->Submitted = Submitted;
+    Irp->IoStatus.Information = sizeof(TCP_RING_ENTER);
+
+    return STATUS_SUCCESS;
+}
+
+VOID RingDetach(
+    PTRANSPORT_CONTEXT Context)
+{
+    PTCP_RING Ring;
+
+    Ring = InterlockedExchangePointer((PVOID*)&Context->Ring, NULL);
+    if (Ring)
+        RingDereference(Ring);
+}
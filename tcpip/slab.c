@@ -0,0 +1,493 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/slab.c
+ * PURPOSE:     Fixed size object caches
+ * NOTES:       A magazine allocator: each processor allocates from and
+ *              frees to its loaded magazine, swaps with its spare when
+ *              that runs out, and only then trades a magazine with the
+ *              depot under the cache lock. Chunks are never handed back
+ *              before the cache is destroyed.
+ */
+
+#include "precomp.h"
+
+#define SLAB_MAGAZINE_SIZE  32          /* Objects per magazine */
+#define SLAB_CHUNK_SIZE     0x10000     /* Bytes per chunk, unless one object needs more */
+#define SLAB_ALIGNMENT      8
+
+typedef struct _SLAB_MAGAZINE {
+    struct _SLAB_MAGAZINE *Next;        /* Next magazine on a depot list */
+    ULONG Count;                        /* Objects held */
+    PVOID Objects[SLAB_MAGAZINE_SIZE];
+} SLAB_MAGAZINE, *PSLAB_MAGAZINE;
+
+typedef struct _SLAB_CHUNK {
+    struct _SLAB_CHUNK *Next;
+} SLAB_CHUNK, *PSLAB_CHUNK;
+
+#define SLAB_CHUNK_HEADER \
+    ((sizeof(SLAB_CHUNK) + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1))
+
+typedef struct _SLAB_CPU {
+    PSLAB_MAGAZINE Loaded;              /* Objects are taken from and put here */
+    PSLAB_MAGAZINE Previous;            /* Spare, either full or empty */
+    ULONGLONG Allocations;
+    ULONGLONG Frees;
+} SLAB_CPU, *PSLAB_CPU;
+
+typedef struct _SLAB_CACHE {
+    LIST_ENTRY ListEntry;               /* Entry on SlabCacheListHead */
+    CHAR Name[TCP_SLAB_NAME_LENGTH];
+    ULONG Size;                         /* Object size, aligned */
+    ULONG ChunkObjects;                 /* Objects carved from one chunk */
+    ULONG Tag;                          /* Pool tag of the chunks */
+    PSLAB_CPU Cpu;                      /* Per-processor magazines */
+
+    KSPIN_LOCK Lock;                    /* Protects everything below */
+    PSLAB_MAGAZINE FullMagazines;       /* Depot */
+    PSLAB_MAGAZINE EmptyMagazines;      /* Depot */
+    PVOID LooseObjects;                 /* Freed when no magazine could be had */
+    PSLAB_CHUNK Chunks;
+    PUCHAR Carve;                       /* Next object of the newest chunk */
+    ULONG CarveLeft;                    /* Objects left in it */
+    ULONG ChunkCount;
+    ULONGLONG Carved;
+    ULONGLONG DepotExchanges;
+    ULONGLONG Failures;
+} SLAB_CACHE;
+
+static LIST_ENTRY SlabCacheListHead;
+static FAST_MUTEX SlabCacheListMutex;
+
+VOID SlabStartup(VOID)
+{
+    InitializeListHead(&SlabCacheListHead);
+    ExInitializeFastMutex(&SlabCacheListMutex);
+}
+
+PSLAB_CACHE SlabCreateCache(
+    PCSTR Name,
+    ULONG Size,
+    ULONG Tag)
+/*
+ * FUNCTION: Creates a cache of fixed size objects
+ * ARGUMENTS:
+ *     Name = Name reported through MIB_SLAB_ID, truncated to fit
+ *     Size = Size of an object in bytes
+ *     Tag  = Pool tag of the chunks the objects are carved from
+ * RETURNS:
+ *     Pointer to the cache, NULL if there was not enough memory
+ * NOTES:
+ *     Must be called at PASSIVE_LEVEL
+ */
+{
+    PSLAB_CACHE Cache;
+    ULONG i;
+
+    Cache = ExAllocatePoolWithTag(NonPagedPool, sizeof(SLAB_CACHE), SLAB_TAG);
+    if (!Cache)
+        return NULL;
+
+    RtlZeroMemory(Cache, sizeof(SLAB_CACHE));
+
+    Cache->Cpu = STATS_ALLOCATE(SLAB_CPU);
+    if (!Cache->Cpu)
+    {
+        ExFreePoolWithTag(Cache, SLAB_TAG);
+        return NULL;
+    }
+
+    for (i = 0; i < TCP_SLAB_NAME_LENGTH - 1 && Name[i]; i++)
+        Cache->Name[i] = Name[i];
+
+    /* Free objects hold the link of the loose list */
+    Size = max(Size, sizeof(PVOID));
+    Cache->Size = (Size + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+    Cache->ChunkObjects = max((SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) / Cache->Size, 1);
+    Cache->Tag = Tag;
+
+    TcpipInitializeSpinLock(&Cache->Lock);
+
+    TcpipAcquireFastMutex(&SlabCacheListMutex);
+    InsertTailList(&SlabCacheListHead, &Cache->ListEntry);
+    TcpipReleaseFastMutex(&SlabCacheListMutex);
+
+    return Cache;
+}
+
+static VOID SlabFreeMagazines(
+    PSLAB_MAGAZINE Magazine)
+{
+    PSLAB_MAGAZINE Next;
+
+    while (Magazine)
+    {
+        Next = Magazine->Next;
+        ExFreePoolWithTag(Magazine, SLAB_TAG);
+        Magazine = Next;
+    }
+}
+
+VOID SlabDestroyCache(
+    PSLAB_CACHE Cache)
+/*
+ * FUNCTION: Destroys a cache and the memory of all its objects
+ * ARGUMENTS:
+ *     Cache = Cache to destroy
+ * NOTES:
+ *     Objects still in use become invalid
+ */
+{
+    PSLAB_CHUNK Chunk, Next;
+    PSLAB_CPU Cpu;
+    ULONG i;
+
+    TcpipAcquireFastMutex(&SlabCacheListMutex);
+    RemoveEntryList(&Cache->ListEntry);
+    TcpipReleaseFastMutex(&SlabCacheListMutex);
+
+    for (i = 0; i < (ULONG)KeNumberProcessors; i++)
+    {
+        Cpu = (PSLAB_CPU)((PUCHAR)Cache->Cpu + STATS_STRIDE(SLAB_CPU) * i);
+
+        if (Cpu->Loaded)
+            ExFreePoolWithTag(Cpu->Loaded, SLAB_TAG);
+        if (Cpu->Previous)
+            ExFreePoolWithTag(Cpu->Previous, SLAB_TAG);
+    }
+
+    SlabFreeMagazines(Cache->FullMagazines);
+    SlabFreeMagazines(Cache->EmptyMagazines);
+
+    for (Chunk = Cache->Chunks; Chunk; Chunk = Next)
+    {
+        Next = Chunk->Next;
+        ExFreePoolWithTag(Chunk, Cache->Tag);
+    }
+
+    StatsFree(Cache->Cpu);
+    ExFreePoolWithTag(Cache, SLAB_TAG);
+}
+
+ULONG SlabObjectSize(
+    PSLAB_CACHE Cache)
+{
+    return Cache->Size;
+}
+
+static PVOID SlabCarve(
+    PSLAB_CACHE Cache)
+/*
+ * FUNCTION: Takes an object that is in no magazine
+ * ARGUMENTS:
+ *     Cache = Cache to allocate from, at DISPATCH_LEVEL
+ * RETURNS:
+ *     Pointer to the object, NULL if there was not enough memory
+ */
+{
+    PSLAB_CHUNK Chunk;
+    PVOID Object = NULL;
+
+    TcpipAcquireSpinLockAtDpcLevel(&Cache->Lock);
+
+    if (Cache->LooseObjects)
+    {
+        Object = Cache->LooseObjects;
+        Cache->LooseObjects = *(PVOID *)Object;
+    }
+    else
+    {
+        if (!Cache->CarveLeft)
+        {
+            Chunk = ExAllocatePoolWithTag(NonPagedPool,
+                                          SLAB_CHUNK_HEADER + Cache->ChunkObjects * Cache->Size,
+                                          Cache->Tag);
+            if (Chunk)
+            {
+                Chunk->Next = Cache->Chunks;
+                Cache->Chunks = Chunk;
+                Cache->ChunkCount++;
+
+                Cache->Carve = (PUCHAR)Chunk + SLAB_CHUNK_HEADER;
+                Cache->CarveLeft = Cache->ChunkObjects;
+            }
+        }
+
+        if (Cache->CarveLeft)
+        {
+            Object = Cache->Carve;
+            Cache->Carve += Cache->Size;
+            Cache->CarveLeft--;
+            Cache->Carved++;
+        }
+        else
+        {
+            Cache->Failures++;
+        }
+    }
+
+    TcpipReleaseSpinLockFromDpcLevel(&Cache->Lock);
+
+    return Object;
+}
+
+static BOOLEAN SlabLoadFull(
+    PSLAB_CACHE Cache,
+    PSLAB_CPU Cpu)
+/*
+ * FUNCTION: Makes sure the loaded magazine of a processor has an object
+ * ARGUMENTS:
+ *     Cache = Cache of the magazines, at DISPATCH_LEVEL
+ *     Cpu   = Magazines of the current processor
+ * RETURNS:
+ *     TRUE if the loaded magazine has an object to take
+ */
+{
+    PSLAB_MAGAZINE Magazine;
+
+    if (Cpu->Loaded && Cpu->Loaded->Count)
+        return TRUE;
+
+    if (Cpu->Previous && Cpu->Previous->Count)
+    {
+        Magazine = Cpu->Loaded;
+        Cpu->Loaded = Cpu->Previous;
+        Cpu->Previous = Magazine;
+        return TRUE;
+    }
+
+    TcpipAcquireSpinLockAtDpcLevel(&Cache->Lock);
+
+    Magazine = Cache->FullMagazines;
+    if (Magazine)
+    {
+        Cache->FullMagazines = Magazine->Next;
+
+        /* Both magazines are empty, keep one as the spare */
+        if (Cpu->Previous)
+        {
+            Cpu->Previous->Next = Cache->EmptyMagazines;
+            Cache->EmptyMagazines = Cpu->Previous;
+        }
+
+        Cpu->Previous = Cpu->Loaded;
+        Cpu->Loaded = Magazine;
+        Cache->DepotExchanges++;
+    }
+
+    TcpipReleaseSpinLockFromDpcLevel(&Cache->Lock);
+
+    return Magazine != NULL;
+}
+
+static BOOLEAN SlabLoadEmpty(
+    PSLAB_CACHE Cache,
+    PSLAB_CPU Cpu)
+/*
+ * FUNCTION: Makes sure the loaded magazine of a processor has room
+ * ARGUMENTS:
+ *     Cache = Cache of the magazines, at DISPATCH_LEVEL
+ *     Cpu   = Magazines of the current processor
+ * RETURNS:
+ *     TRUE if the loaded magazine has room for an object
+ */
+{
+    PSLAB_MAGAZINE Magazine;
+
+    if (Cpu->Loaded && Cpu->Loaded->Count < SLAB_MAGAZINE_SIZE)
+        return TRUE;
+
+    if (Cpu->Previous && Cpu->Previous->Count < SLAB_MAGAZINE_SIZE)
+    {
+        Magazine = Cpu->Loaded;
+        Cpu->Loaded = Cpu->Previous;
+        Cpu->Previous = Magazine;
+        return TRUE;
+    }
+
+    TcpipAcquireSpinLockAtDpcLevel(&Cache->Lock);
+
+    Magazine = Cache->EmptyMagazines;
+    if (Magazine)
+    {
+        Cache->EmptyMagazines = Magazine->Next;
+    }
+    else
+    {
+        Magazine = ExAllocatePoolWithTag(NonPagedPool, sizeof(SLAB_MAGAZINE), SLAB_TAG);
+        if (Magazine)
+            Magazine->Count = 0;
+    }
+
+    if (Magazine)
+    {
+        /* Both magazines are full, the spare goes to the depot */
+        if (Cpu->Previous)
+        {
+            Cpu->Previous->Next = Cache->FullMagazines;
+            Cache->FullMagazines = Cpu->Previous;
+        }
+
+        Cpu->Previous = Cpu->Loaded;
+        Cpu->Loaded = Magazine;
+        Cache->DepotExchanges++;
+    }
+
+    TcpipReleaseSpinLockFromDpcLevel(&Cache->Lock);
+
+    return Magazine != NULL;
+}
+
+PVOID SlabAllocate(
+    PSLAB_CACHE Cache)
+/*
+ * FUNCTION: Allocates an object
+ * ARGUMENTS:
+ *     Cache = Cache to allocate from
+ * RETURNS:
+ *     Pointer to the object, NULL if there was not enough memory
+ * NOTES:
+ *     Callable at or below DISPATCH_LEVEL
+ */
+{
+    PSLAB_CPU Cpu;
+    PVOID Object;
+    KIRQL OldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Cpu = STATS_CPU(Cache->Cpu, SLAB_CPU);
+
+    if (SlabLoadFull(Cache, Cpu))
+        Object = Cpu->Loaded->Objects[--Cpu->Loaded->Count];
+    else
+        Object = SlabCarve(Cache);
+
+    if (Object)
+        Cpu->Allocations++;
+
+    KeLowerIrql(OldIrql);
+
+    return Object;
+}
+
+VOID SlabFree(
+    PSLAB_CACHE Cache,
+    PVOID Object)
+/*
+ * FUNCTION: Frees an object
+ * ARGUMENTS:
+ *     Cache  = Cache the object was allocated from
+ *     Object = Object to free
+ * NOTES:
+ *     Callable at or below DISPATCH_LEVEL
+ */
+{
+    PSLAB_CPU Cpu;
+    KIRQL OldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Cpu = STATS_CPU(Cache->Cpu, SLAB_CPU);
+
+    if (SlabLoadEmpty(Cache, Cpu))
+    {
+        Cpu->Loaded->Objects[Cpu->Loaded->Count++] = Object;
+    }
+    else
+    {
+        TcpipAcquireSpinLockAtDpcLevel(&Cache->Lock);
+        *(PVOID *)Object = Cache->LooseObjects;
+        Cache->LooseObjects = Object;
+        TcpipReleaseSpinLockFromDpcLevel(&Cache->Lock);
+    }
+
+    Cpu->Frees++;
+
+    KeLowerIrql(OldIrql);
+}
+
+static VOID SlabQueryCache(
+    PSLAB_CACHE Cache,
+    PTCPIP_SLAB_STATS Stats)
+{
+    PSLAB_CPU Cpu;
+    KIRQL OldIrql;
+    ULONG i;
+
+    RtlZeroMemory(Stats, sizeof(TCPIP_SLAB_STATS));
+    RtlCopyMemory(Stats->Name, Cache->Name, sizeof(Stats->Name));
+    Stats->ObjectSize = Cache->Size;
+
+    for (i = 0; i < (ULONG)KeNumberProcessors; i++)
+    {
+        Cpu = (PSLAB_CPU)((PUCHAR)Cache->Cpu + STATS_STRIDE(SLAB_CPU) * i);
+
+        Stats->Allocations += InterlockedCompareExchange64((PLONGLONG)&Cpu->Allocations, 0, 0);
+        Stats->Frees += InterlockedCompareExchange64((PLONGLONG)&Cpu->Frees, 0, 0);
+    }
+
+    /* An object freed on another processor may be counted before its allocation */
+    Stats->InUse = (Stats->Allocations > Stats->Frees) ? Stats->Allocations - Stats->Frees : 0;
+
+    TcpipAcquireSpinLock(&Cache->Lock, &OldIrql);
+    Stats->Chunks = Cache->ChunkCount;
+    Stats->HighWater = Cache->Carved;
+    Stats->DepotExchanges = Cache->DepotExchanges;
+    Stats->Failures = Cache->Failures;
+    TcpipReleaseSpinLock(&Cache->Lock, OldIrql);
+}
+
+TDI_STATUS InfoTdiQueryGetSlab(
+    PNDIS_BUFFER Buffer,
+    PUINT BufferSize)
+/*
+ * FUNCTION: Returns the statistics of every object cache
+ * ARGUMENTS:
+ *   Buffer     = Pointer to buffer with data to use
+ *   BufferSize = Pointer to buffer with size of Buffer. On return
+ *                this is filled with number of bytes returned
+ * RETURNS:
+ *   Status of operation
+ */
+{
+    PTCPIP_SLAB_INFO Info;
+    PLIST_ENTRY Entry;
+    TDI_STATUS Status;
+    ULONG Caches = 0, Size;
+
+    TcpipAcquireFastMutex(&SlabCacheListMutex);
+
+    for (Entry = SlabCacheListHead.Flink; Entry != &SlabCacheListHead; Entry = Entry->Flink)
+        Caches++;
+
+    Size = FIELD_OFFSET(TCPIP_SLAB_INFO, Cache) + Caches * sizeof(TCPIP_SLAB_STATS);
+
+    Info = ExAllocatePoolWithTag(NonPagedPool, Size, SLAB_TAG);
+    if (!Info)
+    {
+        TcpipReleaseFastMutex(&SlabCacheListMutex);
+        return TDI_NO_RESOURCES;
+    }
+
+    RtlZeroMemory(Info, Size);
+    Info->Caches = Caches;
+
+    Caches = 0;
+    for (Entry = SlabCacheListHead.Flink; Entry != &SlabCacheListHead; Entry = Entry->Flink)
+    {
+        SlabQueryCache(CONTAINING_RECORD(Entry, SLAB_CACHE, ListEntry),
+                       &Info->Cache[Caches++]);
+    }
+
+    TcpipReleaseFastMutex(&SlabCacheListMutex);
+
+    Status = InfoCopyOut((PCHAR)Info, Size, Buffer, BufferSize);
+
+    ExFreePoolWithTag(Info, SLAB_TAG);
+
+    return Status;
+}
+
+/* EOF */
@@ -0,0 +1,319 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tcpip/trace.c
+ * PURPOSE:     Binary event trace
+ * NOTES:       Every processor writes its own ring at DISPATCH_LEVEL and
+ *              only moves its head; the reader only moves the tails. A
+ *              writer that laps the reader overwrites the oldest records,
+ *              which the reader detects and counts as lost.
+ */
+
+#include "precomp.h"
+#include <intrin.h>
+
+typedef struct _TRACE_RING {
+    volatile LONG Head;         /* Records written, moved by the owning processor */
+    LONG Tail;                  /* Records drained, moved under TraceMutex */
+    TCP_TRACE_RECORD Records[TRACE_RING_SIZE];
+} TRACE_RING, *PTRACE_RING;
+
+volatile BOOLEAN TraceEnabled = FALSE;
+
+static PTRACE_RING *TraceRings = NULL;
+static FAST_MUTEX TraceMutex;
+static ULONGLONG TraceStartTimestamp;
+static LARGE_INTEGER TraceStartCounter;
+static LARGE_INTEGER TraceStartTime;
+
+VOID TraceStartup(VOID)
+{
+    ExInitializeFastMutex(&TraceMutex);
+}
+
+static VOID TraceFreeRings(VOID)
+{
+    ULONG i;
+
+    if (!TraceRings)
+        return;
+
+    for (i = 0; i < (ULONG)KeNumberProcessors; i++)
+    {
+        if (TraceRings[i])
+            ExFreePoolWithTag(TraceRings[i], TRACE_RING_TAG);
+    }
+
+    ExFreePoolWithTag(TraceRings, TRACE_RING_TAG);
+    TraceRings = NULL;
+}
+
+VOID TraceShutdown(VOID)
+{
+    TraceEnabled = FALSE;
+    TraceFreeRings();
+}
+
+static NTSTATUS TraceAllocateRings(VOID)
+{
+    ULONG i;
+
+    TraceRings = ExAllocatePoolWithTag(NonPagedPool,
+                                       KeNumberProcessors * sizeof(PTRACE_RING),
+                                       TRACE_RING_TAG);
+    if (!TraceRings)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(TraceRings, KeNumberProcessors * sizeof(PTRACE_RING));
+
+    for (i = 0; i < (ULONG)KeNumberProcessors; i++)
+    {
+        TraceRings[i] = ExAllocatePoolWithTag(NonPagedPool,
+                                              sizeof(TRACE_RING),
+                                              TRACE_RING_TAG);
+        if (!TraceRings[i])
+        {
+            TraceFreeRings();
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TraceRings[i]->Head = 0;
+        TraceRings[i]->Tail = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID TraceWrite(
+    USHORT Event,
+    UCHAR Reason,
+    ULONG_PTR Arg0,
+    ULONG Arg1,
+    ULONG Arg2)
+/*
+ * FUNCTION: Appends a record to the ring of the current processor
+ * ARGUMENTS:
+ *     Event  = TCP_TRACE_* event id
+ *     Reason = TCP_DROP_* reason for TCP_TRACE_DROP, otherwise zero
+ *     Arg0   = Event specific
+ *     Arg1   = Event specific
+ *     Arg2   = Event specific
+ * NOTES:
+ *     Called through TRACE_EVENT, at or below DISPATCH_LEVEL
+ */
+{
+    PTCP_TRACE_RECORD Record;
+    PTRACE_RING Ring;
+    KIRQL OldIrql;
+    ULONG Processor, Head;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Processor = KeGetCurrentProcessorNumber() % KeNumberProcessors;
+    Ring = TraceRings[Processor];
+
+    Head = (ULONG)Ring->Head;
+    Record = &Ring->Records[Head & (TRACE_RING_SIZE - 1)];
+
+    Record->Timestamp = __rdtsc();
+    Record->Event = Event;
+    Record->Processor = (UCHAR)Processor;
+    Record->Reason = Reason;
+    Record->Arg0 = Arg0;
+    Record->Arg1 = Arg1;
+    Record->Arg2 = Arg2;
+
+    /* Publish the record */
+    InterlockedExchange(&Ring->Head, (LONG)(Head + 1));
+
+    KeLowerIrql(OldIrql);
+}
+
+static ULONG TraceDrainRing(
+    PTRACE_RING Ring,
+    PTCP_TRACE_RECORD Records,
+    ULONG Room,
+    PULONG Lost)
+/*
+ * FUNCTION: Copies the undrained records of a ring
+ * ARGUMENTS:
+ *     Ring    = Ring to drain, TraceMutex must be held
+ *     Records = Buffer for the records
+ *     Room    = Number of records the buffer can hold
+ *     Lost    = Incremented by the number of overwritten records
+ * RETURNS:
+ *     Number of records copied
+ */
+{
+    ULONG Head, Tail, Count, Stale, i;
+
+    Head = (ULONG)InterlockedCompareExchange(&Ring->Head, 0, 0);
+    Tail = (ULONG)Ring->Tail;
+
+    if (Head - Tail > TRACE_RING_SIZE)
+    {
+        *Lost += Head - Tail - TRACE_RING_SIZE;
+        Tail = Head - TRACE_RING_SIZE;
+    }
+
+    Count = min(Head - Tail, Room);
+
+    for (i = 0; i < Count; i++)
+        Records[i] = Ring->Records[(Tail + i) & (TRACE_RING_SIZE - 1)];
+
+    Ring->Tail = (LONG)(Tail + Count);
+
+    /* Slots the writer reached again while we were copying, including
+       the one it may be filling right now, hold torn records */
+    Head = (ULONG)InterlockedCompareExchange(&Ring->Head, 0, 0);
+    if ((LONG)(Head + 1 - TRACE_RING_SIZE - Tail) <= 0)
+        return Count;
+
+    Stale = min(Head + 1 - TRACE_RING_SIZE - Tail, Count);
+
+    RtlMoveMemory(Records, Records + Stale, (Count - Stale) * sizeof(TCP_TRACE_RECORD));
+    *Lost += Stale;
+
+    return Count - Stale;
+}
+
+ULONGLONG TraceEstimateTimestampFrequency(
+    ULONGLONG StartTimestamp,
+    LARGE_INTEGER StartCounter)
+/*
+ * FUNCTION: Estimates the time stamp counter frequency
+ * ARGUMENTS:
+ *     StartTimestamp = Time stamp counter at the start of the interval
+ *     StartCounter   = Performance counter at the start of the interval
+ * RETURNS:
+ *     Ticks per second over the interval, zero if unknown
+ */
+{
+    LARGE_INTEGER Counter, Frequency;
+    ULONGLONG Ticks, Elapsed;
+
+    Ticks = __rdtsc() - StartTimestamp;
+    Counter = KeQueryPerformanceCounter(&Frequency);
+    Elapsed = Counter.QuadPart - StartCounter.QuadPart;
+
+    if (Elapsed == 0)
+        return 0;
+
+    /* Keep the products below in 64 bits */
+    while (Elapsed > 0xFFFFFFFF)
+    {
+        Elapsed >>= 1;
+        Ticks >>= 1;
+    }
+
+    return (Ticks / Elapsed) * Frequency.QuadPart +
+           ((Ticks % Elapsed) * Frequency.QuadPart) / Elapsed;
+}
+
+NTSTATUS DispTcpTraceControl(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_TRACE_CONTROL handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ */
+{
+    PTCP_TRACE_CONTROL Control = Irp->AssociatedIrp.SystemBuffer;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    if (IrpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(TCP_TRACE_CONTROL))
+        return STATUS_INVALID_PARAMETER;
+
+    TcpipAcquireFastMutex(&TraceMutex);
+
+    if (!Control->Enable)
+    {
+        TraceEnabled = FALSE;
+    }
+    else if (!TraceEnabled)
+    {
+        /* Rings stay allocated until unload, so writers never see them go */
+        if (!TraceRings)
+            Status = TraceAllocateRings();
+
+        if (NT_SUCCESS(Status))
+        {
+            TraceStartTimestamp = __rdtsc();
+            TraceStartCounter = KeQueryPerformanceCounter(NULL);
+            KeQuerySystemTime(&TraceStartTime);
+
+            KeMemoryBarrier();
+            TraceEnabled = TRUE;
+        }
+    }
+
+    TcpipReleaseFastMutex(&TraceMutex);
+
+    TI_DbgPrint(MIN_TRACE, ("Tracing %s (%x).\n",
+                            TraceEnabled ? "enabled" : "disabled", Status));
+
+    return Status;
+}
+
+NTSTATUS DispTcpQueryTrace(
+    PIRP Irp,
+    PIO_STACK_LOCATION IrpSp)
+/*
+ * FUNCTION: IOCTL_TCP_QUERY_TRACE handler
+ * ARGUMENTS:
+ *     Irp   = Pointer to an I/O request packet
+ *     IrpSp = Pointer to the current stack location
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Records that do not fit stay in the rings for the next query
+ */
+{
+    ULONG Length = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    PTCP_TRACE_RECORD Records;
+    PTCP_TRACE_DUMP Dump;
+    ULONG Room, i;
+
+    if (Length < sizeof(TCP_TRACE_DUMP) || !Irp->MdlAddress)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    Dump = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (!Dump)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Records = (PTCP_TRACE_RECORD)(Dump + 1);
+    Room = (Length - sizeof(TCP_TRACE_DUMP)) / sizeof(TCP_TRACE_RECORD);
+
+    RtlZeroMemory(Dump, sizeof(TCP_TRACE_DUMP));
+
+    TcpipAcquireFastMutex(&TraceMutex);
+
+    if (TraceRings)
+    {
+        for (i = 0; i < (ULONG)KeNumberProcessors && Dump->Count < Room; i++)
+        {
+            Dump->Count += TraceDrainRing(TraceRings[i],
+                                          Records + Dump->Count,
+                                          Room - Dump->Count,
+                                          &Dump->Lost);
+        }
+
+        Dump->StartTimestamp = TraceStartTimestamp;
+        Dump->StartTime = TraceStartTime;
+        Dump->TimestampFrequency = TraceEstimateTimestampFrequency(TraceStartTimestamp,
+                                                              TraceStartCounter);
+    }
+
+    TcpipReleaseFastMutex(&TraceMutex);
+
+    Irp->IoStatus.Information = sizeof(TCP_TRACE_DUMP) +
+                                Dump->Count * sizeof(TCP_TRACE_RECORD);
+
+    return STATUS_SUCCESS;
+}
+
+/* EOF */
@@ -0,0 +1,500 @@
+/*
+ * COPYRIGHT:   See COPYING in the top level directory
+ * PROJECT:     ReactOS TCP/IP protocol driver
+ * FILE:        tracedmp/tracedmp.c
+ * PURPOSE:     Controls the binary event trace and decodes its records
+ * NOTES:       Usage: tracedmp [-e | -d] [-r file] [-w file] [-p file]
+ *
+ *                -e       Enable tracing and exit
+ *                -d       Disable tracing and exit
+ *                -r file  Decode a dump saved with -w instead of
+ *                         draining the driver
+ *                -w file  Save the drained records to a file
+ *                -p file  Write the records as pcapng, one packet per
+ *                         record with the decoded text as its comment
+ *
+ *              Without -w or -p the records are printed as text.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcpioctl.h>
+
+#define DRAIN_RECORDS   8192
+
+/* pcapng block types and the link type carrying our records */
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_MAGIC        0x1A2B3C4D
+#define PCAPNG_LINKTYPE     147         /* LINKTYPE_USER0 */
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_COMMENT  1
+#define PCAPNG_OPT_TSRESOL  9
+
+/* 100ns intervals between 1601 and 1970 */
+#define EPOCH_DIFFERENCE    116444736000000000ULL
+
+static const char *EventNames[] = {
+    "?",
+    "PACKET_RECEIVE",
+    "IP_DISPATCH",
+    "TCP_INPUT",
+    "TCP_OUTPUT",
+    "IRP_QUEUE",
+    "IRP_COMPLETE",
+    "IRP_CANCEL",
+    "NEIGHBOR_SOLICIT",
+    "NEIGHBOR_UPDATE",
+    "DROP",
+};
+
+static const char *DropNames[] = {
+    "?",
+    "IP_HEADER",
+    "IP_RESOURCES",
+    "IP_UNKNOWN_PROTO",
+    "IP_REASSEMBLY",
+    "NO_ROUTE",
+    "UDP_HEADER",
+    "UDP_NO_PORT",
+    "RCVBUF",
+    "LINK_PROTO",
+    "LINK_RESOURCES",
+    "NEIGHBOR",
+};
+
+#define NAME(Table, Index) \
+    ((Index) < sizeof(Table) / sizeof(Table[0]) ? Table[Index] : Table[0])
+
+static TCP_TRACE_DUMP Dump;
+static PTCP_TRACE_RECORD Records;
+
+static ULONGLONG RecordNanoseconds(PTCP_TRACE_RECORD Record)
+/*
+ * FUNCTION: Converts a record time stamp to nanoseconds since tracing began
+ */
+{
+    ULONGLONG Ticks = Record->Timestamp - Dump.StartTimestamp;
+
+    if (!Dump.TimestampFrequency)
+        return 0;
+
+    return (Ticks / Dump.TimestampFrequency) * 1000000000ULL +
+           (Ticks % Dump.TimestampFrequency) * 1000000000ULL / Dump.TimestampFrequency;
+}
+
+static const char *Address(ULONG Address, char *Buffer)
+{
+    PUCHAR Bytes = (PUCHAR)&Address;
+
+    sprintf(Buffer, "%u.%u.%u.%u", Bytes[0], Bytes[1], Bytes[2], Bytes[3]);
+    return Buffer;
+}
+
+static USHORT Port(ULONG Port)
+{
+    return (USHORT)(((Port & 0xFF) << 8) | ((Port >> 8) & 0xFF));
+}
+
+static void FormatRecord(PTCP_TRACE_RECORD Record, char *Text)
+/*
+ * FUNCTION: Describes a record the way the TCP_TRACE_* definitions do
+ */
+{
+    ULONG Arg0 = (ULONG)Record->Arg0;
+    char A[16];
+
+    switch (Record->Event)
+    {
+    case TCP_TRACE_PACKET_RECEIVE:
+        sprintf(Text, "if %lu size %lu type 0x%04lx",
+                Arg0, Record->Arg1, Record->Arg2);
+        break;
+
+    case TCP_TRACE_IP_DISPATCH:
+        sprintf(Text, "proto %lu size %lu from %s",
+                Arg0, Record->Arg1, Address(Record->Arg2, A));
+        break;
+
+    case TCP_TRACE_TCP_INPUT:
+        sprintf(Text, "size %lu", Arg0);
+        break;
+
+    case TCP_TRACE_TCP_OUTPUT:
+        sprintf(Text, "size %lu to %s", Arg0, Address(Record->Arg1, A));
+        break;
+
+    case TCP_TRACE_IRP_QUEUE:
+    case TCP_TRACE_IRP_CANCEL:
+        sprintf(Text, "irp %08I64x minor %lu", Record->Arg0, Record->Arg1);
+        break;
+
+    case TCP_TRACE_IRP_COMPLETE:
+        sprintf(Text, "irp %08I64x status %08lx information %lu",
+                Record->Arg0, Record->Arg1, Record->Arg2);
+        break;
+
+    case TCP_TRACE_NEIGHBOR_SOLICIT:
+        sprintf(Text, "%s", Address(Arg0, A));
+        break;
+
+    case TCP_TRACE_NEIGHBOR_UPDATE:
+        sprintf(Text, "%s state 0x%02lx", Address(Arg0, A), Record->Arg1);
+        break;
+
+    case TCP_TRACE_DROP:
+        switch (Record->Reason)
+        {
+        case TCP_DROP_IP_UNKNOWN_PROTO:
+            sprintf(Text, "%s proto %lu", NAME(DropNames, Record->Reason), Arg0);
+            break;
+
+        case TCP_DROP_IP_REASSEMBLY:
+            sprintf(Text, "%s from %s id %lu", NAME(DropNames, Record->Reason),
+                    Address(Arg0, A), Port(Record->Arg1));
+            break;
+
+        case TCP_DROP_NO_ROUTE:
+            sprintf(Text, "%s to %s", NAME(DropNames, Record->Reason),
+                    Address(Arg0, A));
+            break;
+
+        case TCP_DROP_UDP_HEADER:
+            sprintf(Text, "%s port %u", NAME(DropNames, Record->Reason), Port(Arg0));
+            break;
+
+        case TCP_DROP_UDP_NO_PORT:
+            sprintf(Text, "%s port %u on %s", NAME(DropNames, Record->Reason),
+                    Port(Arg0), Address(Record->Arg1, A));
+            break;
+
+        case TCP_DROP_RCVBUF:
+            sprintf(Text, "%s port %u size %lu", NAME(DropNames, Record->Reason),
+                    Port(Arg0), Record->Arg1);
+            break;
+
+        case TCP_DROP_LINK_PROTO:
+            sprintf(Text, "%s type 0x%04lx", NAME(DropNames, Record->Reason), Arg0);
+            break;
+
+        case TCP_DROP_NEIGHBOR:
+            sprintf(Text, "%s %s status %08lx", NAME(DropNames, Record->Reason),
+                    Address(Arg0, A), Record->Arg1);
+            break;
+
+        default:
+            sprintf(Text, "%s", NAME(DropNames, Record->Reason));
+            break;
+        }
+        break;
+
+    default:
+        sprintf(Text, "%08I64x %08lx %08lx", Record->Arg0, Record->Arg1, Record->Arg2);
+        break;
+    }
+}
+
+static int CompareRecords(const void *A, const void *B)
+{
+    const TCP_TRACE_RECORD *RecordA = A, *RecordB = B;
+
+    if (RecordA->Timestamp < RecordB->Timestamp)
+        return -1;
+
+    return RecordA->Timestamp > RecordB->Timestamp;
+}
+
+static HANDLE OpenTcp(void)
+{
+    HANDLE Tcp;
+
+    Tcp = CreateFileW(L"\\\\.\\GLOBALROOT\\Device\\Tcp",
+                      GENERIC_READ | GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      NULL, OPEN_EXISTING, 0, NULL);
+    if (Tcp == INVALID_HANDLE_VALUE)
+        fprintf(stderr, "Cannot open the TCP device (%lu)\n", GetLastError());
+
+    return Tcp;
+}
+
+static int Control(ULONG Enable)
+{
+    TCP_TRACE_CONTROL TraceControl;
+    HANDLE Tcp;
+    DWORD Returned;
+    BOOL Success;
+
+    Tcp = OpenTcp();
+    if (Tcp == INVALID_HANDLE_VALUE)
+        return 1;
+
+    TraceControl.Enable = Enable;
+    Success = DeviceIoControl(Tcp, IOCTL_TCP_TRACE_CONTROL,
+                              &TraceControl, sizeof(TraceControl),
+                              NULL, 0, &Returned, NULL);
+    if (!Success)
+        fprintf(stderr, "Trace control failed (%lu)\n", GetLastError());
+
+    CloseHandle(Tcp);
+
+    return !Success;
+}
+
+static int Drain(void)
+/*
+ * FUNCTION: Collects all records the driver holds
+ */
+{
+    ULONG Length = sizeof(TCP_TRACE_DUMP) + DRAIN_RECORDS * sizeof(TCP_TRACE_RECORD);
+    PTCP_TRACE_DUMP Chunk;
+    PTCP_TRACE_RECORD Grown;
+    HANDLE Tcp;
+    DWORD Returned;
+
+    Tcp = OpenTcp();
+    if (Tcp == INVALID_HANDLE_VALUE)
+        return 1;
+
+    Chunk = malloc(Length);
+    if (!Chunk)
+    {
+        CloseHandle(Tcp);
+        return 1;
+    }
+
+    do
+    {
+        if (!DeviceIoControl(Tcp, IOCTL_TCP_QUERY_TRACE, NULL, 0,
+                             Chunk, Length, &Returned, NULL))
+        {
+            fprintf(stderr, "Trace query failed (%lu)\n", GetLastError());
+            break;
+        }
+
+        Grown = realloc(Records, (Dump.Count + Chunk->Count) * sizeof(TCP_TRACE_RECORD) + 1);
+        if (!Grown)
+            break;
+
+        Records = Grown;
+        memcpy(Records + Dump.Count, Chunk + 1, Chunk->Count * sizeof(TCP_TRACE_RECORD));
+
+        Dump.Count += Chunk->Count;
+        Dump.Lost += Chunk->Lost;
+        Dump.StartTimestamp = Chunk->StartTimestamp;
+        Dump.StartTime = Chunk->StartTime;
+        Dump.TimestampFrequency = Chunk->TimestampFrequency;
+    } while (Chunk->Count == DRAIN_RECORDS);
+
+    free(Chunk);
+    CloseHandle(Tcp);
+
+    return 0;
+}
+
+static int Load(const char *Name)
+{
+    FILE *File;
+
+    File = fopen(Name, "rb");
+    if (!File)
+    {
+        fprintf(stderr, "Cannot open %s\n", Name);
+        return 1;
+    }
+
+    if (fread(&Dump, sizeof(Dump), 1, File) != 1 ||
+        !(Records = malloc(Dump.Count * sizeof(TCP_TRACE_RECORD) + 1)) ||
+        fread(Records, sizeof(TCP_TRACE_RECORD), Dump.Count, File) != Dump.Count)
+    {
+        fprintf(stderr, "%s is not a trace dump\n", Name);
+        fclose(File);
+        return 1;
+    }
+
+    fclose(File);
+
+    return 0;
+}
+
+static int Save(const char *Name)
+{
+    FILE *File;
+
+    File = fopen(Name, "wb");
+    if (!File)
+    {
+        fprintf(stderr, "Cannot create %s\n", Name);
+        return 1;
+    }
+
+    fwrite(&Dump, sizeof(Dump), 1, File);
+    fwrite(Records, sizeof(TCP_TRACE_RECORD), Dump.Count, File);
+    fclose(File);
+
+    return 0;
+}
+
+static void Print(void)
+{
+    char Text[128];
+    ULONGLONG Ns;
+    ULONG i;
+
+    printf("%lu records, %lu lost, %I64u ticks/s\n",
+           Dump.Count, Dump.Lost, Dump.TimestampFrequency);
+
+    for (i = 0; i < Dump.Count; i++)
+    {
+        Ns = RecordNanoseconds(&Records[i]);
+        FormatRecord(&Records[i], Text);
+
+        printf("%6I64u.%09I64u cpu%-2u %-16s %s\n",
+               Ns / 1000000000ULL, Ns % 1000000000ULL,
+               Records[i].Processor, NAME(EventNames, Records[i].Event), Text);
+    }
+}
+
+static void WriteU32(FILE *File, ULONG Value)
+{
+    fwrite(&Value, sizeof(Value), 1, File);
+}
+
+static void WriteU16(FILE *File, USHORT Value)
+{
+    fwrite(&Value, sizeof(Value), 1, File);
+}
+
+static int WritePcapng(const char *Name)
+/*
+ * FUNCTION: Writes the records as a pcapng capture
+ * NOTES:
+ *     Each record becomes an enhanced packet block whose data is the
+ *     record itself and whose comment is its decoded text
+ */
+{
+    static const UCHAR Padding[4];
+    char Text[160];
+    ULONGLONG Base, Ns;
+    ULONG TextLength, Padded, i;
+    FILE *File;
+
+    File = fopen(Name, "wb");
+    if (!File)
+    {
+        fprintf(stderr, "Cannot create %s\n", Name);
+        return 1;
+    }
+
+    /* Section header block, section length unknown */
+    WriteU32(File, PCAPNG_SHB);
+    WriteU32(File, 28);
+    WriteU32(File, PCAPNG_MAGIC);
+    WriteU16(File, 1);
+    WriteU16(File, 0);
+    WriteU32(File, 0xFFFFFFFF);
+    WriteU32(File, 0xFFFFFFFF);
+    WriteU32(File, 28);
+
+    /* Interface description block with nanosecond time stamps */
+    WriteU32(File, PCAPNG_IDB);
+    WriteU32(File, 32);
+    WriteU16(File, PCAPNG_LINKTYPE);
+    WriteU16(File, 0);
+    WriteU32(File, 0);
+    WriteU16(File, PCAPNG_OPT_TSRESOL);
+    WriteU16(File, 1);
+    fputc(9, File);
+    fwrite(Padding, 1, 3, File);
+    WriteU32(File, PCAPNG_OPT_END);
+    WriteU32(File, 32);
+
+    Base = (Dump.StartTime.QuadPart - EPOCH_DIFFERENCE) * 100;
+
+    for (i = 0; i < Dump.Count; i++)
+    {
+        Ns = Base + RecordNanoseconds(&Records[i]);
+
+        sprintf(Text, "cpu%u %s ", Records[i].Processor, NAME(EventNames, Records[i].Event));
+        FormatRecord(&Records[i], Text + strlen(Text));
+
+        TextLength = (ULONG)strlen(Text);
+        Padded = (TextLength + 3) & ~3;
+
+        WriteU32(File, PCAPNG_EPB);
+        WriteU32(File, 32 + sizeof(TCP_TRACE_RECORD) + 4 + Padded + 4);
+        WriteU32(File, 0);
+        WriteU32(File, (ULONG)(Ns >> 32));
+        WriteU32(File, (ULONG)Ns);
+        WriteU32(File, sizeof(TCP_TRACE_RECORD));
+        WriteU32(File, sizeof(TCP_TRACE_RECORD));
+        fwrite(&Records[i], sizeof(TCP_TRACE_RECORD), 1, File);
+        WriteU16(File, PCAPNG_OPT_COMMENT);
+        WriteU16(File, (USHORT)TextLength);
+        fwrite(Text, 1, TextLength, File);
+        fwrite(Padding, 1, Padded - TextLength, File);
+        WriteU32(File, PCAPNG_OPT_END);
+        WriteU32(File, 32 + sizeof(TCP_TRACE_RECORD) + 4 + Padded + 4);
+    }
+
+    fclose(File);
+
+    return 0;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "Usage: tracedmp [-e | -d] [-r file] [-w file] [-p file]\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *ReadName = NULL, *SaveName = NULL, *PcapName = NULL;
+    int i, Result;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-e"))
+            return Control(TRUE);
+        else if (!strcmp(argv[i], "-d"))
+            return Control(FALSE);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            ReadName = argv[++i];
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            SaveName = argv[++i];
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            PcapName = argv[++i];
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    Result = ReadName ? Load(ReadName) : Drain();
+    if (Result)
+        return Result;
+
+    /* Each processor's records are in order, merge them by time */
+    if (Dump.Count)
+        qsort(Records, Dump.Count, sizeof(TCP_TRACE_RECORD), CompareRecords);
+
+    if (SaveName)
+        Result |= Save(SaveName);
+
+    if (PcapName)
+        Result |= WritePcapng(PcapName);
+
+    if (!SaveName && !PcapName)
+        Print();
+
+    free(Records);
+
+    return Result;
+}
+
+/* EOF */
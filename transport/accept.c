@@ -48,8 +48,8 @@ NTSTATUS TCPListen(PCONNECTION_ENDPOINT Connection, UINT Backlog)
 {
     NTSTATUS Status = STATUS_SUCCESS;
     struct ip_addr AddressToBind;
+    BOOLEAN Ephemeral = FALSE;
     KIRQL OldIrql;
-    TA_IP_ADDRESS LocalAddress;
 
     ASSERT(Connection);
 
@@ -64,31 +64,37 @@ NTSTATUS TCPListen(PCONNECTION_ENDPOINT Connection, UINT Backlog)
     
     AddressToBind.addr = Connection->AddressFile->Address.Address.IPv4Address;
 
+    /* Check if we had an unspecified port */
+    if (!Connection->AddressFile->Port)
+    {
+        /* We did, so take a random ephemeral port from the port bitmap */
+        Connection->AddressFile->Port = TCPAllocatePort(0);
+        if (Connection->AddressFile->Port == 0xFFFF)
+        {
+            Connection->AddressFile->Port = 0;
+            UnlockObject(Connection, OldIrql);
+            return STATUS_TOO_MANY_ADDRESSES;
+        }
+
+        Ephemeral = TRUE;
+    }
+
     Status = TCPTranslateError(LibTCPBind(Connection,
                                           &AddressToBind,
                                           Connection->AddressFile->Port));
 
-    if (NT_SUCCESS(Status))
+    if (!NT_SUCCESS(Status) && Ephemeral)
     {
-        /* Check if we had an unspecified port */
-        if (!Connection->AddressFile->Port)
-        {
-            /* We did, so we need to copy back the port */
-            Status = TCPGetSockAddress(Connection, (PTRANSPORT_ADDRESS)&LocalAddress, FALSE);
-            if (NT_SUCCESS(Status))
-            {
-                /* Allocate the port in the port bitmap */
-                Connection->AddressFile->Port = TCPAllocatePort(LocalAddress.Address[0].Address[0].sin_port);
-                
-                /* This should never fail */
-                ASSERT(Connection->AddressFile->Port != 0xFFFF);
-            }
-        }
+        /* Leave the address file unbound as it was */
+        TCPFreePort(Connection->AddressFile->Port);
+        Connection->AddressFile->Port = 0;
     }
 
     if (NT_SUCCESS(Status))
     {
-        Connection->SocketContext = LibTCPListen(Connection, Backlog);
+        /* lwIP keeps the backlog in 16 bits; half-open connections live in
+         * its SYN cache and do not count against it */
+        Connection->SocketContext = LibTCPListen(Connection, (u16_t)min(Backlog, 0xFFFF));
         if (!Connection->SocketContext)
             Status = STATUS_UNSUCCESSFUL;
     }
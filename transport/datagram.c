@@ -49,6 +49,212 @@ BOOLEAN DGRemoveIRP(
     return Found;
 }
 
+static VOID DGFillReturnInfo(
+    PTDI_CONNECTION_INFORMATION ReturnInfo,
+    PIP_ADDRESS SrcAddress,
+    USHORT SrcPort)
+{
+    PTA_IP_ADDRESS RTAIPAddress;
+
+    if (!ReturnInfo || !ReturnInfo->RemoteAddress)
+        return;
+
+    RTAIPAddress = (PTA_IP_ADDRESS)ReturnInfo->RemoteAddress;
+    RTAIPAddress->TAAddressCount = 1;
+    RTAIPAddress->Address->AddressType = TDI_ADDRESS_TYPE_IP;
+    RTAIPAddress->Address->AddressLength = TDI_ADDRESS_LENGTH_IP;
+    RTAIPAddress->Address->Address->sin_port = SrcPort;
+    RTAIPAddress->Address->Address->in_addr = SrcAddress->Address.IPv4Address;
+    RtlZeroMemory(RTAIPAddress->Address->Address->sin_zero, 8);
+
+    TI_DbgPrint(MAX_TRACE, ("(A: %08x) Addr %08x Port %04x\n",
+                            RTAIPAddress,
+                            SrcAddress->Address.IPv4Address, SrcPort));
+}
+
+static VOID DGCountDrop(
+    PADDRESS_FILE AddrFile,
+    UINT DataSize)
+{
+    AddrFile->ReceiveDrops++;
+
+    TRACE_DROP(TCP_DROP_RCVBUF, AddrFile->Port, DataSize);
+
+    if (AddrFile->Protocol == IPPROTO_UDP)
+        UDP_STAT_INC(RcvBufErrors);
+}
+
+static VOID DGQueueDatagram(
+    PADDRESS_FILE AddrFile,
+    PIP_ADDRESS SrcAddress,
+    USHORT SrcPort,
+    PIP_PACKET IPPacket,
+    PVOID DataBuffer,
+    UINT DataSize)
+/*
+ * FUNCTION: Keeps a datagram until a receive request is posted
+ * ARGUMENTS:
+ *     AddrFile   = Address file to queue the datagram on
+ *     SrcAddress = Remote address the datagram came from
+ *     SrcPort    = Remote port the datagram came from
+ *     IPPacket   = Pointer to IP packet holding the datagram
+ *     DataBuffer = Pointer to datagram data inside IPPacket
+ *     DataSize   = Number of bytes in DataBuffer
+ * NOTES:
+ *     The address file must be locked. The datagram is not copied, the
+ *     queue entry holds a reference to the packet buffer instead
+ */
+{
+  PDATAGRAM_RECEIVED Received;
+  ULONG Charge = DataSize + sizeof(DATAGRAM_RECEIVED);
+
+  if (AddrFile->ReceivedBytes + Charge > AddrFile->ReceiveBufferSize)
+    {
+      TI_DbgPrint(MID_TRACE, ("Receive buffer full, discarding datagram.\n"));
+      DGCountDrop(AddrFile, DataSize);
+      return;
+    }
+
+  Received = ExAllocatePoolWithTag(NonPagedPool, sizeof(DATAGRAM_RECEIVED),
+                                   DATAGRAM_QUEUE_TAG);
+  if (!Received)
+    {
+      DGCountDrop(AddrFile, DataSize);
+      return;
+    }
+
+  Received->PacketBuffer = IPReferencePacketBuffer(IPPacket);
+  if (!Received->PacketBuffer)
+    {
+      ExFreePoolWithTag(Received, DATAGRAM_QUEUE_TAG);
+      DGCountDrop(AddrFile, DataSize);
+      return;
+    }
+
+  Received->Data = DataBuffer;
+  Received->DataSize = DataSize;
+  Received->SrcAddress = *SrcAddress;
+  Received->SrcPort = SrcPort;
+
+  InsertTailList(&AddrFile->ReceivedQueue, &Received->ListEntry);
+  AddrFile->ReceivedBytes += Charge;
+
+  TI_DbgPrint(MAX_TRACE, ("Queued datagram (%d bytes, %d buffered).\n",
+                          DataSize, AddrFile->ReceivedBytes));
+}
+
+VOID DGFlushReceivedQueue(
+    PADDRESS_FILE AddrFile)
+/*
+ * FUNCTION: Drops all datagrams waiting on an address file
+ * ARGUMENTS:
+ *     AddrFile = Address file to flush
+ */
+{
+  PLIST_ENTRY CurrentEntry;
+  PDATAGRAM_RECEIVED Received;
+
+  while ((CurrentEntry = ExInterlockedRemoveHeadList(&AddrFile->ReceivedQueue, &AddrFile->Lock))) {
+    Received = CONTAINING_RECORD(CurrentEntry, DATAGRAM_RECEIVED, ListEntry);
+    IPDereferencePacketBuffer(Received->PacketBuffer);
+    ExFreePoolWithTag(Received, DATAGRAM_QUEUE_TAG);
+  }
+
+  AddrFile->ReceivedBytes = 0;
+}
+
+static VOID DGGetSourceAddress(
+    PIP_ADDRESS SrcAddress,
+    PLONG AddressLength,
+    PVOID *SourceAddress)
+{
+  if (SrcAddress->Type == IP_ADDRESS_V4)
+    {
+      *AddressLength = sizeof(IPv4_RAW_ADDRESS);
+      *SourceAddress = &SrcAddress->Address.IPv4Address;
+    }
+  else /* (Address->Type == IP_ADDRESS_V6) */
+    {
+      *AddressLength = sizeof(IPv6_RAW_ADDRESS);
+      *SourceAddress = SrcAddress->Address.IPv6Address;
+    }
+}
+
+static BOOLEAN DGIndicateChained(
+    PADDRESS_FILE AddrFile,
+    PIP_ADDRESS SrcAddress,
+    PIP_PACKET IPPacket,
+    PVOID DataBuffer,
+    UINT DataSize,
+    PKIRQL OldIrql)
+/*
+ * FUNCTION: Hands a datagram to the client in the miniport's own buffers
+ * ARGUMENTS:
+ *     AddrFile   = Address file with a chained receive handler
+ *     SrcAddress = Remote address the datagram came from
+ *     IPPacket   = Pointer to IP packet holding the datagram
+ *     DataBuffer = Pointer to datagram data inside IPPacket
+ *     DataSize   = Number of bytes in DataBuffer
+ *     OldIrql    = IRQL to restore when the address file lock is released
+ * RETURNS:
+ *     TRUE if the client took the datagram, FALSE if it should be
+ *     delivered by copying instead
+ * NOTES:
+ *     The address file must be locked and is locked again on return.
+ *     If the client keeps the data it becomes the owner of the NDIS
+ *     packet and gives it back to the miniport through
+ *     TdiReturnChainedReceives()
+ */
+{
+  PTDI_IND_CHAINED_RECEIVE_DATAGRAM ChainedHandler;
+  PVOID HandlerContext;
+  LONG AddressLength;
+  PVOID SourceAddress;
+  PNDIS_BUFFER Tsdu;
+  ULONG StartingOffset;
+  NTSTATUS Status;
+
+  /* Only packets we can return to the miniport may be loaned out */
+  if (!IPPacket->NdisPacket || !IPPacket->ReturnPacket)
+      return FALSE;
+
+  TI_DbgPrint(MAX_TRACE, ("Calling chained receive event handler.\n"));
+
+  ChainedHandler = AddrFile->ChainedReceiveDatagramHandler;
+  HandlerContext = AddrFile->ChainedReceiveDatagramHandlerContext;
+
+  DGGetSourceAddress(SrcAddress, &AddressLength, &SourceAddress);
+
+  NdisQueryPacket(IPPacket->NdisPacket, NULL, NULL, &Tsdu, NULL);
+  StartingOffset = IPPacket->Position +
+      (ULONG)((ULONG_PTR)DataBuffer - (ULONG_PTR)IPPacket->Header);
+
+  ReferenceObject(AddrFile);
+  UnlockObject(AddrFile, *OldIrql);
+
+  Status = (*ChainedHandler)(HandlerContext,
+    AddressLength,
+    SourceAddress,
+    0,
+    NULL,
+    TDI_RECEIVE_ENTIRE_MESSAGE,
+    DataSize,
+    StartingOffset,
+    Tsdu,
+    IPPacket->NdisPacket);
+
+  if (Status == STATUS_PENDING)
+    {
+      /* The client returns the packet, so don't return it in DeinitializePacket */
+      IPPacket->NdisPacket = NULL;
+    }
+
+  LockObject(AddrFile, OldIrql);
+  DereferenceObject(AddrFile);
+
+  return (Status != STATUS_DATA_NOT_ACCEPTED);
+}
+
 VOID DGDeliverData(
   PADDRESS_FILE AddrFile,
   PIP_ADDRESS SrcAddress,
@@ -69,7 +275,9 @@ VOID DGDeliverData(
  *     If there is a receive request, then we copy the data to the
  *     buffer supplied by the user and complete the receive request.
  *     If no suitable receive request exists, then we call the event
- *     handler if it exists, otherwise we drop the packet.
+ *     handler if it exists, preferring the chained one which gets the
+ *     received buffers without a copy. Otherwise we queue the packet
+ *     until a receive request is posted.
  */
 {
   KIRQL OldIrql;
@@ -104,7 +312,6 @@ VOID DGDeliverData(
     {
       PLIST_ENTRY CurrentEntry;
       PDATAGRAM_RECEIVE_REQUEST Current = NULL;
-      PTA_IP_ADDRESS RTAIPAddress;
 
       TI_DbgPrint(MAX_TRACE, ("There is a receive request.\n"));
 
@@ -132,21 +339,14 @@ VOID DGDeliverData(
 			     DataBuffer,
 			     MIN(Current->BufferSize, DataSize) );
 
-	      RTAIPAddress = (PTA_IP_ADDRESS)Current->ReturnInfo->RemoteAddress;
-	      RTAIPAddress->TAAddressCount = 1;
-	      RTAIPAddress->Address->AddressType = TDI_ADDRESS_TYPE_IP;
-          RTAIPAddress->Address->AddressLength = TDI_ADDRESS_LENGTH_IP;
-	      RTAIPAddress->Address->Address->sin_port = SrcPort;
-          RTAIPAddress->Address->Address->in_addr = SrcAddress->Address.IPv4Address;
-          RtlZeroMemory(RTAIPAddress->Address->Address->sin_zero, 8);
-
-	      TI_DbgPrint(MAX_TRACE, ("(A: %08x) Addr %08x Port %04x\n",
-				      RTAIPAddress,
-				      SrcAddress->Address.IPv4Address, SrcPort));
+	      DGFillReturnInfo(Current->ReturnInfo, SrcAddress, SrcPort);
 
               ReferenceObject(AddrFile);
               UnlockObject(AddrFile, OldIrql);
 
+              if (Current->Irp)
+                  IRP_LATENCY_STAMP(Current->Irp) = IPPacket->Timestamp;
+
               /* Complete the receive request */
               if (Current->BufferSize < DataSize)
                   Current->Complete(Current->Context, STATUS_BUFFER_OVERFLOW, Current->BufferSize);
@@ -158,6 +358,11 @@ VOID DGDeliverData(
 	  }
       }
 
+      UnlockObject(AddrFile, OldIrql);
+    }
+  else if (AddrFile->RegisteredChainedReceiveDatagramHandler &&
+           DGIndicateChained(AddrFile, SrcAddress, IPPacket, DataBuffer, DataSize, &OldIrql))
+    {
       UnlockObject(AddrFile, OldIrql);
     }
   else if (AddrFile->RegisteredReceiveDatagramHandler)
@@ -167,16 +372,7 @@ VOID DGDeliverData(
       ReceiveHandler = AddrFile->ReceiveDatagramHandler;
       HandlerContext = AddrFile->ReceiveDatagramHandlerContext;
 
-      if (SrcAddress->Type == IP_ADDRESS_V4)
-        {
-          AddressLength = sizeof(IPv4_RAW_ADDRESS);
-          SourceAddress = &SrcAddress->Address.IPv4Address;
-        }
-      else /* (Address->Type == IP_ADDRESS_V6) */
-        {
-          AddressLength = sizeof(IPv6_RAW_ADDRESS);
-          SourceAddress = SrcAddress->Address.IPv6Address;
-        }
+      DGGetSourceAddress(SrcAddress, &AddressLength, &SourceAddress);
 
       ReferenceObject(AddrFile);
       UnlockObject(AddrFile, OldIrql);
@@ -200,8 +396,8 @@ VOID DGDeliverData(
     }
   else
     {
+      DGQueueDatagram(AddrFile, SrcAddress, SrcPort, IPPacket, DataBuffer, DataSize);
       UnlockObject(AddrFile, OldIrql);
-      TI_DbgPrint(MAX_TRACE, ("Discarding datagram.\n"));
     }
 
   TI_DbgPrint(MAX_TRACE, ("Leaving.\n"));
@@ -217,6 +413,83 @@ VOID DGReceiveComplete(PVOID Context, NTSTATUS Status, ULONG Count) {
     TI_DbgPrint(MAX_TRACE,("Done\n"));
 }
 
+static BOOLEAN DGTakeQueued(
+    PADDRESS_FILE AddrFile,
+    PCHAR BufferData,
+    ULONG ReceiveLength,
+    PTDI_CONNECTION_INFORMATION ReturnInfo,
+    PULONG BytesReceived,
+    PNTSTATUS Status,
+    KIRQL OldIrql)
+/*
+ * FUNCTION: Copies out the oldest queued datagram, if there is one
+ * NOTES:
+ *     The address file must be locked. It is unlocked on return if a
+ *     datagram was taken and stays locked otherwise
+ */
+{
+    PDATAGRAM_RECEIVED Received;
+
+    if (IsListEmpty(&AddrFile->ReceivedQueue))
+        return FALSE;
+
+    Received = CONTAINING_RECORD(RemoveHeadList(&AddrFile->ReceivedQueue),
+                                 DATAGRAM_RECEIVED, ListEntry);
+    AddrFile->ReceivedBytes -= Received->DataSize + sizeof(DATAGRAM_RECEIVED);
+
+    UnlockObject(AddrFile, OldIrql);
+
+    TI_DbgPrint(MAX_TRACE, ("Completing from queued datagram (%d bytes).\n",
+                            Received->DataSize));
+
+    *BytesReceived = MIN(ReceiveLength, Received->DataSize);
+    RtlCopyMemory(BufferData, Received->Data, *BytesReceived);
+    DGFillReturnInfo(ReturnInfo, &Received->SrcAddress, Received->SrcPort);
+
+    *Status = (ReceiveLength < Received->DataSize) ?
+              STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+
+    IPDereferencePacketBuffer(Received->PacketBuffer);
+    ExFreePoolWithTag(Received, DATAGRAM_QUEUE_TAG);
+
+    return TRUE;
+}
+
+BOOLEAN DGReceiveQueued(
+    PADDRESS_FILE AddrFile,
+    PCHAR BufferData,
+    ULONG ReceiveLength,
+    PTDI_CONNECTION_INFORMATION ReturnInfo,
+    PULONG BytesReceived,
+    PNTSTATUS Status)
+/*
+ * FUNCTION: Receives a datagram only if one is already queued
+ * ARGUMENTS:
+ *     AddrFile      = Address file to receive on
+ *     BufferData    = Buffer to copy the datagram to
+ *     ReceiveLength = Size of the buffer
+ *     ReturnInfo    = Pointer to structure for return information
+ *     BytesReceived = Pointer to structure for number of bytes received
+ *     Status        = Receives the status of the receive
+ * RETURNS:
+ *     TRUE if a datagram was received, FALSE if none was waiting
+ * NOTES:
+ *     Never pends, so batched receives can drain the queue
+ */
+{
+    KIRQL OldIrql;
+
+    LockObject(AddrFile, &OldIrql);
+
+    if (DGTakeQueued(AddrFile, BufferData, ReceiveLength, ReturnInfo,
+                     BytesReceived, Status, OldIrql))
+        return TRUE;
+
+    UnlockObject(AddrFile, OldIrql);
+
+    return FALSE;
+}
+
 NTSTATUS DGReceiveDatagram(
     PADDRESS_FILE AddrFile,
     PTDI_CONNECTION_INFORMATION ConnInfo,
@@ -241,7 +514,8 @@ NTSTATUS DGReceiveDatagram(
  * RETURNS:
  *     Status of operation
  * NOTES:
- *     This is the high level interface for receiving DG datagrams
+ *     This is the high level interface for receiving DG datagrams.
+ *     A datagram that is already queued completes the request at once
  */
 {
     NTSTATUS Status;
@@ -252,6 +526,10 @@ NTSTATUS DGReceiveDatagram(
 
     LockObject(AddrFile, &OldIrql);
 
+    if (DGTakeQueued(AddrFile, BufferData, ReceiveLength, ReturnInfo,
+                     BytesReceived, &Status, OldIrql))
+        return Status;
+
     ReceiveRequest = ExAllocatePoolWithTag(NonPagedPool, sizeof(DATAGRAM_RECEIVE_REQUEST),
                                            DATAGRAM_RECV_TAG);
     if (ReceiveRequest)
@@ -278,7 +556,8 @@ NTSTATUS DGReceiveDatagram(
 	    AddrInitIPv4(&ReceiveRequest->RemoteAddress, 0);
         }
 
-	IoMarkIrpPending(Irp);
+	if (Irp)
+	    IoMarkIrpPending(Irp);
 
 	ReceiveRequest->ReturnInfo = ReturnInfo;
 	ReceiveRequest->Buffer = BufferData;
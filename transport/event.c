@@ -48,19 +48,197 @@ BucketCompletionWorker(PVOID Context)
     ExFreeToNPagedLookasideList(&TdiBucketLookasideList, Bucket);
 }
 
+/* Completions that cannot run in the caller's context are parked on a
+ * per-processor list and drained in batches by a single work item, instead
+ * of paying for a work item per request */
+typedef struct _COMPLETION_QUEUE
+{
+    KSPIN_LOCK Lock;
+    LIST_ENTRY ListHead;
+    BOOLEAN WorkerQueued;
+} COMPLETION_QUEUE, *PCOMPLETION_QUEUE;
+
+static PCOMPLETION_QUEUE CompletionQueues;
+static ULONG CompletionQueueCount;
+
+/* Restarts workers that could not be queued, as nothing else may come
+ * along to drain their lists */
+#define COMPLETION_RETRY_DELAY (10 * 1000 * 10) /* 10 ms, in 100 ns units */
+static KTIMER CompletionRetryTimer;
+static KDPC CompletionRetryDpc;
+
+static
+VOID
+CompletionQueueWorker(PVOID Context)
+{
+    PCOMPLETION_QUEUE Queue = (PCOMPLETION_QUEUE)Context;
+    LIST_ENTRY Batch;
+    PLIST_ENTRY Entry;
+    KIRQL OldIrql;
+
+    for (;;)
+    {
+        KeAcquireSpinLock(&Queue->Lock, &OldIrql);
+        if (IsListEmpty(&Queue->ListHead))
+        {
+            Queue->WorkerQueued = FALSE;
+            KeReleaseSpinLock(&Queue->Lock, OldIrql);
+            return;
+        }
+
+        /* Take the whole list so the lock is not held across completions */
+        Batch.Flink = Queue->ListHead.Flink;
+        Batch.Blink = Queue->ListHead.Blink;
+        Batch.Flink->Blink = &Batch;
+        Batch.Blink->Flink = &Batch;
+        InitializeListHead(&Queue->ListHead);
+        KeReleaseSpinLock(&Queue->Lock, OldIrql);
+
+        while (!IsListEmpty(&Batch))
+        {
+            Entry = RemoveHeadList(&Batch);
+            BucketCompletionWorker(CONTAINING_RECORD(Entry, TDI_BUCKET, Entry));
+        }
+    }
+}
+
+/* Called at DISPATCH_LEVEL after setting Queue->WorkerQueued */
+static
+VOID
+CompletionQueueStart(PCOMPLETION_QUEUE Queue)
+{
+    LARGE_INTEGER DueTime;
+
+    if (ChewCreate(CompletionQueueWorker, Queue))
+        return;
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+    Queue->WorkerQueued = FALSE;
+    KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+    DueTime.QuadPart = -COMPLETION_RETRY_DELAY;
+    KeSetTimer(&CompletionRetryTimer, DueTime, &CompletionRetryDpc);
+}
+
+static
+VOID
+NTAPI
+CompletionRetryDpcFn(PKDPC Dpc,
+                     PVOID DeferredContext,
+                     PVOID SystemArgument1,
+                     PVOID SystemArgument2)
+{
+    PCOMPLETION_QUEUE Queue;
+    BOOLEAN QueueWorker;
+    ULONG i;
+
+    for (i = 0; i < CompletionQueueCount; i++)
+    {
+        Queue = &CompletionQueues[i];
+
+        KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+        QueueWorker = !IsListEmpty(&Queue->ListHead) && !Queue->WorkerQueued;
+        if (QueueWorker)
+            Queue->WorkerQueued = TRUE;
+        KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+        if (QueueWorker)
+            CompletionQueueStart(Queue);
+    }
+}
+
+NTSTATUS
+TCPCompletionStartup(VOID)
+{
+    ULONG i;
+
+    CompletionQueueCount = KeNumberProcessors;
+    CompletionQueues = ExAllocatePoolWithTag(NonPagedPool,
+                                             CompletionQueueCount * sizeof(COMPLETION_QUEUE),
+                                             COMPLETION_QUEUE_TAG);
+    if (!CompletionQueues)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (i = 0; i < CompletionQueueCount; i++)
+    {
+        KeInitializeSpinLock(&CompletionQueues[i].Lock);
+        InitializeListHead(&CompletionQueues[i].ListHead);
+        CompletionQueues[i].WorkerQueued = FALSE;
+    }
+
+    KeInitializeTimer(&CompletionRetryTimer);
+    KeInitializeDpc(&CompletionRetryDpc, CompletionRetryDpcFn, NULL);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+TCPCompletionShutdown(VOID)
+{
+    LARGE_INTEGER Delay;
+    BOOLEAN Busy;
+    ULONG i;
+
+    if (!CompletionQueues)
+        return;
+
+    /* Wait for queued workers to drain their lists, including those the
+     * retry timer still has to queue */
+    Delay.QuadPart = -10 * 1000 * 10;
+    do
+    {
+        Busy = FALSE;
+        for (i = 0; i < CompletionQueueCount; i++)
+        {
+            if (*(volatile BOOLEAN *)&CompletionQueues[i].WorkerQueued ||
+                !IsListEmpty(&CompletionQueues[i].ListHead))
+                Busy = TRUE;
+        }
+
+        if (Busy)
+            KeDelayExecutionThread(KernelMode, FALSE, &Delay);
+    } while (Busy);
+
+    KeCancelTimer(&CompletionRetryTimer);
+
+    ExFreePoolWithTag(CompletionQueues, COMPLETION_QUEUE_TAG);
+    CompletionQueues = NULL;
+}
+
 VOID
 CompleteBucket(PCONNECTION_ENDPOINT Connection, PTDI_BUCKET Bucket, const BOOLEAN Synchronous)
 {
+    PCOMPLETION_QUEUE Queue;
+    BOOLEAN QueueWorker;
+    KIRQL OldIrql;
+
     ReferenceObject(Connection);
     Bucket->AssociatedEndpoint = Connection;
-    if (Synchronous)
+
+    /* At PASSIVE_LEVEL no spinlock is held, so the request can be completed
+     * right here unless we are on the lwIP thread, where a completion routine
+     * issuing a new request would block waiting on ourselves */
+    if (Synchronous ||
+        (KeGetCurrentIrql() == PASSIVE_LEVEL && !sys_arch_is_lwip_thread()))
     {
         BucketCompletionWorker(Bucket);
+        return;
     }
-    else
-    {
-        ChewCreate(BucketCompletionWorker, Bucket);
-    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Queue = &CompletionQueues[KeGetCurrentProcessorNumber() % CompletionQueueCount];
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
+    InsertTailList(&Queue->ListHead, &Bucket->Entry);
+    QueueWorker = !Queue->WorkerQueued;
+    Queue->WorkerQueued = TRUE;
+    KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+
+    if (QueueWorker)
+        CompletionQueueStart(Queue);
+
+    KeLowerIrql(OldIrql);
 }
 
 VOID
@@ -105,6 +283,30 @@ FlushReceiveQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const
     DereferenceObject(Connection);
 }
 
+static
+VOID
+TruncateSendBucket(PCONNECTION_ENDPOINT Connection, PTDI_BUCKET Bucket, const BOOLEAN interlocked)
+{
+    /* lwIP references the part already handed over, so the request
+     * ends there and completes once that part is acknowledged */
+    Bucket->Information -= Bucket->SendRemaining;
+    Bucket->SendRemaining = 0;
+    Bucket->Status = STATUS_SUCCESS;
+
+    if (Bucket->AckRemaining == 0)
+    {
+        CompleteBucket(Connection, Bucket, FALSE);
+    }
+    else if (interlocked)
+    {
+        ExInterlockedInsertTailList(&Connection->SendInFlight, &Bucket->Entry, &Connection->Lock);
+    }
+    else
+    {
+        InsertTailList(&Connection->SendInFlight, &Bucket->Entry);
+    }
+}
+
 VOID
 FlushSendQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOOLEAN interlocked)
 {
@@ -118,6 +320,12 @@ FlushSendQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOO
         while ((Entry = ExInterlockedRemoveHeadList(&Connection->SendRequest, &Connection->Lock)))
         {
             Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );    
+
+            if (Bucket->SendRemaining != Bucket->Information)
+            {
+                TruncateSendBucket(Connection, Bucket, TRUE);
+                continue;
+            }
         
             TI_DbgPrint(DEBUG_TCP,
                         ("Completing Send request: %x %x\n",
@@ -136,6 +344,12 @@ FlushSendQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOO
             Entry = RemoveHeadList(&Connection->SendRequest);
             
             Bucket = CONTAINING_RECORD(Entry, TDI_BUCKET, Entry);
+
+            if (Bucket->SendRemaining != Bucket->Information)
+            {
+                TruncateSendBucket(Connection, Bucket, FALSE);
+                continue;
+            }
             
             Bucket->Information = 0;
             Bucket->Status = Status;
@@ -147,6 +361,28 @@ FlushSendQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOO
     DereferenceObject(Connection);
 }
 
+VOID
+FlushInFlightQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status)
+{
+    PTDI_BUCKET Bucket;
+    PLIST_ENTRY Entry;
+    
+    ReferenceObject(Connection);
+
+    /* Only safe once lwIP no longer references the client's pages */
+    while ((Entry = ExInterlockedRemoveHeadList(&Connection->SendInFlight, &Connection->Lock)))
+    {
+        Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
+        
+        Bucket->Status = Status;
+        Bucket->Information = 0;
+        
+        CompleteBucket(Connection, Bucket, FALSE);
+    }
+
+    DereferenceObject(Connection);
+}
+
 VOID
 FlushShutdownQueue(PCONNECTION_ENDPOINT Connection, const NTSTATUS Status, const BOOLEAN interlocked)
 {
@@ -247,6 +483,7 @@ FlushAllQueues(PCONNECTION_ENDPOINT Connection, NTSTATUS Status)
     
     // flush send queue
     FlushSendQueue(Connection, Status, TRUE);
+    FlushInFlightQueue(Connection, Status);
     
     // flush connect queue
     FlushConnectQueue(Connection, Status);
@@ -372,30 +609,56 @@ TCPSendEventHandler(void *arg, const u16_t space)
     PCONNECTION_ENDPOINT Connection = (PCONNECTION_ENDPOINT)arg;
     PTDI_BUCKET Bucket;
     PLIST_ENTRY Entry;
-    PIRP Irp;
     NTSTATUS Status;
-    PMDL Mdl;
-    ULONG BytesSent;
+    ULONG Acked = space;
+    ULONG BytesAcked;
+    u32_t BytesSent;
     
     ReferenceObject(Connection);
 
-    while ((Entry = ExInterlockedRemoveHeadList(&Connection->SendRequest, &Connection->Lock)))
+    /* lwIP acknowledges data in the order it was queued */
+    while (Acked && (Entry = ExInterlockedRemoveHeadList(&Connection->SendInFlight, &Connection->Lock)))
     {
-        UINT SendLen = 0;
-        PVOID SendBuffer = 0;
-        
         Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
-        
-        Irp = Bucket->Request.RequestContext;
-        Mdl = Irp->MdlAddress;
-        
+
+        BytesAcked = MIN(Acked, Bucket->AckRemaining);
+        Bucket->AckRemaining -= BytesAcked;
+        Acked -= BytesAcked;
+
+        if (Bucket->AckRemaining)
+        {
+            ExInterlockedInsertHeadList(&Connection->SendInFlight,
+                                        &Bucket->Entry,
+                                        &Connection->Lock);
+            break;
+        }
+
         TI_DbgPrint(DEBUG_TCP,
-                    ("Getting the user buffer from %x\n", Mdl));
-        
-        NdisQueryBuffer( Mdl, &SendBuffer, &SendLen );
+                    ("Completing Send request: %x %x\n",
+                     Bucket->Request, Bucket->Status));
+
+        /* lwIP is done with the client's pages */
+        CompleteBucket(Connection, Bucket, FALSE);
+    }
+
+    /* Anything left was acknowledged from a partially written request */
+    if (Acked && (Entry = ExInterlockedRemoveHeadList(&Connection->SendRequest, &Connection->Lock)))
+    {
+        Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
+
+        Bucket->AckRemaining -= MIN(Acked, Bucket->AckRemaining);
+
+        ExInterlockedInsertHeadList(&Connection->SendRequest,
+                                    &Bucket->Entry,
+                                    &Connection->Lock);
+    }
+
+    while ((Entry = ExInterlockedRemoveHeadList(&Connection->SendRequest, &Connection->Lock)))
+    {
+        Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
         
         TI_DbgPrint(DEBUG_TCP,
-                    ("Writing %d bytes to %x\n", SendLen, SendBuffer));
+                    ("Writing %d bytes from %x\n", Bucket->SendRemaining, Bucket->SendMdl));
         
         TI_DbgPrint(DEBUG_TCP, ("Connection: %x\n", Connection));
         TI_DbgPrint
@@ -404,18 +667,39 @@ TCPSendEventHandler(void *arg, const u16_t space)
           Connection->SocketContext));
         
         Status = TCPTranslateError(LibTCPSend(Connection,
-                                              SendBuffer,
-                                              SendLen, &BytesSent, TRUE));
+                                              &Bucket->SendMdl,
+                                              &Bucket->SendOffset,
+                                              Bucket->SendRemaining,
+                                              &BytesSent, TRUE));
         
         TI_DbgPrint(DEBUG_TCP,("TCP Bytes: %d\n", BytesSent));
+
+        if (Status == STATUS_SUCCESS)
+        {
+            Bucket->SendRemaining -= BytesSent;
+            Bucket->AckRemaining += BytesSent;
+        }
         
-        if( Status == STATUS_PENDING )
+        if (Status == STATUS_PENDING || (Status == STATUS_SUCCESS && Bucket->SendRemaining))
         {
+            /* Out of send buffer space so wait for acknowledgements */
             ExInterlockedInsertHeadList(&Connection->SendRequest,
                                         &Bucket->Entry,
                                         &Connection->Lock);
             break;
         }
+        else if (Status == STATUS_SUCCESS)
+        {
+            /* Fully queued but lwIP references the pages until they are acknowledged */
+            Bucket->Status = STATUS_SUCCESS;
+            ExInterlockedInsertTailList(&Connection->SendInFlight,
+                                        &Bucket->Entry,
+                                        &Connection->Lock);
+        }
+        else if (Bucket->SendRemaining != Bucket->Information)
+        {
+            TruncateSendBucket(Connection, Bucket, TRUE);
+        }
         else
         {
             TI_DbgPrint(DEBUG_TCP,
@@ -423,7 +707,7 @@ TCPSendEventHandler(void *arg, const u16_t space)
                          Bucket->Request, Status));
             
             Bucket->Status = Status;
-            Bucket->Information = (Bucket->Status == STATUS_SUCCESS) ? BytesSent : 0;
+            Bucket->Information = 0;
                         
             CompleteBucket(Connection, Bucket, FALSE);
         }
@@ -450,8 +734,6 @@ TCPRecvEventHandler(void *arg)
     PCONNECTION_ENDPOINT Connection = (PCONNECTION_ENDPOINT)arg;
     PTDI_BUCKET Bucket;
     PLIST_ENTRY Entry;
-    PIRP Irp;
-    PMDL Mdl;
     UINT Received;
     UINT RecvLen;
     PUCHAR RecvBuffer;
@@ -459,14 +741,13 @@ TCPRecvEventHandler(void *arg)
 
     ReferenceObject(Connection);
 
+    LATENCY_RECORD(TCP_LATENCY_RX_EVENT, Connection->ReceiveTimestamp);
+
     while ((Entry = ExInterlockedRemoveHeadList(&Connection->ReceiveRequest, &Connection->Lock)))
     {
         Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
-        
-        Irp = Bucket->Request.RequestContext;
-        Mdl = Irp->MdlAddress;
 
-        NdisQueryBuffer( Mdl, &RecvBuffer, &RecvLen );
+        NdisQueryBuffer( Bucket->ReceiveMdl, &RecvBuffer, &RecvLen );
 
         Status = LibTCPGetDataFromConnectionQueue(Connection, RecvBuffer, RecvLen, &Received);
         if (Status == STATUS_PENDING)
@@ -480,6 +761,9 @@ TCPRecvEventHandler(void *arg)
         Bucket->Status = Status;
         Bucket->Information = Received;
 
+        if (Bucket->Irp)
+            IRP_LATENCY_STAMP(Bucket->Irp) = Connection->ReceiveTimestamp;
+
         CompleteBucket(Connection, Bucket, FALSE);
     }
 
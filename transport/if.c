@@ -7,14 +7,45 @@
 #include "lwip/api.h"
 #include "lwip/tcpip.h"
 
+#include "rosip.h"
+
+static PIP_INTERFACE
+TCPLocateLocalInterface(PIP_ADDRESS Address)
+/*
+ * FUNCTION: Finds the interface a local destination is received on
+ * ARGUMENTS:
+ *     Address = Pointer to destination address
+ * RETURNS:
+ *     Pointer to interface, NULL if the destination is not local
+ */
+{
+    PIP_INTERFACE IF;
+
+    /* 127/8 is routed to the loopback adapter */
+    if (((PUCHAR)&Address->Address.IPv4Address)[0] == 127)
+        IF = Loopback;
+    else
+        IF = AddrLocateInterface(Address);
+
+    /* Broadcasts go the long way, and lwIP may not know the interface yet */
+    if (!IF || !IF->TCPContext ||
+        (IF != Loopback && !AddrIsEqual(Address, &IF->Unicast)))
+        return NULL;
+
+    return IF;
+}
+
 err_t
 TCPSendDataCallback(struct netif *netif, struct pbuf *p, struct ip_addr *dest)
 {
     NDIS_STATUS NdisStatus;
     PNEIGHBOR_CACHE_ENTRY NCE;
+    PIP_INTERFACE LocalIF;
+    err_t Error;
     IP_PACKET Packet;
     IP_ADDRESS RemoteAddress, LocalAddress;
     PIPv4_HEADER Header;
+    BOOLEAN Locked;
 
     /* The caller frees the pbuf struct */
 
@@ -30,42 +61,130 @@ TCPSendDataCallback(struct netif *netif, struct pbuf *p, struct ip_addr *dest)
     }
     else 
     {
+        TCP_STAT_INC(OutErrors);
         return ERR_IF;
     }
 
+    /* Both endpoints are ours: give lwIP the segment as if it was received,
+       without a route lookup, an NDIS packet or the loopback worker. lwIP
+       still runs TCP on both ends, so ordering, windows and FIN/RST are
+       unchanged */
+    if ((LocalIF = TCPLocateLocalInterface(&RemoteAddress)) != NULL)
+    {
+        Error = LibIPLoopPacket(LocalIF->TCPContext, p, LibTCPOutputTimestamp);
+        if (Error != ERR_OK)
+        {
+            /* Treated like a lost segment, lwIP retransmits it */
+            TCP_STAT_INC(OutErrors);
+            IF_STAT_INC(LocalIF, OutDiscarded);
+            return Error;
+        }
+
+        IF_STAT_ADD(LocalIF, OutBytes, p->tot_len);
+        IF_STAT_INC(LocalIF, OutUnicast);
+        IF_STAT_ADD(LocalIF, InBytes, p->tot_len);
+        IF_STAT_INC(LocalIF, InUnicast);
+
+        TCP_STAT_INC(OutSegs);
+        TCP_STAT_INC(InSegs);
+        TCP_STAT_INC(LoopbackSegs);
+        TRACE_EVENT(TCP_TRACE_TCP_OUTPUT, 0, p->tot_len, RemoteAddress.Address.IPv4Address, 0);
+
+        return ERR_OK;
+    }
+
     IPInitializePacket(&Packet, LocalAddress.Type);
+    Packet.Timestamp = LibTCPOutputTimestamp;
 
     if (!(NCE = RouteGetRouteToDestination(&RemoteAddress)))
     {
+        TCP_STAT_INC(OutErrors);
         return ERR_RTE;
     }
     
     NdisStatus = AllocatePacketWithBuffer(&Packet.NdisPacket, NULL, p->tot_len);
     if (NdisStatus != NDIS_STATUS_SUCCESS)
     {
+        TCP_STAT_INC(OutErrors);
         return ERR_MEM;
     }
 
     GetDataPtr(Packet.NdisPacket, 0, (PCHAR*)&Packet.Header, &Packet.TotalSize);
     Packet.MappedHeader = TRUE;
 
-    ASSERT(p->tot_len == p->len);
-    ASSERT(Packet.TotalSize == p->len);
+    ASSERT(Packet.TotalSize == p->tot_len);
 
-    RtlCopyMemory(Packet.Header, p->payload, p->len);
+    /* Zero-copy TCP segments chain the client's data behind the headers */
+    pbuf_copy_partial(p, Packet.Header, p->tot_len, 0);
 
     Packet.HeaderSize = sizeof(IPv4_HEADER);
     Packet.TotalSize = p->tot_len;
     Packet.SrcAddr = LocalAddress;
     Packet.DstAddr = RemoteAddress;
 
+    /* Path MTU discovery (RFC 1191): segments that fit the path go out
+       with DF so a smaller hop reports its MTU instead of fragmenting.
+       Segments built before the path MTU was lowered are fragmented here,
+       and paths below the smallest MTU we believe are left to fragment */
+    if (Packet.TotalSize <= PMTUGetPathMTU(&RemoteAddress, NCE->Interface->MTU, &Locked) &&
+        !Locked)
+    {
+        Header = Packet.Header;
+        Header->FlagsFragOfs |= WH2N(IPv4_DF_MASK);
+    }
+
     NdisStatus = IPSendDatagram(&Packet, NCE);
     if (!NT_SUCCESS(NdisStatus))
+    {
+        TCP_STAT_INC(OutErrors);
         return ERR_RTE;
+    }
+
+    TCP_STAT_INC(OutSegs);
+    TRACE_EVENT(TCP_TRACE_TCP_OUTPUT, 0, p->tot_len, RemoteAddress.Address.IPv4Address, 0);
 
     return 0;
 }
 
+u16_t
+TCPGetPathMTU(ip_addr_t *addr, u16_t mtu)
+{
+    IP_ADDRESS Destination;
+
+    /* Called by tcp_eff_send_mss, see TCP_PATH_MTU_HOOK */
+    AddrInitIPv4(&Destination, addr->addr);
+
+    return (u16_t)PMTUGetPathMTU(&Destination, mtu, NULL);
+}
+
+u16_t
+TCPLearnPathMTU(ip_addr_t *addr, u16_t nexthopmtu, u16_t datagramsize)
+{
+    IP_ADDRESS Destination;
+
+    /* Called by LibTCPFragmentationNeeded once the message matched a connection */
+    AddrInitIPv4(&Destination, addr->addr);
+
+    return (u16_t)PMTUUpdate(&Destination, nexthopmtu, datagramsize);
+}
+
+VOID
+TCPFragmentationNeeded(PIP_ADDRESS Source, PIP_ADDRESS Destination, PVOID Segment, UINT NextHopMTU, UINT DatagramSize)
+{
+    struct ip_addr local, remote;
+    PTCPv4_HEADER Header = Segment;
+
+    if (Source->Type != IP_ADDRESS_V4 || Destination->Type != IP_ADDRESS_V4)
+        return;
+
+    local.addr = Source->Address.IPv4Address;
+    remote.addr = Destination->Address.IPv4Address;
+
+    /* Only the first 8 bytes of the header are quoted, up to SequenceNumber */
+    LibTCPFragmentationNeeded(&local, Header->SourcePort, &remote, Header->DestinationPort,
+                              Header->SequenceNumber, (u16_t)NextHopMTU, (u16_t)DatagramSize);
+}
+
 VOID
 TCPUpdateInterfaceLinkStatus(PIP_INTERFACE IF)
 {
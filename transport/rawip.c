@@ -61,7 +61,7 @@ NTSTATUS AddGenericHeaderIPv4(
     /* Length of header and data */
     IPHeader->TotalLength = WH2N((USHORT)IPPacket->TotalSize);
     /* Identification */
-    IPHeader->Id = (USHORT)Random();
+    IPHeader->Id = WH2N((USHORT)InterlockedIncrement(&IPv4Identification));
     /* One fragment at offset 0 */
     IPHeader->FlagsFragOfs = 0;
     /* Time-to-Live */
@@ -341,10 +341,6 @@ NTSTATUS RawIPStartup(VOID)
  *     Status of operation
  */
 {
-#ifdef __NTDRIVER__
-  RtlZeroMemory(&UDPStats, sizeof(UDP_STATISTICS));
-#endif
-
   /* Register this protocol with IP layer */
   IPRegisterProtocol(IPPROTO_RAW, RawIpReceive);
 
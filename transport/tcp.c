@@ -40,17 +40,7 @@ DisconnectTimeoutDpc(PKDPC Dpc,
     /* We timed out waiting for pending sends so force it to shutdown */
     TCPTranslateError(LibTCPShutdown(Connection, 0, 1));
 
-    while (!IsListEmpty(&Connection->SendRequest))
-    {
-        Entry = RemoveHeadList(&Connection->SendRequest);
-        
-        Bucket = CONTAINING_RECORD(Entry, TDI_BUCKET, Entry);
-        
-        Bucket->Information = 0;
-        Bucket->Status = STATUS_FILE_CLOSED;
-        
-        CompleteBucket(Connection, Bucket, FALSE);
-    }
+    FlushSendQueue(Connection, STATUS_FILE_CLOSED, FALSE);
     
     while (!IsListEmpty(&Connection->ShutdownRequest))
     {
@@ -101,6 +91,7 @@ PCONNECTION_ENDPOINT TCPAllocateConnectionEndpoint( PVOID ClientContext )
     InitializeListHead(&Connection->ListenRequest);
     InitializeListHead(&Connection->ReceiveRequest);
     InitializeListHead(&Connection->SendRequest);
+    InitializeListHead(&Connection->SendInFlight);
     InitializeListHead(&Connection->ShutdownRequest);
     InitializeListHead(&Connection->PacketQueue);
 
@@ -153,10 +144,12 @@ NTSTATUS TCPClose( PCONNECTION_ENDPOINT Connection )
 
     LockObject(Connection, &OldIrql);
 
-    FlushAllQueues(Connection, STATUS_CANCELLED);
-
+    /* Closing takes lwIP's queued data off the client's pages so the
+     * sends still waiting for acknowledgement can be completed */
     LibTCPClose(Connection, FALSE, TRUE);
 
+    FlushAllQueues(Connection, STATUS_CANCELLED);
+
     UnlockObject(Connection, OldIrql);
 
     DereferenceObject(Connection);
@@ -176,8 +169,13 @@ VOID TCPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
     TI_DbgPrint(DEBUG_TCP,("Sending packet %d (%d) to lwIP\n",
                            IPPacket->TotalSize,
                            IPPacket->HeaderSize));
+
+    TCP_STAT_INC(InSegs);
+    TRACE_EVENT(TCP_TRACE_TCP_INPUT, 0, IPPacket->TotalSize, 0, 0);
+    LATENCY_RECORD(TCP_LATENCY_RX_TRANSPORT, IPPacket->Timestamp);
     
-    LibIPInsertPacket(Interface->TCPContext, IPPacket->Header, IPPacket->TotalSize);
+    LibIPInsertPacket(Interface->TCPContext, IPPacket->Header, IPPacket->TotalSize,
+                      IPPacket->Timestamp);
 }
 
 NTSTATUS TCPStartup(VOID)
@@ -189,9 +187,16 @@ NTSTATUS TCPStartup(VOID)
 {
     NTSTATUS Status;
 
-    Status = PortsStartup( &TCPPorts, 1, 0xfffe );
+    Status = PortsStartup( &TCPPorts, 1, 0xffff, TCP_STARTING_PORT, TCP_DYNAMIC_PORTS );
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    Status = TCPCompletionStartup();
     if (!NT_SUCCESS(Status))
     {
+        PortsShutdown( &TCPPorts );
         return Status;
     }
 
@@ -225,10 +230,12 @@ NTSTATUS TCPShutdown(VOID)
     if (!TCPInitialized)
         return STATUS_SUCCESS;
 
-    ExDeleteNPagedLookasideList(&TdiBucketLookasideList);
-    
     LibIPShutdown();
 
+    TCPCompletionShutdown();
+
+    ExDeleteNPagedLookasideList(&TdiBucketLookasideList);
+
     /* Deregister this protocol with IP layer */
     IPRegisterProtocol(IPPROTO_TCP, NULL);
 
@@ -273,6 +280,47 @@ NTSTATUS TCPTranslateError(const err_t err)
     return Status;
 }
 
+/* Picks an ephemeral port for a connection from Local to Remote (RFC 6056
+ * algorithm 3), skipping ports whose 4-tuple is still in use by a closed
+ * connection in TIME-WAIT. RemotePort and the result are in network byte
+ * order; 0xFFFF means that no port could be found. */
+static
+UINT TCPAllocatePortForPeer(struct ip_addr *Local, struct ip_addr *Remote, const USHORT RemotePort)
+{
+    u16_t Candidates[TCP_PORT_REUSE_TRIES];
+    UINT Port, Count, Free, i;
+
+    /* Reserve every candidate up front, so that one trip to the tcpip
+     * thread checks them all and none of them is picked twice */
+    for (Count = 0; Count < TCP_PORT_REUSE_TRIES; Count++)
+    {
+        Port = AllocatePortForPeer(&TCPPorts, Local->addr, Remote->addr, RemotePort);
+        if (Port == (UINT)-1)
+            break;
+
+        Candidates[Count] = (u16_t)Port;
+    }
+
+    if (Count == 0)
+        return 0xFFFF;
+
+    Free = LibTCPFindFreeTuple(Local, Candidates, (u16_t)Count, Remote, RemotePort);
+
+    for (i = 0; i < Count; i++)
+    {
+        if (i != Free)
+            DeallocatePort(&TCPPorts, Candidates[i]);
+    }
+
+    if (Free == Count)
+    {
+        TI_DbgPrint(MID_TRACE,("All %d ports are still in use towards this peer\n", Count));
+        return 0xFFFF;
+    }
+
+    return Candidates[Free];
+}
+
 NTSTATUS TCPConnect
 ( PCONNECTION_ENDPOINT Connection,
   PTDI_CONNECTION_INFORMATION ConnInfo,
@@ -284,9 +332,9 @@ NTSTATUS TCPConnect
     struct ip_addr bindaddr, connaddr;
     IP_ADDRESS RemoteAddress;
     USHORT RemotePort;
-    TA_IP_ADDRESS LocalAddress;
     PTDI_BUCKET Bucket;
     PNEIGHBOR_CACHE_ENTRY NCE;
+    BOOLEAN Ephemeral = FALSE;
     KIRQL OldIrql;
 
     TI_DbgPrint(DEBUG_TCP,("[IP, TCPConnect] Called\n"));
@@ -331,47 +379,51 @@ NTSTATUS TCPConnect
         bindaddr.addr = Connection->AddressFile->Address.Address.IPv4Address;
     }
 
+    connaddr.addr = RemoteAddress.Address.IPv4Address;
+
+    /* Check if we had an unspecified port */
+    if (!Connection->AddressFile->Port)
+    {
+        /* We did, so pick an ephemeral port for this peer */
+        Connection->AddressFile->Port = TCPAllocatePortForPeer(&bindaddr, &connaddr, RemotePort);
+        if (Connection->AddressFile->Port == 0xFFFF)
+        {
+            Connection->AddressFile->Port = 0;
+            UnlockObject(Connection, OldIrql);
+            return STATUS_TOO_MANY_ADDRESSES;
+        }
+
+        Ephemeral = TRUE;
+    }
+
     Status = TCPTranslateError(LibTCPBind(Connection,
                                           &bindaddr,
                                           Connection->AddressFile->Port));
-    
+
+    if (!NT_SUCCESS(Status) && Ephemeral)
+    {
+        /* Leave the address file unbound as it was */
+        TCPFreePort(Connection->AddressFile->Port);
+        Connection->AddressFile->Port = 0;
+    }
+
     if (NT_SUCCESS(Status))
     {
-        /* Check if we had an unspecified port */
-        if (!Connection->AddressFile->Port)
+        Bucket = ExAllocateFromNPagedLookasideList(&TdiBucketLookasideList);
+        if (!Bucket)
         {
-            /* We did, so we need to copy back the port */
-            Status = TCPGetSockAddress(Connection, (PTRANSPORT_ADDRESS)&LocalAddress, FALSE);
-            if (NT_SUCCESS(Status))
-            {
-                /* Allocate the port in the port bitmap */
-                Connection->AddressFile->Port = TCPAllocatePort(LocalAddress.Address[0].Address[0].sin_port);
-                    
-                /* This should never fail */
-                ASSERT(Connection->AddressFile->Port != 0xFFFF);
-            }
+            UnlockObject(Connection, OldIrql);
+            return STATUS_NO_MEMORY;
         }
-
-        if (NT_SUCCESS(Status))
-        {
-            connaddr.addr = RemoteAddress.Address.IPv4Address;
-
-            Bucket = ExAllocateFromNPagedLookasideList(&TdiBucketLookasideList);
-            if (!Bucket)
-            {
-                UnlockObject(Connection, OldIrql);
-                return STATUS_NO_MEMORY;
-            }
-            
-            Bucket->Request.RequestNotifyObject = (PVOID)Complete;
-            Bucket->Request.RequestContext = Context;
-			
-            InsertTailList( &Connection->ConnectRequest, &Bucket->Entry );
         
-            Status = TCPTranslateError(LibTCPConnect(Connection,
-                                                     &connaddr,
-                                                     RemotePort));
-        }
+        Bucket->Request.RequestNotifyObject = (PVOID)Complete;
+        Bucket->Request.RequestContext = Context;
+        
+        InsertTailList( &Connection->ConnectRequest, &Bucket->Entry );
+    
+        Status = TCPTranslateError(LibTCPConnect(Connection,
+                                                 &connaddr,
+                                                 RemotePort));
     }
 
     UnlockObject(Connection, OldIrql);
@@ -477,7 +529,8 @@ NTSTATUS TCPReceiveData
   PULONG BytesReceived,
   ULONG ReceiveFlags,
   PTCP_COMPLETION_ROUTINE Complete,
-  PVOID Context )
+  PVOID Context,
+  PIRP Irp )
 {
     PTDI_BUCKET Bucket;
     PUCHAR DataBuffer;
@@ -501,8 +554,11 @@ NTSTATUS TCPReceiveData
             return STATUS_NO_MEMORY;
         }
     
+        /* Context is not always an IRP, ring requests pass their own */
         Bucket->Request.RequestNotifyObject = Complete;
         Bucket->Request.RequestContext = Context;
+        Bucket->ReceiveMdl = Buffer;
+        Bucket->Irp = Irp;
 
         ExInterlockedInsertTailList( &Connection->ReceiveRequest, &Bucket->Entry, &Connection->Lock );
         TI_DbgPrint(DEBUG_TCP,("[IP, TCPReceiveData] Queued read irp\n"));
@@ -521,14 +577,13 @@ NTSTATUS TCPReceiveData
 
 NTSTATUS TCPSendData
 ( PCONNECTION_ENDPOINT Connection,
-  PCHAR BufferData,
+  PNDIS_BUFFER Buffer,
   ULONG SendLength,
   PULONG BytesSent,
   ULONG Flags,
   PTCP_COMPLETION_ROUTINE Complete,
   PVOID Context )
 {
-    NTSTATUS Status;
     PTDI_BUCKET Bucket;
     KIRQL OldIrql;
 
@@ -541,38 +596,54 @@ NTSTATUS TCPSendData
     TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Connection->SocketContext = %x\n",
                            Connection->SocketContext));
 
-    Status = TCPTranslateError(LibTCPSend(Connection,
-                                          BufferData,
-                                          SendLength,
-                                          BytesSent,
-                                          FALSE));
-    
-    TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Send: %x, %d\n", Status, SendLength));
+    (*BytesSent) = 0;
 
-    /* Keep this request around ... there was no data yet */
-    if (Status == STATUS_PENDING)
+    if (!Connection->SocketContext || Connection->SendShutdown)
     {
-        /* Freed in TCPSocketState */
-        Bucket = ExAllocateFromNPagedLookasideList(&TdiBucketLookasideList);
-        if (!Bucket)
-        {
-            UnlockObject(Connection, OldIrql);
-            TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Failed to allocate bucket\n"));
-            return STATUS_NO_MEMORY;
-        }
-        
-        Bucket->Request.RequestNotifyObject = Complete;
-        Bucket->Request.RequestContext = Context;
-        
-        InsertTailList( &Connection->SendRequest, &Bucket->Entry );
-        TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Queued write irp\n"));
+        UnlockObject(Connection, OldIrql);
+        return TCPTranslateError(ERR_CLSD);
     }
 
+    if (!SendLength)
+    {
+        UnlockObject(Connection, OldIrql);
+        return STATUS_SUCCESS;
+    }
+
+    /* Freed in TCPSocketState */
+    Bucket = ExAllocateFromNPagedLookasideList(&TdiBucketLookasideList);
+    if (!Bucket)
+    {
+        UnlockObject(Connection, OldIrql);
+        TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Failed to allocate bucket\n"));
+        return STATUS_NO_MEMORY;
+    }
+
+    /* lwIP references the buffer in place, so the request stays
+     * pending until all of it has been acknowledged */
+    Bucket->Request.RequestNotifyObject = Complete;
+    Bucket->Request.RequestContext = Context;
+    Bucket->Information = SendLength;
+    Bucket->SendMdl = Buffer;
+    Bucket->SendOffset = 0;
+    Bucket->SendRemaining = SendLength;
+    Bucket->AckRemaining = 0;
+
+    InsertTailList( &Connection->SendRequest, &Bucket->Entry );
+    TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Queued write irp\n"));
+
     UnlockObject(Connection, OldIrql);
 
-    TI_DbgPrint(DEBUG_TCP, ("[IP, TCPSendData] Leaving. Status = %x\n", Status));
+    /* The tcpip thread writes the queue in order as buffer space opens up */
+    if (LibTCPPushSend(Connection) == ERR_MEM && TCPRemoveIRP(Connection, Context))
+    {
+        TI_DbgPrint(DEBUG_TCP,("[IP, TCPSendData] Failed to push the send queue\n"));
+        return STATUS_NO_MEMORY;
+    }
 
-    return Status;
+    TI_DbgPrint(DEBUG_TCP, ("[IP, TCPSendData] Leaving. Status = STATUS_PENDING\n"));
+
+    return STATUS_PENDING;
 }
 
 UINT TCPAllocatePort(const UINT HintPort)
@@ -588,9 +659,10 @@ UINT TCPAllocatePort(const UINT HintPort)
         }
     }
     else
-        return AllocatePortFromRange( &TCPPorts, 1024, 5000 );
+        return AllocateAnyPort( &TCPPorts );
 }
 
+
 VOID TCPFreePort(const UINT Port)
 {
     DeallocatePort(&TCPPorts, Port);
@@ -661,6 +733,11 @@ BOOLEAN TCPRemoveIRP( PCONNECTION_ENDPOINT Endpoint, PIRP Irp )
             Bucket = CONTAINING_RECORD( Entry, TDI_BUCKET, Entry );
             if( Bucket->Request.RequestContext == Irp )
             {
+                /* lwIP references part of this send until it is acknowledged */
+                if (ListHead[i] == &Endpoint->SendRequest &&
+                    Bucket->SendRemaining != Bucket->Information)
+                    break;
+
                 RemoveEntryList( &Bucket->Entry );
                 ExFreeToNPagedLookasideList(&TdiBucketLookasideList, Bucket);
                 Found = TRUE;
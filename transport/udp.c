@@ -101,6 +101,7 @@ NTSTATUS BuildUDPPacket(
 
     /* FIXME: Assumes IPv4 */
     IPInitializePacket(Packet, IP_ADDRESS_V4);
+    Packet->Timestamp = LATENCY_STAMP();
 
     Packet->TotalSize = sizeof(IPv4_HEADER) + sizeof(UDP_HEADER) + DataLen;
 
@@ -147,6 +148,65 @@ NTSTATUS BuildUDPPacket(
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS BuildUDPTemplate(
+    PADDRESS_FILE AddrFile,
+    PIP_PACKET Packet,
+    PIP_ADDRESS RemoteAddress,
+    USHORT RemotePort,
+    PIP_ADDRESS LocalAddress,
+    USHORT LocalPort )
+/*
+ * FUNCTION: Builds the headers every segment of a segmented send starts with
+ * ARGUMENTS:
+ *     AddrFile     = Address file to send from
+ *     Packet       = IP packet to hold the headers
+ *     LocalAddress = Pointer to our local address
+ *     LocalPort    = The port we send the datagrams from
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Lengths, ids and checksums are filled in per segment by IPSendSegments,
+ *     which reserves the ids of all segments at once
+ */
+{
+    PUDP_HEADER UDPHeader;
+    NTSTATUS Status;
+
+    if (RemoteAddress->Type != IP_ADDRESS_V4)
+        return STATUS_UNSUCCESSFUL;
+
+    IPInitializePacket(Packet, IP_ADDRESS_V4);
+    Packet->Timestamp = LATENCY_STAMP();
+
+    Packet->TotalSize = sizeof(IPv4_HEADER) + sizeof(UDP_HEADER);
+
+    Status = AllocatePacketWithBuffer(&Packet->NdisPacket, NULL, Packet->TotalSize);
+    if (!NT_SUCCESS(Status))
+    {
+        Packet->Free(Packet);
+        return Status;
+    }
+
+    Status = AddGenericHeaderIPv4
+        ( AddrFile, RemoteAddress, RemotePort,
+          LocalAddress, LocalPort,
+          Packet, 0, IPPROTO_UDP,
+          sizeof(UDP_HEADER), (PVOID *)&UDPHeader );
+    if (!NT_SUCCESS(Status))
+    {
+        Packet->Free(Packet);
+        return Status;
+    }
+
+    /* Port values are already big-endian values */
+    UDPHeader->SourcePort = LocalPort;
+    UDPHeader->DestPort   = RemotePort;
+    UDPHeader->Length     = 0;
+    UDPHeader->Checksum   = 0;
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS UDPSendDatagram(
     PADDRESS_FILE AddrFile,
     PTDI_CONNECTION_INFORMATION ConnInfo,
@@ -171,6 +231,8 @@ NTSTATUS UDPSendDatagram(
     USHORT RemotePort;
     NTSTATUS Status;
     PNEIGHBOR_CACHE_ENTRY NCE;
+    ULONG SegmentSize;
+    UINT DataSent;
     KIRQL OldIrql;
 
     LockObject(AddrFile, &OldIrql);
@@ -214,6 +276,38 @@ NTSTATUS UDPSendDatagram(
         }
     }
 
+    SegmentSize = AddrFile->SegmentSize;
+    if (SegmentSize && DataSize > SegmentSize)
+    {
+        /* Send as several datagrams, split as late as possible */
+        if (DataSize > SegmentSize * UDP_MAX_SEGMENTS) {
+            UnlockObject(AddrFile, OldIrql);
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        Status = BuildUDPTemplate( AddrFile,
+                                   &Packet,
+                                   &RemoteAddress,
+                                   RemotePort,
+                                   &LocalAddress,
+                                   AddrFile->Port );
+
+        UnlockObject(AddrFile, OldIrql);
+
+        if( !NT_SUCCESS(Status) )
+            return Status;
+
+        Status = IPSendSegments(&Packet, BufferData, DataSize, SegmentSize, NCE, &DataSent);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        UDP_STAT_ADD(OutDatagrams, (DataSent + SegmentSize - 1) / SegmentSize);
+
+        *DataUsed = DataSent;
+
+        return STATUS_SUCCESS;
+    }
+
     Status = BuildUDPPacket( AddrFile,
 							 &Packet,
 							 &RemoteAddress,
@@ -232,12 +326,144 @@ NTSTATUS UDPSendDatagram(
     if (!NT_SUCCESS(Status))
         return Status;
 
+    UDP_STAT_INC(OutDatagrams);
+
     *DataUsed = DataSize;
 
     return STATUS_SUCCESS;
 }
 
 
+static NTSTATUS UDPFlushBatch(
+    PIP_PACKET Packets,
+    UINT Count,
+    PNEIGHBOR_CACHE_ENTRY NCE,
+    PULONG Sent)
+{
+    NTSTATUS Status;
+    UINT Done;
+
+    if (Count == 0)
+        return STATUS_SUCCESS;
+
+    /* Datagrams ahead of a failure went out and are counted all the same */
+    Status = IPSendDatagramBatch(Packets, Count, NCE, &Done);
+    *Sent += Done;
+    UDP_STAT_ADD(OutDatagrams, Done);
+
+    return Status;
+}
+
+NTSTATUS UDPSendDatagrams(
+    PADDRESS_FILE AddrFile,
+    PUDP_SEND_ENTRY Entries,
+    ULONG Count,
+    PULONG Sent )
+/*
+ * FUNCTION: Sends several UDP datagrams from one address file
+ * ARGUMENTS:
+ *     AddrFile = Address file to send from
+ *     Entries  = Array describing the datagrams
+ *     Count    = Number of entries in the array
+ *     Sent     = Address of buffer to place the number of datagrams sent in
+ * RETURNS:
+ *     Status of operation
+ * NOTES:
+ *     Consecutive datagrams to the same destination share one route
+ *     lookup and are handed to the link layer together. Sending stops at
+ *     the first failure; it is only returned if nothing was sent
+ */
+{
+    IP_PACKET Packets[UDP_SEND_BATCH];
+    PNEIGHBOR_CACHE_ENTRY NCE = NULL, BatchNCE = NULL;
+    IP_ADDRESS LastRemote, LocalAddress;
+    NTSTATUS Status = STATUS_SUCCESS;
+    UINT Batched = 0;
+    KIRQL OldIrql;
+    ULONG i;
+
+    *Sent = 0;
+    AddrInitIPv4(&LastRemote, 0);
+
+    for (i = 0; i < Count; i++)
+    {
+        if (Entries[i].RemoteAddress.Type != IP_ADDRESS_V4)
+        {
+            Status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+
+        LockObject(AddrFile, &OldIrql);
+
+        /* Only look the route up again when the destination changes */
+        if (!NCE || !AddrIsEqual(&Entries[i].RemoteAddress, &LastRemote))
+        {
+            LocalAddress = AddrFile->Address;
+            if (AddrIsUnspecified(&LocalAddress))
+            {
+                NCE = RouteGetRouteToDestination(&Entries[i].RemoteAddress);
+                if (NCE)
+                    LocalAddress = NCE->Interface->Unicast;
+                else
+                    Status = STATUS_NETWORK_UNREACHABLE;
+            }
+            else
+            {
+                NCE = NBLocateNeighbor(&LocalAddress);
+                if (!NCE)
+                    Status = STATUS_INVALID_PARAMETER;
+            }
+
+            if (!NCE)
+            {
+                UnlockObject(AddrFile, OldIrql);
+                break;
+            }
+
+            LastRemote = Entries[i].RemoteAddress;
+        }
+
+        if (Batched > 0 && (NCE != BatchNCE || Batched == UDP_SEND_BATCH))
+        {
+            UnlockObject(AddrFile, OldIrql);
+
+            Status = UDPFlushBatch(Packets, Batched, BatchNCE, Sent);
+            Batched = 0;
+            if (!NT_SUCCESS(Status))
+                break;
+
+            LockObject(AddrFile, &OldIrql);
+        }
+
+        Status = BuildUDPPacket( AddrFile,
+                                 &Packets[Batched],
+                                 &Entries[i].RemoteAddress,
+                                 Entries[i].RemotePort,
+                                 &LocalAddress,
+                                 AddrFile->Port,
+                                 Entries[i].Data,
+                                 Entries[i].DataSize );
+
+        UnlockObject(AddrFile, OldIrql);
+
+        if (!NT_SUCCESS(Status))
+            break;
+
+        BatchNCE = NCE;
+        Batched++;
+    }
+
+    if (Batched > 0)
+    {
+        if (NT_SUCCESS(Status))
+            Status = UDPFlushBatch(Packets, Batched, BatchNCE, Sent);
+        else
+            UDPFlushBatch(Packets, Batched, BatchNCE, Sent);
+    }
+
+    return (*Sent > 0) ? STATUS_SUCCESS : Status;
+}
+
 VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
 /*
  * FUNCTION: Receives and queues a UDP datagram
@@ -258,6 +484,8 @@ VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
 
   TI_DbgPrint(MAX_TRACE, ("Called.\n"));
 
+  LATENCY_RECORD(TCP_LATENCY_RX_TRANSPORT, IPPacket->Timestamp);
+
   switch (IPPacket->Type) {
   /* IPv4 packet */
   case IP_ADDRESS_V4:
@@ -286,6 +514,8 @@ VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
   if (i != DH2N(0x0000FFFF) && UDPHeader->Checksum != 0)
   {
       TI_DbgPrint(MIN_TRACE, ("Bad checksum on packet received.\n"));
+      UDP_STAT_INC(InErrors);
+      TRACE_DROP(TCP_DROP_UDP_HEADER, UDPHeader->DestPort, 0);
       return;
   }
 
@@ -294,6 +524,8 @@ VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
   if ((i < sizeof(UDP_HEADER)) || (i > IPPacket->TotalSize - IPPacket->Position)) {
     /* Incorrect or damaged packet received, discard it */
     TI_DbgPrint(MIN_TRACE, ("Incorrect or damaged UDP packet received.\n"));
+    UDP_STAT_INC(InErrors);
+    TRACE_DROP(TCP_DROP_UDP_HEADER, UDPHeader->DestPort, 0);
     return;
   }
 
@@ -312,6 +544,8 @@ VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
                              IPPROTO_UDP,
                              &SearchContext);
   if (AddrFile) {
+    UDP_STAT_INC(InDatagrams);
+
     do {
       DGDeliverData(AddrFile,
 		    SrcAddress,
@@ -327,6 +561,9 @@ VOID UDPReceive(PIP_INTERFACE Interface, PIP_PACKET IPPacket)
     TI_DbgPrint(MID_TRACE, ("Cannot deliver IPv4 UDP datagram to address (0x%X).\n",
       DN2H(DstAddress->Address.IPv4Address)));
 
+    UDP_STAT_INC(NoPorts);
+    TRACE_DROP(TCP_DROP_UDP_NO_PORT, UDPHeader->DestPort, DstAddress->Address.IPv4Address);
+
     /* FIXME: Send ICMP reply */
   }
   TI_DbgPrint(MAX_TRACE, ("Leaving.\n"));
@@ -343,11 +580,8 @@ NTSTATUS UDPStartup(
 {
   NTSTATUS Status;
 
-#ifdef __NTDRIVER__
-  RtlZeroMemory(&UDPStats, sizeof(UDP_STATISTICS));
-#endif
-  
-  Status = PortsStartup( &UDPPorts, 1, UDP_STARTING_PORT + UDP_DYNAMIC_PORTS );
+  Status = PortsStartup( &UDPPorts, 1, UDP_STARTING_PORT + UDP_DYNAMIC_PORTS,
+                         UDP_STARTING_PORT, UDP_DYNAMIC_PORTS );
 
   if( !NT_SUCCESS(Status) ) return Status;
 
@@ -385,9 +619,7 @@ UINT UDPAllocatePort( UINT HintPort ) {
     if( HintPort ) {
         if( AllocatePort( &UDPPorts, HintPort ) ) return HintPort;
         else return (UINT)-1;
-    } else return AllocatePortFromRange
-               ( &UDPPorts, UDP_STARTING_PORT,
-                 UDP_STARTING_PORT + UDP_DYNAMIC_PORTS );
+    } else return AllocateAnyPort( &UDPPorts );
 }
 
 VOID UDPFreePort( UINT Port ) {
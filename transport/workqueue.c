@@ -16,78 +16,340 @@
 #define FOURCC(w,x,y,z) (((w) << 24) | ((x) << 16) | ((y) << 8) | (z))
 #define CHEW_TAG FOURCC('C','H','E','W')
 
-PDEVICE_OBJECT WorkQueueDevice;
-LIST_ENTRY     WorkQueue;
-KSPIN_LOCK     WorkQueueLock;
-KEVENT         WorkQueueClear;
+/* Work items preallocated per worker; ChewCreate falls back to pool
+ * allocations once these are all in use */
+#define CHEW_ITEMS_PER_WORKER 128
+
+/* Maximum number of high priority items run back to back while normal
+ * priority work is waiting */
+#define CHEW_HIGH_PRIORITY_BURST 16
 
 typedef struct _WORK_ITEM
 {
+    SLIST_ENTRY FreeEntry;
     LIST_ENTRY Entry;
-    PIO_WORKITEM WorkItem;
     VOID (*Worker)(PVOID WorkerContext);
     PVOID WorkerContext;
+    BOOLEAN Preallocated;
 } WORK_ITEM, *PWORK_ITEM;
 
-VOID ChewInit(PDEVICE_OBJECT DeviceObject)
+typedef struct _CHEW_WORKER
 {
-    WorkQueueDevice = DeviceObject;
-    InitializeListHead(&WorkQueue);
-    KeInitializeSpinLock(&WorkQueueLock);
-    KeInitializeEvent(&WorkQueueClear, NotificationEvent, TRUE);
+    KSPIN_LOCK Lock;                            /* Protects both deques */
+    LIST_ENTRY Queue[CHEW_PRIORITY_COUNT];      /* Owner pops the head, thieves the tail */
+    ULONG Burst;                                /* High priority items run in a row */
+    KEVENT Wake;
+    PKTHREAD Thread;
+    ULONG Number;
+    volatile BOOLEAN Busy;
+    volatile BOOLEAN Stop;
+} CHEW_WORKER, *PCHEW_WORKER;
+
+PDEVICE_OBJECT WorkQueueDevice;
+KEVENT         WorkQueueClear;
+
+static PCHEW_WORKER ChewWorkers;
+static ULONG        ChewWorkerCount;
+static PWORK_ITEM   ChewItems;
+static SLIST_HEADER ChewFreeItems;
+static LONG         ChewPending;
+
+static PWORK_ITEM ChewPopItem(PCHEW_WORKER Worker, ULONG Priority, BOOLEAN Steal)
+{
+    PLIST_ENTRY Entry;
+    KIRQL OldIrql;
+
+    if (IsListEmpty(&Worker->Queue[Priority]))
+        return NULL;
+
+    KeAcquireSpinLock(&Worker->Lock, &OldIrql);
+    if (IsListEmpty(&Worker->Queue[Priority]))
+    {
+        KeReleaseSpinLock(&Worker->Lock, OldIrql);
+        return NULL;
+    }
+
+    Entry = Steal ? RemoveTailList(&Worker->Queue[Priority]) :
+                    RemoveHeadList(&Worker->Queue[Priority]);
+    KeReleaseSpinLock(&Worker->Lock, OldIrql);
+
+    return CONTAINING_RECORD(Entry, WORK_ITEM, Entry);
 }
 
-VOID ChewShutdown(VOID)
+static PWORK_ITEM ChewNextItem(PCHEW_WORKER Worker)
+{
+    PWORK_ITEM Item;
+    ULONG Priority, i;
+
+    /* Receive work goes first, but normal work gets a turn now and then */
+    if (Worker->Burst < CHEW_HIGH_PRIORITY_BURST)
+    {
+        Item = ChewPopItem(Worker, CHEW_PRIORITY_HIGH, FALSE);
+        if (Item)
+        {
+            Worker->Burst++;
+            return Item;
+        }
+    }
+
+    Worker->Burst = 0;
+    for (Priority = 0; Priority < CHEW_PRIORITY_COUNT; Priority++)
+    {
+        Item = ChewPopItem(Worker, Priority, FALSE);
+        if (Item)
+            return Item;
+    }
+
+    /* Our own deques are empty, steal from the other workers */
+    for (Priority = 0; Priority < CHEW_PRIORITY_COUNT; Priority++)
+    {
+        for (i = 1; i < ChewWorkerCount; i++)
+        {
+            Item = ChewPopItem(&ChewWorkers[(Worker->Number + i) % ChewWorkerCount],
+                               Priority,
+                               TRUE);
+            if (Item)
+                return Item;
+        }
+    }
+
+    return NULL;
+}
+
+static VOID ChewFreeItem(PWORK_ITEM Item)
 {
-    KeWaitForSingleObject(&WorkQueueClear, Executive, KernelMode, FALSE, NULL);
+    if (Item->Preallocated)
+        InterlockedPushEntrySList(&ChewFreeItems, &Item->FreeEntry);
+    else
+        ExFreePoolWithTag(Item, CHEW_TAG);
 }
 
-VOID NTAPI ChewWorkItem(PDEVICE_OBJECT DeviceObject, PVOID ChewItem)
+static VOID NTAPI ChewWorkerThread(PVOID Context)
 {
-    PWORK_ITEM WorkItem = ChewItem;
-    KIRQL OldIrql;
+    PCHEW_WORKER Worker = Context;
+    PWORK_ITEM Item;
 
-    WorkItem->Worker(WorkItem->WorkerContext);
+    /* Only a hint: work items may change this thread's affinity themselves */
+    KeSetIdealProcessorThread(KeGetCurrentThread(), (UCHAR)Worker->Number);
 
-    IoFreeWorkItem(WorkItem->WorkItem);
+    for (;;)
+    {
+        Item = ChewNextItem(Worker);
+        if (!Item)
+        {
+            Worker->Busy = FALSE;
+
+            if (Worker->Stop)
+                break;
 
-    KeAcquireSpinLock(&WorkQueueLock, &OldIrql);
-    RemoveEntryList(&WorkItem->Entry);
+            KeWaitForSingleObject(&Worker->Wake, Executive, KernelMode, FALSE, NULL);
+            continue;
+        }
 
-    if (IsListEmpty(&WorkQueue))
-        KeSetEvent(&WorkQueueClear, 0, FALSE);
+        Worker->Busy = TRUE;
 
-    KeReleaseSpinLock(&WorkQueueLock, OldIrql);
+        Item->Worker(Item->WorkerContext);
 
-    ExFreePoolWithTag(WorkItem, CHEW_TAG);
+        ChewFreeItem(Item);
+
+        if (InterlockedDecrement(&ChewPending) == 0)
+            KeSetEvent(&WorkQueueClear, 0, FALSE);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
-BOOLEAN ChewCreate(VOID (*Worker)(PVOID), PVOID WorkerContext)
+static VOID ChewStopWorkers(VOID)
 {
-    PWORK_ITEM Item;
-    Item = ExAllocatePoolWithTag(NonPagedPool, 
-                                 sizeof(WORK_ITEM),
-                                 CHEW_TAG);
+    ULONG i;
+
+    for (i = 0; i < ChewWorkerCount; i++)
+    {
+        ChewWorkers[i].Stop = TRUE;
+        KeSetEvent(&ChewWorkers[i].Wake, 0, FALSE);
+    }
+
+    for (i = 0; i < ChewWorkerCount; i++)
+    {
+        if (!ChewWorkers[i].Thread)
+            continue;
+
+        KeWaitForSingleObject(ChewWorkers[i].Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(ChewWorkers[i].Thread);
+    }
+
+    ExFreePoolWithTag(ChewWorkers, CHEW_TAG);
+    ChewWorkers = NULL;
+    ChewWorkerCount = 0;
+
+    ExFreePoolWithTag(ChewItems, CHEW_TAG);
+    ChewItems = NULL;
+}
+
+NTSTATUS ChewInit(PDEVICE_OBJECT DeviceObject)
+{
+    HANDLE ThreadHandle;
+    NTSTATUS Status;
+    ULONG i, j;
+
+    WorkQueueDevice = DeviceObject;
+    KeInitializeEvent(&WorkQueueClear, NotificationEvent, TRUE);
+    InitializeSListHead(&ChewFreeItems);
+    ChewPending = 0;
 
-    if (Item)
+    ChewItems = ExAllocatePoolWithTag(NonPagedPool,
+                                      KeNumberProcessors * CHEW_ITEMS_PER_WORKER * sizeof(WORK_ITEM),
+                                      CHEW_TAG);
+    if (!ChewItems)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (i = 0; i < KeNumberProcessors * CHEW_ITEMS_PER_WORKER; i++)
     {
-        Item->WorkItem = IoAllocateWorkItem(WorkQueueDevice);
-        if (!Item->WorkItem)
+        ChewItems[i].Preallocated = TRUE;
+        InterlockedPushEntrySList(&ChewFreeItems, &ChewItems[i].FreeEntry);
+    }
+
+    ChewWorkers = ExAllocatePoolWithTag(NonPagedPool,
+                                        KeNumberProcessors * sizeof(CHEW_WORKER),
+                                        CHEW_TAG);
+    if (!ChewWorkers)
+    {
+        ExFreePoolWithTag(ChewItems, CHEW_TAG);
+        ChewItems = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(ChewWorkers, KeNumberProcessors * sizeof(CHEW_WORKER));
+    ChewWorkerCount = KeNumberProcessors;
+
+    for (i = 0; i < ChewWorkerCount; i++)
+    {
+        KeInitializeSpinLock(&ChewWorkers[i].Lock);
+        for (j = 0; j < CHEW_PRIORITY_COUNT; j++)
+            InitializeListHead(&ChewWorkers[i].Queue[j]);
+        KeInitializeEvent(&ChewWorkers[i].Wake, SynchronizationEvent, FALSE);
+        ChewWorkers[i].Number = i;
+        ChewWorkers[i].Busy = TRUE;
+    }
+
+    for (i = 0; i < ChewWorkerCount; i++)
+    {
+        Status = PsCreateSystemThread(&ThreadHandle,
+                                      THREAD_ALL_ACCESS,
+                                      NULL,
+                                      NULL,
+                                      NULL,
+                                      ChewWorkerThread,
+                                      &ChewWorkers[i]);
+        if (NT_SUCCESS(Status))
         {
-            ExFreePool(Item);
-            return FALSE;
+            Status = ObReferenceObjectByHandle(ThreadHandle,
+                                               THREAD_ALL_ACCESS,
+                                               *PsThreadType,
+                                               KernelMode,
+                                               (PVOID*)&ChewWorkers[i].Thread,
+                                               NULL);
+            if (!NT_SUCCESS(Status))
+            {
+                /* The thread runs but ChewStopWorkers cannot wait for it
+                   without a reference, so stop it through the handle
+                   before ChewWorkers is freed */
+                ChewWorkers[i].Thread = NULL;
+                ChewWorkers[i].Stop = TRUE;
+                KeSetEvent(&ChewWorkers[i].Wake, 0, FALSE);
+                ZwWaitForSingleObject(ThreadHandle, FALSE, NULL);
+            }
+            ZwClose(ThreadHandle);
         }
 
-        Item->Worker = Worker;
-        Item->WorkerContext = WorkerContext;
-        ExInterlockedInsertTailList(&WorkQueue, &Item->Entry, &WorkQueueLock);
+        if (!NT_SUCCESS(Status))
+        {
+            ChewStopWorkers();
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID ChewShutdown(VOID)
+{
+    if (!ChewWorkers)
+        return;
+
+    /* Wait for the remaining work items before stopping the workers */
+    for (;;)
+    {
         KeResetEvent(&WorkQueueClear);
-        IoQueueWorkItem(Item->WorkItem, ChewWorkItem, DelayedWorkQueue, Item);
+        if (ChewPending == 0)
+            break;
+
+        KeWaitForSingleObject(&WorkQueueClear, Executive, KernelMode, FALSE, NULL);
+    }
+
+    ChewStopWorkers();
+}
+
+BOOLEAN ChewCreateEx(VOID (*Worker)(PVOID), PVOID WorkerContext, ULONG Priority)
+{
+    PCHEW_WORKER Target;
+    PSLIST_ENTRY FreeEntry;
+    PWORK_ITEM Item;
+    KIRQL OldIrql;
+    ULONG i;
 
-        return TRUE;
+    if (!ChewWorkers || Priority >= CHEW_PRIORITY_COUNT)
+        return FALSE;
+
+    FreeEntry = InterlockedPopEntrySList(&ChewFreeItems);
+    if (FreeEntry)
+    {
+        Item = CONTAINING_RECORD(FreeEntry, WORK_ITEM, FreeEntry);
     }
     else
     {
-        return FALSE;
+        Item = ExAllocatePoolWithTag(NonPagedPool,
+                                     sizeof(WORK_ITEM),
+                                     CHEW_TAG);
+        if (!Item)
+            return FALSE;
+
+        Item->Preallocated = FALSE;
     }
+
+    Item->Worker = Worker;
+    Item->WorkerContext = WorkerContext;
+
+    InterlockedIncrement(&ChewPending);
+
+    /* Queue on the worker of the current processor */
+    Target = &ChewWorkers[KeGetCurrentProcessorNumber() % ChewWorkerCount];
+
+    KeAcquireSpinLock(&Target->Lock, &OldIrql);
+    InsertTailList(&Target->Queue[Priority], &Item->Entry);
+    KeReleaseSpinLock(&Target->Lock, OldIrql);
+
+    KeSetEvent(&Target->Wake, 0, FALSE);
+
+    /* If that worker is tied up, wake an idle one to steal the item */
+    if (Target->Busy)
+    {
+        for (i = 1; i < ChewWorkerCount; i++)
+        {
+            PCHEW_WORKER Other = &ChewWorkers[(Target->Number + i) % ChewWorkerCount];
+
+            if (!Other->Busy)
+            {
+                KeSetEvent(&Other->Wake, 0, FALSE);
+                break;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN ChewCreate(VOID (*Worker)(PVOID), PVOID WorkerContext)
+{
+    return ChewCreateEx(Worker, WorkerContext, CHEW_PRIORITY_NORMAL);
 }